@@ -0,0 +1,236 @@
+// bench/bench_archive.c
+// Three years of per-pump snapshots: file size and history scan speed with
+// everything in SQLite vs everything older than ARCHIVE_AFTER_DAYS moved to
+// archive segments. Scans go through db_history_*, the same path as
+// /api/pump/history, and must return identical rows on both sides.
+#include "../src/db.h"
+#include "../src/archive.h"
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DB        "/var/tmp/bench_archive.db"
+#define YEARS           3
+#define GATEWAYS        16
+#define PUMPS           2
+#define MEAN_GAP_S      600     // one change per pump every ~10 minutes
+#define PAGES           200
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t rng = 88172645463325252ull;
+
+static uint32_t next_rand() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (uint32_t)rng;
+}
+
+static long long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long long)st.st_size : 0;
+}
+
+static void remove_archive() {
+    DIR *dir = opendir(BENCH_DB ".archive");
+    if (!dir) return;
+    
+    struct dirent *e;
+    char path[512];
+    while ((e = readdir(dir)) != NULL) {
+        if (e->d_name[0] == '.' && (e->d_name[1] == 0 || e->d_name[1] == '.')) continue;
+        snprintf(path, sizeof(path), "%s/%s", BENCH_DB ".archive", e->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    rmdir(BENCH_DB ".archive");
+}
+
+// Bulk load on a private connection; the writer thread stays idle
+static long long generate(time_t end) {
+    sqlite3 *conn;
+    sqlite3_stmt *stmt;
+    long long rows = 0;
+    time_t start = end - (time_t)YEARS * 365 * 86400;
+    time_t next[GATEWAYS * PUMPS];
+    int status[GATEWAYS * PUMPS] = {0};
+    
+    if (sqlite3_open(BENCH_DB, &conn) != SQLITE_OK) return -1;
+    sqlite3_prepare_v2(conn, "INSERT INTO pump_snapshots (device_id, pump_id, command, status, busy, alarm, timestamp) VALUES (?,?,?,?,?,?,?)",
+                       -1, &stmt, NULL);
+    
+    for (int p = 0; p < GATEWAYS * PUMPS; p++) {
+        next[p] = start + next_rand() % MEAN_GAP_S;
+    }
+    
+    sqlite3_exec(conn, "BEGIN", NULL, NULL, NULL);
+    for (;;) {
+        // The pump due soonest goes next, so ids grow with time as they do live
+        int p = 0;
+        for (int i = 1; i < GATEWAYS * PUMPS; i++) {
+            if (next[i] < next[p]) p = i;
+        }
+        time_t t = next[p];
+        if (t >= end) break;
+        
+        // Mostly stopped/running cycles, with the odd start-up and fault
+        uint32_t r = next_rand();
+        status[p] = (r % 100 < 2) ? STATUS_ERROR : (status[p] == STATUS_RUNNING ? STATUS_STOPPED : STATUS_RUNNING);
+        char device_id[32];
+        snprintf(device_id, sizeof(device_id), "site-%02d", p / PUMPS);
+        
+        sqlite3_bind_text(stmt, 1, device_id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 2, 1 + p % PUMPS);
+        sqlite3_bind_int(stmt, 3, status[p] == STATUS_RUNNING);
+        sqlite3_bind_int(stmt, 4, status[p]);
+        sqlite3_bind_int(stmt, 5, (r >> 8) % 50 == 0 ? 1 + p % PUMPS : 0);
+        sqlite3_bind_int(stmt, 6, status[p] == STATUS_ERROR);
+        sqlite3_bind_int64(stmt, 7, t);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        
+        next[p] = t + 1 + next_rand() % (2 * MEAN_GAP_S);
+        rows++;
+    }
+    sqlite3_exec(conn, "COMMIT", NULL, NULL, NULL);
+    sqlite3_finalize(stmt);
+    sqlite3_close(conn);
+    return rows;
+}
+
+// VACUUM so the file size reflects the live rows only; -1 if it didn't run
+static long long sqlite_size() {
+    sqlite3 *conn;
+    if (sqlite3_open(BENCH_DB, &conn) != SQLITE_OK) return -1;
+    
+    char *err = NULL;
+    sqlite3_busy_timeout(conn, 5000);
+    if (sqlite3_exec(conn, "VACUUM; PRAGMA wal_checkpoint(TRUNCATE);", NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "VACUUM failed: %s\n", err ? err : sqlite3_errmsg(conn));
+        sqlite3_free(err);
+        sqlite3_close(conn);
+        return -1;
+    }
+    sqlite3_close(conn);
+    return file_size(BENCH_DB) + file_size(BENCH_DB "-wal");
+}
+
+typedef struct {
+    long long rows;
+    uint64_t checksum;
+    double seconds;
+} ScanResult;
+
+// Pages until the cursor runs out, like a client walking the history
+static ScanResult scan(const DbHistoryQuery *query, int max_pages) {
+    ScanResult res = {0, 1469598103934665603ull, 0};
+    DbHistoryQuery q = *query;
+    char row[512];
+    char token[64];
+    
+    double t0 = now_sec();
+    for (int page = 0; max_pages <= 0 || page < max_pages; page++) {
+        DbHistoryCursor *cur = db_history_open(&q);
+        if (!cur) break;
+        
+        int n;
+        while ((n = db_history_next(cur, row, sizeof(row))) > 0) {
+            for (int i = 0; i < n; i++) {
+                res.checksum = (res.checksum ^ (unsigned char)row[i]) * 1099511628211ull;
+            }
+            res.rows++;
+        }
+        
+        int more = db_history_cursor(cur, token, sizeof(token));
+        db_history_close(cur);
+        if (!more || db_history_parse_cursor(token, &q) != 0) break;
+    }
+    res.seconds = now_sec() - t0;
+    return res;
+}
+
+typedef struct {
+    const char *name;
+    DbHistoryQuery q;
+    int pages;
+    ScanResult before;
+    ScanResult after;
+} Scenario;
+
+int main() {
+    unlink(BENCH_DB);
+    unlink(BENCH_DB "-wal");
+    unlink(BENCH_DB "-shm");
+    remove_archive();
+    
+    // db_open() logs to stdout; only the results go to stderr
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+    if (db_open(BENCH_DB) != 0) return 1;
+    
+    // The hourly sweep would start a minute in and compete with VACUUM and the scans
+    db_retention_pause(1);
+    
+    time_t end = time(NULL);
+    double t0 = now_sec();
+    long long rows = generate(end);
+    fprintf(stderr, "generated %lld snapshots over %d years in %.1f s\n\n", rows, YEARS, now_sec() - t0);
+    
+    time_t year2 = end - 2 * 365 * 86400;
+    Scenario scenarios[] = {
+        {.name = "full scan, 1000-row pages", .q = {.limit = 1000}, .pages = 0},
+        {.name = "30-day window (archived)", .q = {.limit = 1000, .from = year2, .to = year2 + 30 * 86400}, .pages = 0},
+        {.name = "30-day window (recent)", .q = {.limit = 1000, .from = end - 30 * 86400, .to = end}, .pages = 0},
+        {.name = "200 pages from year 2", .q = {.limit = 1000, .has_cursor = 1, .cursor_ts = year2, .cursor_id = 0}, .pages = PAGES},
+    };
+    int count = sizeof(scenarios) / sizeof(scenarios[0]);
+    
+    long long sqlite_before = sqlite_size();
+    if (sqlite_before < 0) return 1;
+    for (int i = 0; i < count; i++) {
+        scenarios[i].before = scan(&scenarios[i].q, scenarios[i].pages);
+    }
+    
+    t0 = now_sec();
+    int archived = db_archive_older_than(end - (time_t)ARCHIVE_AFTER_DAYS * 86400);
+    double archive_s = now_sec() - t0;
+    
+    ArchiveStats as;
+    archive_get_stats(&as);
+    long long sqlite_after = sqlite_size();
+    if (sqlite_after < 0) return 1;
+    for (int i = 0; i < count; i++) {
+        scenarios[i].after = scan(&scenarios[i].q, scenarios[i].pages);
+    }
+    
+    fprintf(stderr, "archived %d rows into %d segments in %.1f s (%.0f rows/s)\n",
+            archived, as.segments, archive_s, archived / archive_s);
+    fprintf(stderr, "size:  sqlite only %lld bytes (%.1f B/row)\n", sqlite_before, (double)sqlite_before / rows);
+    fprintf(stderr, "       sqlite %lld + archive %lld = %lld bytes (archive %.2f B/row, %.1fx smaller overall)\n\n",
+            sqlite_after, as.bytes, sqlite_after + as.bytes, as.rows ? (double)as.bytes / as.rows : 0,
+            (double)sqlite_before / (sqlite_after + as.bytes));
+    
+    fprintf(stderr, "%-28s %10s %12s %12s %8s\n", "scan", "rows", "sqlite r/s", "archive r/s", "same");
+    for (int i = 0; i < count; i++) {
+        Scenario *s = &scenarios[i];
+        fprintf(stderr, "%-28s %10lld %12.0f %12.0f %8s\n", s->name, s->after.rows,
+                s->before.rows / s->before.seconds, s->after.rows / s->after.seconds,
+                (s->before.rows == s->after.rows && s->before.checksum == s->after.checksum) ? "yes" : "NO");
+    }
+    
+    db_close();
+    unlink(BENCH_DB);
+    unlink(BENCH_DB "-wal");
+    unlink(BENCH_DB "-shm");
+    remove_archive();
+    return 0;
+}
@@ -0,0 +1,109 @@
+// bench/bench_commands.c
+// 10k-command batches through the command pipeline: submit, local apply
+// and publish time, one commands_submit() per command vs one
+// commands_submit_batch(). The publisher acks inline and the apply hook
+// reports back inline, so this measures the pipeline, not a broker or the
+// ingest worker.
+#include "../src/shared.h"
+#include "../src/commands.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define GATEWAYS        100
+#define PUMPS           100         // per gateway: GATEWAYS * PUMPS commands per round
+#define ROUNDS          5
+
+static unsigned long long published = 0;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Stands in for the broker: PUBACK at once
+static int fake_publish(long long id, const char *payload) {
+    published++;
+    commands_delivered(id);
+    return 0;
+}
+
+// Stands in for the ingest worker
+static int fake_apply(long long id, const char *device_id, int pump_id, int state) {
+    commands_applied(id);
+    return 0;
+}
+
+static void wait_published(unsigned long long target) {
+    CommandStats st;
+    do {
+        usleep(100);
+        commands_get_stats(&st);
+    } while (st.published < target);
+}
+
+int main() {
+    int n = GATEWAYS * PUMPS;
+    CommandRequest *reqs = malloc(n * sizeof(*reqs));
+    long long *ids = malloc(n * sizeof(*ids));
+    if (!reqs || !ids) return 1;
+    
+    for (int i = 0; i < n; i++) {
+        snprintf(reqs[i].device_id, sizeof(reqs[i].device_id), "site-%03d", i / PUMPS);
+        reqs[i].pump_id = i % PUMPS + 1;
+        reqs[i].state = 0;
+    }
+    
+    if (commands_init(fake_publish, fake_apply) != 0) {
+        printf("commands_init failed\n");
+        return 1;
+    }
+    
+    printf("%d commands per round, %d rounds\n", n, ROUNDS);
+    unsigned long long sent = 0;
+    
+    for (int mode = 0; mode < 2; mode++) {
+        double submit_total = 0, published_total = 0, worst = 0;
+        
+        for (int r = 0; r < ROUNDS; r++) {
+            double t0 = now_sec();
+            if (mode == 0) {
+                for (int i = 0; i < n; i++) {
+                    ids[i] = commands_submit(reqs[i].device_id, reqs[i].pump_id, reqs[i].state);
+                    if (ids[i] < 0) {
+                        printf("submit refused at %d\n", i);
+                        return 1;
+                    }
+                }
+            } else if (commands_submit_batch(reqs, n, ids, NULL) != 0) {
+                printf("batch refused\n");
+                return 1;
+            }
+            double t1 = now_sec();
+            
+            sent += n;
+            wait_published(sent);
+            double t2 = now_sec();
+            
+            submit_total += t1 - t0;
+            published_total += t2 - t0;
+            if (t2 - t0 > worst) worst = t2 - t0;
+        }
+        
+        printf("%-8s submit %7.2f ms   all published %7.2f ms (worst %7.2f ms)   %.0f commands/s\n",
+               mode == 0 ? "single" : "batch", submit_total * 1000 / ROUNDS, published_total * 1000 / ROUNDS,
+               worst * 1000, n * ROUNDS / published_total);
+    }
+    
+    CommandStats st;
+    commands_get_stats(&st);
+    printf("published %llu, applied %llu, superseded %llu, pending %d\n", published, st.applied, st.superseded, st.pending);
+    
+    commands_shutdown();
+    free(reqs);
+    free(ids);
+    return 0;
+}
@@ -0,0 +1,299 @@
+// bench/bench_http.c
+// Requests/sec and latency of GET /api/pump/status over loopback while other
+// clients pull large history pages, at 1, 4 and 8 MHD threads, with history
+// on the slow pool and inline on the event loops.
+// No results recorded yet: the machine this was written on had no
+// libmicrohttpd. `make bench && ./build/bench_http` prints the table
+// (status r/s, p50/p99, pool vs inline at 1/4/8 threads) to copy here.
+#include "../src/shared.h"
+#include "../src/registry.h"
+#include "../src/events.h"
+#include "../src/db.h"
+#include "../src/http_api.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DB        "/tmp/bench_http.db"
+#define BENCH_PORT      18080
+#define GATEWAYS        8
+#define PUMPS           8
+#define HISTORY_ROWS    200000
+#define HISTORY_LIMIT   20000       // rows per history request
+#define STATUS_CLIENTS  32          // keep-alive, one request in flight each
+#define HISTORY_CLIENTS 4
+#define DURATION_S      5
+#define HIST_BUCKET_US  10          // latency histogram: 10 us buckets up to 2 s
+#define HIST_BUCKETS    200000
+
+typedef struct {
+    int port;
+    int history;
+    unsigned long long requests;
+    unsigned long long errors;
+    unsigned long long bytes;
+    uint32_t *hist;
+} Client;
+
+static volatile int bench_stop = 0;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_local(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// One keep-alive response with a Content-Length; bytes of body or -1
+static long read_response(int fd, char *buf, size_t cap) {
+    size_t len = 0;
+    char *body = NULL;
+    
+    while (!body) {
+        if (len == cap - 1) return -1;
+        ssize_t n = recv(fd, buf + len, cap - 1 - len, 0);
+        if (n <= 0) return -1;
+        len += n;
+        buf[len] = '\0';
+        body = strstr(buf, "\r\n\r\n");
+    }
+    body += 4;
+    
+    const char *cl = strstr(buf, "Content-Length:");
+    if (!cl) cl = strstr(buf, "content-length:");
+    if (!cl || strncmp(buf, "HTTP/1.1 200", 12) != 0) return -1;
+    long want = atol(cl + 15);
+    long have = (long)(len - (body - buf));
+    
+    // Drain the rest of the body without keeping it
+    while (have < want) {
+        ssize_t n = recv(fd, buf, cap - 1, 0);
+        if (n <= 0) return -1;
+        have += n;
+    }
+    return want;
+}
+
+static void* status_client(void *arg) {
+    Client *c = arg;
+    static const char req[] = "GET /api/pump/status HTTP/1.1\r\nHost: bench\r\n\r\n";
+    char *buf = malloc(64 * 1024);
+    int fd = -1;
+    
+    while (!bench_stop) {
+        if (fd < 0 && (fd = connect_local(c->port)) < 0) {
+            c->errors++;
+            usleep(1000);
+            continue;
+        }
+        
+        double t0 = now_sec();
+        long n = send_all(fd, req, sizeof(req) - 1) == 0 ? read_response(fd, buf, 64 * 1024) : -1;
+        if (n < 0) {
+            c->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        
+        long us = (long)((now_sec() - t0) * 1e6) / HIST_BUCKET_US;
+        c->hist[us < HIST_BUCKETS ? us : HIST_BUCKETS - 1]++;
+        c->requests++;
+        c->bytes += n;
+    }
+    
+    if (fd >= 0) close(fd);
+    free(buf);
+    return NULL;
+}
+
+// Streamed (chunked) pages: read to EOF on a Connection: close request
+static void* history_client(void *arg) {
+    Client *c = arg;
+    char req[160];
+    snprintf(req, sizeof(req), "GET /api/pump/history?limit=%d HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n",
+             HISTORY_LIMIT);
+    char *buf = malloc(64 * 1024);
+    
+    while (!bench_stop) {
+        int fd = connect_local(c->port);
+        if (fd < 0 || send_all(fd, req, strlen(req)) != 0) {
+            c->errors++;
+            if (fd >= 0) close(fd);
+            usleep(1000);
+            continue;
+        }
+        
+        double t0 = now_sec();
+        ssize_t n;
+        unsigned long long got = 0;
+        while ((n = recv(fd, buf, 64 * 1024, 0)) > 0) {
+            got += n;
+        }
+        close(fd);
+        
+        long us = (long)((now_sec() - t0) * 1e6) / HIST_BUCKET_US;
+        c->hist[us < HIST_BUCKETS ? us : HIST_BUCKETS - 1]++;
+        c->requests++;
+        c->bytes += got;
+    }
+    
+    free(buf);
+    return NULL;
+}
+
+static double percentile(const uint32_t *hist, unsigned long long total, double p) {
+    unsigned long long want = (unsigned long long)(total * p);
+    unsigned long long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > want) return i * HIST_BUCKET_US / 1000.0;
+    }
+    return HIST_BUCKETS * HIST_BUCKET_US / 1000.0;
+}
+
+static void run(int threads, int slow_threads) {
+    HttpConfig cfg;
+    http_api_default_config(&cfg);
+    cfg.port = BENCH_PORT + threads * 10 + slow_threads;
+    cfg.threads = threads;
+    cfg.slow_threads = slow_threads;
+    if (http_api_start(&cfg) != 0) {
+        fprintf(stderr, "start failed on port %d\n", cfg.port);
+        exit(1);
+    }
+    
+    Client clients[STATUS_CLIENTS + HISTORY_CLIENTS];
+    pthread_t tids[STATUS_CLIENTS + HISTORY_CLIENTS];
+    memset(clients, 0, sizeof(clients));
+    bench_stop = 0;
+    
+    for (int i = 0; i < STATUS_CLIENTS + HISTORY_CLIENTS; i++) {
+        Client *c = &clients[i];
+        c->port = cfg.port;
+        c->history = i >= STATUS_CLIENTS;
+        c->hist = calloc(HIST_BUCKETS, sizeof(uint32_t));
+        pthread_create(&tids[i], NULL, c->history ? history_client : status_client, c);
+    }
+    
+    double t0 = now_sec();
+    sleep(DURATION_S);
+    bench_stop = 1;
+    for (int i = 0; i < STATUS_CLIENTS + HISTORY_CLIENTS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_sec() - t0;
+    http_api_stop();
+    
+    // Merge per-client histograms by kind
+    uint32_t *status_hist = calloc(HIST_BUCKETS, sizeof(uint32_t));
+    uint32_t *history_hist = calloc(HIST_BUCKETS, sizeof(uint32_t));
+    unsigned long long status_n = 0, history_n = 0, errors = 0;
+    for (int i = 0; i < STATUS_CLIENTS + HISTORY_CLIENTS; i++) {
+        Client *c = &clients[i];
+        uint32_t *h = c->history ? history_hist : status_hist;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            h[b] += c->hist[b];
+        }
+        if (c->history) {
+            history_n += c->requests;
+        } else {
+            status_n += c->requests;
+        }
+        errors += c->errors;
+        free(c->hist);
+    }
+    
+    fprintf(stderr, "%7d  %-7s  %10.0f  %8.2f  %8.2f  %9.1f  %8.0f  %6llu\n",
+            threads, slow_threads ? "pool" : "inline",
+            status_n / elapsed, percentile(status_hist, status_n, 0.50), percentile(status_hist, status_n, 0.99),
+            history_n / elapsed, percentile(history_hist, history_n, 0.99), errors);
+    
+    free(status_hist);
+    free(history_hist);
+}
+
+int main() {
+    pthread_mutex_init(&lock, NULL);
+    if (registry_init(REGISTRY_MAX_PUMPS, REGISTRY_MAX_GATEWAYS) != 0) return 1;
+    pthread_mutex_lock(&lock);
+    for (int g = 0; g < GATEWAYS; g++) {
+        char device_id[32];
+        snprintf(device_id, sizeof(device_id), "site-%02d", g);
+        for (int p = 1; p <= PUMPS; p++) {
+            registry_add_pump(device_id, p);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    
+    // Server logs go to /dev/null; only the results go to stderr
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+    
+    unlink(BENCH_DB);
+    if (db_open(BENCH_DB) != 0) return 1;
+    
+    PumpStatus snap;
+    memset(&snap, 0, sizeof(snap));
+    time_t base = time(NULL) - HISTORY_ROWS;
+    for (int i = 0; i < HISTORY_ROWS; i++) {
+        snprintf(snap.device_id, sizeof(snap.device_id), "site-%02d", i % GATEWAYS);
+        snap.pump_id = 1 + (i / GATEWAYS) % PUMPS;
+        snap.status = i & 1;
+        snap.timestamp = base + i;
+        db_insert_snapshot(&snap);
+    }
+    db_flush();
+    events_init();
+    
+    fprintf(stderr, "%d status clients (keep-alive), %d history clients (%d rows per page), %d s per run\n\n",
+            STATUS_CLIENTS, HISTORY_CLIENTS, HISTORY_LIMIT, DURATION_S);
+    fprintf(stderr, "threads  history  status r/s   p50 ms    p99 ms  history/s  hist p99  errors\n");
+    
+    int thread_counts[] = {1, 4, 8};
+    for (int i = 0; i < 3; i++) {
+        run(thread_counts[i], 0);
+        run(thread_counts[i], HTTP_SLOW_THREADS);
+    }
+    
+    running = 0;
+    db_close();
+    registry_free();
+    unlink(BENCH_DB);
+    return 0;
+}
@@ -0,0 +1,262 @@
+// bench/bench_mqtt.c
+// QoS 1 publishes/sec through the shared MQTTAsync connection (mqtt.c) at
+// several in-flight windows. The broker is an in-process stand-in for
+// mosquitto that answers CONNECT, SUBSCRIBE and PINGREQ and acknowledges
+// every QoS 1 PUBLISH after ACK_DELAY_US, like a broker one round trip away.
+// A window of 1 is the stop-and-wait of the old synchronous client.
+#define _GNU_SOURCE
+#include "../src/shared.h"
+#include "../src/mqtt.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PORT      18830
+#define ACK_DELAY_US    200         // simulated broker round trip
+#define PUBLISHERS      4
+#define MESSAGES        20000       // per window
+#define PAYLOAD_BYTES   200
+#define MAX_PENDING     65536       // acks the stand-in holds back
+
+static int windows[] = {1, 8, 64, 256};
+
+// ===== STAND-IN BROKER =====
+typedef struct {
+    int fd;
+    unsigned char in[1 << 16];
+    size_t in_len;
+    uint16_t ack_id[MAX_PENDING];
+    double ack_due[MAX_PENDING];
+    int ack_head;
+    int ack_count;
+} BrokerConn;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// One complete packet at the front of in[]: its length, 0 if incomplete
+static size_t packet_length(const unsigned char *p, size_t len, size_t *header, size_t *body) {
+    size_t value = 0, i = 1;
+    int shift = 0;
+    while (i < len && i < 5) {
+        value |= (size_t)(p[i] & 0x7f) << shift;
+        shift += 7;
+        if (!(p[i++] & 0x80)) {
+            if (len < i + value) return 0;
+            *header = i;
+            *body = value;
+            return i + value;
+        }
+    }
+    return 0;
+}
+
+static int handle_packet(BrokerConn *c, const unsigned char *p, size_t header, size_t body) {
+    const unsigned char *b = p + header;
+    int type = p[0] >> 4;
+    
+    if (type == 1) {                // CONNECT
+        unsigned char connack[] = {0x20, 0x02, 0x00, 0x00};
+        return write_all(c->fd, connack, sizeof(connack));
+    }
+    if (type == 3) {                // PUBLISH
+        int qos = (p[0] >> 1) & 3;
+        if (qos == 0 || body < 4) return 0;
+        size_t topic_len = (b[0] << 8) | b[1];
+        if (c->ack_count == MAX_PENDING) return -1;
+        int i = (c->ack_head + c->ack_count++) % MAX_PENDING;
+        c->ack_id[i] = (b[2 + topic_len] << 8) | b[3 + topic_len];
+        c->ack_due[i] = now_sec() + ACK_DELAY_US / 1e6;
+        return 0;
+    }
+    if (type == 8) {                // SUBSCRIBE: grant QoS 1 to every filter
+        unsigned char suback[64] = {0x90, 0, b[0], b[1]};
+        size_t n = 4;
+        for (size_t off = 2; off + 2 < body && n < sizeof(suback); ) {
+            off += 2 + ((b[off] << 8) | b[off + 1]) + 1;
+            suback[n++] = 1;
+        }
+        suback[1] = (unsigned char)(n - 2);
+        return write_all(c->fd, suback, n);
+    }
+    if (type == 12) {               // PINGREQ
+        unsigned char pingresp[] = {0xd0, 0x00};
+        return write_all(c->fd, pingresp, sizeof(pingresp));
+    }
+    if (type == 14) return -1;      // DISCONNECT
+    return 0;
+}
+
+static void* broker_conn_thread(void *arg) {
+    BrokerConn *c = arg;
+    
+    for (;;) {
+        // Acks that are due go out in one write
+        unsigned char out[4096];
+        size_t out_len = 0;
+        double now = now_sec();
+        while (c->ack_count > 0 && c->ack_due[c->ack_head] <= now && out_len + 4 <= sizeof(out)) {
+            uint16_t id = c->ack_id[c->ack_head];
+            unsigned char puback[] = {0x40, 0x02, id >> 8, id & 0xff};
+            memcpy(out + out_len, puback, 4);
+            out_len += 4;
+            c->ack_head = (c->ack_head + 1) % MAX_PENDING;
+            c->ack_count--;
+        }
+        if (out_len > 0 && write_all(c->fd, out, out_len) != 0) break;
+        
+        struct timespec timeout = {1, 0};
+        if (c->ack_count > 0) {
+            double wait = c->ack_due[c->ack_head] - now_sec();
+            if (wait < 0) wait = 0;
+            timeout.tv_sec = (time_t)wait;
+            timeout.tv_nsec = (long)((wait - (time_t)wait) * 1e9);
+        }
+        struct pollfd pfd = {c->fd, POLLIN, 0};
+        int ready = ppoll(&pfd, 1, &timeout, NULL);
+        if (ready < 0) break;
+        if (ready == 0) continue;
+        
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n <= 0) break;
+        c->in_len += n;
+        
+        size_t off = 0, header, body, len;
+        while ((len = packet_length(c->in + off, c->in_len - off, &header, &body)) > 0) {
+            if (handle_packet(c, c->in + off, header, body) != 0) goto done;
+            off += len;
+        }
+        memmove(c->in, c->in + off, c->in_len - off);
+        c->in_len -= off;
+    }
+    
+done:
+    close(c->fd);
+    free(c);
+    return NULL;
+}
+
+static void* broker_thread(void *arg) {
+    int lfd = *(int *)arg;
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) break;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        
+        BrokerConn *c = calloc(1, sizeof(*c));
+        pthread_t tid;
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        pthread_create(&tid, NULL, broker_conn_thread, c);
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+static int broker_listen() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BENCH_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// ===== PUBLISHERS =====
+static void* publisher(void *arg) {
+    char payload[PAYLOAD_BYTES];
+    memset(payload, 'x', sizeof(payload));
+    
+    for (int i = 0; i < MESSAGES / PUBLISHERS; i++) {
+        while (mqtt_publish("bench/status", payload, sizeof(payload), 1, 0, NULL) != 0) usleep(100);
+    }
+    return NULL;
+}
+
+int main() {
+    static int lfd;
+    lfd = broker_listen();
+    if (lfd < 0) {
+        printf("Can't listen on port %d\n", BENCH_PORT);
+        return 1;
+    }
+    pthread_t broker_tid;
+    pthread_create(&broker_tid, NULL, broker_thread, &lfd);
+    
+    char broker[64];
+    snprintf(broker, sizeof(broker), "tcp://127.0.0.1:%d", BENCH_PORT);
+    printf("%d QoS 1 publishes of %d bytes from %d threads, broker acks after %d us\n",
+           MESSAGES, PAYLOAD_BYTES, PUBLISHERS, ACK_DELAY_US);
+    
+    for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+        MqttConfig cfg;
+        mqtt_default_config(&cfg);
+        cfg.broker = broker;
+        cfg.username = NULL;
+        cfg.password = NULL;
+        cfg.inflight_max = windows[w];
+        cfg.subscribe = 0;
+        cfg.outbox_path = NULL;
+        
+        MqttStats st;
+        if (mqtt_start(&cfg) != 0) return 1;
+        do {
+            usleep(1000);
+            mqtt_get_stats(&st);
+        } while (!st.connected);
+        
+        unsigned long long acked0 = st.acked;
+        double t0 = now_sec();
+        pthread_t tids[PUBLISHERS];
+        for (int i = 0; i < PUBLISHERS; i++) pthread_create(&tids[i], NULL, publisher, NULL);
+        for (int i = 0; i < PUBLISHERS; i++) pthread_join(tids[i], NULL);
+        double t_published = now_sec();
+        
+        do {
+            usleep(200);
+            mqtt_get_stats(&st);
+        } while (st.acked + st.failed < acked0 + MESSAGES);
+        double t_acked = now_sec();
+        
+        printf("window %4d   published in %8.2f ms   all acked in %8.2f ms   %8.0f publishes/s   failed %llu\n",
+               windows[w], (t_published - t0) * 1000, (t_acked - t0) * 1000, MESSAGES / (t_acked - t0), st.failed);
+        mqtt_stop();
+    }
+    
+    close(lfd);
+    return 0;
+}
@@ -0,0 +1,89 @@
+// bench/bench_registry.c
+// Lookup and update cost of the pump registry from 2 to 100k pumps.
+// Both should stay flat: the index is O(1) and the columns are contiguous.
+#include "../src/shared.h"
+#include "../src/registry.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define OPS 2000000
+#define PUMPS_PER_GATEWAY 8
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(int pumps) {
+    int gateways = (pumps + PUMPS_PER_GATEWAY - 1) / PUMPS_PER_GATEWAY;
+    char (*names)[64] = malloc(sizeof(*names) * gateways);
+    int *keys = malloc(sizeof(int) * OPS);
+    long sink = 0;
+    
+    registry_init(pumps, gateways);
+    for (int g = 0; g < gateways; g++) {
+        snprintf(names[g], sizeof(names[g]), "site-%d", g);
+    }
+    for (int i = 0; i < pumps; i++) {
+        registry_add_pump(names[i / PUMPS_PER_GATEWAY], 1 + i % PUMPS_PER_GATEWAY);
+    }
+    
+    // Random access pattern, generated up front so rand() is not timed
+    srand(42);
+    for (int i = 0; i < OPS; i++) {
+        keys[i] = rand() % pumps;
+    }
+    
+    double t0 = now_sec();
+    for (int i = 0; i < OPS; i++) {
+        int k = keys[i];
+        sink += registry_find_pump(names[k / PUMPS_PER_GATEWAY], 1 + k % PUMPS_PER_GATEWAY);
+    }
+    double t1 = now_sec();
+    
+    time_t ts = time(NULL);
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < OPS; i++) {
+        int k = keys[i];
+        int slot = registry_find_pump(names[k / PUMPS_PER_GATEWAY], 1 + k % PUMPS_PER_GATEWAY);
+        sink += registry_set_status(slot, 1 + (i & 1), ts);
+    }
+    pthread_mutex_unlock(&lock);
+    double t2 = now_sec();
+    
+    PumpStatus p;
+    for (int i = 0; i < OPS; i++) {
+        registry_read(keys[i], &p);
+        sink += p.status;
+    }
+    double t3 = now_sec();
+    
+    fprintf(stderr, "pumps=%-7d lookup=%6.1f ns  lookup+update=%6.1f ns  read=%6.1f ns  (sink %ld)\n",
+           pumps,
+           (t1 - t0) * 1e9 / OPS,
+           (t2 - t1) * 1e9 / OPS,
+           (t3 - t2) * 1e9 / OPS,
+           sink & 1);
+    
+    registry_free();
+    free(keys);
+    free(names);
+}
+
+int main() {
+    int sizes[] = {2, 100, 1000, 10000, 100000};
+    
+    pthread_mutex_init(&lock, NULL);
+    
+    // Registration logs every new gateway; only the results go to stderr
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+    
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        run(sizes[i]);
+    }
+    
+    pthread_mutex_destroy(&lock);
+    return 0;
+}
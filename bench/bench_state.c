@@ -0,0 +1,109 @@
+// bench/bench_state.c
+// Reader throughput on the shared pump state while a feedback storm runs.
+// Compares the old mutex read path with the seqlock snapshot.
+#include "../src/shared.h"
+#include "../src/registry.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_SECONDS 2
+
+static volatile int bench_stop = 0;
+static volatile int use_seqlock = 0;
+static long writer_ops = 0;
+static volatile long sink;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* writer_thread(void *arg) {
+    int i = 0;
+    while (!bench_stop) {
+        update_pump_feedback(NULL, 1 + (i & 1), (i & 2) ? STATUS_RUNNING : STATUS_STOPPED);
+        i++;
+    }
+    writer_ops = i;
+    return NULL;
+}
+
+static void* reader_thread(void *arg) {
+    long *ops = arg;
+    long n = 0;
+    long sum = 0;
+    PumpStatus snap;
+    
+    while (!bench_stop) {
+        int pump_id = 1 + (n & 1);
+        if (use_seqlock) {
+            pump_status_snapshot(NULL, pump_id, &snap);
+        } else {
+            pthread_mutex_lock(&lock);
+            pump_status_snapshot(NULL, pump_id, &snap);
+            pthread_mutex_unlock(&lock);
+        }
+        sum += snap.status;
+        n++;
+    }
+    sink = sum;
+    *ops = n;
+    return NULL;
+}
+
+static void run(int readers, int seqlock_mode) {
+    pthread_t wtid, rtid[64];
+    long ops[64] = {0};
+    
+    bench_stop = 0;
+    use_seqlock = seqlock_mode;
+    
+    pthread_create(&wtid, NULL, writer_thread, NULL);
+    for (int i = 0; i < readers; i++) {
+        pthread_create(&rtid[i], NULL, reader_thread, &ops[i]);
+    }
+    
+    double start = now_sec();
+    sleep(BENCH_SECONDS);
+    bench_stop = 1;
+    
+    pthread_join(wtid, NULL);
+    long total = 0;
+    for (int i = 0; i < readers; i++) {
+        pthread_join(rtid[i], NULL);
+        total += ops[i];
+    }
+    double elapsed = now_sec() - start;
+    
+    fprintf(stderr, "%-8s readers=%-2d  reads/s=%12.0f  feedback writes/s=%10.0f\n",
+            seqlock_mode ? "seqlock" : "mutex", readers,
+            total / elapsed, writer_ops / elapsed);
+}
+
+int main(int argc, char **argv) {
+    int max_readers = argc > 1 ? atoi(argv[1]) : 4;
+    if (max_readers < 1 || max_readers > 64) max_readers = 4;
+    
+    pthread_mutex_init(&lock, NULL);
+    
+    // The update path logs every change; keep the storm off the terminal
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+    if (registry_init(16, 4) != 0) return 1;
+    
+    // Both pumps must exist before readers look them up
+    update_pump_feedback(NULL, 1, STATUS_STOPPED);
+    update_pump_feedback(NULL, 2, STATUS_STOPPED);
+    
+    for (int r = 1; r <= max_readers; r *= 2) {
+        run(r, 0);
+        run(r, 1);
+    }
+    
+    registry_free();
+    pthread_mutex_destroy(&lock);
+    return 0;
+}
@@ -0,0 +1,796 @@
+#include "archive.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Segment file, written once and then only mmap'd (little-endian):
+//   SegHeader
+//   device dictionary   devices x (u8 len, bytes), padded to 8
+//   block index         blocks x SegBlock
+//   block data          rows sorted by (timestamp, id), per block:
+//     timestamps        zigzag varints: first, first delta, then delta-of-delta
+//     ids               zigzag varints: first, then deltas
+//     device .. alarm   bit-packed columns, value - base in width bits
+// Every segment holds keys above the previous segment's, so the list sorted
+// by max key is also sorted by min key.
+#define SEG_MAGIC       "PUMPSEG1"
+#define SEG_FIELDS      6
+#define SEG_TAIL_PAD    8           // lets the bit reader load 8 bytes anywhere
+
+enum { F_DEVICE, F_PUMP, F_COMMAND, F_STATUS, F_BUSY, F_ALARM };
+
+typedef struct {
+    char magic[8];
+    int64_t min_ts;
+    int64_t max_ts;
+    int64_t min_id;
+    int64_t max_id;
+    int64_t last_id;        // id of the newest key, (max_ts, last_id)
+    uint32_t rows;
+    uint32_t blocks;
+    uint32_t devices;
+    uint32_t dict_off;
+    uint32_t index_off;
+    int32_t base[SEG_FIELDS];
+    uint8_t width[SEG_FIELDS];
+    uint8_t pad[6];
+} SegHeader;
+
+typedef struct {
+    int64_t first_ts;
+    int64_t last_ts;
+    uint32_t off;
+    uint32_t rows;
+} SegBlock;
+
+typedef struct {
+    char name[64];
+    const uint8_t *map;
+    size_t size;
+    const SegHeader *hdr;
+    const SegBlock *index;
+    char (*devices)[64];
+    int refs;               // under seg_lock; the list holds one
+} Segment;
+
+static sqlite3 *wconn = NULL;
+static char archive_dir[256];
+static Segment **segs = NULL;
+static int seg_count = 0;
+static int seg_cap = 0;
+static long long seg_rows = 0;
+static long long seg_bytes = 0;
+static pthread_mutex_t seg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ArchiveRow *pending = NULL;     // writer thread only
+static sqlite3_stmt *select_stmt = NULL;
+static sqlite3_stmt *delete_stmt = NULL;
+static sqlite3_stmt *record_stmt = NULL;
+static sqlite3_stmt *forget_stmt = NULL;
+
+// ===== ENCODING =====
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static size_t put_varint(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+static const uint8_t* get_varint(const uint8_t *p, const uint8_t *end, uint64_t *out) {
+    uint64_t v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *out = v;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static void put_bits(uint8_t *buf, size_t bit, uint32_t v, int width) {
+    for (int i = 0; i < width; i++, bit++) {
+        if ((v >> i) & 1) buf[bit >> 3] |= (uint8_t)(1u << (bit & 7));
+    }
+}
+
+static uint32_t get_bits(const uint8_t *buf, size_t bit, int width) {
+    uint64_t word;
+    memcpy(&word, buf + (bit >> 3), sizeof(word));
+    return (uint32_t)((word >> (bit & 7)) & ((1ull << width) - 1));
+}
+
+static int bits_for(uint32_t range) {
+    int w = 0;
+    while (w < 32 && (range >> w) != 0) w++;
+    return w;
+}
+
+static int row_field(const ArchiveRow *r, int f, const int *dev_index) {
+    switch (f) {
+        case F_DEVICE: return *dev_index;
+        case F_PUMP: return r->pump_id;
+        case F_COMMAND: return r->command;
+        case F_STATUS: return r->status;
+        case F_BUSY: return r->busy;
+        default: return r->alarm;
+    }
+}
+
+// Device dictionary lookup while building: open addressing over the row count
+static int dict_index(int *table, int cap, char (*names)[64], int *count, const char *device_id) {
+    unsigned int h = 2166136261u;
+    for (const char *p = device_id; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    
+    unsigned int i = h & (cap - 1);
+    while (table[i] >= 0) {
+        if (strcmp(names[table[i]], device_id) == 0) return table[i];
+        i = (i + 1) & (cap - 1);
+    }
+    
+    snprintf(names[*count], 64, "%s", device_id);
+    table[i] = (*count)++;
+    return table[i];
+}
+
+// Encode n rows (sorted by key) into a malloc'd segment image
+static uint8_t* encode_segment(const ArchiveRow *rows, int n, size_t *size_out) {
+    int cap = 1;
+    while (cap < n * 2) cap <<= 1;
+    
+    int *table = malloc(sizeof(int) * cap);
+    int *dev = malloc(sizeof(int) * n);
+    char (*names)[64] = malloc((size_t)n * 64);
+    int blocks = (n + ARCHIVE_BLOCK_ROWS - 1) / ARCHIVE_BLOCK_ROWS;
+    
+    // Varints are at most 10 bytes, each packed column at most 4 bytes a row
+    size_t max = sizeof(SegHeader) + (size_t)n * 65 + 8 + sizeof(SegBlock) * blocks
+               + (size_t)n * (20 + 4 * SEG_FIELDS) + (size_t)blocks * SEG_FIELDS + SEG_TAIL_PAD;
+    uint8_t *buf = calloc(1, max);
+    
+    if (!table || !dev || !names || !buf) {
+        free(table);
+        free(dev);
+        free(names);
+        free(buf);
+        return NULL;
+    }
+    
+    memset(table, -1, sizeof(int) * cap);
+    int devices = 0;
+    for (int i = 0; i < n; i++) {
+        dev[i] = dict_index(table, cap, names, &devices, rows[i].device_id);
+    }
+    
+    SegHeader *hdr = (SegHeader *)buf;
+    memcpy(hdr->magic, SEG_MAGIC, sizeof(hdr->magic));
+    hdr->rows = n;
+    hdr->blocks = blocks;
+    hdr->devices = devices;
+    hdr->min_ts = rows[0].timestamp;
+    hdr->max_ts = rows[n - 1].timestamp;
+    hdr->min_id = hdr->max_id = rows[0].id;
+    hdr->last_id = rows[n - 1].id;
+    
+    // Small-domain fields get just enough bits for the segment's own range
+    for (int f = 0; f < SEG_FIELDS; f++) {
+        int lo = INT_MAX, hi = INT_MIN;
+        for (int i = 0; i < n; i++) {
+            int v = row_field(&rows[i], f, &dev[i]);
+            if (v < lo) lo = v;
+            if (v > hi) hi = v;
+        }
+        hdr->base[f] = lo;
+        hdr->width[f] = bits_for((uint32_t)((int64_t)hi - lo));
+    }
+    
+    size_t off = sizeof(SegHeader);
+    hdr->dict_off = off;
+    for (int d = 0; d < devices; d++) {
+        size_t len = strlen(names[d]);
+        buf[off++] = (uint8_t)len;
+        memcpy(buf + off, names[d], len);
+        off += len;
+    }
+    off = (off + 7) & ~(size_t)7;
+    
+    hdr->index_off = off;
+    SegBlock *index = (SegBlock *)(buf + off);
+    off += sizeof(SegBlock) * blocks;
+    
+    for (int b = 0; b < blocks; b++) {
+        const ArchiveRow *r = rows + (size_t)b * ARCHIVE_BLOCK_ROWS;
+        const int *d = dev + (size_t)b * ARCHIVE_BLOCK_ROWS;
+        int m = n - b * ARCHIVE_BLOCK_ROWS;
+        if (m > ARCHIVE_BLOCK_ROWS) m = ARCHIVE_BLOCK_ROWS;
+        
+        index[b].first_ts = r[0].timestamp;
+        index[b].last_ts = r[m - 1].timestamp;
+        index[b].off = off;
+        index[b].rows = m;
+        
+        // Snapshots arrive at a steady-ish cadence, so the second difference
+        // of the timestamps is mostly a one-byte varint
+        int64_t prev_delta = 0;
+        for (int i = 0; i < m; i++) {
+            int64_t v = r[i].timestamp;
+            if (i == 1) v = r[1].timestamp - r[0].timestamp;
+            if (i >= 2) v = (r[i].timestamp - r[i - 1].timestamp) - prev_delta;
+            if (i >= 1) prev_delta = r[i].timestamp - r[i - 1].timestamp;
+            off += put_varint(buf + off, zigzag(v));
+        }
+        for (int i = 0; i < m; i++) {
+            off += put_varint(buf + off, zigzag(i == 0 ? r[0].id : r[i].id - r[i - 1].id));
+            if (r[i].id < hdr->min_id) hdr->min_id = r[i].id;
+            if (r[i].id > hdr->max_id) hdr->max_id = r[i].id;
+        }
+        for (int f = 0; f < SEG_FIELDS; f++) {
+            for (int i = 0; i < m; i++) {
+                int64_t v = (int64_t)row_field(&r[i], f, &d[i]) - hdr->base[f];
+                put_bits(buf + off, (size_t)i * hdr->width[f], (uint32_t)v, hdr->width[f]);
+            }
+            off += ((size_t)m * hdr->width[f] + 7) / 8;
+        }
+    }
+    
+    free(table);
+    free(dev);
+    free(names);
+    *size_out = off + SEG_TAIL_PAD;
+    return buf;
+}
+
+// ===== SEGMENTS =====
+static void segment_free(Segment *s) {
+    if (s->map) munmap((void *)s->map, s->size);
+    free(s->devices);
+    free(s);
+}
+
+static void segment_release(Segment *s) {
+    pthread_mutex_lock(&seg_lock);
+    int last = (--s->refs == 0);
+    pthread_mutex_unlock(&seg_lock);
+    if (last) segment_free(s);
+}
+
+static Segment* segment_map(const char *name) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", archive_dir, name);
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "[ARCHIVE] Cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    
+    struct stat st;
+    Segment *s = calloc(1, sizeof(*s));
+    if (!s || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SegHeader) + SEG_TAIL_PAD) {
+        close(fd);
+        free(s);
+        fprintf(stderr, "[ARCHIVE] Bad segment %s\n", path);
+        return NULL;
+    }
+    
+    s->size = st.st_size;
+    void *map = mmap(NULL, s->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        free(s);
+        fprintf(stderr, "[ARCHIVE] mmap %s failed: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    
+    s->map = map;
+    s->hdr = (const SegHeader *)map;
+    s->index = (const SegBlock *)(s->map + s->hdr->index_off);
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    s->refs = 1;
+    
+    if (memcmp(s->hdr->magic, SEG_MAGIC, sizeof(s->hdr->magic)) != 0 ||
+        s->hdr->index_off + (size_t)s->hdr->blocks * sizeof(SegBlock) > s->size) {
+        fprintf(stderr, "[ARCHIVE] Bad segment %s\n", path);
+        segment_free(s);
+        return NULL;
+    }
+    
+    // Scans read blocks in both directions from here on
+    madvise(map, s->size, MADV_RANDOM);
+    
+    s->devices = calloc(s->hdr->devices ? s->hdr->devices : 1, 64);
+    if (!s->devices) {
+        segment_free(s);
+        return NULL;
+    }
+    const uint8_t *p = s->map + s->hdr->dict_off;
+    for (uint32_t d = 0; d < s->hdr->devices; d++) {
+        size_t len = *p++;
+        memcpy(s->devices[d], p, len < 63 ? len : 63);
+        p += len;
+    }
+    return s;
+}
+
+static int segment_append(Segment *s) {
+    pthread_mutex_lock(&seg_lock);
+    if (seg_count == seg_cap) {
+        int cap = seg_cap ? seg_cap * 2 : 64;
+        Segment **grown = realloc(segs, sizeof(*grown) * cap);
+        if (!grown) {
+            pthread_mutex_unlock(&seg_lock);
+            return -1;
+        }
+        segs = grown;
+        seg_cap = cap;
+    }
+    segs[seg_count++] = s;
+    seg_rows += s->hdr->rows;
+    seg_bytes += s->size;
+    pthread_mutex_unlock(&seg_lock);
+    return 0;
+}
+
+static void segment_unpublish(Segment *s) {
+    pthread_mutex_lock(&seg_lock);
+    if (seg_count > 0 && segs[seg_count - 1] == s) {
+        seg_count--;
+        seg_rows -= s->hdr->rows;
+        seg_bytes -= s->size;
+    }
+    pthread_mutex_unlock(&seg_lock);
+    segment_release(s);
+}
+
+// Segments on disk but not in archive_segments were written by a run that
+// never committed; their rows are still in pump_snapshots
+static void remove_orphans() {
+    DIR *dir = opendir(archive_dir);
+    if (!dir) return;
+    
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+        size_t len = strlen(e->d_name);
+        if (len < 5 || strcmp(e->d_name + len - 5, ".pseg") != 0) continue;
+        
+        int known = 0;
+        for (int i = 0; i < seg_count && !known; i++) {
+            known = strcmp(segs[i]->name, e->d_name) == 0;
+        }
+        if (!known) {
+            char path[512];
+            snprintf(path, sizeof(path), "%s/%s", archive_dir, e->d_name);
+            unlink(path);
+            printf("[ARCHIVE] Removed uncommitted segment %s\n", e->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+int archive_init(sqlite3 *writer, const char *dir) {
+    char *err_msg = NULL;
+    sqlite3_stmt *stmt;
+    
+    wconn = writer;
+    snprintf(archive_dir, sizeof(archive_dir), "%s", dir);
+    if (mkdir(archive_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "[ARCHIVE] Cannot create %s: %s\n", archive_dir, strerror(errno));
+        return -1;
+    }
+    
+    if (sqlite3_exec(wconn,
+            "CREATE TABLE IF NOT EXISTS archive_segments (file TEXT PRIMARY KEY, rows INTEGER, bytes INTEGER, "
+            "min_ts INTEGER, max_ts INTEGER, min_id INTEGER, max_id INTEGER);",
+            NULL, NULL, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "[ARCHIVE] Error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return -1;
+    }
+    
+    if (sqlite3_prepare_v2(wconn, "SELECT file FROM archive_segments ORDER BY max_ts, max_id", -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "[ARCHIVE] Error: %s\n", sqlite3_errmsg(wconn));
+        return -1;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        Segment *s = segment_map((const char *)sqlite3_column_text(stmt, 0));
+        if (s && segment_append(s) != 0) segment_free(s);
+    }
+    sqlite3_finalize(stmt);
+    remove_orphans();
+    
+    // Keys strictly above the last segment, so segments never overlap.
+    // A late row older than that stays in pump_snapshots, where the history
+    // merge still finds it.
+    const char *select_sql =
+        "SELECT id, device_id, pump_id, command, status, busy, alarm, timestamp FROM pump_snapshots "
+        "WHERE timestamp < ?1 AND (timestamp, id) > (?2, ?3) ORDER BY timestamp, id LIMIT ?4";
+    const char *delete_sql =
+        "DELETE FROM pump_snapshots WHERE timestamp < ?1 AND (timestamp, id) > (?2, ?3) AND (timestamp, id) <= (?4, ?5)";
+    const char *record_sql =
+        "INSERT INTO archive_segments (file, rows, bytes, min_ts, max_ts, min_id, max_id) VALUES (?,?,?,?,?,?,?)";
+    
+    if (sqlite3_prepare_v3(wconn, select_sql, -1, SQLITE_PREPARE_PERSISTENT, &select_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v3(wconn, delete_sql, -1, SQLITE_PREPARE_PERSISTENT, &delete_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v3(wconn, record_sql, -1, SQLITE_PREPARE_PERSISTENT, &record_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v3(wconn, "DELETE FROM archive_segments WHERE file = ?", -1, SQLITE_PREPARE_PERSISTENT, &forget_stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "[ARCHIVE] Prepare failed: %s\n", sqlite3_errmsg(wconn));
+        return -1;
+    }
+    
+    pending = malloc(sizeof(ArchiveRow) * ARCHIVE_SEGMENT_ROWS);
+    if (!pending) return -1;
+    
+    printf("[ARCHIVE] %d segments, %lld rows, %lld bytes in %s\n", seg_count, seg_rows, seg_bytes, archive_dir);
+    return 0;
+}
+
+void archive_close() {
+    sqlite3_finalize(select_stmt);
+    sqlite3_finalize(delete_stmt);
+    sqlite3_finalize(record_stmt);
+    sqlite3_finalize(forget_stmt);
+    select_stmt = delete_stmt = record_stmt = forget_stmt = NULL;
+    free(pending);
+    pending = NULL;
+    
+    pthread_mutex_lock(&seg_lock);
+    Segment **list = segs;
+    int n = seg_count;
+    segs = NULL;
+    seg_count = seg_cap = 0;
+    seg_rows = seg_bytes = 0;
+    pthread_mutex_unlock(&seg_lock);
+    
+    for (int i = 0; i < n; i++) {
+        segment_release(list[i]);
+    }
+    free(list);
+    wconn = NULL;
+}
+
+static int write_file(const char *path, const uint8_t *buf, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    
+    size_t done = 0;
+    while (done < size) {
+        ssize_t w = write(fd, buf + done, size - done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            close(fd);
+            return -1;
+        }
+        done += w;
+    }
+    
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+static int sync_dir() {
+    int fd = open(archive_dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+int archive_run(time_t cutoff, int min_rows) {
+    if (!wconn || !pending) return -1;
+    
+    // Resume after the newest archived key
+    sqlite3_int64 after_ts = LLONG_MIN, after_id = 0;
+    pthread_mutex_lock(&seg_lock);
+    if (seg_count > 0) {
+        after_ts = segs[seg_count - 1]->hdr->max_ts;
+        after_id = segs[seg_count - 1]->hdr->last_id;
+    }
+    pthread_mutex_unlock(&seg_lock);
+    
+    if (sqlite3_exec(wconn, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "[ARCHIVE] BEGIN failed: %s\n", sqlite3_errmsg(wconn));
+        return -1;
+    }
+    
+    int n = 0;
+    sqlite3_bind_int64(select_stmt, 1, cutoff);
+    sqlite3_bind_int64(select_stmt, 2, after_ts);
+    sqlite3_bind_int64(select_stmt, 3, after_id);
+    sqlite3_bind_int(select_stmt, 4, ARCHIVE_SEGMENT_ROWS);
+    while (n < ARCHIVE_SEGMENT_ROWS && sqlite3_step(select_stmt) == SQLITE_ROW) {
+        ArchiveRow *r = &pending[n++];
+        const char *dev = (const char *)sqlite3_column_text(select_stmt, 1);
+        r->id = sqlite3_column_int64(select_stmt, 0);
+        snprintf(r->device_id, sizeof(r->device_id), "%s", dev ? dev : "");
+        r->pump_id = sqlite3_column_int(select_stmt, 2);
+        r->command = sqlite3_column_int(select_stmt, 3);
+        r->status = sqlite3_column_int(select_stmt, 4);
+        r->busy = sqlite3_column_int(select_stmt, 5);
+        r->alarm = sqlite3_column_int(select_stmt, 6);
+        r->timestamp = sqlite3_column_int64(select_stmt, 7);
+    }
+    sqlite3_reset(select_stmt);
+    
+    if (n == 0 || n < min_rows) {
+        sqlite3_exec(wconn, "ROLLBACK", NULL, NULL, NULL);
+        return 0;
+    }
+    
+    size_t size;
+    uint8_t *image = encode_segment(pending, n, &size);
+    if (!image) {
+        sqlite3_exec(wconn, "ROLLBACK", NULL, NULL, NULL);
+        return -1;
+    }
+    const SegHeader *hdr = (const SegHeader *)image;
+    
+    // Written under a temporary name, then renamed; the segment only counts
+    // once archive_segments commits together with the DELETE
+    char name[64], tmp[512], path[512];
+    snprintf(name, sizeof(name), "seg-%016llx-%016llx.pseg",
+             (unsigned long long)hdr->max_ts, (unsigned long long)hdr->last_id);
+    snprintf(path, sizeof(path), "%s/%s", archive_dir, name);
+    snprintf(tmp, sizeof(tmp), "%s/.%s.tmp", archive_dir, name);
+    
+    int rc = write_file(tmp, image, size);
+    if (rc == 0) rc = rename(tmp, path);
+    if (rc == 0) rc = sync_dir();
+    if (rc != 0) fprintf(stderr, "[ARCHIVE] Writing %s failed: %s\n", name, strerror(errno));
+    
+    if (rc == 0) {
+        sqlite3_bind_int64(delete_stmt, 1, cutoff);
+        sqlite3_bind_int64(delete_stmt, 2, after_ts);
+        sqlite3_bind_int64(delete_stmt, 3, after_id);
+        sqlite3_bind_int64(delete_stmt, 4, pending[n - 1].timestamp);
+        sqlite3_bind_int64(delete_stmt, 5, pending[n - 1].id);
+        rc = (sqlite3_step(delete_stmt) == SQLITE_DONE) ? 0 : -1;
+        sqlite3_reset(delete_stmt);
+    }
+    if (rc == 0) {
+        sqlite3_bind_text(record_stmt, 1, name, -1, SQLITE_STATIC);
+        sqlite3_bind_int(record_stmt, 2, n);
+        sqlite3_bind_int64(record_stmt, 3, size);
+        sqlite3_bind_int64(record_stmt, 4, hdr->min_ts);
+        sqlite3_bind_int64(record_stmt, 5, hdr->max_ts);
+        sqlite3_bind_int64(record_stmt, 6, hdr->min_id);
+        sqlite3_bind_int64(record_stmt, 7, hdr->max_id);
+        rc = (sqlite3_step(record_stmt) == SQLITE_DONE) ? 0 : -1;
+        sqlite3_reset(record_stmt);
+    }
+    free(image);
+    
+    // Published before COMMIT: a reader in between sees the rows twice
+    // (history merges equal keys) rather than not at all
+    Segment *s = (rc == 0) ? segment_map(name) : NULL;
+    if (s && segment_append(s) != 0) {
+        segment_free(s);
+        s = NULL;
+    }
+    if (s && sqlite3_exec(wconn, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        segment_unpublish(s);
+        s = NULL;
+    }
+    
+    if (!s) {
+        fprintf(stderr, "[ARCHIVE] Segment %s not committed: %s\n", name, sqlite3_errmsg(wconn));
+        sqlite3_exec(wconn, "ROLLBACK", NULL, NULL, NULL);
+        unlink(tmp);
+        unlink(path);
+        return -1;
+    }
+    
+    printf("[ARCHIVE] %s: %d rows, %zu bytes\n", name, n, size);
+    return n;
+}
+
+int archive_expire(time_t cutoff) {
+    if (!wconn) return -1;
+    
+    pthread_mutex_lock(&seg_lock);
+    Segment *s = (seg_count > 0 && segs[0]->hdr->max_ts < cutoff) ? segs[0] : NULL;
+    pthread_mutex_unlock(&seg_lock);
+    if (!s) return 0;
+    
+    // Forget it first; a crash before the unlink leaves an orphan that the
+    // next start removes
+    sqlite3_bind_text(forget_stmt, 1, s->name, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(forget_stmt);
+    sqlite3_reset(forget_stmt);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "[ARCHIVE] Cannot drop %s: %s\n", s->name, sqlite3_errmsg(wconn));
+        return -1;
+    }
+    
+    pthread_mutex_lock(&seg_lock);
+    memmove(segs, segs + 1, sizeof(*segs) * (seg_count - 1));
+    seg_count--;
+    seg_rows -= s->hdr->rows;
+    seg_bytes -= s->size;
+    pthread_mutex_unlock(&seg_lock);
+    
+    // Open cursors keep their mapping until they close
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", archive_dir, s->name);
+    unlink(path);
+    printf("[ARCHIVE] Expired %s\n", s->name);
+    segment_release(s);
+    return 1;
+}
+
+void archive_get_stats(ArchiveStats *out) {
+    pthread_mutex_lock(&seg_lock);
+    out->segments = seg_count;
+    out->rows = seg_rows;
+    out->bytes = seg_bytes;
+    pthread_mutex_unlock(&seg_lock);
+}
+
+// ===== READER =====
+// Walks segments and blocks newest first, decoding one block at a time, so
+// a scan of any length needs one block of column buffers.
+struct ArchiveCursor {
+    Segment **segs;         // referenced snapshot of the list at open
+    int nsegs;
+    int seg;
+    int block;
+    int row;                // next row to return in the decoded block, -1 when used up
+    time_t from;
+    time_t to;
+    int has_key;
+    time_t key_ts;
+    long long key_id;
+    int64_t ts[ARCHIVE_BLOCK_ROWS];
+    int64_t id[ARCHIVE_BLOCK_ROWS];
+    int32_t field[SEG_FIELDS][ARCHIVE_BLOCK_ROWS];
+};
+
+ArchiveCursor* archive_cursor_open(time_t from, time_t to, int has_key, time_t key_ts, long long key_id) {
+    ArchiveCursor *cur = malloc(sizeof(*cur));
+    if (!cur) return NULL;
+    
+    pthread_mutex_lock(&seg_lock);
+    cur->segs = seg_count ? malloc(sizeof(Segment *) * seg_count) : NULL;
+    cur->nsegs = cur->segs ? seg_count : 0;
+    for (int i = 0; i < cur->nsegs; i++) {
+        cur->segs[i] = segs[i];
+        segs[i]->refs++;
+    }
+    pthread_mutex_unlock(&seg_lock);
+    
+    cur->seg = cur->nsegs - 1;
+    cur->block = cur->seg >= 0 ? (int)cur->segs[cur->seg]->hdr->blocks : 0;
+    cur->row = -1;
+    cur->from = from;
+    cur->to = to;
+    cur->has_key = has_key;
+    cur->key_ts = key_ts;
+    cur->key_id = key_id;
+    return cur;
+}
+
+static int decode_block(ArchiveCursor *cur, const Segment *s, const SegBlock *blk) {
+    const SegHeader *hdr = s->hdr;
+    const uint8_t *p = s->map + blk->off;
+    const uint8_t *end = s->map + s->size;
+    int m = blk->rows;
+    uint64_t v;
+    
+    if (m > ARCHIVE_BLOCK_ROWS || blk->off >= s->size) return -1;
+    
+    int64_t delta = 0;
+    for (int i = 0; i < m; i++) {
+        if (!(p = get_varint(p, end, &v))) return -1;
+        int64_t x = unzigzag(v);
+        if (i == 0) {
+            cur->ts[0] = x;
+        } else {
+            delta = (i == 1) ? x : delta + x;
+            cur->ts[i] = cur->ts[i - 1] + delta;
+        }
+    }
+    for (int i = 0; i < m; i++) {
+        if (!(p = get_varint(p, end, &v))) return -1;
+        cur->id[i] = (i == 0) ? unzigzag(v) : cur->id[i - 1] + unzigzag(v);
+    }
+    for (int f = 0; f < SEG_FIELDS; f++) {
+        int w = hdr->width[f];
+        size_t bytes = ((size_t)m * w + 7) / 8;
+        if (p + bytes + SEG_TAIL_PAD > end) return -1;
+        for (int i = 0; i < m; i++) {
+            cur->field[f][i] = hdr->base[f] + (w ? (int32_t)get_bits(p, (size_t)i * w, w) : 0);
+        }
+        p += bytes;
+    }
+    return m;
+}
+
+// Advance to the next block that may hold rows at or below the upper bound
+static int next_block(ArchiveCursor *cur) {
+    while (cur->seg >= 0) {
+        const Segment *s = cur->segs[cur->seg];
+        
+        if (cur->from > 0 && s->hdr->max_ts < cur->from) return 0;
+        while (cur->block > 0) {
+            const SegBlock *blk = &s->index[--cur->block];
+            if (cur->from > 0 && blk->last_ts < cur->from) return 0;
+            if (cur->to > 0 && blk->first_ts > cur->to) continue;
+            if (cur->has_key && blk->first_ts > cur->key_ts) continue;
+            
+            int m = decode_block(cur, s, blk);
+            if (m < 0) {
+                fprintf(stderr, "[ARCHIVE] Corrupt block %d in %s\n", cur->block, s->name);
+                return -1;
+            }
+            cur->row = m - 1;
+            return 1;
+        }
+        
+        if (--cur->seg >= 0) cur->block = cur->segs[cur->seg]->hdr->blocks;
+    }
+    return 0;
+}
+
+int archive_cursor_next(ArchiveCursor *cur, ArchiveRow *out) {
+    for (;;) {
+        while (cur->row >= 0) {
+            int i = cur->row--;
+            int64_t ts = cur->ts[i];
+            
+            if (cur->from > 0 && ts < cur->from) {
+                cur->seg = -1;
+                cur->row = -1;
+                return 0;
+            }
+            if (cur->to > 0 && ts > cur->to) continue;
+            if (cur->has_key && (ts > cur->key_ts || (ts == cur->key_ts && cur->id[i] >= cur->key_id))) continue;
+            
+            const Segment *s = cur->segs[cur->seg];
+            uint32_t d = (uint32_t)cur->field[F_DEVICE][i];
+            out->id = cur->id[i];
+            snprintf(out->device_id, sizeof(out->device_id), "%s", d < s->hdr->devices ? s->devices[d] : "");
+            out->pump_id = cur->field[F_PUMP][i];
+            out->command = cur->field[F_COMMAND][i];
+            out->status = cur->field[F_STATUS][i];
+            out->busy = cur->field[F_BUSY][i];
+            out->alarm = cur->field[F_ALARM][i];
+            out->timestamp = ts;
+            return 1;
+        }
+        
+        if (next_block(cur) <= 0) return 0;
+    }
+}
+
+void archive_cursor_close(ArchiveCursor *cur) {
+    if (!cur) return;
+    
+    for (int i = 0; i < cur->nsegs; i++) {
+        segment_release(cur->segs[i]);
+    }
+    free(cur->segs);
+    free(cur);
+}
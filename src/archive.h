@@ -0,0 +1,55 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <sqlite3.h>
+#include <stddef.h>
+#include <time.h>
+
+// Snapshots older than ARCHIVE_AFTER_DAYS move out of SQLite into immutable,
+// memory-mapped columnar segment files (<db path>.archive/*.pseg)
+#define ARCHIVE_AFTER_DAYS      90
+#define ARCHIVE_SEGMENT_ROWS    65536
+#define ARCHIVE_BLOCK_ROWS      1024
+#define ARCHIVE_MIN_ROWS        4096    // don't cut a segment for fewer rows
+#define ARCHIVE_CHECK_S         3600
+
+typedef struct {
+    long long id;
+    char device_id[64];
+    int pump_id;
+    int command;
+    int status;
+    int busy;
+    int alarm;
+    time_t timestamp;
+} ArchiveRow;
+
+typedef struct {
+    int segments;
+    long long rows;
+    long long bytes;
+} ArchiveStats;
+
+int archive_init(sqlite3 *writer, const char *dir);
+void archive_close();
+
+// Writer connection only. Moves up to ARCHIVE_SEGMENT_ROWS snapshots older
+// than cutoff into a new segment. Returns rows archived (0 if fewer than
+// min_rows were due), -1 on error.
+int archive_run(time_t cutoff, int min_rows);
+
+// Writer connection only. Drops the oldest segment if all of it is older
+// than cutoff. Returns 1 if one was dropped, 0 if none is due, -1 on error.
+int archive_expire(time_t cutoff);
+
+// Newest first across all segments, same order and filters as the SQLite
+// history query. from/to of 0 leave that side open; with has_key only rows
+// with (timestamp, id) < (key_ts, key_id) are returned.
+typedef struct ArchiveCursor ArchiveCursor;
+ArchiveCursor* archive_cursor_open(time_t from, time_t to, int has_key, time_t key_ts, long long key_id);
+int archive_cursor_next(ArchiveCursor *cur, ArchiveRow *out);  // 1 = row, 0 = end
+void archive_cursor_close(ArchiveCursor *cur);
+
+void archive_get_stats(ArchiveStats *out);
+
+#endif
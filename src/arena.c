@@ -0,0 +1,77 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGN) char data[];
+};
+
+static size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void arena_init(Arena *a, size_t cap) {
+    memset(a, 0, sizeof(*a));
+    a->cap = cap;
+}
+
+void* arena_alloc(Arena *a, size_t size) {
+    size = align_up(size ? size : 1);
+    
+    ArenaBlock *b = a->head;
+    if (!b || b->size - b->used < size) {
+        // Double with use so a growing buffer costs O(log n) blocks
+        size_t want = a->total > ARENA_BLOCK_SIZE ? a->total : ARENA_BLOCK_SIZE;
+        if (want < size) want = size;
+        if (a->total + want > a->cap) want = a->cap > a->total ? a->cap - a->total : 0;
+        if (want < size) return NULL;
+        
+        b = malloc(sizeof(*b) + want);
+        if (!b) return NULL;
+        b->next = a->head;
+        b->size = want;
+        b->used = 0;
+        a->head = b;
+        a->total += want;
+    }
+    
+    void *p = b->data + b->used;
+    b->used += size;
+    a->last = p;
+    a->last_size = size;
+    return p;
+}
+
+void* arena_grow(Arena *a, void *ptr, size_t old_size, size_t new_size) {
+    if (!ptr) return arena_alloc(a, new_size);
+    if (new_size <= old_size) return ptr;
+    
+    ArenaBlock *b = a->head;
+    size_t need = align_up(new_size);
+    if (ptr == a->last && (char *)ptr + need <= b->data + b->size) {
+        b->used = (size_t)((char *)ptr - b->data) + need;
+        a->last_size = need;
+        return ptr;
+    }
+    
+    void *p = arena_alloc(a, new_size);
+    if (p) memcpy(p, ptr, old_size);
+    return p;
+}
+
+void arena_free(Arena *a) {
+    ArenaBlock *b = a->head;
+    size_t cap = a->cap;
+    
+    // a may itself live in one of the blocks: done with it before freeing
+    memset(a, 0, sizeof(*a));
+    a->cap = cap;
+    while (b) {
+        ArenaBlock *next = b->next;
+        free(b);
+        b = next;
+    }
+}
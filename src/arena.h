@@ -0,0 +1,29 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator for per-request memory: allocations are never freed one
+// by one, the whole arena goes at once. Blocks are chained, so pointers
+// stay valid while it grows; cap bounds the total.
+#define ARENA_BLOCK_SIZE    4096
+#define ARENA_ALIGN         16
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;       // current block, older ones behind it
+    size_t total;           // bytes in all blocks
+    size_t cap;
+    void *last;             // most recent allocation, the only one that grows in place
+    size_t last_size;
+} Arena;
+
+void arena_init(Arena *a, size_t cap);
+void* arena_alloc(Arena *a, size_t size);     // NULL past cap or out of memory
+// Resize ptr (old_size bytes, may be NULL); in place when it is the latest
+// allocation and its block has room, otherwise copied. NULL leaves ptr as is.
+void* arena_grow(Arena *a, void *ptr, size_t old_size, size_t new_size);
+void arena_free(Arena *a);                     // everything, including a struct living in the arena
+
+#endif
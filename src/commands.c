@@ -0,0 +1,577 @@
+#include "commands.h"
+#include "shared.h"
+#include "registry.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    long long id;           // 0 = empty slot
+    char device_id[64];
+    int pump_id;
+    int state;
+    int stage;
+    int offline;            // held in the MQTT offline queue; the timeout starts at its PUBACK
+    int local;              // handed to apply_fn: the broker's echo is dropped
+    const char *error;
+    long long created_ms;
+    long long published_ms;
+    long long applied_ms;
+    long long done_ms;
+    int pending_slot;       // index in pending[] while unfinished, else -1
+    long long pump_next;    // next pending command in the same pump bucket
+} Command;
+
+typedef struct {
+    long long id;           // 0 = free
+    int until;
+    long long deadline_ms;
+    void *arg;
+} CommandWaiter;
+
+static pthread_mutex_t cmd_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cmd_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t sender_tid;
+static int sender_running = 0;
+static CommandPublishFn publish_fn = NULL;
+static CommandApplyFn apply_fn = NULL;
+static char origin[96];
+
+static Command *table = NULL;               // slot = id % COMMANDS_MAX
+static long long next_id = 1;
+static long long pending[COMMANDS_PENDING_MAX];
+static atomic_int pending_count;
+// Pending commands by pump, so submit and feedback don't scan pending[]
+#define PUMP_BUCKETS (COMMANDS_PENDING_MAX * 2)
+static long long pump_bucket[PUMP_BUCKETS];
+// Superseded commands wait here too until the sender skips them
+#define SEND_QUEUE_SIZE (COMMANDS_PENDING_MAX * 2)
+static long long send_queue[SEND_QUEUE_SIZE];
+static int send_head = 0;
+static int send_count = 0;
+
+static CommandWaiter waiters[COMMANDS_MAX_WAITERS];
+static int waiter_count = 0;
+static void (*park_fn)(void *arg) = NULL;
+static void (*wake_fn)(void *arg) = NULL;
+static int waits_open = 0;
+
+static CommandStats stats;
+
+static const char *stage_names[] = {"queued", "applied", "published", "confirmed", "failed", "timeout", "superseded"};
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Under cmd_lock
+static Command* command_get(long long id) {
+    if (id <= 0 || !table) return NULL;
+    Command *c = &table[id % COMMANDS_MAX];
+    return c->id == id ? c : NULL;
+}
+
+static unsigned pump_hash(const char *device_id, int pump_id) {
+    unsigned h = 2166136261u ^ (unsigned)pump_id;
+    for (const char *p = device_id; *p; p++) h = (h ^ (unsigned char)*p) * 16777619u;
+    return h % PUMP_BUCKETS;
+}
+
+// Under cmd_lock: the unfinished command for a pump (at most one)
+static Command* pending_find(const char *device_id, int pump_id) {
+    Command *c = command_get(pump_bucket[pump_hash(device_id, pump_id)]);
+    while (c && (c->pump_id != pump_id || strcmp(c->device_id, device_id) != 0)) c = command_get(c->pump_next);
+    return c;
+}
+
+static void pending_add(Command *c) {
+    int n = atomic_load(&pending_count);
+    pending[n] = c->id;
+    c->pending_slot = n;
+    atomic_store(&pending_count, n + 1);
+    
+    unsigned h = pump_hash(c->device_id, c->pump_id);
+    c->pump_next = pump_bucket[h];
+    pump_bucket[h] = c->id;
+}
+
+static void pending_remove(Command *c) {
+    if (c->pending_slot < 0) return;
+    
+    int n = atomic_load(&pending_count);
+    Command *last = command_get(pending[n - 1]);
+    pending[c->pending_slot] = pending[n - 1];
+    if (last) last->pending_slot = c->pending_slot;
+    c->pending_slot = -1;
+    atomic_store(&pending_count, n - 1);
+    
+    long long *link = &pump_bucket[pump_hash(c->device_id, c->pump_id)];
+    while (*link && *link != c->id) {
+        Command *prev = command_get(*link);
+        if (!prev) break;
+        link = &prev->pump_next;
+    }
+    if (*link == c->id) *link = c->pump_next;
+}
+
+// Under cmd_lock: wakes requests waiting on c that are satisfied now
+static void waiters_notify(const Command *c) {
+    if (waiter_count == 0) return;
+    
+    for (int i = 0; i < COMMANDS_MAX_WAITERS; i++) {
+        CommandWaiter *w = &waiters[i];
+        if (w->id == c->id && (c->stage >= w->until || c->stage >= COMMAND_CONFIRMED)) {
+            w->id = 0;
+            waiter_count--;
+            if (wake_fn) wake_fn(w->arg);
+        }
+    }
+}
+
+// Under cmd_lock. Stages only move forward; a late PUBACK or apply for a
+// command already further along only fills in its timestamp.
+static void command_advance(Command *c, int stage, const char *error) {
+    long long now = now_ms();
+    if (stage == COMMAND_PUBLISHED && !c->published_ms) {
+        c->published_ms = now;
+        stats.published++;
+    }
+    if (stage == COMMAND_APPLIED && !c->applied_ms) {
+        c->applied_ms = now;
+        stats.applied++;
+    }
+    if (c->stage >= COMMAND_CONFIRMED || stage <= c->stage) return;
+    
+    c->stage = stage;
+    if (stage >= COMMAND_CONFIRMED) {
+        c->done_ms = now;
+        c->error = error;
+        pending_remove(c);
+        if (stage == COMMAND_CONFIRMED) stats.confirmed++;
+        if (stage == COMMAND_FAILED) stats.failed++;
+        if (stage == COMMAND_TIMEOUT) stats.timeouts++;
+        if (stage == COMMAND_SUPERSEDED) stats.superseded++;
+    }
+    waiters_notify(c);
+}
+
+// Under cmd_lock: final states for commands and waits past their time.
+// Returns the nearest deadline still ahead.
+static long long expire(long long now) {
+    long long next = now + 1000;
+    
+    // Backwards: a removal moves the last entry, which was already seen
+    for (int i = atomic_load(&pending_count) - 1; i >= 0; i--) {
+        Command *c = command_get(pending[i]);
+        if (!c || (c->offline && !c->published_ms)) continue;
+        if (now - (c->offline ? c->published_ms : c->created_ms) >= COMMANDS_TIMEOUT_S * 1000LL) {
+            command_advance(c, COMMAND_TIMEOUT, c->published_ms ? "No matching feedback" : "Broker did not acknowledge");
+        }
+    }
+    
+    for (int i = 0; waiter_count > 0 && i < COMMANDS_MAX_WAITERS; i++) {
+        CommandWaiter *w = &waiters[i];
+        if (!w->id) continue;
+        if (w->deadline_ms <= now) {
+            w->id = 0;
+            waiter_count--;
+            if (wake_fn) wake_fn(w->arg);
+        } else if (w->deadline_ms < next) {
+            next = w->deadline_ms;
+        }
+    }
+    return next;
+}
+
+// Publishes in submit order off the HTTP threads; a publish only waits while
+// the MQTT in-flight window is full, the PUBACK arrives through
+// commands_delivered(id). Up to
+// COMMANDS_SEND_BATCH go out per lock round trip, so a bulk submit is
+// pipelined instead of paying for the lock on every publish.
+static void* sender_thread(void *arg) {
+    static char payloads[COMMANDS_SEND_BATCH][256];
+    long long ids[COMMANDS_SEND_BATCH];
+    int rcs[COMMANDS_SEND_BATCH];
+    
+    pthread_mutex_lock(&cmd_lock);
+    while (sender_running) {
+        if (send_count == 0) {
+            long long next = expire(now_ms());
+            struct timespec ts = {next / 1000, (next % 1000) * 1000000};
+            pthread_cond_timedwait(&cmd_cond, &cmd_lock, &ts);
+            continue;
+        }
+        
+        int n = 0;
+        while (send_count > 0 && n < COMMANDS_SEND_BATCH) {
+            long long id = send_queue[send_head];
+            send_head = (send_head + 1) % SEND_QUEUE_SIZE;
+            send_count--;
+            
+            Command *c = command_get(id);
+            if (!c || c->stage >= COMMAND_CONFIRMED) continue;
+            
+            snprintf(payloads[n], sizeof(payloads[n]),
+                     "{\"device_id\":\"%s\",\"pump_id\":%d,\"state\":%d,\"command_id\":%lld,\"origin\":\"%s\"}",
+                     c->device_id, c->pump_id, c->state, id, origin);
+            ids[n++] = id;
+        }
+        pthread_mutex_unlock(&cmd_lock);
+        
+        for (int i = 0; i < n; i++) {
+            rcs[i] = publish_fn ? publish_fn(ids[i], payloads[i]) : -1;
+        }
+        
+        pthread_mutex_lock(&cmd_lock);
+        for (int i = 0; i < n; i++) {
+            Command *c = command_get(ids[i]);
+            if (!c) continue;
+            if (rcs[i] < 0) {
+                command_advance(c, COMMAND_FAILED, "Publish failed");
+            } else if (rcs[i] > 0) {
+                c->offline = 1;
+                stats.offline++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cmd_lock);
+    return NULL;
+}
+
+int commands_init(CommandPublishFn publish, CommandApplyFn apply) {
+    table = calloc(COMMANDS_MAX, sizeof(Command));
+    if (!table) return -1;
+    
+    // IDs stay unique across restarts, so a client never reads another command's status
+    next_id = (long long)time(NULL) * 1000;
+    publish_fn = publish;
+    apply_fn = apply;
+    
+    char host[64] = "";
+    gethostname(host, sizeof(host) - 1);
+    snprintf(origin, sizeof(origin), "%s:%d", host[0] ? host : "pump_server", (int)getpid());
+    atomic_store(&pending_count, 0);
+    memset(pump_bucket, 0, sizeof(pump_bucket));
+    send_head = 0;
+    send_count = 0;
+    
+    sender_running = 1;
+    if (pthread_create(&sender_tid, NULL, sender_thread, NULL) != 0) {
+        sender_running = 0;
+        free(table);
+        table = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void commands_shutdown() {
+    if (!sender_running) return;
+    
+    pthread_mutex_lock(&cmd_lock);
+    sender_running = 0;
+    pthread_cond_signal(&cmd_cond);
+    pthread_mutex_unlock(&cmd_lock);
+    pthread_join(sender_tid, NULL);
+    
+    commands_wake_all();
+    pthread_mutex_lock(&cmd_lock);
+    free(table);
+    table = NULL;
+    pthread_mutex_unlock(&cmd_lock);
+}
+
+// Under cmd_lock, with room in pending[] checked by the caller
+static Command* command_queue(const char *device_id, int pump_id, int state, long long now) {
+    // A newer command for the pump replaces whatever is still pending for it
+    Command *old = pending_find(device_id, pump_id);
+    if (old) command_advance(old, COMMAND_SUPERSEDED, NULL);
+    
+    long long id = next_id++;
+    Command *c = &table[id % COMMANDS_MAX];
+    if (c->id && c->stage < COMMAND_CONFIRMED) pending_remove(c);
+    
+    memset(c, 0, sizeof(*c));
+    c->id = id;
+    snprintf(c->device_id, sizeof(c->device_id), "%s", device_id);
+    c->pump_id = pump_id;
+    c->state = state;
+    c->stage = COMMAND_QUEUED;
+    c->created_ms = now;
+    // Before the sender can see it: the echo may beat apply_local()
+    c->local = apply_fn != NULL;
+    pending_add(c);
+    
+    send_queue[(send_head + send_count) % SEND_QUEUE_SIZE] = id;
+    send_count++;
+    stats.submitted++;
+    return c;
+}
+
+// Under cmd_lock: 0 if there is room for pending_n more unfinished commands
+// and send_n more entries in the send queue
+static int pending_room(int pending_n, int send_n, long long now) {
+    if (send_count + send_n > SEND_QUEUE_SIZE) return -1;
+    if (atomic_load(&pending_count) + pending_n > COMMANDS_PENDING_MAX) expire(now);
+    return atomic_load(&pending_count) + pending_n <= COMMANDS_PENDING_MAX ? 0 : -1;
+}
+
+// Outside cmd_lock: apply_fn queues for the ingest worker, which calls
+// back into commands_applied(). Superseded by the time we get here
+// (later in the same batch) means there is nothing left to apply.
+static void apply_local(long long id) {
+    CommandRequest r;
+    pthread_mutex_lock(&cmd_lock);
+    Command *c = command_get(id);
+    int live = c && c->local && c->stage < COMMAND_CONFIRMED;
+    if (live) {
+        memcpy(r.device_id, c->device_id, sizeof(r.device_id));
+        r.pump_id = c->pump_id;
+        r.state = c->state;
+        stats.local++;
+    }
+    pthread_mutex_unlock(&cmd_lock);
+    
+    if (!live || apply_fn(id, r.device_id, r.pump_id, r.state) == 0) return;
+    
+    // Not applied: let the echo do it
+    pthread_mutex_lock(&cmd_lock);
+    c = command_get(id);
+    if (c) c->local = 0;
+    stats.local--;
+    pthread_mutex_unlock(&cmd_lock);
+}
+
+long long commands_submit(const char *device_id, int pump_id, int state) {
+    if (!device_id) device_id = DEFAULT_GATEWAY_ID;
+    
+    pthread_mutex_lock(&cmd_lock);
+    long long now = now_ms();
+    if (!table || !sender_running ||
+        pending_room(pending_find(device_id, pump_id) ? 0 : 1, 1, now) != 0) {
+        pthread_mutex_unlock(&cmd_lock);
+        return -1;
+    }
+    
+    long long id = command_queue(device_id, pump_id, state, now)->id;
+    pthread_cond_signal(&cmd_cond);
+    pthread_mutex_unlock(&cmd_lock);
+    
+    apply_local(id);
+    return id;
+}
+
+int commands_submit_batch(const CommandRequest *reqs, int n, long long *ids, int *stages) {
+    if (n <= 0 || n > COMMANDS_BATCH_MAX) return -1;
+    
+    pthread_mutex_lock(&cmd_lock);
+    if (!table || !sender_running) {
+        pthread_mutex_unlock(&cmd_lock);
+        return -1;
+    }
+    
+    // Room is checked up front for all n. A command for a pump that already
+    // has one pending supersedes it, so only the others need a slot.
+    long long now = now_ms();
+    int fresh = 0;
+    for (int i = 0; i < n; i++) {
+        const char *device_id = reqs[i].device_id[0] ? reqs[i].device_id : DEFAULT_GATEWAY_ID;
+        if (!pending_find(device_id, reqs[i].pump_id)) fresh++;
+    }
+    if (pending_room(fresh, n, now) != 0) {
+        pthread_mutex_unlock(&cmd_lock);
+        return -1;
+    }
+    
+    for (int i = 0; i < n; i++) {
+        const char *device_id = reqs[i].device_id[0] ? reqs[i].device_id : DEFAULT_GATEWAY_ID;
+        ids[i] = command_queue(device_id, reqs[i].pump_id, reqs[i].state, now)->id;
+    }
+    
+    pthread_cond_signal(&cmd_cond);
+    pthread_mutex_unlock(&cmd_lock);
+    
+    for (int i = 0; i < n; i++) apply_local(ids[i]);
+    
+    // Read back after the whole batch: an earlier entry may be superseded by now
+    if (stages) {
+        pthread_mutex_lock(&cmd_lock);
+        for (int i = 0; i < n; i++) {
+            Command *c = command_get(ids[i]);
+            stages[i] = c ? c->stage : COMMAND_SUPERSEDED;
+        }
+        pthread_mutex_unlock(&cmd_lock);
+    }
+    return 0;
+}
+
+// The PUBACK can come before the sender is back from publishing; stages
+// only move forward, so the order doesn't matter
+void commands_delivered(long long id) {
+    pthread_mutex_lock(&cmd_lock);
+    Command *c = command_get(id);
+    if (c) command_advance(c, COMMAND_PUBLISHED, NULL);
+    pthread_mutex_unlock(&cmd_lock);
+}
+
+void commands_publish_failed(long long id, const char *error) {
+    pthread_mutex_lock(&cmd_lock);
+    Command *c = command_get(id);
+    if (c) command_advance(c, COMMAND_FAILED, error);
+    pthread_mutex_unlock(&cmd_lock);
+}
+
+void commands_applied(long long id) {
+    pthread_mutex_lock(&cmd_lock);
+    Command *c = command_get(id);
+    if (c) command_advance(c, COMMAND_APPLIED, NULL);
+    pthread_mutex_unlock(&cmd_lock);
+}
+
+void commands_superseded(long long id) {
+    pthread_mutex_lock(&cmd_lock);
+    Command *c = command_get(id);
+    if (c) command_advance(c, COMMAND_SUPERSEDED, NULL);
+    pthread_mutex_unlock(&cmd_lock);
+}
+
+// Start expects Running, stop expects Stopped; Error fails the command
+void commands_feedback(const char *device_id, int pump_id, int status) {
+    // Feedback is constant traffic and commands are rare
+    if (atomic_load(&pending_count) == 0) return;
+    if (!device_id) device_id = DEFAULT_GATEWAY_ID;
+    
+    pthread_mutex_lock(&cmd_lock);
+    Command *c = pending_find(device_id, pump_id);
+    // Feedback from before the command reached the broker says nothing about
+    // it; applying it locally doesn't count, the pump hasn't seen it yet
+    if (c && c->published_ms) {
+        if (status == STATUS_ERROR) {
+            command_advance(c, COMMAND_FAILED, "Pump reported an error");
+        } else if (status == (c->state ? STATUS_RUNNING : STATUS_STOPPED)) {
+            command_advance(c, COMMAND_CONFIRMED, NULL);
+        }
+    }
+    pthread_mutex_unlock(&cmd_lock);
+}
+
+static void append_ms(char *buf, size_t max, int *len, const char *name, long long ms) {
+    if (*len < 0 || (size_t)*len >= max) return;
+    if (ms) {
+        *len += snprintf(buf + *len, max - *len, ",\"%s\":%lld", name, ms);
+    } else {
+        *len += snprintf(buf + *len, max - *len, ",\"%s\":null", name);
+    }
+}
+
+int commands_render_json(long long id, char *buf, size_t max) {
+    pthread_mutex_lock(&cmd_lock);
+    Command *c = command_get(id);
+    if (!c) {
+        pthread_mutex_unlock(&cmd_lock);
+        return -1;
+    }
+    
+    int len = snprintf(buf, max, "{\"id\":%lld,\"device_id\":\"%s\",\"pump_id\":%d,\"state\":%d,\"status\":\"%s\",\"done\":%s",
+                       c->id, c->device_id, c->pump_id, c->state, stage_names[c->stage],
+                       c->stage >= COMMAND_CONFIRMED ? "true" : "false");
+    append_ms(buf, max, &len, "created_at", c->created_ms);
+    append_ms(buf, max, &len, "published_at", c->published_ms);
+    append_ms(buf, max, &len, "applied_at", c->applied_ms);
+    append_ms(buf, max, &len, "done_at", c->done_ms);
+    if (len >= 0 && (size_t)len < max) {
+        if (c->error) {
+            len += snprintf(buf + len, max - len, ",\"error\":\"%s\"}", c->error);
+        } else {
+            len += snprintf(buf + len, max - len, ",\"error\":null}");
+        }
+    }
+    pthread_mutex_unlock(&cmd_lock);
+    
+    return (len >= 0 && (size_t)len < max) ? len : -1;
+}
+
+const char* commands_stage_name(int stage) {
+    return stage >= 0 && stage <= COMMAND_SUPERSEDED ? stage_names[stage] : "unknown";
+}
+
+int commands_stage_from_name(const char *name) {
+    for (int stage = COMMAND_APPLIED; stage <= COMMAND_CONFIRMED; stage++) {
+        if (strcmp(name, stage_names[stage]) == 0) return stage;
+    }
+    return -1;
+}
+
+void commands_set_waker(void (*park)(void *arg), void (*wake)(void *arg)) {
+    pthread_mutex_lock(&cmd_lock);
+    park_fn = park;
+    wake_fn = wake;
+    waits_open = park && wake;
+    pthread_mutex_unlock(&cmd_lock);
+}
+
+int commands_wait(long long id, int until, int wait_ms, void *arg) {
+    if (wait_ms <= 0) return 0;
+    if (wait_ms > COMMANDS_MAX_WAIT_MS) wait_ms = COMMANDS_MAX_WAIT_MS;
+    
+    pthread_mutex_lock(&cmd_lock);
+    Command *c = command_get(id);
+    if (!c || !waits_open || c->stage >= until || c->stage >= COMMAND_CONFIRMED ||
+        waiter_count >= COMMANDS_MAX_WAITERS) {
+        pthread_mutex_unlock(&cmd_lock);
+        return 0;
+    }
+    
+    CommandWaiter *w = waiters;
+    while (w->id) w++;
+    w->id = id;
+    w->until = until;
+    w->deadline_ms = now_ms() + wait_ms;
+    w->arg = arg;
+    waiter_count++;
+    if (park_fn) park_fn(arg);
+    
+    // The sender sleeps until the nearest deadline; this one may be nearer
+    pthread_cond_signal(&cmd_cond);
+    pthread_mutex_unlock(&cmd_lock);
+    return 1;
+}
+
+void commands_wake_all() {
+    pthread_mutex_lock(&cmd_lock);
+    waits_open = 0;
+    for (int i = 0; waiter_count > 0 && i < COMMANDS_MAX_WAITERS; i++) {
+        CommandWaiter *w = &waiters[i];
+        if (!w->id) continue;
+        w->id = 0;
+        waiter_count--;
+        if (wake_fn) wake_fn(w->arg);
+    }
+    pthread_mutex_unlock(&cmd_lock);
+}
+
+void commands_get_stats(CommandStats *out) {
+    pthread_mutex_lock(&cmd_lock);
+    *out = stats;
+    out->pending = atomic_load(&pending_count);
+    out->waiters = waiter_count;
+    pthread_mutex_unlock(&cmd_lock);
+}
+
+const char* commands_origin() {
+    return origin;
+}
+
+int commands_is_echo(long long id) {
+    pthread_mutex_lock(&cmd_lock);
+    Command *c = command_get(id);
+    int echo = !c || c->local;
+    pthread_mutex_unlock(&cmd_lock);
+    return echo;
+}
@@ -0,0 +1,101 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <stddef.h>
+
+// Pump command pipeline. A command gets an ID, is applied to the registry
+// right away and queued; a sender thread publishes it to pump/control, and
+// its progress is tracked from there:
+//   queued -> applied (the registry took it) -> published (broker PUBACK)
+//   -> confirmed (hardware feedback matched)
+// or ends failed / timeout / superseded (a newer command for the same pump).
+// The broker's echo of our own command is recognized by its origin and
+// dropped, so it is applied once and a late echo can't undo a newer command.
+#define COMMANDS_MAX            32768   // recent commands kept for lookup
+#define COMMANDS_PENDING_MAX    16384   // not yet finished; more are refused
+#define COMMANDS_BATCH_MAX      10000   // commands in one commands_submit_batch()
+#define COMMANDS_SEND_BATCH     64      // published per sender lock round trip
+#define COMMANDS_TIMEOUT_S      30      // no confirming feedback by then: timeout
+#define COMMANDS_MAX_WAITERS    256     // parked ?wait= requests
+#define COMMANDS_MAX_WAIT_MS    30000
+
+#define COMMAND_QUEUED          0
+#define COMMAND_APPLIED         1
+#define COMMAND_PUBLISHED       2
+#define COMMAND_CONFIRMED       3       // this and above are final
+#define COMMAND_FAILED          4
+#define COMMAND_TIMEOUT         5
+#define COMMAND_SUPERSEDED      6
+
+typedef struct {
+    char device_id[64];
+    int pump_id;
+    int state;
+} CommandRequest;
+
+typedef struct {
+    unsigned long long submitted;
+    unsigned long long published;
+    unsigned long long applied;
+    unsigned long long confirmed;
+    unsigned long long failed;
+    unsigned long long timeouts;
+    unsigned long long superseded;
+    unsigned long long offline;         // held in the MQTT offline queue at publish
+    unsigned long long local;           // applied at submit, not via the broker
+    int pending;
+    int waiters;
+} CommandStats;
+
+// Publishes command id's payload: 0 once handed to the broker connection
+// (commands_delivered(id) follows the PUBACK), 1 if held in the offline
+// queue until the broker is back, -1 on failure.
+typedef int (*CommandPublishFn)(long long id, const char *payload);
+
+// Applies command id to the pump state without the broker: 0 once queued for
+// that, after which commands_applied(id) follows; -1 if it couldn't be, and
+// the broker's echo applies it instead.
+typedef int (*CommandApplyFn)(long long id, const char *device_id, int pump_id, int state);
+
+int commands_init(CommandPublishFn publish, CommandApplyFn apply);
+void commands_shutdown();
+
+// Returns the command ID, or -1 if too many commands are pending
+long long commands_submit(const char *device_id, int pump_id, int state);
+// All or nothing, under one lock: 0 with ids[i] (and stages[i], may be NULL)
+// filled in request order, or -1 and nothing queued if there is no room for
+// all n. Like commands_submit(), each one supersedes what is pending for its
+// pump, including an earlier request in the same batch.
+int commands_submit_batch(const CommandRequest *reqs, int n, long long *ids, int *stages);
+const char* commands_stage_name(int stage);
+
+// Progress reports
+void commands_delivered(long long id);                  // broker PUBACK
+void commands_publish_failed(long long id, const char *error);  // the offline queue gave up on it
+void commands_applied(long long id);                    // the registry took it
+void commands_superseded(long long id);                 // dropped for a newer state of its pump before it was applied
+void commands_feedback(const char *device_id, int pump_id, int status);
+
+// Status JSON for a command; bytes written, or -1 if unknown or expired
+int commands_render_json(long long id, char *buf, size_t max);
+int commands_stage_from_name(const char *name);        // -1 if not applied/published/confirmed
+
+// Long-poll. park(arg) runs under the pipeline lock when the wait is
+// registered, wake(arg) once the command reaches `until` (or any final
+// stage) or wait_ms passes. Returns 1 if parked, 0 if the caller should
+// answer now (already there, unknown ID, or no waiter slot).
+void commands_set_waker(void (*park)(void *arg), void (*wake)(void *arg));
+int commands_wait(long long id, int until, int wait_ms, void *arg);
+void commands_wake_all();   // before the HTTP server stops; new waits are refused until commands_set_waker()
+
+void commands_get_stats(CommandStats *out);
+
+// "host:pid", sent as "origin" with every command so our subscription can
+// tell its own echo from a command published by another client
+const char* commands_origin();
+// For pump/control messages carrying our origin: 1 if the echo of command id
+// is to be dropped (applied at submit, or too old to still be tracked),
+// 0 if its local apply failed and the echo has to apply it
+int commands_is_echo(long long id);
+
+#endif
@@ -0,0 +1,176 @@
+#include "compress.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+// Accept-Encoding: "gzip, deflate;q=0.5, br". A coding is refused by q=0;
+// "*" stands for anything not listed.
+int compress_negotiate(const char *accept_encoding) {
+    if (!accept_encoding) return COMPRESS_NONE;
+    
+    int gzip = -1, deflate = -1, any = -1;      // -1 = not listed, 0 = refused, 1 = fine
+    const char *p = accept_encoding;
+    
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        const char *name = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t name_len = p - name;
+        
+        int ok = 1;
+        while (*p && *p != ',') {
+            if (*p == ';') {
+                p++;
+                while (*p == ' ' || *p == '\t') p++;
+                if ((*p == 'q' || *p == 'Q') && p[1] == '=') ok = strtod(p + 2, NULL) > 0;
+            } else {
+                p++;
+            }
+        }
+        
+        if (name_len == 4 && strncasecmp(name, "gzip", 4) == 0) {
+            gzip = ok;
+        } else if (name_len == 7 && strncasecmp(name, "deflate", 7) == 0) {
+            deflate = ok;
+        } else if (name_len == 1 && *name == '*') {
+            any = ok;
+        }
+    }
+    
+    if (gzip == 1 || (gzip < 0 && any == 1)) return COMPRESS_GZIP;
+    if (deflate == 1 || (deflate < 0 && any == 1)) return COMPRESS_DEFLATE;
+    return COMPRESS_NONE;
+}
+
+const char* compress_name(int encoding) {
+    return encoding == COMPRESS_GZIP ? "gzip" : encoding == COMPRESS_DEFLATE ? "deflate" : "identity";
+}
+
+static int compress_init(z_stream *z, int encoding, int level) {
+    memset(z, 0, sizeof(*z));
+    int bits = encoding == COMPRESS_GZIP ? 15 + 16 : 15;
+    return deflateInit2(z, level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+}
+
+size_t compress_bound(size_t len) {
+    // deflateBound plus the gzip header and trailer
+    return compressBound(len) + 18;
+}
+
+size_t compress_into(int encoding, int level, const char *data, size_t len, char *out, size_t cap) {
+    z_stream z;
+    if (compress_init(&z, encoding, level) != 0) return 0;
+    
+    z.next_in = (Bytef *)data;
+    z.avail_in = len;
+    z.next_out = (Bytef *)out;
+    z.avail_out = cap;
+    
+    int rc = deflate(&z, Z_FINISH);
+    size_t n = rc == Z_STREAM_END ? z.total_out : 0;
+    deflateEnd(&z);
+    return n;
+}
+
+char* compress_buffer(int encoding, const char *data, size_t len, size_t *out_len) {
+    size_t cap = compress_bound(len);
+    char *out = malloc(cap);
+    if (!out) return NULL;
+    
+    size_t n = compress_into(encoding, COMPRESS_LEVEL, data, len, out, cap);
+    if (n == 0 || n >= len) {
+        free(out);
+        return NULL;
+    }
+    
+    *out_len = n;
+    return out;
+}
+
+// ===== STREAMS =====
+typedef struct {
+    z_stream z;
+    MHD_ContentReaderCallback reader;
+    MHD_ContentReaderFreeCallback free_cb;
+    void *cls;
+    uint64_t in_pos;        // bytes taken from the original reader
+    size_t in_len;
+    size_t in_off;
+    int in_end;
+    int finished;
+    char in[COMPRESS_STREAM_INPUT];
+} CompressStream;
+
+static ssize_t compress_stream_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    CompressStream *cs = cls;
+    if (cs->finished) return MHD_CONTENT_READER_END_OF_STREAM;
+    
+    cs->z.next_out = (Bytef *)buf;
+    cs->z.avail_out = max;
+    
+    while (cs->z.avail_out > 0) {
+        if (cs->in_off == cs->in_len && !cs->in_end) {
+            ssize_t n = cs->reader(cs->cls, cs->in_pos, cs->in, sizeof(cs->in));
+            if (n == MHD_CONTENT_READER_END_OF_STREAM) {
+                cs->in_end = 1;
+            } else if (n < 0) {
+                return MHD_CONTENT_READER_END_WITH_ERROR;
+            } else if (n == 0) {
+                break;      // nothing yet: send what we have
+            } else {
+                cs->in_pos += n;
+                cs->in_len = n;
+                cs->in_off = 0;
+            }
+        }
+        
+        cs->z.next_in = (Bytef *)cs->in + cs->in_off;
+        cs->z.avail_in = cs->in_len - cs->in_off;
+        int rc = deflate(&cs->z, cs->in_end ? Z_FINISH : Z_NO_FLUSH);
+        cs->in_off = cs->in_len - cs->z.avail_in;
+        
+        if (rc == Z_STREAM_END) {
+            cs->finished = 1;
+            break;
+        }
+        if (rc != Z_OK && rc != Z_BUF_ERROR) return MHD_CONTENT_READER_END_WITH_ERROR;
+    }
+    
+    size_t out = max - cs->z.avail_out;
+    if (out == 0 && cs->finished) return MHD_CONTENT_READER_END_OF_STREAM;
+    return (ssize_t)out;
+}
+
+static void compress_stream_free(void *cls) {
+    CompressStream *cs = cls;
+    if (cs->free_cb) cs->free_cb(cs->cls);
+    deflateEnd(&cs->z);
+    free(cs);
+}
+
+int compress_stream_wrap(int encoding, MHD_ContentReaderCallback *reader, void **cls,
+                         MHD_ContentReaderFreeCallback *free_cb) {
+    if (encoding == COMPRESS_NONE) return -1;
+    
+    CompressStream *cs = malloc(sizeof(*cs));
+    if (!cs) return -1;
+    if (compress_init(&cs->z, encoding, COMPRESS_LEVEL) != 0) {
+        free(cs);
+        return -1;
+    }
+    
+    cs->reader = *reader;
+    cs->free_cb = *free_cb;
+    cs->cls = *cls;
+    cs->in_pos = 0;
+    cs->in_len = 0;
+    cs->in_off = 0;
+    cs->in_end = 0;
+    cs->finished = 0;
+    
+    *reader = compress_stream_read;
+    *cls = cs;
+    *free_cb = compress_stream_free;
+    return 0;
+}
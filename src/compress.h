@@ -0,0 +1,34 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <microhttpd.h>
+
+// HTTP content coding for JSON responses and static files (zlib)
+#define COMPRESS_NONE           0
+#define COMPRESS_GZIP           1
+#define COMPRESS_DEFLATE        2       // zlib-wrapped, as RFC 9110 defines it
+
+#define COMPRESS_MIN_BYTES      1024    // smaller bodies go out as they are
+#define COMPRESS_LEVEL          6       // per-response work
+#define COMPRESS_STATIC_LEVEL   9       // done once at startup
+#define COMPRESS_STREAM_INPUT   (16 * 1024)
+
+// Best coding the Accept-Encoding header allows (gzip first); NULL = none
+int compress_negotiate(const char *accept_encoding);
+const char* compress_name(int encoding);
+
+// One-shot. Returns the compressed size, or 0 if it did not fit in cap.
+size_t compress_bound(size_t len);
+size_t compress_into(int encoding, int level, const char *data, size_t len, char *out, size_t cap);
+// malloc'd copy, or NULL if it failed or would not be smaller
+char* compress_buffer(int encoding, const char *data, size_t len, size_t *out_len);
+
+// Swaps a content reader for one that compresses its output on the fly,
+// so streamed (chunked) responses can be compressed too. The wrapper owns
+// the original: its free callback runs the original one. Returns -1 (and
+// changes nothing) if the compressor can't be set up.
+int compress_stream_wrap(int encoding, MHD_ContentReaderCallback *reader, void **cls,
+                         MHD_ContentReaderFreeCallback *free_cb);
+
+#endif
@@ -1,253 +1,1017 @@
 #include "db.h"
+#include "registry.h"
+#include "rollup.h"
+#include "archive.h"
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
 
-sqlite3 *db = NULL;
+sqlite3 *db = NULL;          // writer connection, owned by the writer thread once open
+static sqlite3 *db_ro = NULL; // history queries, so readers never see a half-written batch
+static char db_path[512];     // for reader connections
 
-int db_init() {
-    mkdir("/var/lib/pump_server", 0755);
-    
-    int rc = sqlite3_open(DB_PATH, &db);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "[DB] Cannot open: %s\n", sqlite3_errmsg(db));
-        return -1;
+#define HISTORY_COLUMNS "SELECT id, device_id, pump_id, command, status, busy, alarm, timestamp FROM pump_snapshots "
+
+// History query shapes: one cached statement per combination of filters
+#define HISTORY_FROM        1
+#define HISTORY_TO          2
+#define HISTORY_AFTER       4   // keyset cursor: (timestamp, id) < (?, ?)
+#define HISTORY_SINCE       8   // id > ?, oldest first
+#define HISTORY_SHAPES      16
+
+// Statement cache, prepared once in db_open(). Index with the STMT_* ids.
+// The log tables have no timestamp index, so retention takes the oldest ids
+// and stops at the first step that finds a row still inside the window.
+// Inserts and deletes run on the writer connection, everything from
+// STMT_HISTORY on db_ro.
+enum {
+    STMT_INSERT_COMMAND,
+    STMT_INSERT_FEEDBACK,
+    STMT_INSERT_SNAPSHOT,
+    STMT_INSERT_GATEWAY,
+    STMT_EXPIRE_COMMANDS,   // retention, in the order of retention_days[]
+    STMT_EXPIRE_FEEDBACK,
+    STMT_EXPIRE_GATEWAY,
+    STMT_EXPIRE_SNAPSHOTS,
+    STMT_EXPIRE_ROLLUP_MINUTE,
+    STMT_EXPIRE_ROLLUP_HOUR,
+    STMT_HISTORY,           // + shape bits
+    STMT_COUNT = STMT_HISTORY + HISTORY_SHAPES
+};
+
+static const char *stmt_sql[STMT_COUNT] = {
+    "INSERT INTO pump_commands (device_id, pump_id, command, timestamp, source) VALUES (?,?,?,?,?)",
+    "INSERT INTO pump_feedback (device_id, pump_id, status, timestamp) VALUES (?,?,?,?)",
+    "INSERT INTO pump_snapshots (device_id, pump_id, command, status, busy, alarm, timestamp) VALUES (?,?,?,?,?,?,?)",
+    "INSERT INTO gateway_history (is_online, device_id, firmware, timestamp) VALUES (?,?,?,?)",
+    "DELETE FROM pump_commands WHERE id IN (SELECT id FROM pump_commands ORDER BY id LIMIT ?2) AND timestamp < ?1",
+    "DELETE FROM pump_feedback WHERE id IN (SELECT id FROM pump_feedback ORDER BY id LIMIT ?2) AND timestamp < ?1",
+    "DELETE FROM gateway_history WHERE id IN (SELECT id FROM gateway_history ORDER BY id LIMIT ?2) AND timestamp < ?1",
+    "DELETE FROM pump_snapshots WHERE id IN (SELECT id FROM pump_snapshots WHERE timestamp < ?1 LIMIT ?2)",
+    "DELETE FROM pump_rollup_minute WHERE (device_id, pump_id, bucket) IN "
+    "(SELECT device_id, pump_id, bucket FROM pump_rollup_minute WHERE bucket < ?1 LIMIT ?2)",
+    "DELETE FROM pump_rollup_hour WHERE (device_id, pump_id, bucket) IN "
+    "(SELECT device_id, pump_id, bucket FROM pump_rollup_hour WHERE bucket < ?1 LIMIT ?2)",
+};
+static char history_sql[HISTORY_SHAPES][384];
+
+// Filters are bound in the order they appear here. Both orders walk
+// idx_snapshots_time, which already ends in the rowid, or the primary key.
+static void db_build_history_sql() {
+    for (int shape = 0; shape < HISTORY_SHAPES; shape++) {
+        char *sql = history_sql[shape];
+        size_t len = snprintf(sql, sizeof(history_sql[shape]), HISTORY_COLUMNS);
+        const char *sep = "WHERE ";
+        
+        if (shape & HISTORY_SINCE) {
+            len += snprintf(sql + len, sizeof(history_sql[shape]) - len, "%sid > ? ", sep);
+            sep = "AND ";
+        }
+        if (shape & HISTORY_FROM) {
+            len += snprintf(sql + len, sizeof(history_sql[shape]) - len, "%stimestamp >= ? ", sep);
+            sep = "AND ";
+        }
+        if (shape & HISTORY_TO) {
+            len += snprintf(sql + len, sizeof(history_sql[shape]) - len, "%stimestamp <= ? ", sep);
+            sep = "AND ";
+        }
+        if (shape & HISTORY_AFTER) {
+            len += snprintf(sql + len, sizeof(history_sql[shape]) - len, "%s(timestamp, id) < (?, ?) ", sep);
+        }
+        snprintf(sql + len, sizeof(history_sql[shape]) - len, "%s LIMIT ?",
+                 (shape & HISTORY_SINCE) ? "ORDER BY id ASC" : "ORDER BY timestamp DESC, id DESC");
+        
+        stmt_sql[STMT_HISTORY + shape] = sql;
     }
+}
+
+static sqlite3_stmt *stmt_cache[STMT_COUNT];
+static pthread_mutex_t stmt_locks[STMT_COUNT];
+
+// A statement can only run on one thread at a time; checkout holds its
+// mutex until release resets it for the next caller.
+static sqlite3_stmt* db_stmt_checkout(int id) {
+    if (!stmt_cache[id]) return NULL;
+    pthread_mutex_lock(&stmt_locks[id]);
+    return stmt_cache[id];
+}
+
+static void db_stmt_release(int id) {
+    sqlite3_reset(stmt_cache[id]);
+    sqlite3_clear_bindings(stmt_cache[id]);
+    pthread_mutex_unlock(&stmt_locks[id]);
+}
+
+static int db_prepare_cache() {
+    db_build_history_sql();
+    for (int i = 0; i < STMT_COUNT; i++) {
+        sqlite3 *conn = (i < STMT_HISTORY) ? db : db_ro;
+        if (sqlite3_prepare_v3(conn, stmt_sql[i], -1, SQLITE_PREPARE_PERSISTENT, &stmt_cache[i], NULL) != SQLITE_OK) {
+            fprintf(stderr, "[DB] Prepare failed: %s\n  %s\n", sqlite3_errmsg(conn), stmt_sql[i]);
+            return -1;
+        }
+        pthread_mutex_init(&stmt_locks[i], NULL);
+    }
+    return 0;
+}
+
+// ===== READER CONNECTIONS =====
+// Threads that mostly run history queries (the HTTP slow pool) each get a
+// read connection and history statements of their own, so they neither
+// serialize on db_ro nor borrow from the shared cache.
+typedef struct DbReader {
+    sqlite3 *conn;
+    sqlite3_stmt *stmt[HISTORY_SHAPES];
+    int busy[HISTORY_SHAPES];
+} DbReader;
+
+static __thread DbReader *thread_reader = NULL;
+
+int db_reader_open() {
+    if (thread_reader) return 0;
+    if (!db_path[0]) return -1;
     
-    printf("[DB] Opened: %s\n", DB_PATH);
+    DbReader *r = calloc(1, sizeof(*r));
+    if (!r) return -1;
     
-    const char *sql = 
-        "CREATE TABLE IF NOT EXISTS pump_commands (id INTEGER PRIMARY KEY AUTOINCREMENT, pump_id INTEGER, command INTEGER, timestamp INTEGER, source TEXT);"
-        "CREATE TABLE IF NOT EXISTS pump_feedback (id INTEGER PRIMARY KEY AUTOINCREMENT, pump_id INTEGER, status INTEGER, timestamp INTEGER);"
-        "CREATE TABLE IF NOT EXISTS pump_snapshots (id INTEGER PRIMARY KEY AUTOINCREMENT, pump1_cmd INTEGER, pump1_status INTEGER, pump2_cmd INTEGER, pump2_status INTEGER, busy INTEGER, alarm INTEGER, timestamp INTEGER);"
-        "CREATE TABLE IF NOT EXISTS gateway_history (id INTEGER PRIMARY KEY AUTOINCREMENT, is_online INTEGER, device_id TEXT, firmware TEXT, timestamp INTEGER);"
-        "CREATE INDEX IF NOT EXISTS idx_snapshots_time ON pump_snapshots(timestamp);";
+    if (sqlite3_open_v2(db_path, &r->conn, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "[DB] Cannot open reader: %s\n", sqlite3_errmsg(r->conn));
+        sqlite3_close(r->conn);
+        free(r);
+        return -1;
+    }
+    thread_reader = r;
+    return 0;
+}
+
+void db_reader_close() {
+    DbReader *r = thread_reader;
+    if (!r) return;
     
-    char *err_msg = NULL;
-    rc = sqlite3_exec(db, sql, NULL, NULL, &err_msg);
+    for (int i = 0; i < HISTORY_SHAPES; i++) {
+        sqlite3_finalize(r->stmt[i]);
+    }
+    sqlite3_close(r->conn);
+    free(r);
+    thread_reader = NULL;
+}
+
+static void db_finalize_cache() {
+    for (int i = 0; i < STMT_COUNT; i++) {
+        if (stmt_cache[i]) {
+            sqlite3_finalize(stmt_cache[i]);
+            stmt_cache[i] = NULL;
+            pthread_mutex_destroy(&stmt_locks[i]);
+        }
+    }
+}
+
+// ===== GROUP-COMMIT WRITER =====
+// db_insert_* only copy the row into this queue. The writer thread commits
+// up to batch_max rows per transaction, waiting at most latency_ms after the
+// oldest queued row, so a burst pays one fsync instead of one per row.
+#define DB_WRITE_COMMAND    1
+#define DB_WRITE_FEEDBACK   2
+#define DB_WRITE_SNAPSHOT   3
+#define DB_WRITE_GATEWAY    4
+
+typedef struct {
+    int type;
+    char device_id[64];
+    char text[32];          // command source or gateway firmware
+    int pump_id;
+    int command;
+    int status;             // feedback/snapshot status, gateway is_online
+    int busy;
+    int alarm;
+    time_t timestamp;
+    double queued_at;       // monotonic ms, for the latency window
+} DbWrite;
+
+static DbWrite *write_queue = NULL;
+static int wq_head = 0;
+static int wq_count = 0;
+static int wq_in_flight = 0;
+static int writer_stop = 0;
+static int batch_max = DB_BATCH_MAX;
+static int batch_latency_ms = DB_BATCH_LATENCY_MS;
+static pthread_t writer_tid;
+static time_t next_rollup_tick = 0;   // writer thread only
+static time_t next_archive_check = 0;
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;  // transactions on `db`
+static pthread_mutex_t wq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wq_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wq_not_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wq_drained = PTHREAD_COND_INITIALIZER;
+
+// Bumped after every transaction that changed rows readers can see
+static atomic_ullong data_version;
+
+static void bump_data_version() {
+    atomic_fetch_add_explicit(&data_version, 1, memory_order_release);
+}
+
+// Writer stats (under wq_lock). Commit durations of the last
+// DB_LATENCY_SAMPLES transactions are kept for the p99.
+static DbWriterStats wstats;
+static double commit_ms[DB_LATENCY_SAMPLES];
+static int commit_samples = 0;
+
+static double mono_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Absolute CLOCK_REALTIME deadline for pthread_cond_timedwait
+static struct timespec deadline_after_ms(double ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long long ns = deadline.tv_nsec + (long long)(ms * 1e6);
+    deadline.tv_sec += ns / 1000000000LL;
+    deadline.tv_nsec = ns % 1000000000LL;
+    return deadline;
+}
+
+static int db_enqueue(const DbWrite *w) {
+    if (!write_queue) return -1;
     
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "[DB] Error: %s\n", err_msg);
-        sqlite3_free(err_msg);
+    pthread_mutex_lock(&wq_lock);
+    // Back-pressure rather than drop: the ingest queue absorbs the burst
+    while (wq_count == DB_WRITE_QUEUE_SIZE && !writer_stop) {
+        pthread_cond_wait(&wq_not_full, &wq_lock);
+    }
+    if (writer_stop) {
+        pthread_mutex_unlock(&wq_lock);
         return -1;
     }
     
-    printf("[DB] Tables OK\n");
+    DbWrite *slot = &write_queue[(wq_head + wq_count) % DB_WRITE_QUEUE_SIZE];
+    *slot = *w;
+    slot->queued_at = mono_ms();
+    wq_count++;
+    wstats.queued++;
+    if (wq_count == 1 || wq_count >= batch_max) {
+        pthread_cond_signal(&wq_not_empty);
+    }
+    pthread_mutex_unlock(&wq_lock);
     return 0;
 }
 
-int db_close() {
-    if (db) {
-        sqlite3_close(db);
-        printf("[DB] Closed\n");
+static int db_exec_write(const DbWrite *w) {
+    int id = 0;
+    
+    switch (w->type) {
+        case DB_WRITE_COMMAND: id = STMT_INSERT_COMMAND; break;
+        case DB_WRITE_FEEDBACK: id = STMT_INSERT_FEEDBACK; break;
+        case DB_WRITE_SNAPSHOT: id = STMT_INSERT_SNAPSHOT; break;
+        case DB_WRITE_GATEWAY: id = STMT_INSERT_GATEWAY; break;
+        default: return -1;
+    }
+    
+    sqlite3_stmt *stmt = db_stmt_checkout(id);
+    if (!stmt) return -1;
+    
+    switch (w->type) {
+        case DB_WRITE_COMMAND:
+            sqlite3_bind_text(stmt, 1, w->device_id, -1, SQLITE_STATIC);
+            sqlite3_bind_int(stmt, 2, w->pump_id);
+            sqlite3_bind_int(stmt, 3, w->command);
+            sqlite3_bind_int64(stmt, 4, w->timestamp);
+            sqlite3_bind_text(stmt, 5, w->text, -1, SQLITE_STATIC);
+            break;
+        case DB_WRITE_FEEDBACK:
+            sqlite3_bind_text(stmt, 1, w->device_id, -1, SQLITE_STATIC);
+            sqlite3_bind_int(stmt, 2, w->pump_id);
+            sqlite3_bind_int(stmt, 3, w->status);
+            sqlite3_bind_int64(stmt, 4, w->timestamp);
+            break;
+        case DB_WRITE_SNAPSHOT:
+            sqlite3_bind_text(stmt, 1, w->device_id, -1, SQLITE_STATIC);
+            sqlite3_bind_int(stmt, 2, w->pump_id);
+            sqlite3_bind_int(stmt, 3, w->command);
+            sqlite3_bind_int(stmt, 4, w->status);
+            sqlite3_bind_int(stmt, 5, w->busy);
+            sqlite3_bind_int(stmt, 6, w->alarm);
+            sqlite3_bind_int64(stmt, 7, w->timestamp);
+            break;
+        case DB_WRITE_GATEWAY:
+            sqlite3_bind_int(stmt, 1, w->status);
+            sqlite3_bind_text(stmt, 2, w->device_id, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, w->text, -1, SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 4, w->timestamp);
+            break;
+    }
+    
+    int rc = sqlite3_step(stmt);
+    db_stmt_release(id);
+    if (rc != SQLITE_DONE) return -1;
+    
+    // Rollups move in the same transaction as the row that feeds them
+    if (w->type == DB_WRITE_SNAPSHOT) {
+        return rollup_snapshot(w->device_id, w->pump_id, w->status, w->busy, w->alarm, w->timestamp);
     }
     return 0;
 }
 
-int db_insert_command(int pump_id, int command, time_t timestamp, const char *source) {
-    const char *sql = "INSERT INTO pump_commands VALUES (NULL,?,?,?,?)";
+// Moves one segment's worth of aged snapshots per call, in its own
+// transaction; a backlog drains one segment per rollup tick
+static void db_archive_tick(time_t now) {
+    int n = archive_run(now - (time_t)ARCHIVE_AFTER_DAYS * 86400, ARCHIVE_MIN_ROWS);
+    next_archive_check = now + (n == ARCHIVE_SEGMENT_ROWS ? ROLLUP_TICK_S : ARCHIVE_CHECK_S);
+}
+
+// ===== RETENTION =====
+// A sweep starts hourly on a rollup tick and then advances one bounded step
+// per writer iteration: DB_RETENTION_BATCH rows from one table, one expired
+// archive segment, or DB_VACUUM_PAGES pages of incremental_vacuum, each in its
+// own short transaction, so queued writes never wait behind a whole sweep.
+#define RETENTION_TABLES    6
+#define RETENTION_ARCHIVE   RETENTION_TABLES    // then incremental_vacuum
+
+static const int retention_days[RETENTION_TABLES] = {
+    DB_RETENTION_DAYS, DB_RETENTION_DAYS, DB_RETENTION_DAYS, DB_SNAPSHOT_RETENTION_DAYS,
+    DB_ROLLUP_MINUTE_DAYS, DB_ROLLUP_HOUR_DAYS
+};
+static int retention_phase = -1;      // writer thread only; -1 = no sweep running
+static time_t retention_now = 0;
+static time_t next_retention = 0;
+static atomic_int retention_paused;   // a running sweep waits, one due doesn't start stepping
+
+static int db_pragma_int(const char *pragma) {
     sqlite3_stmt *stmt;
+    int value = -1;
     
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) return -1;
-    
-    sqlite3_bind_int(stmt, 1, pump_id);
-    sqlite3_bind_int(stmt, 2, command);
-    sqlite3_bind_int64(stmt, 3, timestamp);
-    sqlite3_bind_text(stmt, 4, source, -1, SQLITE_STATIC);
-    
-    int rc = sqlite3_step(stmt);
+    if (sqlite3_prepare_v2(db, pragma, -1, &stmt, NULL) != SQLITE_OK) return -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) value = sqlite3_column_int(stmt, 0);
     sqlite3_finalize(stmt);
-    return (rc == SQLITE_DONE) ? 0 : -1;
+    return value;
 }
 
-int db_insert_feedback(int pump_id, int status, time_t timestamp) {
-    const char *sql = "INSERT INTO pump_feedback VALUES (NULL,?,?,?)";
-    sqlite3_stmt *stmt;
+static void db_retention_step() {
+    double t0 = mono_ms();
+    unsigned long long expired = 0, vacuumed = 0;
+    int segments = 0;
+    
+    pthread_mutex_lock(&conn_lock);
+    if (atomic_load(&retention_paused)) {
+        pthread_mutex_unlock(&conn_lock);
+        return;
+    }
     
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) return -1;
+    if (retention_phase < RETENTION_TABLES) {
+        int id = STMT_EXPIRE_COMMANDS + retention_phase;
+        sqlite3_stmt *stmt = db_stmt_checkout(id);
+        sqlite3_bind_int64(stmt, 1, retention_now - (time_t)retention_days[retention_phase] * 86400);
+        sqlite3_bind_int(stmt, 2, DB_RETENTION_BATCH);
+        
+        int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_DONE) {
+            expired = sqlite3_changes(db);
+        } else {
+            fprintf(stderr, "[DB-WRITER] Retention failed: %s\n", sqlite3_errmsg(db));
+        }
+        db_stmt_release(id);
+        
+        if (rc != SQLITE_DONE || expired < DB_RETENTION_BATCH) retention_phase++;
+    } else if (retention_phase == RETENTION_ARCHIVE) {
+        segments = archive_expire(retention_now - (time_t)DB_SNAPSHOT_RETENTION_DAYS * 86400) > 0;
+        if (!segments) retention_phase++;
+    } else {
+        int free_pages = db_pragma_int("PRAGMA freelist_count");
+        if (free_pages > 0) {
+            char sql[64];
+            snprintf(sql, sizeof(sql), "PRAGMA incremental_vacuum(%d)", DB_VACUUM_PAGES);
+            sqlite3_exec(db, sql, NULL, NULL, NULL);
+            int left = db_pragma_int("PRAGMA freelist_count");
+            vacuumed = (left >= 0 && left < free_pages) ? free_pages - left : 0;
+        }
+        if (free_pages <= 0 || vacuumed == 0) retention_phase = -1;
+    }
+    pthread_mutex_unlock(&conn_lock);
+    if (expired > 0 || segments) bump_data_version();
+    
+    double elapsed = mono_ms() - t0;
+    pthread_mutex_lock(&wq_lock);
+    wstats.expired += expired;
+    wstats.vacuumed_pages += vacuumed;
+    wstats.segments_expired += segments;
+    if (elapsed > wstats.max_retention_step_ms) wstats.max_retention_step_ms = elapsed;
+    pthread_mutex_unlock(&wq_lock);
+}
+
+// One transaction for the whole batch. Returns the number of rows written.
+static int db_commit_batch(const DbWrite *batch, int n) {
+    int written = 0;
+    time_t now = time(NULL);
+    int tick = now >= next_rollup_tick;
+    
+    if (n == 0 && !tick) return 0;
+    
+    pthread_mutex_lock(&conn_lock);
+    if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "[DB-WRITER] BEGIN failed: %s\n", sqlite3_errmsg(db));
+        pthread_mutex_unlock(&conn_lock);
+        return 0;
+    }
     
-    sqlite3_bind_int(stmt, 1, pump_id);
-    sqlite3_bind_int(stmt, 2, status);
-    sqlite3_bind_int64(stmt, 3, timestamp);
+    for (int i = 0; i < n; i++) {
+        if (db_exec_write(&batch[i]) == 0) {
+            written++;
+        } else {
+            fprintf(stderr, "[DB-WRITER] Insert failed: %s\n", sqlite3_errmsg(db));
+        }
+    }
     
-    int rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    return (rc == SQLITE_DONE) ? 0 : -1;
+    if (tick) {
+        if (rollup_tick(now) != 0) {
+            fprintf(stderr, "[DB-WRITER] Rollup tick failed: %s\n", sqlite3_errmsg(db));
+        }
+        next_rollup_tick = now + ROLLUP_TICK_S;
+    }
+    
+    if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "[DB-WRITER] COMMIT failed: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+        written = 0;
+    } else {
+        if (tick && now >= next_archive_check) db_archive_tick(now);
+        bump_data_version();
+    }
+    if (tick && now >= next_retention && retention_phase < 0) {
+        retention_phase = 0;
+        retention_now = now;
+        next_retention = now + DB_RETENTION_CHECK_S;
+    }
+    pthread_mutex_unlock(&conn_lock);
+    
+    return written;
 }
 
-int db_insert_snapshot(int p1_cmd, int p1_st, int p2_cmd, int p2_st, int busy, int alarm, time_t timestamp) {
-    if (!db) return -1;
+static void* db_writer_thread(void *arg) {
+    DbWrite *batch = malloc(sizeof(DbWrite) * DB_WRITE_QUEUE_SIZE);
+    if (!batch) {
+        fprintf(stderr, "[DB-WRITER] Out of memory\n");
+        return NULL;
+    }
     
-    const char *sql = "INSERT INTO pump_snapshots VALUES (NULL,?,?,?,?,?,?,?)";
-    sqlite3_stmt *stmt;
+    next_rollup_tick = time(NULL) + ROLLUP_TICK_S;
+    next_archive_check = next_rollup_tick;
+    next_retention = next_rollup_tick;
+    retention_phase = -1;
+    
+    pthread_mutex_lock(&wq_lock);
+    for (;;) {
+        // Idle: still wake up for the rollup tick so open intervals get credited
+        while (wq_count == 0 && !writer_stop) {
+            if (retention_phase >= 0 && !atomic_load(&retention_paused)) {
+                pthread_mutex_unlock(&wq_lock);
+                db_retention_step();
+                pthread_mutex_lock(&wq_lock);
+                
+                // Leave the file to readers between steps; a queued write ends the gap
+                struct timespec gap = deadline_after_ms(DB_RETENTION_IDLE_GAP_MS);
+                if (wq_count == 0 && !writer_stop) pthread_cond_timedwait(&wq_not_empty, &wq_lock, &gap);
+                continue;
+            }
+            struct timespec deadline = {next_rollup_tick, 0};
+            if (pthread_cond_timedwait(&wq_not_empty, &wq_lock, &deadline) == ETIMEDOUT && wq_count == 0) {
+                pthread_mutex_unlock(&wq_lock);
+                db_commit_batch(NULL, 0);
+                pthread_mutex_lock(&wq_lock);
+            }
+        }
+        if (wq_count == 0 && writer_stop) break;
+        
+        // Let the batch fill until it is full or the oldest row has waited long enough
+        while (wq_count < batch_max && !writer_stop) {
+            double wait_ms = write_queue[wq_head].queued_at + batch_latency_ms - mono_ms();
+            if (wait_ms <= 0) break;
+            
+            struct timespec deadline = deadline_after_ms(wait_ms);
+            pthread_cond_timedwait(&wq_not_empty, &wq_lock, &deadline);
+        }
+        
+        int n = wq_count < batch_max ? wq_count : batch_max;
+        for (int i = 0; i < n; i++) {
+            batch[i] = write_queue[(wq_head + i) % DB_WRITE_QUEUE_SIZE];
+        }
+        wq_head = (wq_head + n) % DB_WRITE_QUEUE_SIZE;
+        wq_count -= n;
+        wq_in_flight = n;
+        pthread_cond_broadcast(&wq_not_full);
+        pthread_mutex_unlock(&wq_lock);
+        
+        double t0 = mono_ms();
+        int written = db_commit_batch(batch, n);
+        double elapsed = mono_ms() - t0;
+        
+        // Under load, one retention step between batches
+        if (retention_phase >= 0) db_retention_step();
+        
+        pthread_mutex_lock(&wq_lock);
+        wq_in_flight = 0;
+        wstats.written += written;
+        wstats.failed += n - written;
+        wstats.commits++;
+        if (n > wstats.largest_batch) wstats.largest_batch = n;
+        commit_ms[commit_samples % DB_LATENCY_SAMPLES] = elapsed;
+        commit_samples++;
+        pthread_cond_broadcast(&wq_drained);
+    }
+    pthread_mutex_unlock(&wq_lock);
     
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) return -1;
+    free(batch);
+    return NULL;
+}
+
+void db_retention_pause(int paused) {
+    atomic_store(&retention_paused, paused ? 1 : 0);
     
-    sqlite3_bind_int(stmt, 1, p1_cmd);
-    sqlite3_bind_int(stmt, 2, p1_st);
-    sqlite3_bind_int(stmt, 3, p2_cmd);
-    sqlite3_bind_int(stmt, 4, p2_st);
-    sqlite3_bind_int(stmt, 5, busy);
-    sqlite3_bind_int(stmt, 6, alarm);
-    sqlite3_bind_int64(stmt, 7, timestamp);
+    // Every step runs under conn_lock, so once we hold it none is in flight
+    pthread_mutex_lock(&conn_lock);
+    pthread_mutex_unlock(&conn_lock);
     
-    int rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    return (rc == SQLITE_DONE) ? 0 : -1;
+    // An idle writer picks a pending sweep back up
+    pthread_mutex_lock(&wq_lock);
+    pthread_cond_signal(&wq_not_empty);
+    pthread_mutex_unlock(&wq_lock);
 }
 
-int db_insert_gateway_status(int is_online, const char *device_id, const char *firmware, time_t timestamp) {
-    if (!db) return -1;
+void db_set_batch_limits(int max_batch, int max_latency_ms) {
+    if (max_batch < 1) max_batch = 1;
+    if (max_batch > DB_WRITE_QUEUE_SIZE) max_batch = DB_WRITE_QUEUE_SIZE;
+    if (max_latency_ms < 0) max_latency_ms = 0;
+    
+    pthread_mutex_lock(&wq_lock);
+    batch_max = max_batch;
+    batch_latency_ms = max_latency_ms;
+    pthread_cond_signal(&wq_not_empty);
+    pthread_mutex_unlock(&wq_lock);
+}
+
+int db_archive_older_than(time_t cutoff) {
+    int total = 0, n;
     
-    const char *sql = "INSERT INTO gateway_history VALUES (NULL,?,?,?,?)";
+    if (!write_queue) return -1;
+    
+    pthread_mutex_lock(&conn_lock);
+    while ((n = archive_run(cutoff, 1)) > 0) {
+        total += n;
+    }
+    pthread_mutex_unlock(&conn_lock);
+    if (total > 0) bump_data_version();
+    return n < 0 ? -1 : total;
+}
+
+int db_flush() {
+    if (!write_queue) return -1;
+    
+    pthread_mutex_lock(&wq_lock);
+    pthread_cond_signal(&wq_not_empty);
+    while (wq_count > 0 || wq_in_flight > 0) {
+        pthread_cond_wait(&wq_drained, &wq_lock);
+    }
+    pthread_mutex_unlock(&wq_lock);
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+unsigned long long db_data_version() {
+    return atomic_load_explicit(&data_version, memory_order_acquire);
+}
+
+void db_get_writer_stats(DbWriterStats *out) {
+    static double sorted[DB_LATENCY_SAMPLES];
+    
+    pthread_mutex_lock(&wq_lock);
+    *out = wstats;
+    out->pending = wq_count + wq_in_flight;
+    out->batch_max = batch_max;
+    out->batch_latency_ms = batch_latency_ms;
+    int n = commit_samples < DB_LATENCY_SAMPLES ? commit_samples : DB_LATENCY_SAMPLES;
+    memcpy(sorted, commit_ms, sizeof(double) * n);
+    
+    if (n > 0) {
+        qsort(sorted, n, sizeof(double), cmp_double);
+        out->p99_commit_ms = sorted[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1];
+        out->max_commit_ms = sorted[n - 1];
+    } else {
+        out->p99_commit_ms = 0;
+        out->max_commit_ms = 0;
+    }
+    pthread_mutex_unlock(&wq_lock);
+}
+
+static int db_column_exists(const char *table, const char *column) {
+    char sql[128];
     sqlite3_stmt *stmt;
+    int found = 0;
     
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) return -1;
+    snprintf(sql, sizeof(sql), "PRAGMA table_info(%s)", table);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) return 0;
     
-    sqlite3_bind_int(stmt, 1, is_online);
-    sqlite3_bind_text(stmt, 2, device_id ? device_id : "", -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 3, firmware ? firmware : "", -1, SQLITE_STATIC);
-    sqlite3_bind_int64(stmt, 4, timestamp);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *name = (const char *)sqlite3_column_text(stmt, 1);
+        if (name && strcmp(name, column) == 0) {
+            found = 1;
+            break;
+        }
+    }
     
-    int rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
-    return (rc == SQLITE_DONE) ? 0 : -1;
+    return found;
 }
 
-int db_get_history(char *output, int max_size, int limit) {
-    if (!db) {
-        sprintf(output, "{\"error\":\"DB not init\"}");
+// Older databases stored one wide row per change (pump1_cmd, pump2_cmd, ...).
+// Split them into per-pump rows owned by the default gateway.
+static int db_migrate_legacy() {
+    char *err_msg = NULL;
+    
+    if (db_column_exists("pump_snapshots", "pump1_cmd")) {
+        printf("[DB] Migrating pump_snapshots to per-pump rows...\n");
+        
+        const char *sql =
+            "BEGIN;"
+            "ALTER TABLE pump_snapshots RENAME TO pump_snapshots_legacy;"
+            "CREATE TABLE pump_snapshots (id INTEGER PRIMARY KEY AUTOINCREMENT, device_id TEXT, pump_id INTEGER, command INTEGER, status INTEGER, busy INTEGER, alarm INTEGER, timestamp INTEGER);"
+            "INSERT INTO pump_snapshots (device_id, pump_id, command, status, busy, alarm, timestamp) "
+            "SELECT device_id, pump_id, command, status, busy, alarm, timestamp FROM ("
+            " SELECT '" DEFAULT_GATEWAY_ID "' AS device_id, 1 AS pump_id, pump1_cmd AS command, pump1_status AS status, busy, alarm, timestamp, id FROM pump_snapshots_legacy"
+            " UNION ALL"
+            " SELECT '" DEFAULT_GATEWAY_ID "', 2, pump2_cmd, pump2_status, busy, alarm, timestamp, id FROM pump_snapshots_legacy"
+            ") ORDER BY id, pump_id;"
+            "DROP TABLE pump_snapshots_legacy;"
+            "COMMIT;";
+        
+        if (sqlite3_exec(db, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+            fprintf(stderr, "[DB] Migration error: %s\n", err_msg);
+            sqlite3_free(err_msg);
+            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+            return -1;
+        }
+    }
+    
+    const char *tables[] = {"pump_commands", "pump_feedback"};
+    for (int i = 0; i < 2; i++) {
+        if (!db_column_exists(tables[i], "id") || db_column_exists(tables[i], "device_id")) continue;
+        
+        char sql[128];
+        snprintf(sql, sizeof(sql), "ALTER TABLE %s ADD COLUMN device_id TEXT DEFAULT '" DEFAULT_GATEWAY_ID "'", tables[i]);
+        if (sqlite3_exec(db, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+            fprintf(stderr, "[DB] Migration error: %s\n", err_msg);
+            sqlite3_free(err_msg);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+int db_init() {
+    mkdir("/var/lib/pump_server", 0755);
+    return db_open(DB_PATH);
+}
+
+int db_open(const char *path) {
+    int rc = sqlite3_open(path, &db);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "[DB] Cannot open: %s\n", sqlite3_errmsg(db));
         return -1;
     }
     
-    const char *sql = "SELECT * FROM pump_snapshots ORDER BY timestamp DESC LIMIT ?";
-    sqlite3_stmt *stmt;
+    printf("[DB] Opened: %s\n", path);
+    snprintf(db_path, sizeof(db_path), "%s", path);
     
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        sprintf(output, "{\"error\":\"Query failed\"}");
+    // Must precede the first table; older files are converted below
+    sqlite3_exec(db, "PRAGMA auto_vacuum=INCREMENTAL;", NULL, NULL, NULL);
+    
+    if (db_migrate_legacy() != 0) {
         return -1;
     }
     
-    sqlite3_bind_int(stmt, 1, limit);
+    const char *sql = 
+        "CREATE TABLE IF NOT EXISTS pump_commands (id INTEGER PRIMARY KEY AUTOINCREMENT, pump_id INTEGER, command INTEGER, timestamp INTEGER, source TEXT, device_id TEXT);"
+        "CREATE TABLE IF NOT EXISTS pump_feedback (id INTEGER PRIMARY KEY AUTOINCREMENT, pump_id INTEGER, status INTEGER, timestamp INTEGER, device_id TEXT);"
+        "CREATE TABLE IF NOT EXISTS pump_snapshots (id INTEGER PRIMARY KEY AUTOINCREMENT, device_id TEXT, pump_id INTEGER, command INTEGER, status INTEGER, busy INTEGER, alarm INTEGER, timestamp INTEGER);"
+        "CREATE TABLE IF NOT EXISTS gateway_history (id INTEGER PRIMARY KEY AUTOINCREMENT, is_online INTEGER, device_id TEXT, firmware TEXT, timestamp INTEGER);"
+        "CREATE INDEX IF NOT EXISTS idx_snapshots_time ON pump_snapshots(timestamp);"
+        "CREATE INDEX IF NOT EXISTS idx_snapshots_pump ON pump_snapshots(device_id, pump_id, timestamp);";
     
-    char temp[102400];
-    temp[0] = '\0';  // CRITICAL: Clear buffer to prevent stale data
-    char *ptr = temp;
-    int remaining = sizeof(temp);
-    int count = 0;
+    char *err_msg = NULL;
+    rc = sqlite3_exec(db, sql, NULL, NULL, &err_msg);
     
-    while (sqlite3_step(stmt) == SQLITE_ROW && remaining > 200) {
-        int written = snprintf(ptr, remaining,
-            "%s{\"pump1\":%d,\"pump1_status\":%d,\"pump2\":%d,\"pump2_status\":%d,\"busy\":%d,\"alarm\":%d,\"timestamp\":%lld}",
-            (count > 0 ? "," : ""),
-            sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2),
-            sqlite3_column_int(stmt, 3), sqlite3_column_int(stmt, 4),
-            sqlite3_column_int(stmt, 5), sqlite3_column_int(stmt, 6),
-            (long long)sqlite3_column_int64(stmt, 7));
-        
-        ptr += written;
-        remaining -= written;
-        count++;
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "[DB] Error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return -1;
     }
     
-    sqlite3_finalize(stmt);
-    snprintf(output, max_size, "{\"count\":%d,\"data\":[%s]}", count, temp);
+    printf("[DB] Tables OK\n");
     
-    printf("[DB] Retrieved %d records\n", count);
-    return 0;
-}
-
-int db_get_history_filtered(char *output, int max_size, int limit, time_t from, time_t to) {
-    if (!db) {
-        sprintf(output, "{\"error\":\"DB not init\"}");
+    // A file created before retention existed has auto_vacuum off, and only
+    // a full VACUUM can switch it. Done once, before any thread writes.
+    if (db_pragma_int("PRAGMA auto_vacuum") != 2) {
+        printf("[DB] Enabling incremental vacuum (one-time VACUUM)...\n");
+        if (sqlite3_exec(db, "VACUUM;", NULL, NULL, &err_msg) != SQLITE_OK) {
+            fprintf(stderr, "[DB] Error: %s\n", err_msg);
+            sqlite3_free(err_msg);
+            err_msg = NULL;
+        }
+    }
+    
+    // WAL lets the history connection read while the writer commits.
+    // synchronous=NORMAL still never corrupts; a power cut can only lose
+    // the last committed batch, and db_close() checkpoints before exit.
+    if (sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=" DB_SYNCHRONOUS ";", NULL, NULL, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "[DB] Error: %s\n", err_msg);
+        sqlite3_free(err_msg);
         return -1;
     }
     
-    char sql[512];
-    sqlite3_stmt *stmt;
+    if (sqlite3_open_v2(path, &db_ro, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "[DB] Cannot open read connection: %s\n", sqlite3_errmsg(db_ro));
+        return -1;
+    }
     
-    printf("[DB-FILTER] CALLED: limit=%d, from=%ld, to=%ld\n", limit, from, to);
+    // Creates the rollup tables, which the retention statements need
+    if (rollup_init(db, db_ro) != 0) {
+        return -1;
+    }
     
-    // Build SQL
-    if (from > 0 && to > 0) {
-        snprintf(sql, sizeof(sql), "SELECT * FROM pump_snapshots WHERE timestamp >= ? AND timestamp <= ? ORDER BY timestamp DESC LIMIT ?");
-    } else if (from > 0) {
-        snprintf(sql, sizeof(sql), "SELECT * FROM pump_snapshots WHERE timestamp >= ? ORDER BY timestamp DESC LIMIT ?");
-    } else if (to > 0) {
-        snprintf(sql, sizeof(sql), "SELECT * FROM pump_snapshots WHERE timestamp <= ? ORDER BY timestamp DESC LIMIT ?");
-    } else {
-        snprintf(sql, sizeof(sql), "SELECT * FROM pump_snapshots ORDER BY timestamp DESC LIMIT ?");
+    if (db_prepare_cache() != 0) {
+        return -1;
     }
     
-    printf("[DB-FILTER] SQL: %s\n", sql);
+    printf("[DB] %d statements cached\n", STMT_COUNT);
     
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        fprintf(stderr, "[DB-FILTER] Prepare failed: %s\n", sqlite3_errmsg(db));
-        sprintf(output, "{\"error\":\"Prepare failed\"}");
+    char archive_dir[512];
+    snprintf(archive_dir, sizeof(archive_dir), "%s.archive", path);
+    if (archive_init(db, archive_dir) != 0) {
         return -1;
     }
     
-    // Bind parameters
-    if (from > 0 && to > 0) {
-        sqlite3_bind_int64(stmt, 1, (sqlite3_int64)from);
-        sqlite3_bind_int64(stmt, 2, (sqlite3_int64)to);
-        sqlite3_bind_int(stmt, 3, limit);
-        printf("[DB-FILTER] Bound: from=%ld, to=%ld, limit=%d\n", from, to, limit);
-    } else if (from > 0) {
-        sqlite3_bind_int64(stmt, 1, (sqlite3_int64)from);
-        sqlite3_bind_int(stmt, 2, limit);
-        printf("[DB-FILTER] Bound: from=%ld, limit=%d\n", from, limit);
-    } else if (to > 0) {
-        sqlite3_bind_int64(stmt, 1, (sqlite3_int64)to);
-        sqlite3_bind_int(stmt, 2, limit);
-        printf("[DB-FILTER] Bound: to=%ld, limit=%d\n", to, limit);
-    } else {
-        sqlite3_bind_int(stmt, 1, limit);
-        printf("[DB-FILTER] Bound: limit=%d\n", limit);
-    }
-    
-    // Build response
-    char temp[409600];
-    temp[0] = '\0';  //  Clear buffer to prevent stale data
-    char *ptr = temp;
-    int remaining = sizeof(temp);
-    int count = 0;
-    
-    while (sqlite3_step(stmt) == SQLITE_ROW && remaining > 200) {
-        int written = snprintf(ptr, remaining,
-            "%s{\"pump1\":%d,\"pump1_status\":%d,\"pump2\":%d,\"pump2_status\":%d,\"busy\":%d,\"alarm\":%d,\"timestamp\":%lld}",
-            (count > 0 ? "," : ""),
-            sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2),
-            sqlite3_column_int(stmt, 3), sqlite3_column_int(stmt, 4),
-            sqlite3_column_int(stmt, 5), sqlite3_column_int(stmt, 6),
-            (long long)sqlite3_column_int64(stmt, 7));
+    write_queue = malloc(sizeof(DbWrite) * DB_WRITE_QUEUE_SIZE);
+    if (!write_queue) {
+        fprintf(stderr, "[DB] Out of memory for write queue\n");
+        return -1;
+    }
+    wq_head = 0;
+    wq_count = 0;
+    writer_stop = 0;
+    memset(&wstats, 0, sizeof(wstats));
+    commit_samples = 0;
+    pthread_create(&writer_tid, NULL, db_writer_thread, NULL);
+    
+    printf("[DB] Writer started (batch %d rows / %d ms, WAL)\n", batch_max, batch_latency_ms);
+    return 0;
+}
+
+int db_close() {
+    // Everything queued before this call is committed before the handle closes
+    if (write_queue) {
+        pthread_mutex_lock(&wq_lock);
+        writer_stop = 1;
+        pthread_cond_broadcast(&wq_not_empty);
+        pthread_cond_broadcast(&wq_not_full);
+        pthread_mutex_unlock(&wq_lock);
         
-        ptr += written;
-        remaining -= written;
-        count++;
+        pthread_join(writer_tid, NULL);
+        free(write_queue);
+        write_queue = NULL;
+        printf("[DB] Writer stopped (%llu rows in %llu commits)\n", wstats.written, wstats.commits);
     }
     
-    sqlite3_finalize(stmt);
-    snprintf(output, max_size, "{\"count\":%d,\"data\":[%s]}", count, temp);
-    
-    printf("[DB-FILTER]  Retrieved %d records\n", count);
+    if (db) {
+        archive_close();
+        rollup_close();
+        db_finalize_cache();
+        if (db_ro) {
+            sqlite3_close(db_ro);
+            db_ro = NULL;
+        }
+        sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE);", NULL, NULL, NULL);
+        sqlite3_close(db);
+        db = NULL;
+        printf("[DB] Closed\n");
+    }
     return 0;
 }
 
-int db_cleanup_old_records(int days) {
-    time_t cutoff = time(NULL) - (days * 86400);
-    char sql[256];
-    snprintf(sql, sizeof(sql), "DELETE FROM pump_snapshots WHERE timestamp < %ld", cutoff);
+int db_insert_command(const char *device_id, int pump_id, int command, time_t timestamp, const char *source) {
+    DbWrite w = {.type = DB_WRITE_COMMAND, .pump_id = pump_id, .command = command, .timestamp = timestamp};
+    snprintf(w.device_id, sizeof(w.device_id), "%s", device_id ? device_id : "");
+    snprintf(w.text, sizeof(w.text), "%s", source ? source : "");
+    return db_enqueue(&w);
+}
+
+int db_insert_feedback(const char *device_id, int pump_id, int status, time_t timestamp) {
+    DbWrite w = {.type = DB_WRITE_FEEDBACK, .pump_id = pump_id, .status = status, .timestamp = timestamp};
+    snprintf(w.device_id, sizeof(w.device_id), "%s", device_id ? device_id : "");
+    return db_enqueue(&w);
+}
+
+int db_insert_snapshot(const PumpStatus *snap) {
+    DbWrite w = {.type = DB_WRITE_SNAPSHOT, .pump_id = snap->pump_id, .command = snap->command,
+                 .status = snap->status, .busy = snap->busy, .alarm = snap->alarm, .timestamp = snap->timestamp};
+    snprintf(w.device_id, sizeof(w.device_id), "%s", snap->device_id);
+    return db_enqueue(&w);
+}
+
+int db_insert_gateway_status(int is_online, const char *device_id, const char *firmware, time_t timestamp) {
+    DbWrite w = {.type = DB_WRITE_GATEWAY, .status = is_online, .timestamp = timestamp};
+    snprintf(w.device_id, sizeof(w.device_id), "%s", device_id ? device_id : "");
+    snprintf(w.text, sizeof(w.text), "%s", firmware ? firmware : "");
+    return db_enqueue(&w);
+}
+
+// History rows come straight off the SQLite cursor, one JSON object per call,
+// so a response of any size needs only the caller's buffer. Pages that reach
+// archived time merge in the archive segments, which share the key order.
+struct DbHistoryCursor {
+    sqlite3_stmt *stmt;
+    int cached_id;          // statement borrowed from the cache, or -1 if private
+    DbReader *reader;       // set if the statement is the thread reader's rather than the cache's
+    int limit;
+    int since;              // incremental sync: callers continue from max_id instead
+    int rows;
+    sqlite3_int64 last_ts;  // keyset position of the last row returned
+    sqlite3_int64 last_id;
+    sqlite3_int64 max_id;
+    ArchiveCursor *archive; // NULL in since mode; archived ids are never new
+    int have_db;            // 1 = db_row is the next SQLite row, -1 = SQLite done
+    int have_archive;
+    ArchiveRow db_row;
+    ArchiveRow archive_row;
+};
+
+DbHistoryCursor* db_history_open(const DbHistoryQuery *q) {
+    DbReader *r = thread_reader;
+    if (!r && !db_ro) return NULL;
+    
+    DbHistoryCursor *cur = calloc(1, sizeof(*cur));
+    if (!cur) return NULL;
+    
+    // Pick the statement for this filter shape
+    int shape = 0;
+    if (q->since_id > 0) shape |= HISTORY_SINCE;
+    if (q->from > 0) shape |= HISTORY_FROM;
+    if (q->to > 0) shape |= HISTORY_TO;
+    if (q->has_cursor && !(shape & HISTORY_SINCE)) shape |= HISTORY_AFTER;
+    // With both, SQLite bounds the index range by `to`, and every page would
+    // rescan the rows before the cursor
+    if ((shape & HISTORY_AFTER) && q->cursor_ts <= q->to) shape &= ~HISTORY_TO;
+    int id = STMT_HISTORY + shape;
+    
+    // A cursor lives across many network writes, so never wait for the
+    // cached statement: if another stream holds it, prepare a private one
+    sqlite3 *conn = r ? r->conn : db_ro;
+    if (r && !r->busy[shape] && (r->stmt[shape] ||
+        sqlite3_prepare_v3(conn, stmt_sql[id], -1, SQLITE_PREPARE_PERSISTENT, &r->stmt[shape], NULL) == SQLITE_OK)) {
+        r->busy[shape] = 1;
+        cur->stmt = r->stmt[shape];
+        cur->cached_id = id;
+        cur->reader = r;
+    } else if (!r && stmt_cache[id] && pthread_mutex_trylock(&stmt_locks[id]) == 0) {
+        cur->stmt = stmt_cache[id];
+        cur->cached_id = id;
+    } else {
+        cur->cached_id = -1;
+        if (sqlite3_prepare_v2(conn, stmt_sql[id], -1, &cur->stmt, NULL) != SQLITE_OK) {
+            fprintf(stderr, "[DB] History prepare failed: %s\n", sqlite3_errmsg(conn));
+            free(cur);
+            return NULL;
+        }
+    }
     
-    char *err_msg = NULL;
-    int rc = sqlite3_exec(db, sql, NULL, NULL, &err_msg);
+    int n = 1;
+    if (shape & HISTORY_SINCE) sqlite3_bind_int64(cur->stmt, n++, q->since_id);
+    if (shape & HISTORY_FROM) sqlite3_bind_int64(cur->stmt, n++, (sqlite3_int64)q->from);
+    if (shape & HISTORY_TO) sqlite3_bind_int64(cur->stmt, n++, (sqlite3_int64)q->to);
+    if (shape & HISTORY_AFTER) {
+        sqlite3_bind_int64(cur->stmt, n++, (sqlite3_int64)q->cursor_ts);
+        sqlite3_bind_int64(cur->stmt, n++, q->cursor_id);
+    }
+    sqlite3_bind_int(cur->stmt, n, q->limit > 0 ? q->limit : -1);
     
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "[DB] Cleanup error: %s\n", err_msg);
-        sqlite3_free(err_msg);
+    cur->limit = q->limit;
+    cur->since = (shape & HISTORY_SINCE) != 0;
+    cur->max_id = q->since_id;
+    if (!cur->since) {
+        cur->archive = archive_cursor_open(q->from, q->to, q->has_cursor, q->cursor_ts, q->cursor_id);
+    }
+    return cur;
+}
+
+// 1 = row, 0 = done, -1 = error
+static int db_history_step(DbHistoryCursor *cur, ArchiveRow *row) {
+    int rc = sqlite3_step(cur->stmt);
+    if (rc == SQLITE_DONE) return 0;
+    if (rc != SQLITE_ROW) {
+        fprintf(stderr, "[DB] History step failed: %s\n", sqlite3_errmsg(sqlite3_db_handle(cur->stmt)));
         return -1;
     }
     
-    printf("[DB] Cleaned %d days\n", days);
+    sqlite3_stmt *stmt = cur->stmt;
+    const char *device_id = (const char *)sqlite3_column_text(stmt, 1);
+    row->id = sqlite3_column_int64(stmt, 0);
+    snprintf(row->device_id, sizeof(row->device_id), "%s", device_id ? device_id : "");
+    row->pump_id = sqlite3_column_int(stmt, 2);
+    row->command = sqlite3_column_int(stmt, 3);
+    row->status = sqlite3_column_int(stmt, 4);
+    row->busy = sqlite3_column_int(stmt, 5);
+    row->alarm = sqlite3_column_int(stmt, 6);
+    row->timestamp = sqlite3_column_int64(stmt, 7);
+    return 1;
+}
+
+int db_history_next(DbHistoryCursor *cur, char *buf, size_t max) {
+    if (cur->limit > 0 && cur->rows >= cur->limit) return 0;
+    
+    // Peek one row from each side and emit the newer key
+    if (cur->have_db == 0) {
+        int rc = db_history_step(cur, &cur->db_row);
+        if (rc < 0) return -1;
+        cur->have_db = rc ? 1 : -1;
+    }
+    if (cur->archive && cur->have_archive == 0) {
+        cur->have_archive = archive_cursor_next(cur->archive, &cur->archive_row) ? 1 : -1;
+    }
+    
+    const ArchiveRow *row = NULL;
+    if (cur->have_db == 1) row = &cur->db_row;
+    if (cur->have_archive == 1 && (!row || cur->archive_row.timestamp > row->timestamp ||
+        (cur->archive_row.timestamp == row->timestamp && cur->archive_row.id > row->id))) {
+        row = &cur->archive_row;
+    }
+    if (!row) return 0;
+    
+    // The same row on both sides while an archive segment is committing
+    int same = cur->have_db == 1 && cur->have_archive == 1 && cur->archive_row.id == cur->db_row.id;
+    if (row == &cur->db_row || same) cur->have_db = 0;
+    if (row == &cur->archive_row || same) cur->have_archive = 0;
+    
+    cur->last_id = row->id;
+    cur->last_ts = row->timestamp;
+    if (cur->last_id > cur->max_id) cur->max_id = cur->last_id;
+    
+    int written = snprintf(buf, max,
+        "{\"id\":%lld,\"device_id\":\"%s\",\"pump_id\":%d,\"command\":%d,\"status\":%d,\"busy\":%d,\"alarm\":%d,\"timestamp\":%lld}",
+        (long long)row->id, row->device_id, row->pump_id, row->command,
+        row->status, row->busy, row->alarm, (long long)row->timestamp);
+    
+    if (written < 0 || (size_t)written >= max) return -1;
+    cur->rows++;
+    return written;
+}
+
+// The token is just the keyset position; clients treat it as opaque
+int db_history_cursor(const DbHistoryCursor *cur, char *buf, size_t max) {
+    if (cur->since || cur->limit <= 0 || cur->rows < cur->limit) return 0;
+    snprintf(buf, max, "%llx.%llx", (unsigned long long)cur->last_ts, (unsigned long long)cur->last_id);
+    return 1;
+}
+
+int db_history_parse_cursor(const char *token, DbHistoryQuery *q) {
+    unsigned long long ts, id;
+    char tail;
+    
+    if (!token || sscanf(token, "%llx.%llx%c", &ts, &id, &tail) != 2) return -1;
+    q->has_cursor = 1;
+    q->cursor_ts = (time_t)ts;
+    q->cursor_id = (long long)id;
     return 0;
-}
\ No newline at end of file
+}
+
+long long db_history_max_id(const DbHistoryCursor *cur) {
+    return cur->max_id;
+}
+
+int db_history_rows(const DbHistoryCursor *cur) {
+    return cur->rows;
+}
+
+void db_history_close(DbHistoryCursor *cur) {
+    if (!cur) return;
+    
+    if (cur->reader) {
+        sqlite3_reset(cur->stmt);
+        sqlite3_clear_bindings(cur->stmt);
+        cur->reader->busy[cur->cached_id - STMT_HISTORY] = 0;
+    } else if (cur->cached_id >= 0) {
+        db_stmt_release(cur->cached_id);
+    } else {
+        sqlite3_finalize(cur->stmt);
+    }
+    archive_cursor_close(cur->archive);
+    free(cur);
+}
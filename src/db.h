@@ -1,29 +1,102 @@
 #ifndef DB_H
 #define DB_H
 
+#include "shared.h"
 #include <sqlite3.h>
+#include <stddef.h>
 #include <time.h>
 
 // Database path
 #define DB_PATH "/var/lib/pump_server/pump.db"
 
+// Group commit: a transaction closes at DB_BATCH_MAX rows or DB_BATCH_LATENCY_MS
+// after the oldest queued row, whichever comes first
+#define DB_BATCH_MAX            256
+#define DB_BATCH_LATENCY_MS     50
+#define DB_WRITE_QUEUE_SIZE     16384
+#define DB_LATENCY_SAMPLES      1024
+#define DB_SYNCHRONOUS          "NORMAL"
+
+// Retention: swept hourly by the writer in steps of DB_RETENTION_BATCH rows,
+// interleaved with the write batches; freed pages go back DB_VACUUM_PAGES at a time
+#define DB_RETENTION_DAYS           365     // commands, feedback, gateway history
+#define DB_SNAPSHOT_RETENTION_DAYS  1095    // snapshots, archived or not
+#define DB_ROLLUP_MINUTE_DAYS       30      // day rollups are kept
+#define DB_ROLLUP_HOUR_DAYS         730
+#define DB_RETENTION_BATCH          200
+#define DB_RETENTION_CHECK_S        3600
+#define DB_VACUUM_PAGES             32
+#define DB_RETENTION_IDLE_GAP_MS    20      // between steps when there is nothing to write
+
+typedef struct {
+    unsigned long long queued;
+    unsigned long long written;
+    unsigned long long failed;
+    unsigned long long commits;
+    int pending;
+    int largest_batch;
+    int batch_max;
+    int batch_latency_ms;
+    double p99_commit_ms;       // over the last DB_LATENCY_SAMPLES commits
+    double max_commit_ms;
+    unsigned long long expired;         // rows removed by retention
+    unsigned long long vacuumed_pages;
+    int segments_expired;
+    double max_retention_step_ms;
+} DbWriterStats;
+
 // Functions
 int db_init();
-int db_close();
+int db_open(const char *path);     // db_init() on DB_PATH; benchmarks open their own file
+int db_close();           // flushes the write queue first
 
-// Insert
-int db_insert_command(int pump_id, int command, time_t timestamp, const char *source);
-int db_insert_feedback(int pump_id, int status, time_t timestamp);
-int db_insert_snapshot(int p1_cmd, int p1_st, int p2_cmd, int p2_st, int busy, int alarm, time_t timestamp);
+// Group-commit writer
+void db_set_batch_limits(int max_batch, int max_latency_ms);
+int db_flush();           // blocks until everything queued so far is committed
+// Paused, no sweep step runs from the time this returns until it is resumed,
+// so benchmarks and tests get the file to themselves (e.g. for VACUUM)
+void db_retention_pause(int paused);
+int db_archive_older_than(time_t cutoff);   // archive now instead of on the writer's schedule; rows moved or -1
+void db_get_writer_stats(DbWriterStats *out);
+// Changes after every commit, retention step or archive run that touched
+// rows; a query run after reading it sees at least that data
+unsigned long long db_data_version();
+
+// Insert (queued for the writer thread; 0 = queued)
+int db_insert_command(const char *device_id, int pump_id, int command, time_t timestamp, const char *source);
+int db_insert_feedback(const char *device_id, int pump_id, int status, time_t timestamp);
+int db_insert_snapshot(const PumpStatus *snap);
 int db_insert_gateway_status(int is_online, const char *device_id, const char *firmware, time_t timestamp);
 
 // Query
-int db_get_history(char *output, int max_size, int limit);
-int db_get_history_filtered(char *output, int max_size, int limit, time_t from, time_t to);
+// History query. Pages are newest first and continue from a keyset cursor
+// over (timestamp, id); since_id instead returns rows newer than the
+// client's latest, oldest first.
+typedef struct {
+    int limit;              // <= 0: no limit
+    time_t from;            // 0: open
+    time_t to;              // 0: open
+    int has_cursor;
+    time_t cursor_ts;
+    long long cursor_id;
+    long long since_id;     // > 0: incremental sync, cursor ignored
+} DbHistoryQuery;
+
+// A cursor is closed on the thread that opened it. Threads that called
+// db_reader_open() run their cursors on their own read connection.
+typedef struct DbHistoryCursor DbHistoryCursor;
+DbHistoryCursor* db_history_open(const DbHistoryQuery *q);
+int db_history_next(DbHistoryCursor *cur, char *buf, size_t max);  // bytes of one JSON row, 0 at end, -1 on error
+int db_history_rows(const DbHistoryCursor *cur);
+long long db_history_max_id(const DbHistoryCursor *cur);
+int db_history_cursor(const DbHistoryCursor *cur, char *buf, size_t max);  // 1 if a next page may exist
+int db_history_parse_cursor(const char *token, DbHistoryQuery *q);
+void db_history_close(DbHistoryCursor *cur);
 int db_get_pump_history(int pump_id, char *output, int max_size, int limit);
 
-// Cleanup
-int db_cleanup_old_records(int days);
+// Per-thread read connection for history cursors; close before db_close()
+int db_reader_open();
+void db_reader_close();
 
 // Global
 extern sqlite3 *db;
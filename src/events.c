@@ -0,0 +1,279 @@
+#include "events.h"
+#include "registry.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EVENTS_MASK         (EVENTS_JOURNAL_SIZE - 1)
+#define EVENTS_KEY_SLOTS    (EVENTS_JOURNAL_SIZE * 2)
+
+#define EVENT_PUMP      1
+#define EVENT_GATEWAY   2
+
+typedef struct {
+    int type;
+    char device_id[64];
+    int pump_id;
+    uint32_t hash;
+    const char *event;
+    int data_off;           // JSON body inside frame
+    int data_len;
+    int len;
+    char frame[EVENTS_FRAME_MAX];
+} JournalEntry;
+
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+static JournalEntry journal[EVENTS_JOURNAL_SIZE];
+static unsigned long long events_seq = 0;       // last published
+static unsigned long long events_base = 0;      // nothing at or before this was ever in the journal
+static unsigned long long events_published = 0;
+static unsigned long long events_coalesced = 0;
+static void (*events_listeners[EVENTS_MAX_LISTENERS])(unsigned long long seq);
+
+// Read scratch, only used under events_lock
+static uint16_t key_slots[EVENTS_KEY_SLOTS];
+static unsigned char keep[EVENTS_JOURNAL_SIZE];
+
+// When a plain heartbeat may next refresh last_seen, by registry gateway slot
+static time_t gw_next_refresh[REGISTRY_MAX_GATEWAYS];
+
+static uint32_t key_hash(int type, const char *device_id, int pump_id) {
+    uint32_t h = 2166136261u ^ (uint32_t)type;
+    for (const char *c = device_id; *c; c++) {
+        h = (h ^ (unsigned char)*c) * 16777619u;
+    }
+    return (h ^ (uint32_t)pump_id) * 16777619u;
+}
+
+void events_init() {
+    pthread_mutex_lock(&events_lock);
+    events_seq = (unsigned long long)time(NULL) * 1000000ull;
+    events_base = events_seq;
+    pthread_mutex_unlock(&events_lock);
+}
+
+unsigned long long events_head() {
+    pthread_mutex_lock(&events_lock);
+    unsigned long long seq = events_seq;
+    pthread_mutex_unlock(&events_lock);
+    return seq;
+}
+
+int events_add_listener(void (*fn)(unsigned long long seq)) {
+    pthread_mutex_lock(&events_lock);
+    for (int i = 0; i < EVENTS_MAX_LISTENERS; i++) {
+        if (!events_listeners[i]) {
+            events_listeners[i] = fn;
+            pthread_mutex_unlock(&events_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&events_lock);
+    return -1;
+}
+
+void events_remove_listener(void (*fn)(unsigned long long seq)) {
+    pthread_mutex_lock(&events_lock);
+    for (int i = 0; i < EVENTS_MAX_LISTENERS; i++) {
+        if (events_listeners[i] == fn) events_listeners[i] = NULL;
+    }
+    pthread_mutex_unlock(&events_lock);
+}
+
+// Listeners run on the publishing thread, outside events_lock
+static void notify(unsigned long long seq) {
+    void (*fns[EVENTS_MAX_LISTENERS])(unsigned long long);
+    
+    pthread_mutex_lock(&events_lock);
+    memcpy(fns, events_listeners, sizeof(fns));
+    pthread_mutex_unlock(&events_lock);
+    
+    for (int i = 0; i < EVENTS_MAX_LISTENERS; i++) {
+        if (fns[i]) fns[i](seq);
+    }
+}
+
+// Caller holds events_lock. data is the JSON body of the frame.
+static unsigned long long journal_append(int type, const char *device_id, int pump_id, const char *event, const char *data) {
+    unsigned long long seq = ++events_seq;
+    JournalEntry *e = &journal[seq & EVENTS_MASK];
+    
+    e->type = type;
+    snprintf(e->device_id, sizeof(e->device_id), "%s", device_id);
+    e->pump_id = pump_id;
+    e->hash = key_hash(type, e->device_id, pump_id);
+    e->event = event;
+    e->data_off = snprintf(e->frame, sizeof(e->frame), "id: %llu\nevent: %s\ndata: ", seq, event);
+    e->len = e->data_off + snprintf(e->frame + e->data_off, sizeof(e->frame) - e->data_off, "%s\n\n", data);
+    if (e->len >= (int)sizeof(e->frame)) e->len = sizeof(e->frame) - 1;
+    e->data_len = e->len - e->data_off - 2;
+    
+    events_published++;
+    return seq;
+}
+
+void events_pump(const PumpStatus *p) {
+    char data[320];
+    snprintf(data, sizeof(data),
+             "{\"device_id\":\"%s\",\"pump_id\":%d,\"command\":%d,\"status\":%d,\"busy\":%d,\"alarm\":%d,\"timestamp\":%ld}",
+             p->device_id, p->pump_id, p->command, p->status, p->busy, p->alarm, p->timestamp);
+    
+    pthread_mutex_lock(&events_lock);
+    unsigned long long seq = journal_append(EVENT_PUMP, p->device_id, p->pump_id, "pump", data);
+    pthread_mutex_unlock(&events_lock);
+    
+    notify(seq);
+}
+
+static int gateway_json(const GatewayHardwareStatus *gw, char *buf, size_t max) {
+    return snprintf(buf, max, "{\"status\":%d,\"is_online\":%d,\"device_id\":\"%s\",\"firmware\":\"%s\",\"last_seen\":%ld}",
+                    gw->gateway_reported_status, gw->is_online, gw->device_id, gw->firmware_version, gw->last_seen_at);
+}
+
+char* events_render_gateways(const char *device_id, size_t *len_out) {
+    size_t cap = 4096;
+    size_t len = 0;
+    char *buf = malloc(cap);
+    if (!buf) return NULL;
+    
+    int gw, end, count = 0;
+    if (device_id) {
+        gw = registry_find_gateway(device_id);
+        end = gw < 0 ? gw : gw + 1;
+    } else {
+        gw = 0;
+        end = registry_gateway_count();
+    }
+    
+    len = snprintf(buf, cap, "{\"gateways\":[");
+    
+    for (; gw < end; gw++) {
+        GatewayHardwareStatus g;
+        if (registry_read_gateway(gw, &g) != 0) continue;
+        
+        // Room for one gateway plus the closing "],"count":N}"
+        if (cap - len < 256) {
+            cap *= 2;
+            char *grown = realloc(buf, cap);
+            if (!grown) {
+                free(buf);
+                return NULL;
+            }
+            buf = grown;
+        }
+        if (count > 0) buf[len++] = ',';
+        len += gateway_json(&g, buf + len, cap - len);
+        count++;
+    }
+    
+    len += snprintf(buf + len, cap - len, "],\"count\":%d}", count);
+    if (len_out) *len_out = len;
+    return buf;
+}
+
+void events_gateway(const GatewayHardwareStatus *gw, int changed) {
+    time_t now = time(NULL);
+    int slot = registry_find_gateway(gw->device_id);
+    if (slot < 0 || slot >= REGISTRY_MAX_GATEWAYS) return;
+    
+    char data[256];
+    gateway_json(gw, data, sizeof(data));
+    unsigned long long seq = 0;
+    
+    pthread_mutex_lock(&events_lock);
+    if (changed || now >= gw_next_refresh[slot]) {
+        gw_next_refresh[slot] = now + EVENTS_HEARTBEAT_S;
+        seq = journal_append(EVENT_GATEWAY, gw->device_id, 0, "gateway", data);
+    }
+    pthread_mutex_unlock(&events_lock);
+    
+    if (seq) notify(seq);
+}
+
+int events_scan(unsigned long long after, unsigned long long until, const char *device_id,
+                EventsVisitor fn, void *arg, unsigned long long *next) {
+    pthread_mutex_lock(&events_lock);
+    
+    unsigned long long head = (until && until < events_seq) ? until : events_seq;
+    unsigned long long tail = events_seq > events_base + EVENTS_JOURNAL_SIZE ? events_seq - EVENTS_JOURNAL_SIZE : events_base;
+    if (after < tail || after > head) {
+        pthread_mutex_unlock(&events_lock);
+        return -1;
+    }
+    
+    // Newest first: the first frame seen for a key is its current value and
+    // every older one for the same key is superseded
+    memset(key_slots, 0, sizeof(key_slots));
+    for (unsigned long long seq = head; seq > after; seq--) {
+        JournalEntry *e = &journal[seq & EVENTS_MASK];
+        int idx = (int)(seq & EVENTS_MASK);
+        keep[idx] = 0;
+        
+        if (device_id && strcmp(e->device_id, device_id) != 0) continue;
+        
+        uint32_t h = e->hash & (EVENTS_KEY_SLOTS - 1);
+        int superseded = 0;
+        while (key_slots[h]) {
+            JournalEntry *k = &journal[key_slots[h] - 1];
+            if (k->hash == e->hash && k->type == e->type && k->pump_id == e->pump_id &&
+                strcmp(k->device_id, e->device_id) == 0) {
+                superseded = 1;
+                break;
+            }
+            h = (h + 1) & (EVENTS_KEY_SLOTS - 1);
+        }
+        if (superseded) {
+            events_coalesced++;
+            continue;
+        }
+        key_slots[h] = (uint16_t)(idx + 1);
+        keep[idx] = 1;
+    }
+    
+    int visited = 0;
+    unsigned long long last = after;
+    for (unsigned long long seq = after + 1; seq <= head; seq++) {
+        JournalEntry *e = &journal[seq & EVENTS_MASK];
+        if (keep[seq & EVENTS_MASK]) {
+            if (fn(arg, seq, e->event, e->frame + e->data_off, e->data_len, e->frame, e->len) != 0) break;
+            visited++;
+        }
+        last = seq;
+    }
+    
+    pthread_mutex_unlock(&events_lock);
+    
+    *next = last;
+    return visited;
+}
+
+typedef struct {
+    char *buf;
+    size_t max;
+    size_t len;
+} ReadBuf;
+
+static int copy_frame(void *arg, unsigned long long seq, const char *event, const char *data, int data_len,
+                      const char *frame, int frame_len) {
+    ReadBuf *rb = arg;
+    if (rb->len + frame_len > rb->max) return 1;
+    memcpy(rb->buf + rb->len, frame, frame_len);
+    rb->len += frame_len;
+    return 0;
+}
+
+int events_read(unsigned long long after, const char *device_id, char *buf, size_t max, unsigned long long *next) {
+    ReadBuf rb = {buf, max, 0};
+    if (events_scan(after, 0, device_id, copy_frame, &rb, next) < 0) return -1;
+    return (int)rb.len;
+}
+
+void events_get_stats(EventsStats *out) {
+    pthread_mutex_lock(&events_lock);
+    out->seq = events_seq;
+    out->published = events_published;
+    out->coalesced = events_coalesced;
+    pthread_mutex_unlock(&events_lock);
+}
@@ -0,0 +1,64 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include "shared.h"
+#include <stddef.h>
+#include <time.h>
+
+// Change journal behind /api/events. Every pump or gateway change becomes one
+// pre-rendered SSE frame in a ring; each client only remembers the last
+// sequence number it sent, so a publish costs the same for 1 or 200 clients.
+#define EVENTS_JOURNAL_SIZE     4096            // power of two
+#define EVENTS_FRAME_MAX        384
+#define EVENTS_CLIENT_BUFFER    (64 * 1024)     // most one client is handed per fill
+#define EVENTS_MAX_CLIENTS      256
+#define EVENTS_HEARTBEAT_S      15
+#define EVENTS_RETRY_MS         2000            // EventSource reconnect delay
+#define EVENTS_MAX_LISTENERS    4
+
+typedef struct {
+    unsigned long long seq;
+    unsigned long long published;
+    unsigned long long coalesced;   // frames skipped because a newer one for the same key followed
+} EventsStats;
+
+// Sequence numbers start from the wall clock so a Last-Event-ID from before
+// a restart is never mistaken for one of ours
+void events_init();
+
+// Publish from the state writers (shared.c), after `lock` is released
+void events_pump(const PumpStatus *p);
+// One frame per gateway, keyed by its device_id: on every change, and for a
+// plain heartbeat (changed 0) at most every EVENTS_HEARTBEAT_S to refresh last_seen
+void events_gateway(const GatewayHardwareStatus *gw, int changed);
+
+unsigned long long events_head();
+
+// {"gateways":[...],"count":N} for GET /api/gateway/status, every entry the
+// same JSON as a gateway frame; only device_id's when not NULL. Returns a
+// malloc'd string; caller frees.
+char* events_render_gateways(const char *device_id, size_t *len_out);
+
+// Frames after `after`, oldest first, only the newest one per pump and per
+// gateway; device_id NULL means all gateways. Stops before max bytes.
+// *next is where to continue from. Returns bytes, or -1 if `after` already
+// fell out of the journal and the client needs a full snapshot.
+int events_read(unsigned long long after, const char *device_id, char *buf, size_t max, unsigned long long *next);
+
+// Same selection as events_read, handed over one frame at a time: event is
+// "pump" or "gateway", data the JSON body, frame the full SSE text. Runs
+// under the journal lock, so fn must not publish. A non-zero return stops
+// before that frame (it is not counted in *next). until, when not 0, stops
+// the scan at that sequence number. Returns frames visited or -1.
+typedef int (*EventsVisitor)(void *arg, unsigned long long seq, const char *event, const char *data, int data_len,
+                             const char *frame, int frame_len);
+int events_scan(unsigned long long after, unsigned long long until, const char *device_id,
+                EventsVisitor fn, void *arg, unsigned long long *next);
+
+// Called after every publish on the publishing thread, outside the journal lock
+int events_add_listener(void (*fn)(unsigned long long seq));
+void events_remove_listener(void (*fn)(unsigned long long seq));
+
+void events_get_stats(EventsStats *out);
+
+#endif
@@ -1,21 +1,58 @@
 #include "http_api.h"
-#include "mqtt.h"
 #include "shared.h"
 #include "db.h"
+#include "registry.h"
+#include "ingest.h"
+#include "rollup.h"
+#include "archive.h"
+#include "events.h"
+#include "ws.h"
+#include "offload.h"
+#include "commands.h"
+#include "mqtt.h"
+#include "respcache.h"
+#include "compress.h"
+#include "static_files.h"
+#include "arena.h"
+#include "router.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <microhttpd.h>
 #include <unistd.h>
 #include <json-c/json.h>
 
+static HttpConfig http_cfg;
+
 // Structure to store query params
 typedef struct {
     const char *limit_str;
     const char *from_str;
     const char *to_str;
+    const char *cursor_str;
+    const char *since_str;
 } QueryParams;
 
+// Route metadata (api_routes[] below)
+#define ROUTE_CACHEABLE     0x1     // conditional GET: If-None-Match is read, a 200 carries the ETag
+#define ROUTE_STREAMING     0x2     // the body comes from a content reader, compressed on the fly
+#define ROUTE_SLOW          0x4     // ... and that reader runs on the slow pool
+
+// One request as a route handler sees it
+typedef struct {
+    struct MHD_Connection *connection;
+    const char *url;
+    void **con_cls;
+    const RouteParams *params;      // from the path, e.g. {device_id}
+    struct json_object *body;       // POST: the parsed JSON, owned by the request
+    const char *if_none_match;      // ROUTE_CACHEABLE only
+    int encoding;                   // COMPRESS_NONE once a stream can't be compressed
+    int flags;
+    char etag[RESPCACHE_ETAG_MAX];
+} HttpRequest;
+
 // Iterator callback to collect query parameters
 static enum MHD_Result get_query_iterator(void *cls, enum MHD_ValueKind kind,
                                           const char *key, const char *value) {
@@ -30,122 +67,1146 @@ static enum MHD_Result get_query_iterator(void *cls, enum MHD_ValueKind kind,
     } else if (strcmp(key, "to") == 0) {
         params->to_str = value;
         printf("[PARSE] ✅ to=%s\n", value);
+    } else if (strcmp(key, "cursor") == 0) {
+        params->cursor_str = value;
+    } else if (strcmp(key, "since_id") == 0) {
+        params->since_str = value;
     }
     
     return MHD_YES;
 }
 
-char* handle_pump_control(const char *payload) {
-    printf("[API] Control: %s\n", payload);
-    
-    MQTTClient_message msg = MQTTClient_message_initializer;
-    msg.payload = (void*)payload;
-    msg.payloadlen = strlen(payload);
-    msg.qos = 1;
-    msg.retained = 0;
+// WebSocket "cmd": same pipeline as POST /api/pump/control; the ack carries
+// the command ID and the state change itself comes back as a "pump" frame
+static long long ws_command(const char *device_id, int pump_id, int state) {
+    printf("[API] WS control: %s/Pump%d -> %d\n", device_id, pump_id, state);
+    return commands_submit(device_id, pump_id, state);
+}
+
+// Queues the command and answers 202 at once; progress is at /api/commands/{id}
+char* handle_pump_control(struct json_object *parsed, int *status) {
+    struct json_object *pump_id_obj, *device_id_obj, *state_obj;
+    char device_id[64] = DEFAULT_GATEWAY_ID;
+    int pump_id = 0;
+    int state = -1;
     
-    int rc = MQTTClient_publishMessage(mqtt_sub_client, "pump/control", &msg, NULL);
+    if (json_object_object_get_ex(parsed, "device_id", &device_id_obj)) {
+        snprintf(device_id, sizeof(device_id), "%s", json_object_get_string(device_id_obj));
+    }
+    if (json_object_object_get_ex(parsed, "pump_id", &pump_id_obj)) {
+        pump_id = json_object_get_int(pump_id_obj);
+    }
+    if (json_object_object_get_ex(parsed, "state", &state_obj)) {
+        state = json_object_get_int(state_obj);
+    }
     
-    if (rc != MQTTCLIENT_SUCCESS) {
-        return strdup("{\"status\":\"error\"}");
+    if (pump_id < 1 || (state != 0 && state != 1) || !registry_valid_device_id(device_id)) {
+        *status = 400;
+        return strdup("{\"status\":\"error\",\"error\":\"Invalid device_id, pump_id or state\"}");
     }
     
-    usleep(100000);
+    long long id = commands_submit(device_id, pump_id, state);
+    if (id < 0) {
+        *status = 503;
+        return strdup("{\"status\":\"error\",\"error\":\"Too many pending commands\"}");
+    }
     
-    pthread_mutex_lock(&lock);
-    static char response[1024];
+    char response[256];
     snprintf(response, sizeof(response),
-             "{\"status\":\"sent\",\"current_state\":{\"pump1\":%d,\"pump2\":%d}}",
-             current_pump_status.pump1, current_pump_status.pump2);
-    pthread_mutex_unlock(&lock);
+             "{\"status\":\"accepted\",\"command_id\":%lld,\"location\":\"/api/commands/%lld\"}", id, id);
     
+    *status = 202;
     return strdup(response);
 }
 
-int handle_pump_feedback(const char *payload) {
-    printf("[API] Feedback: %s\n", payload);
+// Body: [{"device_id":"site-1","pump_id":1,"state":0}, ...] or {"commands":[...]}.
+// Validated as a whole and queued in one step: either every command gets
+// an ID (202) or none does (400 / 503).
+char* handle_pump_control_batch(struct json_object *parsed, int *status) {
+    struct json_object *list = parsed;
+    if (json_object_is_type(parsed, json_type_object)) json_object_object_get_ex(parsed, "commands", &list);
+    if (!list || !json_object_is_type(list, json_type_array)) {
+        *status = 400;
+        return strdup("{\"status\":\"error\",\"error\":\"Expected an array of commands\"}");
+    }
+    
+    int n = (int)json_object_array_length(list);
+    if (n < 1 || n > COMMANDS_BATCH_MAX) {
+        char response[128];
+        snprintf(response, sizeof(response), "{\"status\":\"error\",\"error\":\"Between 1 and %d commands\"}", COMMANDS_BATCH_MAX);
+        *status = 400;
+        return strdup(response);
+    }
+    
+    CommandRequest *reqs = malloc(n * sizeof(*reqs));
+    long long *ids = malloc(n * sizeof(*ids));
+    int *stages = malloc(n * sizeof(*stages));
+    char *response = NULL;
+    if (!reqs || !ids || !stages) {
+        *status = 500;
+        response = strdup("{\"status\":\"error\",\"error\":\"Out of memory\"}");
+        goto out;
+    }
+    
+    for (int i = 0; i < n; i++) {
+        struct json_object *cmd = json_object_array_get_idx(list, i);
+        struct json_object *obj;
+        CommandRequest *r = &reqs[i];
+        snprintf(r->device_id, sizeof(r->device_id), "%s", DEFAULT_GATEWAY_ID);
+        r->pump_id = 0;
+        r->state = -1;
+        
+        if (json_object_is_type(cmd, json_type_object)) {
+            if (json_object_object_get_ex(cmd, "device_id", &obj)) {
+                snprintf(r->device_id, sizeof(r->device_id), "%s", json_object_get_string(obj));
+            }
+            if (json_object_object_get_ex(cmd, "pump_id", &obj)) r->pump_id = json_object_get_int(obj);
+            if (json_object_object_get_ex(cmd, "state", &obj)) r->state = json_object_get_int(obj);
+        }
+        
+        if (r->pump_id < 1 || (r->state != 0 && r->state != 1) || !registry_valid_device_id(r->device_id)) {
+            char err[128];
+            snprintf(err, sizeof(err), "{\"status\":\"error\",\"error\":\"Invalid device_id, pump_id or state\",\"index\":%d}", i);
+            *status = 400;
+            response = strdup(err);
+            goto out;
+        }
+    }
     
-    struct json_object *parsed = json_tokener_parse(payload);
-    if (!parsed) return 400;
+    if (commands_submit_batch(reqs, n, ids, stages) != 0) {
+        *status = 503;
+        response = strdup("{\"status\":\"error\",\"error\":\"Too many pending commands\"}");
+        goto out;
+    }
     
-    struct json_object *pump_id_obj, *status_obj;
+    // In request order; a later command for the same pump supersedes an earlier one
+    size_t max = 64 + (size_t)n * 64;
+    response = malloc(max);
+    if (!response) {
+        *status = 500;
+        response = strdup("{\"status\":\"error\",\"error\":\"Out of memory\"}");
+        goto out;
+    }
+    size_t len = snprintf(response, max, "{\"status\":\"accepted\",\"count\":%d,\"commands\":[", n);
+    for (int i = 0; i < n; i++) {
+        len += snprintf(response + len, max - len, "%s{\"command_id\":%lld,\"status\":\"%s\"}",
+                        i ? "," : "", ids[i], commands_stage_name(stages[i]));
+    }
+    snprintf(response + len, max - len, "]}");
+    *status = 202;
+    
+out:
+    free(reqs);
+    free(ids);
+    free(stages);
+    return response;
+}
+
+int handle_pump_feedback(struct json_object *parsed) {
+    struct json_object *pump_id_obj, *status_obj, *device_id_obj;
+    const char *device_id = NULL;
+    
+    if (json_object_object_get_ex(parsed, "device_id", &device_id_obj)) {
+        device_id = json_object_get_string(device_id_obj);
+    }
     
     if (json_object_object_get_ex(parsed, "pump_id", &pump_id_obj) &&
         json_object_object_get_ex(parsed, "status", &status_obj)) {
         
-        int pump_id = json_object_get_int(pump_id_obj);
-        int status = json_object_get_int(status_obj);
+        IngestEvent ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.type = INGEST_FEEDBACK;
+        ev.pump_id = json_object_get_int(pump_id_obj);
+        ev.value = json_object_get_int(status_obj);
+        ev.busy = -1;
+        ev.alarm = -1;
+        if (device_id) snprintf(ev.device_id, sizeof(ev.device_id), "%s", device_id);
         
-        update_pump_feedback(pump_id, status);
-        json_object_put(parsed);
-        return 200;
+        // Same path as MQTT feedback; the worker applies and persists it
+        return ingest_push(&ev) == 0 ? 200 : 503;
     }
     
-    json_object_put(parsed);
     return 400;
 }
 
-char* handle_gateway_status() {
-    pthread_mutex_lock(&lock);
+// ===== POST BODIES =====
+// One arena per request holds this state. Each upload chunk goes straight to
+// an incremental tokener, so a large body is parsed while it arrives and
+// never copied or rescanned; only its first POST_LOG_BYTES are kept, for the
+// log line. request_completed() releases the arena in one step however the
+// request ended.
+#define POST_LOG_BYTES      256
+
+typedef struct {
+    Arena arena;                    // this struct is its first allocation
+    struct json_tokener *tok;
+    struct json_object *parsed;     // once the tokener has a complete value
+    size_t len;                     // body bytes so far
+    int status;                     // 0, or 400 / 413 once the body is refused
+    char log_head[POST_LOG_BYTES + 1];
+} PostRequest;
+
+static PostRequest* post_request_new() {
+    Arena arena;
+    arena_init(&arena, ARENA_BLOCK_SIZE);
     
-    time_t now = time(NULL);
-    long seconds_since_last_seen = now - gateway_hw_status.last_seen_at;
-    int is_online = (seconds_since_last_seen < 30) && gateway_hw_status.is_online;
+    PostRequest *pr = arena_alloc(&arena, sizeof(*pr));
+    struct json_tokener *tok = pr ? json_tokener_new() : NULL;
+    if (!tok) {
+        arena_free(&arena);
+        return NULL;
+    }
     
-    static char response[1024];
-    snprintf(response, sizeof(response),
-             "{\"status\":%d,\"is_online\":%d,\"device_id\":\"%s\",\"firmware\":\"%s\",\"last_seen\":%ld}",
-             gateway_hw_status.gateway_reported_status,  
-             is_online,                                  
-             gateway_hw_status.device_id,
-             gateway_hw_status.firmware_version, 
-             gateway_hw_status.last_seen_at);
-    
-    pthread_mutex_unlock(&lock);
-    return strdup(response);
+    memset(pr, 0, sizeof(*pr));
+    pr->arena = arena;
+    pr->tok = tok;
+    return pr;
+}
+
+static void post_request_free(PostRequest *pr) {
+    if (pr->parsed) json_object_put(pr->parsed);
+    json_tokener_free(pr->tok);
+    arena_free(&pr->arena);
+}
+
+static int only_whitespace(const char *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] != ' ' && p[i] != '\t' && p[i] != '\r' && p[i] != '\n') return 0;
+    }
+    return 1;
+}
+
+// Over the limit or malformed: the rest of the upload is drained unread
+static void post_request_feed(PostRequest *pr, const char *data, size_t size) {
+    if (pr->status) return;
+    if (pr->len + size > (size_t)http_cfg.post_max_bytes) {
+        pr->status = 413;
+        return;
+    }
+    
+    if (pr->len < POST_LOG_BYTES) {
+        size_t n = size < POST_LOG_BYTES - pr->len ? size : POST_LOG_BYTES - pr->len;
+        memcpy(pr->log_head + pr->len, data, n);
+        pr->log_head[pr->len + n] = '\0';
+    }
+    pr->len += size;
+    
+    // Anything but whitespace after the value is an error
+    if (pr->parsed) {
+        if (!only_whitespace(data, size)) pr->status = 400;
+        return;
+    }
+    
+    pr->parsed = json_tokener_parse_ex(pr->tok, data, (int)size);
+    if (pr->parsed) {
+        size_t end = json_tokener_get_parse_end(pr->tok);
+        if (!only_whitespace(data + end, size - end)) pr->status = 400;
+    } else if (json_tokener_get_error(pr->tok) != json_tokener_continue) {
+        pr->status = 400;
+    }
+}
+
+// End of upload: a bare top-level number only ends at end of input
+static void post_request_finish(PostRequest *pr) {
+    if (pr->status || pr->parsed) return;
+    
+    pr->parsed = json_tokener_parse_ex(pr->tok, "", 1);
+    if (!pr->parsed) pr->status = 400;
+}
+
+// device_id narrows the listing to one gateway; entries are rendered the
+// same as the gateway frames on /api/events
+char* handle_gateway_status(const char *device_id) {
+    char *response = events_render_gateways(device_id, NULL);
+    if (!response) {
+        return strdup("{\"error\":\"Out of memory\"}");
+    }
+    
+    return response;
+}
+
+// ===== SERVER-SENT EVENTS =====
+// /api/events: a snapshot on connect, then journal frames as they are
+// published. With nothing to send the connection is suspended, so an idle
+// dashboard costs no requests and no CPU; publishes and heartbeats resume it.
+typedef struct SseStream {
+    struct MHD_Connection *connection;
+    char device_id[64];             // "" = all gateways
+    unsigned long long seq;         // last journal frame handed out
+    int need_snapshot;
+    int heartbeat;                  // under sse_lock
+    int suspended;                  // under sse_lock
+    int closing;                    // under sse_lock
+    char *out;                      // buf, or a malloc'd snapshot
+    size_t out_len;
+    size_t out_off;
+    struct SseStream *next;
+    char buf[EVENTS_CLIENT_BUFFER];
+} SseStream;
+
+static pthread_mutex_t sse_lock = PTHREAD_MUTEX_INITIALIZER;
+static SseStream *sse_streams = NULL;
+static int sse_clients = 0;
+static int sse_stopping = 0;
+static unsigned long long sse_resyncs = 0;
+static unsigned long long sse_heartbeats = 0;
+
+static void sse_get_stats(int *clients, int *suspended, unsigned long long *resyncs, unsigned long long *heartbeats) {
+    pthread_mutex_lock(&sse_lock);
+    *clients = sse_clients;
+    *suspended = 0;
+    for (SseStream *s = sse_streams; s; s = s->next) {
+        *suspended += s->suspended;
+    }
+    *resyncs = sse_resyncs;
+    *heartbeats = sse_heartbeats;
+    pthread_mutex_unlock(&sse_lock);
+}
+
+// Journal listener: runs on whichever thread published
+static void sse_wake(unsigned long long seq) {
+    pthread_mutex_lock(&sse_lock);
+    if (!sse_stopping) {
+        for (SseStream *s = sse_streams; s; s = s->next) {
+            if (s->suspended) {
+                s->suspended = 0;
+                MHD_resume_connection(s->connection);
+            }
+        }
+    }
+    pthread_mutex_unlock(&sse_lock);
+}
+
+// Comment line every EVENTS_HEARTBEAT_S keeps proxies from timing the stream
+// out and lets MHD notice clients that went away while suspended
+static void sse_ping() {
+    pthread_mutex_lock(&sse_lock);
+    if (!sse_stopping) {
+        for (SseStream *s = sse_streams; s; s = s->next) {
+            s->heartbeat = 1;
+            if (s->suspended) {
+                s->suspended = 0;
+                MHD_resume_connection(s->connection);
+            }
+        }
+    }
+    pthread_mutex_unlock(&sse_lock);
+}
+
+// Before MHD_stop_daemon: end every stream, suspended ones included
+static void sse_shutdown() {
+    pthread_mutex_lock(&sse_lock);
+    sse_stopping = 1;
+    for (SseStream *s = sse_streams; s; s = s->next) {
+        s->closing = 1;
+        if (s->suspended) {
+            s->suspended = 0;
+            MHD_resume_connection(s->connection);
+        }
+    }
+    pthread_mutex_unlock(&sse_lock);
+}
+
+static void sse_release_out(SseStream *s) {
+    if (s->out && s->out != s->buf) free(s->out);
+    s->out = NULL;
+    s->out_len = 0;
+    s->out_off = 0;
+}
+
+// Full state as "pumps" and "gateways" events. The head is taken before the
+// registry is read, so a change racing with the render is replayed rather
+// than lost; replaying a frame is harmless since every frame is a full value.
+static int sse_snapshot(SseStream *s) {
+    s->seq = events_head();
+    
+    size_t pumps_len;
+    char *pumps = registry_render_json(s->device_id[0] ? s->device_id : NULL, &pumps_len);
+    char *gateway = events_render_gateways(s->device_id[0] ? s->device_id : NULL, NULL);
+    if (!pumps || !gateway) {
+        free(pumps);
+        free(gateway);
+        return -1;
+    }
+    
+    size_t cap = pumps_len + strlen(gateway) + 128;
+    char *out = malloc(cap);
+    if (!out) {
+        free(pumps);
+        free(gateway);
+        return -1;
+    }
+    
+    s->out_len = snprintf(out, cap, "retry: %d\nid: %llu\nevent: pumps\ndata: %s\n\nevent: gateways\ndata: %s\n\n",
+                          EVENTS_RETRY_MS, s->seq, pumps, gateway);
+    s->out = out;
+    s->out_off = 0;
+    s->need_snapshot = 0;
+    
+    free(pumps);
+    free(gateway);
+    return 0;
+}
+
+// Queue the next chunk. Returns 1 if there is nothing to send, -1 on error.
+static int sse_fill(SseStream *s) {
+    if (s->need_snapshot) {
+        return sse_snapshot(s);
+    }
+    
+    unsigned long long next;
+    int n = events_read(s->seq, s->device_id[0] ? s->device_id : NULL, s->buf, sizeof(s->buf), &next);
+    if (n < 0) {
+        // Fell behind the journal (or reconnected with an id we no longer have)
+        pthread_mutex_lock(&sse_lock);
+        sse_resyncs++;
+        pthread_mutex_unlock(&sse_lock);
+        return sse_snapshot(s);
+    }
+    s->seq = next;
+    if (n > 0) {
+        s->out = s->buf;
+        s->out_len = n;
+        s->out_off = 0;
+        return 0;
+    }
+    
+    pthread_mutex_lock(&sse_lock);
+    int ping = s->heartbeat;
+    s->heartbeat = 0;
+    if (ping) sse_heartbeats++;
+    pthread_mutex_unlock(&sse_lock);
+    
+    if (ping) {
+        s->out = s->buf;
+        s->out_len = snprintf(s->buf, sizeof(s->buf), ": ping\n\n");
+        s->out_off = 0;
+        return 0;
+    }
+    return 1;
+}
+
+static ssize_t sse_stream_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    SseStream *s = cls;
+    size_t out = 0;
+    
+    while (out < max) {
+        if (s->out_off < s->out_len) {
+            size_t n = s->out_len - s->out_off;
+            if (n > max - out) n = max - out;
+            memcpy(buf + out, s->out + s->out_off, n);
+            s->out_off += n;
+            out += n;
+            continue;
+        }
+        sse_release_out(s);
+        
+        pthread_mutex_lock(&sse_lock);
+        int closing = s->closing;
+        pthread_mutex_unlock(&sse_lock);
+        if (closing) {
+            return out > 0 ? (ssize_t)out : MHD_CONTENT_READER_END_OF_STREAM;
+        }
+        
+        int rc = sse_fill(s);
+        if (rc < 0) {
+            return out > 0 ? (ssize_t)out : MHD_CONTENT_READER_END_WITH_ERROR;
+        }
+        if (rc > 0) break;
+    }
+    
+    if (out > 0) return (ssize_t)out;
+    
+    // Nothing to send: park until the journal moves or a heartbeat is due.
+    // The check and the suspend happen under sse_lock, which sse_wake takes
+    // after every publish, so a frame can't slip in between unnoticed.
+    pthread_mutex_lock(&sse_lock);
+    if (events_head() == s->seq && !s->heartbeat && !s->closing) {
+        s->suspended = 1;
+        MHD_suspend_connection(s->connection);
+    }
+    pthread_mutex_unlock(&sse_lock);
+    return 0;
 }
 
-char* handle_pump_status() {
-    pthread_mutex_lock(&lock);
+static void sse_stream_free(void *cls) {
+    SseStream *s = cls;
+    
+    pthread_mutex_lock(&sse_lock);
+    for (SseStream **p = &sse_streams; *p; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+    sse_clients--;
+    pthread_mutex_unlock(&sse_lock);
+    
+    sse_release_out(s);
+    free(s);
+}
+
+// NULL with *status set when the stream can't be opened
+static struct MHD_Response* handle_events(struct MHD_Connection *connection, int *status) {
+    const char *device_id = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "device_id");
+    const char *last_id = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Last-Event-ID");
+    
+    if (device_id && !registry_valid_device_id(device_id)) {
+        *status = 400;
+        return NULL;
+    }
+    
+    SseStream *s = calloc(1, sizeof(*s));
+    if (!s) {
+        *status = 500;
+        return NULL;
+    }
+    s->connection = connection;
+    if (device_id) snprintf(s->device_id, sizeof(s->device_id), "%s", device_id);
+    
+    // EventSource sends back the last id it saw; resume from there if the journal still has it
+    if (last_id && *last_id) {
+        s->seq = strtoull(last_id, NULL, 10);
+    } else {
+        s->need_snapshot = 1;
+    }
+    
+    pthread_mutex_lock(&sse_lock);
+    if (sse_stopping || sse_clients >= EVENTS_MAX_CLIENTS) {
+        pthread_mutex_unlock(&sse_lock);
+        free(s);
+        *status = 503;
+        return NULL;
+    }
+    s->next = sse_streams;
+    sse_streams = s;
+    sse_clients++;
+    pthread_mutex_unlock(&sse_lock);
     
-    static char response[1024];
+    struct MHD_Response *response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 8 * 1024,
+                                                                      sse_stream_read, s, sse_stream_free);
+    if (!response) {
+        sse_stream_free(s);
+        *status = 500;
+        return NULL;
+    }
+    
+    printf("[API] Event stream opened (%s)\n", device_id ? device_id : "all gateways");
+    return response;
+}
+
+// ===== WEBSOCKET =====
+// libmicrohttpd answers the upgrade; after that the socket belongs to ws.c
+static void ws_release(void *handle) {
+    MHD_upgrade_action(handle, MHD_UPGRADE_ACTION_CLOSE);
+}
+
+static void ws_upgraded(void *cls, struct MHD_Connection *connection, void *con_cls,
+                        const char *extra_in, size_t extra_in_size, MHD_socket sock,
+                        struct MHD_UpgradeResponseHandle *urh) {
+    if (ws_attach(sock, extra_in, extra_in_size, ws_release, urh) != 0) {
+        MHD_upgrade_action(urh, MHD_UPGRADE_ACTION_CLOSE);
+    }
+}
+
+// NULL with *status set when the request is not a usable upgrade
+static struct MHD_Response* handle_ws(struct MHD_Connection *connection, int *status) {
+    const char *upgrade = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Upgrade");
+    const char *key = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Sec-WebSocket-Key");
+    const char *version = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Sec-WebSocket-Version");
+    
+    if (!upgrade || strcasecmp(upgrade, "websocket") != 0 || !key || strlen(key) > 64 ||
+        !version || strcmp(version, "13") != 0) {
+        *status = 400;
+        return NULL;
+    }
+    if (ws_full()) {
+        *status = 503;
+        return NULL;
+    }
+    
+    char accept[32];
+    ws_accept_key(key, accept);
+    
+    struct MHD_Response *response = MHD_create_response_for_upgrade(ws_upgraded, NULL);
+    if (!response) {
+        *status = 500;
+        return NULL;
+    }
+    MHD_add_response_header(response, "Upgrade", "websocket");
+    MHD_add_response_header(response, "Sec-WebSocket-Accept", accept);
+    
+    printf("[API] WebSocket upgrade\n");
+    return response;
+}
+
+char* handle_metrics() {
+    IngestStats st;
+    ingest_get_stats(&st);
+    
+    DbWriterStats ws;
+    db_get_writer_stats(&ws);
+    
+    ArchiveStats as;
+    archive_get_stats(&as);
+    
+    EventsStats es;
+    events_get_stats(&es);
+    
+    int sse_count, sse_parked;
+    unsigned long long resyncs, heartbeats;
+    sse_get_stats(&sse_count, &sse_parked, &resyncs, &heartbeats);
+    
+    WsStats wss;
+    ws_get_stats(&wss);
+    
+    OffloadStats os;
+    offload_get_stats(&os);
+    
+    CommandStats cs;
+    commands_get_stats(&cs);
+    
+    RespCacheStats rc;
+    respcache_get_stats(&rc);
+    
+    MqttStats ms;
+    mqtt_get_stats(&ms);
+    
+    char response[4096];
     snprintf(response, sizeof(response),
-             "{\"pump1\":%d,\"pump1_status\":%d,\"pump2\":%d,\"pump2_status\":%d,\"busy\":%d,\"alarm\":%d,\"timestamp\":%ld}",
-             current_pump_status.pump1, current_pump_status.pump1_status,
-             current_pump_status.pump2, current_pump_status.pump2_status,
-             current_pump_status.busy, current_pump_status.alarm,
-             current_pump_status.timestamp);
+             "{\"ingest\":{\"policy\":\"%s\",\"capacity\":%zu,\"depth\":%zu,\"high_water\":%zu,"
+             "\"enqueued\":%llu,\"processed\":%llu,\"dropped\":%llu,\"coalesced\":%llu,\"coalesce_pending\":%zu},"
+             "\"db_writer\":{\"batch_max\":%d,\"batch_latency_ms\":%d,\"pending\":%d,\"queued\":%llu,\"written\":%llu,"
+             "\"failed\":%llu,\"commits\":%llu,\"largest_batch\":%d,\"p99_commit_ms\":%.3f,\"max_commit_ms\":%.3f,"
+             "\"expired\":%llu,\"segments_expired\":%d,\"vacuumed_pages\":%llu,\"max_retention_step_ms\":%.3f},"
+             "\"archive\":{\"segments\":%d,\"rows\":%lld,\"bytes\":%lld},"
+             "\"events\":{\"seq\":%llu,\"published\":%llu,\"coalesced\":%llu,\"clients\":%d,\"suspended\":%d,"
+             "\"resyncs\":%llu,\"heartbeats\":%llu},"
+             "\"ws\":{\"clients\":%d,\"subscribed\":%d,\"messages_in\":%llu,\"batches\":%llu,\"deliveries\":%llu,"
+             "\"bytes_out\":%llu,\"resyncs\":%llu,\"commands\":%llu,\"commands_failed\":%llu},"
+             "\"http\":{\"threads\":%d,\"connection_limit\":%d,\"slow_threads\":%d,\"slow_streams\":%d,"
+             "\"slow_queued\":%d,\"slow_jobs\":%llu,\"slow_bytes\":%llu,\"cache_renders\":%llu,"
+             "\"cache_responses\":%llu,\"cache_bodies\":%d},"
+             "\"commands\":{\"submitted\":%llu,\"published\":%llu,\"applied\":%llu,\"confirmed\":%llu,"
+             "\"failed\":%llu,\"timeouts\":%llu,\"superseded\":%llu,\"offline\":%llu,\"local\":%llu,\"pending\":%d,\"waiters\":%d},"
+             "\"mqtt\":{\"connected\":%d,\"inflight_max\":%d,\"inflight\":%d,\"published\":%llu,\"acked\":%llu,"
+             "\"failed\":%llu,\"received\":%llu,\"reconnects\":%llu,\"connect_failures\":%llu,"
+             "\"pump_updates\":%llu,\"full_status\":%llu,\"echoes\":%llu,"
+             "\"outbox\":{\"depth\":%d,\"unsent\":%d,\"capacity\":%d,\"bytes\":%lld,\"queued\":%llu,"
+             "\"dropped\":%llu,\"expired\":%llu}}}",
+             ingest_policy_name(st.policy), st.capacity, st.depth, st.high_water,
+             st.enqueued, st.processed, st.dropped, st.coalesced, st.coalesce_pending,
+             ws.batch_max, ws.batch_latency_ms, ws.pending, ws.queued, ws.written,
+             ws.failed, ws.commits, ws.largest_batch, ws.p99_commit_ms, ws.max_commit_ms,
+             ws.expired, ws.segments_expired, ws.vacuumed_pages, ws.max_retention_step_ms,
+             as.segments, as.rows, as.bytes,
+             es.seq, es.published, es.coalesced, sse_count, sse_parked, resyncs, heartbeats,
+             wss.clients, wss.subscribed, wss.messages_in, wss.batches, wss.deliveries,
+             wss.bytes_out, wss.resyncs, wss.commands, wss.commands_failed,
+             http_cfg.threads, http_cfg.connection_limit, os.threads, os.streams,
+             os.queued, os.jobs, os.bytes, rc.renders,
+             rc.responses, rc.bodies,
+             cs.submitted, cs.published, cs.applied, cs.confirmed,
+             cs.failed, cs.timeouts, cs.superseded, cs.offline, cs.local, cs.pending, cs.waiters,
+             ms.connected, ms.inflight_max, ms.inflight, ms.published, ms.acked,
+             ms.failed, ms.received, ms.reconnects, ms.connect_failures,
+             ms.pump_updates, ms.full_status, ms.echoes,
+             ms.outbox_depth, ms.outbox_unsent, ms.outbox_max, ms.outbox_bytes, ms.outbox_queued,
+             ms.outbox_dropped, ms.outbox_expired);
     
-    pthread_mutex_unlock(&lock);
     return strdup(response);
 }
 
-char* handle_pump_history(struct MHD_Connection *connection) {
-    static char response[512000];
+// device_id narrows the listing to one gateway
+char* handle_pump_status(const char *device_id) {
+    char *response = registry_render_json(device_id, NULL);
+    if (!response) {
+        return strdup("{\"error\":\"Out of memory\"}");
+    }
+    
+    return response;
+}
+
+// ===== COMMAND STATUS =====
+// GET /api/commands/{id}[?wait=ms[&until=applied|published|confirmed]]. A
+// wait parks the connection (suspended, no thread held) until the command
+// gets there or the time is up; the handler then runs again and answers.
+static int command_parked;
+
+static void command_park(void *connection) {
+    MHD_suspend_connection(connection);
+}
+
+static void command_wake(void *connection) {
+    MHD_resume_connection(connection);
+}
+
+// NULL response_data means the connection was parked
+static char* handle_command_status(HttpRequest *req, int *status) {
+    struct MHD_Connection *connection = req->connection;
+    long long id = route_param_int(req->params, "id", 0);
+    if (id <= 0) {
+        *status = 404;
+        return strdup("{\"error\":\"Unknown command\"}");
+    }
+    
+    if (*req->con_cls == NULL) {
+        const char *wait_str = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "wait");
+        const char *until_str = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "until");
+        int until = until_str ? commands_stage_from_name(until_str) : COMMAND_CONFIRMED;
+        if (until < 0) {
+            *status = 400;
+            return strdup("{\"error\":\"until must be applied, published or confirmed\"}");
+        }
+        
+        if (wait_str && commands_wait(id, until, atoi(wait_str), connection)) {
+            *req->con_cls = &command_parked;
+            return NULL;
+        }
+    }
+    
+    char buf[512];
+    if (commands_render_json(id, buf, sizeof(buf)) < 0) {
+        *status = 404;
+        return strdup("{\"error\":\"Unknown command\"}");
+    }
+    return strdup(buf);
+}
+
+// ===== STREAMED RESPONSES =====
+// Rollup and history bodies: compressed on the fly when the client takes
+// gzip/deflate, and for ROUTE_SLOW routes offloaded, so the query and the
+// compression both run on the pool thread. req->encoding comes back
+// COMPRESS_NONE if the compressor could not be set up.
+static struct MHD_Response* stream_response(HttpRequest *req, MHD_ContentReaderCallback reader,
+                                            void *cls, MHD_ContentReaderFreeCallback free_cb) {
+    if (req->encoding != COMPRESS_NONE && compress_stream_wrap(req->encoding, &reader, &cls, &free_cb) != 0) {
+        req->encoding = COMPRESS_NONE;
+    }
+    
+    struct MHD_Response *response;
+    if (req->flags & ROUTE_SLOW) {
+        response = offload_response(req->connection, reader, cls, free_cb);
+    } else {
+        response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, OFFLOAD_CHUNK, reader, cls, free_cb);
+        if (!response) free_cb(cls);
+    }
+    if (response) {
+        MHD_add_response_header(response, "Vary", "Accept-Encoding");
+        if (req->encoding != COMPRESS_NONE) MHD_add_response_header(response, "Content-Encoding", compress_name(req->encoding));
+    }
+    return response;
+}
+
+// Rendered on the slow pool: a year of hour buckets is a real query
+typedef struct {
+    int level;
+    time_t from;
+    time_t to;
+    char device_id[64];
+    int has_device;
+    int pump_id;
+    char *json;
+    size_t len;
+    size_t off;
+} RollupStream;
+
+static ssize_t rollup_stream_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    RollupStream *rs = cls;
+    
+    if (!rs->json) {
+        rs->json = rollup_render_json(rs->level, rs->from, rs->to, rs->has_device ? rs->device_id : NULL,
+                                      rs->pump_id, &rs->len);
+        if (!rs->json) {
+            rs->json = strdup("{\"error\":\"Database failed\"}");
+            if (!rs->json) return MHD_CONTENT_READER_END_WITH_ERROR;
+            rs->len = strlen(rs->json);
+        }
+    }
+    if (rs->off == rs->len) return MHD_CONTENT_READER_END_OF_STREAM;
+    
+    size_t n = rs->len - rs->off;
+    if (n > max) n = max;
+    memcpy(buf, rs->json + rs->off, n);
+    rs->off += n;
+    return (ssize_t)n;
+}
+
+static void rollup_stream_free(void *cls) {
+    RollupStream *rs = cls;
+    free(rs->json);
+    free(rs);
+}
+
+// Path parameters ({device_id}, {pump_id}) take the place of the query ones
+static struct MHD_Response* handle_pump_rollup(HttpRequest *req, int *bad_request) {
+    struct MHD_Connection *connection = req->connection;
+    const char *bucket = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "bucket");
+    const char *from_str = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "from");
+    const char *to_str = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "to");
+    const char *device_id = route_param(req->params, "device_id");
+    const char *pump_str = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "pump_id");
+    if (!device_id) device_id = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "device_id");
     
+    int level = rollup_level_from_name(bucket ? bucket : "hour");
+    if (level < 0) {
+        *bad_request = 1;
+        return NULL;
+    }
+    
+    RollupStream *rs = calloc(1, sizeof(*rs));
+    if (!rs) return NULL;
+    
+    // Default window: the last 1440 buckets (a day of minutes, 60 days of hours, ...)
+    rs->level = level;
+    rs->to = to_str ? (time_t)atoll(to_str) : time(NULL) + 1;
+    rs->from = from_str ? (time_t)atoll(from_str) : rs->to - 1440L * rollup_level_seconds(level);
+    rs->pump_id = (int)route_param_int(req->params, "pump_id", pump_str ? atoi(pump_str) : 0);
+    if (device_id) {
+        snprintf(rs->device_id, sizeof(rs->device_id), "%s", device_id);
+        rs->has_device = 1;
+    }
+    
+    printf("[API] Rollup: bucket=%s, from=%ld, to=%ld\n", rollup_level_name(level), rs->from, rs->to);
+    
+    return stream_response(req, rollup_stream_read, rs, rollup_stream_free);
+}
+
+// ===== STREAMED HISTORY =====
+// Rows go from the SQLite cursor to the socket through MHD's reader
+// callback, so memory per request is one row no matter how many match.
+// The cursor is opened by the first read, so with the slow pool the query
+// runs on a pool thread.
+typedef struct {
+    DbHistoryQuery query;
+    DbHistoryCursor *cursor;
+    int stage;              // 0 = opening bracket, 1 = rows, 2 = trailer, 3 = done
+    char row[512];
+    size_t row_len;
+    size_t row_off;
+} HistoryStream;
+
+static ssize_t history_stream_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    HistoryStream *hs = cls;
+    size_t out = 0;
+    
+    while (out < max) {
+        // Finish whatever is pending from the previous call first
+        if (hs->row_off < hs->row_len) {
+            size_t n = hs->row_len - hs->row_off;
+            if (n > max - out) n = max - out;
+            memcpy(buf + out, hs->row + hs->row_off, n);
+            hs->row_off += n;
+            out += n;
+            continue;
+        }
+        
+        if (hs->stage == 0) {
+            hs->cursor = db_history_open(&hs->query);
+            if (!hs->cursor) {
+                // Nothing is sent yet, so the client still gets a JSON error
+                hs->row_len = snprintf(hs->row, sizeof(hs->row), "{\"error\":\"Database failed\"}");
+                hs->stage = 3;
+                hs->row_off = 0;
+                continue;
+            }
+            hs->row_len = snprintf(hs->row, sizeof(hs->row), "{\"data\":[");
+            hs->stage = 1;
+        } else if (hs->stage == 1) {
+            int first = db_history_rows(hs->cursor) == 0;
+            int n = db_history_next(hs->cursor, hs->row + 1, sizeof(hs->row) - 1);
+            if (n < 0) {
+                return out > 0 ? (ssize_t)out : MHD_CONTENT_READER_END_WITH_ERROR;
+            }
+            if (n == 0) {
+                hs->stage = 2;
+                continue;
+            }
+            if (first) {
+                memmove(hs->row, hs->row + 1, n);
+                hs->row_len = n;
+            } else {
+                hs->row[0] = ',';
+                hs->row_len = n + 1;
+            }
+        } else if (hs->stage == 2) {
+            char next[64];
+            int more = db_history_cursor(hs->cursor, next, sizeof(next));
+            hs->row_len = snprintf(hs->row, sizeof(hs->row),
+                                   "],\"count\":%d,\"max_id\":%lld,\"next_cursor\":%s%s%s}",
+                                   db_history_rows(hs->cursor), db_history_max_id(hs->cursor),
+                                   more ? "\"" : "", more ? next : "null", more ? "\"" : "");
+            hs->stage = 3;
+            printf("[API] History streamed %d rows\n", db_history_rows(hs->cursor));
+        } else {
+            break;
+        }
+        hs->row_off = 0;
+    }
+    
+    return out > 0 ? (ssize_t)out : MHD_CONTENT_READER_END_OF_STREAM;
+}
+
+static void history_stream_free(void *cls) {
+    HistoryStream *hs = cls;
+    db_history_close(hs->cursor);
+    free(hs);
+}
+
+static struct MHD_Response* handle_pump_history(HttpRequest *req, int *bad_request) {
     // Initialize query params structure
-    QueryParams params = {NULL, NULL, NULL};
+    QueryParams params = {NULL, NULL, NULL, NULL, NULL};
     
     // Extract query parameters from connection
-    MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND, get_query_iterator, &params);
+    MHD_get_connection_values(req->connection, MHD_GET_ARGUMENT_KIND, get_query_iterator, &params);
     
-    // Parse parameters with defaults
-    int limit = params.limit_str ? atoi(params.limit_str) : 1000;
-    time_t from = params.from_str ? (time_t)atoll(params.from_str) : 0;
-    time_t to = params.to_str ? (time_t)atoll(params.to_str) : 0;
+    // Parse parameters with defaults; there is no upper cap since rows are streamed
+    DbHistoryQuery q;
+    memset(&q, 0, sizeof(q));
+    q.limit = params.limit_str ? atoi(params.limit_str) : 1000;
+    q.from = params.from_str ? (time_t)atoll(params.from_str) : 0;
+    q.to = params.to_str ? (time_t)atoll(params.to_str) : 0;
+    q.since_id = params.since_str ? atoll(params.since_str) : 0;
     
-    if (limit > 5000) limit = 5000;
-    if (limit < 1) limit = 1000;
+    if (q.limit < 1) q.limit = 1000;
+    if (params.cursor_str && db_history_parse_cursor(params.cursor_str, &q) != 0) {
+        *bad_request = 1;
+        return NULL;
+    }
     
-    printf("[API] ✅ FINAL PARAMS: limit=%d, from=%ld, to=%ld\n", limit, from, to);
+    printf("[API] History: limit=%d, from=%ld, to=%ld, since_id=%lld, cursor=%s\n",
+           q.limit, q.from, q.to, q.since_id, params.cursor_str ? params.cursor_str : "-");
     
-    int result = db_get_history_filtered(response, sizeof(response), limit, from, to);
+    HistoryStream *hs = calloc(1, sizeof(*hs));
+    if (!hs) return NULL;
+    hs->query = q;
     
-    if (result != 0) {
-        return strdup("{\"error\":\"Database failed\"}");
+    return stream_response(req, history_stream_read, hs, history_stream_free);
+}
+
+static enum MHD_Result queue_not_modified(struct MHD_Connection *connection, const char *etag) {
+    struct MHD_Response *response = respcache_not_modified(etag);
+    if (!response) return MHD_NO;
+    
+    enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+// ===== ROUTES =====
+// Buffered JSON bodies: compressed when worth it; a 200 from a cacheable
+// route carries the ETag its handler computed. Takes data (malloc'd).
+static struct MHD_Response* json_response(HttpRequest *req, int status, char *data) {
+    size_t len = strlen(data);
+    int compressed = 0;
+    if (req->encoding != COMPRESS_NONE && len >= COMPRESS_MIN_BYTES) {
+        size_t zlen;
+        char *z = compress_buffer(req->encoding, data, len, &zlen);
+        if (z) {
+            free(data);
+            data = z;
+            len = zlen;
+            compressed = 1;
+        }
     }
     
-    return strdup(response);
+    struct MHD_Response *response = MHD_create_response_from_buffer(len, data, MHD_RESPMEM_MUST_FREE);
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    MHD_add_response_header(response, "Vary", "Accept-Encoding");
+    if (compressed) MHD_add_response_header(response, "Content-Encoding", compress_name(req->encoding));
+    if (req->etag[0] && status == 200) respcache_set_etag(response, req->etag);
+    return response;
+}
+
+static enum MHD_Result queue_json(HttpRequest *req, int status, char *data) {
+    struct MHD_Response *response = json_response(req, status, data);
+    enum MHD_Result ret = MHD_queue_response(req->connection, status, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+// Streamed JSON (history, rollup) once the reader is set up
+static enum MHD_Result queue_stream(HttpRequest *req, struct MHD_Response *response) {
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    if (req->etag[0]) respcache_set_etag(response, req->etag);
+    
+    enum MHD_Result ret = MHD_queue_response(req->connection, 200, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+static enum MHD_Result queue_cached(HttpRequest *req, int key) {
+    int status;
+    struct MHD_Response *response = respcache_response(key, req->if_none_match, req->encoding == COMPRESS_GZIP, &status);
+    if (!response) return queue_json(req, 500, strdup("{\"error\":\"Out of memory\"}"));
+    return MHD_queue_response(req->connection, status, response);
+}
+
+// Whole-fleet listing comes pre-rendered; one gateway is rendered per request
+static enum MHD_Result route_pump_status(HttpRequest *req) {
+    const char *device_id = route_param(req->params, "device_id");
+    if (!device_id) device_id = MHD_lookup_connection_value(req->connection, MHD_GET_ARGUMENT_KIND, "device_id");
+    if (!device_id) return queue_cached(req, RESPCACHE_PUMPS);
+    
+    respcache_etag('p', registry_version(), req->etag, sizeof(req->etag));
+    if (respcache_etag_match(req->if_none_match, req->etag)) return queue_not_modified(req->connection, req->etag);
+    return queue_json(req, 200, handle_pump_status(device_id));
+}
+
+static enum MHD_Result route_gateway_status(HttpRequest *req) {
+    const char *device_id = MHD_lookup_connection_value(req->connection, MHD_GET_ARGUMENT_KIND, "device_id");
+    if (!device_id) return queue_cached(req, RESPCACHE_GATEWAY);
+    
+    respcache_etag('g', registry_gateway_version(), req->etag, sizeof(req->etag));
+    if (respcache_etag_match(req->if_none_match, req->etag)) return queue_not_modified(req->connection, req->etag);
+    return queue_json(req, 200, handle_gateway_status(device_id));
+}
+
+static enum MHD_Result route_pump_history(HttpRequest *req) {
+    // Read before the query runs, so the rows are at least this new
+    respcache_etag('h', db_data_version(), req->etag, sizeof(req->etag));
+    if (respcache_etag_match(req->if_none_match, req->etag)) return queue_not_modified(req->connection, req->etag);
+    
+    int bad_request = 0;
+    struct MHD_Response *response = handle_pump_history(req, &bad_request);
+    if (bad_request) return queue_json(req, 400, strdup("{\"error\":\"Invalid cursor\"}"));
+    if (!response) return queue_json(req, 500, strdup("{\"error\":\"Out of memory\"}"));
+    return queue_stream(req, response);
+}
+
+static enum MHD_Result route_pump_rollup(HttpRequest *req) {
+    int bad_request = 0;
+    struct MHD_Response *response = handle_pump_rollup(req, &bad_request);
+    if (bad_request) return queue_json(req, 400, strdup("{\"error\":\"bucket must be minute, hour or day\"}"));
+    if (!response) return queue_json(req, 500, strdup("{\"error\":\"Out of memory\"}"));
+    return queue_stream(req, response);
+}
+
+static enum MHD_Result route_command_status(HttpRequest *req) {
+    int status = 200;
+    char *data = handle_command_status(req, &status);
+    if (!data) return MHD_YES;      // parked until the command moves or the wait ends
+    return queue_json(req, status, data);
+}
+
+static enum MHD_Result route_metrics(HttpRequest *req) {
+    return queue_json(req, 200, handle_metrics());
+}
+
+static enum MHD_Result route_ws(HttpRequest *req) {
+    int status = 200;
+    struct MHD_Response *response = handle_ws(req->connection, &status);
+    if (!response) {
+        return queue_json(req, status, strdup(status == 400 ? "{\"error\":\"WebSocket upgrade required\"}" :
+                                              status == 503 ? "{\"error\":\"Too many WebSocket clients\"}" :
+                                              "{\"error\":\"Out of memory\"}"));
+    }
+    
+    enum MHD_Result ret = MHD_queue_response(req->connection, MHD_HTTP_SWITCHING_PROTOCOLS, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+static enum MHD_Result route_events(HttpRequest *req) {
+    int status = 200;
+    struct MHD_Response *response = handle_events(req->connection, &status);
+    if (!response) {
+        return queue_json(req, status, strdup(status == 400 ? "{\"error\":\"Invalid device_id\"}" :
+                                              status == 503 ? "{\"error\":\"Too many event streams\"}" :
+                                              "{\"error\":\"Out of memory\"}"));
+    }
+    
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    MHD_add_response_header(response, "Content-Type", "text/event-stream");
+    MHD_add_response_header(response, "Cache-Control", "no-cache");
+    MHD_add_response_header(response, "X-Accel-Buffering", "no");
+    
+    enum MHD_Result ret = MHD_queue_response(req->connection, 200, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+static enum MHD_Result route_pump_control(HttpRequest *req) {
+    int status = 200;
+    char *data = handle_pump_control(req->body, &status);
+    return queue_json(req, status, data);
+}
+
+static enum MHD_Result route_pump_control_batch(HttpRequest *req) {
+    int status = 200;
+    char *data = handle_pump_control_batch(req->body, &status);
+    return queue_json(req, status, data);
+}
+
+static enum MHD_Result route_pump_feedback(HttpRequest *req) {
+    int status = handle_pump_feedback(req->body);
+    return queue_json(req, status, strdup(status == 400 ? "{\"status\":\"error\",\"error\":\"pump_id and status are required\"}" :
+                                          status == 503 ? "{\"status\":\"error\",\"error\":\"Ingest queue full\"}" :
+                                          "{\"status\":\"ok\"}"));
+}
+
+// The dashboard; /api/ stays JSON-only
+static enum MHD_Result route_static(HttpRequest *req) {
+    int status = 200;
+    struct MHD_Response *response = NULL;
+    if (strncmp(req->url, "/api/", 5) != 0) {
+        response = static_response(req->url, MHD_lookup_connection_value(req->connection, MHD_GET_ARGUMENT_KIND, "v"),
+                                   req->encoding == COMPRESS_GZIP, req->if_none_match, &status);
+    }
+    if (!response) return queue_json(req, 404, strdup("{\"error\":\"Not found\"}"));
+    return MHD_queue_response(req->connection, status, response);
+}
+
+typedef struct {
+    int methods;
+    const char *pattern;
+    enum MHD_Result (*handler)(HttpRequest *req);
+    int flags;
+} ApiRoute;
+
+static const ApiRoute api_routes[] = {
+    {ROUTER_GET,  "/api/pump/status",                   route_pump_status,          ROUTE_CACHEABLE},
+    {ROUTER_GET,  "/api/gateway/status",                route_gateway_status,       ROUTE_CACHEABLE},
+    {ROUTER_GET,  "/api/gateways/{device_id}/status",   route_pump_status,          ROUTE_CACHEABLE},
+    {ROUTER_GET,  "/api/pump/history",                  route_pump_history,         ROUTE_CACHEABLE | ROUTE_STREAMING | ROUTE_SLOW},
+    {ROUTER_GET,  "/api/pump/rollup",                   route_pump_rollup,          ROUTE_STREAMING | ROUTE_SLOW},
+    {ROUTER_GET,  "/api/gateways/{device_id}/pumps/{pump_id:int}/rollup",
+                                                        route_pump_rollup,          ROUTE_STREAMING | ROUTE_SLOW},
+    {ROUTER_GET,  "/api/commands/{id:int}",             route_command_status,       0},
+    {ROUTER_GET,  "/api/metrics",                       route_metrics,              0},
+    {ROUTER_GET,  "/api/ws",                            route_ws,                   ROUTE_STREAMING},
+    {ROUTER_GET,  "/api/events",                        route_events,               ROUTE_STREAMING},
+    {ROUTER_POST, "/api/pump/control",                  route_pump_control,         0},
+    {ROUTER_POST, "/api/pump/control/batch",            route_pump_control_batch,   0},
+    {ROUTER_POST, "/api/pump/feedback",                 route_pump_feedback,        0},
+    {ROUTER_GET,  "/{path*}",                           route_static,               ROUTE_CACHEABLE},
+};
+
+static Router *router = NULL;
+
+static int routes_build() {
+    router = router_new();
+    if (!router) return -1;
+    
+    for (size_t i = 0; i < sizeof(api_routes) / sizeof(api_routes[0]); i++) {
+        if (router_add(router, api_routes[i].methods, api_routes[i].pattern, &api_routes[i]) != 0) {
+            printf("[HTTP] Bad route: %s\n", api_routes[i].pattern);
+            router_free(router);
+            router = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Runs once per request, whatever the outcome; frees a POST's arena
+static void request_completed(void *cls, struct MHD_Connection *connection, void **con_cls,
+                              enum MHD_RequestTerminationCode toe) {
+    // GETs only ever leave the command_parked sentinel here
+    if (*con_cls && *con_cls != &command_parked) post_request_free(*con_cls);
+    *con_cls = NULL;
 }
 
 static enum MHD_Result handle_request(void *cls, struct MHD_Connection *connection,
@@ -155,92 +1216,184 @@ static enum MHD_Result handle_request(void *cls, struct MHD_Connection *connecti
     
     printf("[DEBUG] Request: %s %s\n", method, url);
     
-    struct MHD_Response *response;
-    char *response_data = NULL;
-    int status_code = 200;
-    
     if (strcmp(method, "OPTIONS") == 0) {
-        response_data = strdup("");
-        response = MHD_create_response_from_buffer(0, response_data, MHD_RESPMEM_MUST_FREE);
+        char *empty = strdup("");
+        struct MHD_Response *response = MHD_create_response_from_buffer(0, empty, MHD_RESPMEM_MUST_FREE);
         MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
         MHD_add_response_header(response, "Access-Control-Allow-Methods", "GET, POST, OPTIONS");
-        MHD_add_response_header(response, "Access-Control-Allow-Headers", "Content-Type");
+        MHD_add_response_header(response, "Access-Control-Allow-Headers", "Content-Type, If-None-Match");
         
         enum MHD_Result ret = MHD_queue_response(connection, 204, response);
         MHD_destroy_response(response);
         return ret;
     }
     
+    // Bodies are taken in whole before routing, so an unknown URL answers after the upload
+    PostRequest *pr = NULL;
     if (strcmp(method, "POST") == 0) {
         if (*con_cls == NULL) {
-            char *post_buffer = malloc(1024);
-            if (!post_buffer) return MHD_NO;
-            post_buffer[0] = '\0';
-            *con_cls = post_buffer;
+            pr = post_request_new();
+            if (!pr) return MHD_NO;
+            *con_cls = pr;
             return MHD_YES;
         }
         
-        char *post_buffer = *con_cls;
+        pr = *con_cls;
         
         if (*upload_data_size != 0) {
-            strncat(post_buffer, upload_data, *upload_data_size);
+            post_request_feed(pr, upload_data, *upload_data_size);
             *upload_data_size = 0;
             return MHD_YES;
         }
+        post_request_finish(pr);
         
-        if (strcmp(url, "/api/pump/control") == 0) {
-            response_data = handle_pump_control(post_buffer);
-        } else if (strcmp(url, "/api/pump/feedback") == 0) {
-            status_code = handle_pump_feedback(post_buffer);
-            response_data = strdup("{\"status\":\"ok\"}");
-        } else {
-            status_code = 404;
-            response_data = strdup("{\"error\":\"Not found\"}");
-        }
-        free(post_buffer);
-    } 
-    else if (strcmp(method, "GET") == 0) {
-        if (strcmp(url, "/api/pump/status") == 0) {
-            response_data = handle_pump_status();
-        } else if (strncmp(url, "/api/pump/history", 17) == 0) {
-            response_data = handle_pump_history(connection);  
-        } else if (strcmp(url, "/api/gateway/status") == 0) { 
-            response_data = handle_gateway_status();
-        } else {
-            status_code = 404;
-            response_data = strdup("{\"error\":\"Not found\"}");
-        }
+        printf("[API] POST %s (%zu bytes): %s\n", url, pr->len, pr->log_head);
     }
-    else {
-        status_code = 405;
-        response_data = strdup("{\"error\":\"Not allowed\"}");
+    
+    RouteParams params;
+    int allowed;
+    const ApiRoute *route = router_match(router, router_method(method), url, &params, &allowed);
+    
+    HttpRequest req;
+    req.connection = connection;
+    req.url = url;
+    req.con_cls = con_cls;
+    req.params = &params;
+    req.body = pr ? pr->parsed : NULL;
+    req.if_none_match = NULL;
+    req.encoding = compress_negotiate(MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                                                  MHD_HTTP_HEADER_ACCEPT_ENCODING));
+    req.flags = route ? route->flags : 0;
+    req.etag[0] = '\0';
+    
+    if (!route && allowed) {
+        char allow[32];
+        snprintf(allow, sizeof(allow), "%s%s%s", allowed & ROUTER_GET ? "GET" : "",
+                 (allowed & ROUTER_GET) && (allowed & ROUTER_POST) ? ", " : "", allowed & ROUTER_POST ? "POST" : "");
+        
+        struct MHD_Response *response = json_response(&req, 405, strdup("{\"error\":\"Not allowed\"}"));
+        MHD_add_response_header(response, "Allow", allow);
+        enum MHD_Result ret = MHD_queue_response(connection, 405, response);
+        MHD_destroy_response(response);
+        return ret;
     }
+    if (!route) return queue_json(&req, 404, strdup("{\"error\":\"Not found\"}"));
     
-    response = MHD_create_response_from_buffer(strlen(response_data), response_data, MHD_RESPMEM_MUST_FREE);
-    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
-    MHD_add_response_header(response, "Content-Type", "application/json");
+    if (pr && pr->status == 413) {
+        return queue_json(&req, 413, strdup("{\"status\":\"error\",\"error\":\"Body too large\"}"));
+    }
+    if (pr && pr->status) {
+        return queue_json(&req, 400, strdup("{\"status\":\"error\",\"error\":\"Invalid JSON\"}"));
+    }
     
-    enum MHD_Result ret = MHD_queue_response(connection, status_code, response);
-    MHD_destroy_response(response);
-    return ret;
+    if (route->flags & ROUTE_CACHEABLE) {
+        req.if_none_match = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH);
+    }
+    return route->handler(&req);
+}
+
+// ===== ENGINE =====
+static struct MHD_Daemon *daemon_handle = NULL;
+
+void http_api_default_config(HttpConfig *cfg) {
+    cfg->port = HTTP_PORT;
+    cfg->threads = HTTP_THREADS;
+    cfg->slow_threads = HTTP_SLOW_THREADS;
+    cfg->connection_limit = HTTP_CONNECTION_LIMIT;
+    cfg->connection_timeout_s = HTTP_CONNECTION_TIMEOUT_S;
+    cfg->web_root = HTTP_WEB_ROOT;
+    cfg->post_max_bytes = HTTP_POST_MAX_BYTES;
+}
+
+int http_api_start(const HttpConfig *cfg) {
+    http_cfg = *cfg;
+    if (http_cfg.threads < 1) http_cfg.threads = 1;
+    if (http_cfg.post_max_bytes < 1) http_cfg.post_max_bytes = HTTP_POST_MAX_BYTES;
+    if (routes_build() != 0) return -1;
+    
+    pthread_mutex_lock(&sse_lock);
+    sse_stopping = 0;
+    pthread_mutex_unlock(&sse_lock);
+    
+    if (ws_init() != 0) {
+        printf("[HTTP-API] WebSocket hub failed, /api/ws disabled\n");
+    }
+    ws_set_command_handler(ws_command);
+    commands_set_waker(command_park, command_wake);
+    
+    if (http_cfg.web_root && static_init(http_cfg.web_root) != 0) {
+        printf("[HTTP-API] No dashboard files, serving the API only\n");
+    }
+    
+    if (offload_init(http_cfg.slow_threads) != 0) {
+        printf("[HTTP-API] Slow pool failed, history runs on the event loops\n");
+    }
+    
+    // Suspend/resume parks idle /api/events streams and slow queries; upgrade
+    // hands /api/ws sockets to ws.c. A pool of one is just the internal thread.
+    unsigned int flags = MHD_USE_EPOLL_INTERNAL_THREAD | MHD_ALLOW_SUSPEND_RESUME | MHD_ALLOW_UPGRADE;
+    daemon_handle = MHD_start_daemon(flags, http_cfg.port, NULL, NULL, &handle_request, NULL,
+                                     MHD_OPTION_THREAD_POOL_SIZE, (unsigned int)(http_cfg.threads > 1 ? http_cfg.threads : 0),
+                                     MHD_OPTION_CONNECTION_LIMIT, (unsigned int)http_cfg.connection_limit,
+                                     MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int)http_cfg.connection_timeout_s,
+                                     MHD_OPTION_NOTIFY_COMPLETED, request_completed, NULL,
+                                     MHD_OPTION_END);
+    if (!daemon_handle) {
+        printf("[HTTP-API] Failed\n");
+        ws_shutdown();
+        offload_shutdown();
+        static_free();
+        router_free(router);
+        router = NULL;
+        return -1;
+    }
+    
+    printf("[HTTP-API] Running on port %d (%d epoll threads, %d slow, %d connections max, %ds timeout)\n",
+           http_cfg.port, http_cfg.threads, http_cfg.slow_threads, http_cfg.connection_limit,
+           http_cfg.connection_timeout_s);
+    events_add_listener(sse_wake);
+    return 0;
+}
+
+void http_api_stop() {
+    if (!daemon_handle) return;
+    
+    // MHD can't stop with suspended connections: resume everything first
+    events_remove_listener(sse_wake);
+    ws_shutdown();
+    sse_shutdown();
+    commands_wake_all();
+    offload_quiesce();
+    MHD_stop_daemon(daemon_handle);
+    daemon_handle = NULL;
+    offload_shutdown();
+    respcache_shutdown();
+    static_free();
+    router_free(router);
+    router = NULL;
 }
 
 void* http_api_thread(void *arg) {
-    struct MHD_Daemon *daemon;
     sleep(2);
     
-    daemon = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY, HTTP_PORT, NULL, NULL, &handle_request, NULL, MHD_OPTION_END);
-    if (!daemon) {
-        printf("[HTTP-API] Failed\n");
+    HttpConfig cfg;
+    http_api_default_config(&cfg);
+    if (http_api_start(&cfg) != 0) {
         return NULL;
     }
     
-    printf("[HTTP-API] Running on port %d\n", HTTP_PORT);
-    
+    time_t next_ping = time(NULL) + EVENTS_HEARTBEAT_S;
     while (running) {
         sleep(1);
+        
+        time_t now = time(NULL);
+        update_gateway_liveness(now);
+        if (now >= next_ping) {
+            sse_ping();
+            next_ping = now + EVENTS_HEARTBEAT_S;
+        }
     }
     
-    MHD_stop_daemon(daemon);
+    http_api_stop();
     return NULL;
-}
\ No newline at end of file
+}
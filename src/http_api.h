@@ -3,6 +3,30 @@
 
 #define HTTP_PORT 8080
 
+// Engine: libmicrohttpd with one epoll loop per thread, each owning its
+// connections. History and rollup queries run on the slow pool (offload.c),
+// so they never hold up /api/pump/status on the same loop.
+#define HTTP_THREADS                4
+#define HTTP_SLOW_THREADS           2       // 0 = run them on the loops
+#define HTTP_CONNECTION_LIMIT       2048    // includes /api/ws and /api/events clients
+#define HTTP_CONNECTION_TIMEOUT_S   30      // idle keep-alive; above EVENTS_HEARTBEAT_S
+#define HTTP_WEB_ROOT               "web"   // dashboard files, served at / (static_files.c)
+#define HTTP_POST_MAX_BYTES         (1024 * 1024)   // larger bodies get 413
+
+typedef struct {
+    int port;
+    int threads;
+    int slow_threads;
+    int connection_limit;
+    int connection_timeout_s;
+    const char *web_root;       // NULL = API only
+    int post_max_bytes;
+} HttpConfig;
+
+void http_api_default_config(HttpConfig *cfg);
+int http_api_start(const HttpConfig *cfg);     // 0 = listening
+void http_api_stop();
+
 void* http_api_thread(void *arg);
 
-#endif
\ No newline at end of file
+#endif
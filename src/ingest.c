@@ -0,0 +1,389 @@
+#include "ingest.h"
+#include "shared.h"
+#include "commands.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+// Bounded MPMC ring (Vyukov). Each cell carries a sequence number that tells
+// producers and the consumer whose turn it is, so no lock is needed. Only
+// the worker dequeues, except drop-oldest producers evicting on overflow.
+typedef struct {
+    atomic_size_t seq;
+    IngestEvent ev;
+} IngestCell;
+
+typedef struct {
+    int in_use;
+    IngestEvent ev;
+} CoalesceSlot;
+
+static IngestCell *cells = NULL;
+static size_t mask = 0;
+static int overflow_policy = INGEST_OVERFLOW_POLICY;
+
+static _Alignas(64) atomic_size_t enqueue_pos;
+static _Alignas(64) atomic_size_t dequeue_pos;
+
+static atomic_ullong stat_enqueued;
+static atomic_ullong stat_processed;
+static atomic_ullong stat_dropped;
+static atomic_ullong stat_coalesced;
+static atomic_size_t stat_high_water;
+
+// Overflow side table for INGEST_COALESCE. Only touched when the ring is
+// full or while it still holds entries, so the fast path stays lock-free.
+static CoalesceSlot coalesce[INGEST_COALESCE_SLOTS];
+static pthread_mutex_t coalesce_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t coalesce_pending;
+
+// Worker sleep/wake
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int worker_sleeping;
+static atomic_int stopping;     // set by ingest_stop() once producers are gone
+
+int ingest_init(size_t capacity, int policy) {
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+    
+    cells = calloc(size, sizeof(*cells));
+    if (!cells) {
+        fprintf(stderr, "[INGEST] Out of memory for %zu events\n", size);
+        return -1;
+    }
+    
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&cells[i].seq, i);
+    }
+    mask = size - 1;
+    overflow_policy = policy;
+    atomic_store(&enqueue_pos, 0);
+    atomic_store(&dequeue_pos, 0);
+    atomic_store(&stopping, 0);
+    
+    printf("[INGEST] Queue: %zu events, overflow policy: %s\n", size, ingest_policy_name(policy));
+    return 0;
+}
+
+void ingest_free() {
+    free(cells);
+    cells = NULL;
+}
+
+const char* ingest_policy_name(int policy) {
+    switch (policy) {
+        case INGEST_BLOCK: return "block";
+        case INGEST_DROP_OLDEST: return "drop-oldest";
+        case INGEST_COALESCE: return "coalesce";
+    }
+    return "unknown";
+}
+
+static int ring_enqueue(const IngestEvent *ev) {
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    
+    for (;;) {
+        IngestCell *cell = &cells[pos & mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->ev = *ev;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (dif < 0) {
+            return -1;  // full
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static int ring_dequeue(IngestEvent *out) {
+    size_t pos = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+    
+    for (;;) {
+        IngestCell *cell = &cells[pos & mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *out = cell->ev;
+                atomic_store_explicit(&cell->seq, pos + mask + 1, memory_order_release);
+                return 0;
+            }
+        } else if (dif < 0) {
+            return -1;  // empty
+        } else {
+            pos = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static size_t ring_depth() {
+    size_t head = atomic_load_explicit(&dequeue_pos, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+static int same_key(const IngestEvent *a, const IngestEvent *b) {
+    return a->type == b->type && a->pump_id == b->pump_id && strcmp(a->device_id, b->device_id) == 0;
+}
+
+static unsigned int key_hash(const IngestEvent *ev) {
+    unsigned int h = 2166136261u ^ (unsigned int)ev->type;
+    h = (h ^ (unsigned int)ev->pump_id) * 16777619u;
+    for (const char *p = ev->device_id; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return h;
+}
+
+// A newer event over a pending one for the same key. What the newer one
+// leaves out keeps the older value: busy/alarm at -1, a heartbeat without
+// firmware. The status is there for both or neither (it comes with pump_id,
+// which is part of the key), so the newer one wins. Returns the command the
+// older event carried if the merge drops it, 0 otherwise.
+static long long coalesce_merge(IngestEvent *pending, const IngestEvent *ev) {
+    IngestEvent older = *pending;
+    *pending = *ev;
+    
+    if (ev->busy < 0) pending->busy = older.busy;
+    if (ev->alarm < 0) pending->alarm = older.alarm;
+    if (!ev->has_firmware && older.has_firmware) {
+        memcpy(pending->firmware, older.firmware, sizeof(pending->firmware));
+        pending->has_firmware = 1;
+    }
+    
+    return older.command_id > 0 && older.command_id != ev->command_id ? older.command_id : 0;
+}
+
+// Newer event merges into a pending one for the same pump. Returns 0 if stored.
+static int coalesce_store(const IngestEvent *ev, int only_if_pending) {
+    unsigned int start = key_hash(ev) % INGEST_COALESCE_SLOTS;
+    int free_slot = -1;
+    int rc = -1;
+    long long replaced = 0;
+    
+    pthread_mutex_lock(&coalesce_lock);
+    for (unsigned int n = 0; n < INGEST_COALESCE_SLOTS; n++) {
+        unsigned int i = (start + n) % INGEST_COALESCE_SLOTS;
+        if (!coalesce[i].in_use) {
+            if (free_slot < 0) free_slot = (int)i;
+            if (only_if_pending) break;
+            continue;
+        }
+        if (same_key(&coalesce[i].ev, ev)) {
+            replaced = coalesce_merge(&coalesce[i].ev, ev);
+            atomic_fetch_add(&stat_coalesced, 1);
+            rc = 0;
+            break;
+        }
+    }
+    if (rc != 0 && !only_if_pending && free_slot >= 0) {
+        coalesce[free_slot].in_use = 1;
+        coalesce[free_slot].ev = *ev;
+        atomic_fetch_add(&coalesce_pending, 1);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&coalesce_lock);
+    
+    // Its state never reaches the registry; commands_applied() won't follow
+    if (replaced) commands_superseded(replaced);
+    return rc;
+}
+
+static void wake_worker() {
+    if (atomic_load(&worker_sleeping)) {
+        pthread_mutex_lock(&wake_lock);
+        atomic_store(&worker_sleeping, 0);
+        pthread_cond_signal(&wake_cond);
+        pthread_mutex_unlock(&wake_lock);
+    }
+}
+
+int ingest_push(const IngestEvent *ev) {
+    // Keep per-pump order: once a pump has a coalesced event pending, newer
+    // ones for it must replace that event rather than jump ahead in the ring
+    if (overflow_policy == INGEST_COALESCE && atomic_load(&coalesce_pending) > 0) {
+        if (coalesce_store(ev, 1) == 0) {
+            wake_worker();
+            return 0;
+        }
+    }
+    
+    while (ring_enqueue(ev) != 0) {
+        if (overflow_policy == INGEST_DROP_OLDEST) {
+            IngestEvent victim;
+            if (ring_dequeue(&victim) == 0) {
+                atomic_fetch_add(&stat_dropped, 1);
+                // An evicted local command will never be applied here
+                if (victim.command_id > 0) commands_superseded(victim.command_id);
+            }
+        } else if (overflow_policy == INGEST_COALESCE) {
+            int rc = coalesce_store(ev, 0);
+            if (rc != 0) atomic_fetch_add(&stat_dropped, 1);
+            wake_worker();
+            return rc;
+        } else {
+            if (atomic_load(&stopping)) {
+                atomic_fetch_add(&stat_dropped, 1);
+                return -1;
+            }
+            wake_worker();
+            sched_yield();
+        }
+    }
+    
+    atomic_fetch_add(&stat_enqueued, 1);
+    
+    size_t depth = ring_depth();
+    size_t high = atomic_load_explicit(&stat_high_water, memory_order_relaxed);
+    while (depth > high && !atomic_compare_exchange_weak(&stat_high_water, &high, depth)) {
+    }
+    
+    wake_worker();
+    return 0;
+}
+
+int ingest_command(long long id, const char *device_id, int pump_id, int state) {
+    IngestEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = INGEST_CONTROL;
+    snprintf(ev.device_id, sizeof(ev.device_id), "%s", device_id);
+    ev.pump_id = pump_id;
+    ev.value = state;
+    ev.busy = -1;
+    ev.alarm = -1;
+    ev.command_id = id;
+    return ingest_push(&ev);
+}
+
+void ingest_get_stats(IngestStats *out) {
+    out->capacity = mask + 1;
+    out->depth = ring_depth();
+    out->enqueued = atomic_load(&stat_enqueued);
+    out->processed = atomic_load(&stat_processed);
+    out->dropped = atomic_load(&stat_dropped);
+    out->coalesced = atomic_load(&stat_coalesced);
+    out->coalesce_pending = atomic_load(&coalesce_pending);
+    out->high_water = atomic_load(&stat_high_water);
+    out->policy = overflow_policy;
+}
+
+static void ingest_apply(const IngestEvent *ev) {
+    const char *device_id = ev->device_id[0] ? ev->device_id : NULL;
+    
+    switch (ev->type) {
+        case INGEST_HEARTBEAT:
+            update_gateway_heartbeat(device_id, ev->has_firmware ? ev->firmware : NULL, ev->value);
+            break;
+        case INGEST_CONTROL:
+            update_pump_status(device_id, ev->pump_id, ev->value);
+            if (ev->command_id > 0) commands_applied(ev->command_id);
+            break;
+        case INGEST_FEEDBACK:
+            if (ev->pump_id > 0) {
+                update_pump_feedback(device_id, ev->pump_id, ev->value);
+                commands_feedback(device_id, ev->pump_id, ev->value);
+            }
+            if (ev->busy >= 0 || ev->alarm >= 0) {
+                update_system_status(device_id, ev->busy, ev->alarm);
+            }
+            break;
+    }
+    atomic_fetch_add(&stat_processed, 1);
+}
+
+// Move every coalesced event out under the lock, apply them outside it
+static int flush_coalesced() {
+    static IngestEvent pending[INGEST_COALESCE_SLOTS];
+    int n = 0;
+    
+    pthread_mutex_lock(&coalesce_lock);
+    for (int i = 0; i < INGEST_COALESCE_SLOTS; i++) {
+        if (coalesce[i].in_use) {
+            pending[n++] = coalesce[i].ev;
+            coalesce[i].in_use = 0;
+        }
+    }
+    atomic_store(&coalesce_pending, 0);
+    pthread_mutex_unlock(&coalesce_lock);
+    
+    for (int i = 0; i < n; i++) {
+        ingest_apply(&pending[i]);
+    }
+    return n;
+}
+
+void ingest_stop() {
+    atomic_store(&stopping, 1);
+    pthread_mutex_lock(&wake_lock);
+    atomic_store(&worker_sleeping, 0);
+    pthread_cond_signal(&wake_cond);
+    pthread_mutex_unlock(&wake_lock);
+}
+
+void* ingest_worker_thread(void *arg) {
+    IngestEvent batch[INGEST_BATCH_SIZE];
+    
+    printf("[INGEST] Worker started\n");
+    
+    for (;;) {
+        int n = 0;
+        while (n < INGEST_BATCH_SIZE && ring_dequeue(&batch[n]) == 0) {
+            n++;
+        }
+        
+        for (int i = 0; i < n; i++) {
+            ingest_apply(&batch[i]);
+        }
+        
+        // Coalesced events are newer than anything still in the ring for
+        // the same pump, so they go in only once the ring has drained
+        if (n < INGEST_BATCH_SIZE && atomic_load(&coalesce_pending) > 0) {
+            n += flush_coalesced();
+        }
+        
+        if (n > 0) continue;
+        if (atomic_load(&stopping) && ring_depth() == 0 &&
+            atomic_load(&coalesce_pending) == 0) break;
+        
+        // Sleep until a producer wakes us; the timeout covers a missed signal
+        atomic_store(&worker_sleeping, 1);
+        if (ring_depth() > 0 || atomic_load(&coalesce_pending) > 0) {
+            atomic_store(&worker_sleeping, 0);
+            continue;
+        }
+        
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100 * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        
+        pthread_mutex_lock(&wake_lock);
+        while (atomic_load(&worker_sleeping) && !atomic_load(&stopping)) {
+            if (pthread_cond_timedwait(&wake_cond, &wake_lock, &deadline) != 0) break;
+        }
+        atomic_store(&worker_sleeping, 0);
+        pthread_mutex_unlock(&wake_lock);
+    }
+    
+    printf("[INGEST] Worker stopped (%llu events processed, %llu dropped)\n",
+           (unsigned long long)atomic_load(&stat_processed),
+           (unsigned long long)atomic_load(&stat_dropped));
+    return NULL;
+}
@@ -0,0 +1,66 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stddef.h>
+
+// Bounded lock-free queue between the MQTT receive callback and the
+// state/persistence worker. Producers never touch the DB or `lock`.
+#define INGEST_QUEUE_SIZE       4096    // power of two
+#define INGEST_BATCH_SIZE       64
+#define INGEST_COALESCE_SLOTS   1024
+#define INGEST_OVERFLOW_POLICY  INGEST_COALESCE
+
+// What a producer does when the ring is full
+#define INGEST_BLOCK        0   // wait for the worker to make room
+#define INGEST_DROP_OLDEST  1   // discard the oldest queued event
+#define INGEST_COALESCE     2   // keep only the newest event per pump until the worker catches up
+
+#define INGEST_HEARTBEAT    1
+#define INGEST_CONTROL      2
+#define INGEST_FEEDBACK     3
+
+typedef struct {
+    int type;
+    char device_id[64];     // "" = default gateway
+    char firmware[32];      // heartbeat only
+    int has_firmware;
+    int pump_id;            // 0 when the message carried none
+    int value;              // control: state, feedback: status, heartbeat: status
+    int busy;               // feedback: -1 when absent
+    int alarm;              // feedback: -1 when absent
+    long long command_id;   // control: set when the command came through commands.c
+} IngestEvent;
+
+typedef struct {
+    size_t capacity;
+    size_t depth;
+    unsigned long long enqueued;
+    unsigned long long processed;
+    unsigned long long dropped;
+    unsigned long long coalesced;
+    size_t coalesce_pending;
+    size_t high_water;
+    int policy;
+} IngestStats;
+
+int ingest_init(size_t capacity, int policy);
+void ingest_free();
+
+// Called from the MQTT callback. Returns 0 if queued (or coalesced), -1 if dropped.
+int ingest_push(const IngestEvent *ev);
+
+// A command submitted on this server, applied like one from pump/control
+// without waiting for the broker to echo it back. A CommandApplyFn.
+int ingest_command(long long id, const char *device_id, int pump_id, int state);
+
+void ingest_get_stats(IngestStats *out);
+const char* ingest_policy_name(int policy);
+
+// Call once the MQTT client and HTTP API have stopped: the worker empties the
+// ring and the coalesce table, then exits
+void ingest_stop();
+
+// Drains the queue in batches and applies them until ingest_stop()
+void* ingest_worker_thread(void *arg);
+
+#endif
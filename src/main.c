@@ -3,6 +3,10 @@
 #include "mqtt.h"
 #include "http_api.h"
 #include "db.h"         
+#include "registry.h"
+#include "ingest.h"
+#include "events.h"
+#include "commands.h"
 #include <stdio.h>
 #include <signal.h>
 #include <unistd.h>
@@ -13,7 +17,7 @@ void signal_handler(int sig) {
 }
 
 int main() {
-    pthread_t mqtt_pub_tid, mqtt_sub_tid, http_tid;
+    pthread_t mqtt_pub_tid, http_tid, ingest_tid;
     
     pthread_mutex_init(&lock, NULL);
     signal(SIGINT, signal_handler);
@@ -21,23 +25,54 @@ int main() {
     
     printf("=== Server Starting ===\n");
     
+    if (registry_init(REGISTRY_MAX_PUMPS, REGISTRY_MAX_GATEWAYS) != 0) {
+        fprintf(stderr, "[MAIN] Failed to allocate pump registry\n");
+        return 1;
+    }
+    
     if (db_init() != 0) {
         fprintf(stderr, "[MAIN] Failed to initialize database\n");
         return 1;
     }
     
+    if (ingest_init(INGEST_QUEUE_SIZE, INGEST_OVERFLOW_POLICY) != 0) {
+        fprintf(stderr, "[MAIN] Failed to allocate ingest queue\n");
+        return 1;
+    }
+    
+    events_init();
+    
+    if (commands_init(mqtt_publish_control, ingest_command) != 0) {
+        fprintf(stderr, "[MAIN] Failed to start command pipeline\n");
+        return 1;
+    }
+    
+    pthread_create(&ingest_tid, NULL, ingest_worker_thread, NULL);
+    
+    MqttConfig mqtt_cfg;
+    mqtt_default_config(&mqtt_cfg);
+    if (mqtt_start(&mqtt_cfg) != 0) {
+        fprintf(stderr, "[MAIN] MQTT client failed, running without the broker\n");
+    }
     pthread_create(&mqtt_pub_tid, NULL, mqtt_publisher_thread, NULL);
-    pthread_create(&mqtt_sub_tid, NULL, mqtt_subscriber_thread, NULL);
     pthread_create(&http_tid, NULL, http_api_thread, NULL);
     
     printf("[MAIN] All threads started\n");
     printf("Press Ctrl+C to stop\n\n");
     
     pthread_join(mqtt_pub_tid, NULL);
-    pthread_join(mqtt_sub_tid, NULL);
     pthread_join(http_tid, NULL);
+    // No more arrivals into the ingest queue; late command publishes just fail
+    mqtt_stop();
+    
+    // Producers are gone; the worker drains what is left before the DB closes
+    ingest_stop();
+    pthread_join(ingest_tid, NULL);
+    ingest_free();
+    commands_shutdown();
     
     db_close();
+    registry_free();
     
     pthread_mutex_destroy(&lock);
     printf("[MAIN] Shutdown complete\n");
@@ -1,230 +1,919 @@
 #include "mqtt.h"
 #include "shared.h"
+#include "registry.h"
+#include "ingest.h"
+#include "commands.h"
+#include "outbox.h"
+#include "events.h"
+#include "topics.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <json-c/json.h>
 
-MQTTClient mqtt_pub_client;
-MQTTClient mqtt_sub_client;
+static MqttConfig mqtt_cfg;
+static MQTTAsync client = NULL;
+// Publishers hold it shared; mqtt_stop() takes it to destroy the client
+static pthread_rwlock_t client_lock = PTHREAD_RWLOCK_INITIALIZER;
+static atomic_int connected;
 
-int mqtt_message_arrived(void *context, char *topicName, int topicLen, MQTTClient_message *message) {
-    char payload[1024];
-    snprintf(payload, sizeof(payload), "%.*s", (int)message->payloadlen, (char*)message->payload);
+// The in-flight window is kept here, not in paho's queue: paho only wakes its
+// send thread when a command is added, so a publish queued behind a full
+// window would wait for the next one (or a 1 s tick) after the PUBACK.
+static pthread_mutex_t window_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t window_open = PTHREAD_COND_INITIALIZER;
+static int window_used;
+
+static atomic_ullong stat_published;
+static atomic_ullong stat_acked;
+static atomic_ullong stat_failed;
+static atomic_ullong stat_received;
+static atomic_ullong stat_reconnects;
+static atomic_ullong stat_connect_failures;
+static atomic_ullong stat_pump_updates;
+static atomic_ullong stat_full_status;
+static atomic_ullong stat_echoes;
+static atomic_uint connect_generation;      // bumped on every connect
+
+// Connection state and the outbox, both under conn_lock. The connection
+// thread connects, reconnects and drains the outbox; the client's callbacks
+// only record what happened and wake it.
+#define MQTT_DOWN           0
+#define MQTT_CONNECTING     1
+#define MQTT_UP             2
+
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t conn_tid;
+static int conn_running = 0;
+static int conn_state = MQTT_DOWN;
+static int conn_attempt = 0;        // failures since the last good connect
+static long long reconnect_at_ms = 0;
+static int ever_connected = 0;
+static int client_stale = 0;        // lost its connection: replace before reconnecting
+static unsigned jitter_seed;
+static Outbox outbox;
+static int outbox_ready = 0;
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// ===== SUBSCRIPTIONS =====
+// Typed handlers: each turns one kind of message into an IngestEvent (type
+// left 0 when the message is unusable). pump_id comes from the topic when
+// the filter has it, 0 = from the payload.
+typedef void (*MqttParseFn)(struct json_object *parsed, int pump_id, IngestEvent *ev);
+
+// ===== XỬ LÝ GATEWAY HEARTBEAT =====
+static void parse_heartbeat(struct json_object *parsed, int pump_id, IngestEvent *ev) {
+    struct json_object *firmware_obj, *status_obj;
     
-    printf("[MQTT-SUB] Topic: %s\n", topicName);
-    printf("[MQTT-SUB] Payload: %s\n", payload);
+    ev->type = INGEST_HEARTBEAT;
+    ev->value = 1;  // default online
     
-    // ===== XỬ LÝ GATEWAY HEARTBEAT =====
-    if (strcmp(topicName, "gateway/heartbeat") == 0) {
-        struct json_object *parsed = json_tokener_parse(payload);
-        if (parsed) {
-            struct json_object *device_id_obj, *firmware_obj, *status_obj;
-            
-            const char *device_id = NULL;
-            const char *firmware = NULL;
-            int status = 1;  // default online
-            
-            if (json_object_object_get_ex(parsed, "device_id", &device_id_obj)) {
-                device_id = json_object_get_string(device_id_obj);
-            }
-            
-            if (json_object_object_get_ex(parsed, "firmware", &firmware_obj)) {
-                firmware = json_object_get_string(firmware_obj);
-            }
-            
-            if (json_object_object_get_ex(parsed, "status", &status_obj)) {
-                status = json_object_get_int(status_obj);
-            }
-            
-            update_gateway_heartbeat(device_id, firmware, status);
-            json_object_put(parsed);
+    if (json_object_object_get_ex(parsed, "firmware", &firmware_obj)) {
+        snprintf(ev->firmware, sizeof(ev->firmware), "%s", json_object_get_string(firmware_obj));
+        ev->has_firmware = 1;
+    }
+    
+    if (json_object_object_get_ex(parsed, "status", &status_obj)) {
+        ev->value = json_object_get_int(status_obj);
+    }
+}
+
+// ===== XỬ LÝ PUMP CONTROL =====
+static void parse_control(struct json_object *parsed, int pump_id, IngestEvent *ev) {
+    struct json_object *pump_id_obj, *state_obj, *command_id_obj, *origin_obj;
+    int has_pump = pump_id > 0;
+    
+    if (!has_pump && json_object_object_get_ex(parsed, "pump_id", &pump_id_obj)) {
+        pump_id = json_object_get_int(pump_id_obj);
+        has_pump = 1;
+    }
+    if (!has_pump || !json_object_object_get_ex(parsed, "state", &state_obj)) return;
+    
+    ev->type = INGEST_CONTROL;
+    ev->pump_id = pump_id;
+    ev->value = json_object_get_int(state_obj);
+    
+    // Our own commands come back with our origin and their ID. They
+    // were applied at submit; only one whose local apply failed
+    // goes on, so an echo can't undo a newer command.
+    if (json_object_object_get_ex(parsed, "origin", &origin_obj) &&
+        json_object_object_get_ex(parsed, "command_id", &command_id_obj) &&
+        strcmp(json_object_get_string(origin_obj), commands_origin()) == 0) {
+        ev->command_id = json_object_get_int64(command_id_obj);
+        if (commands_is_echo(ev->command_id)) {
+            ev->type = 0;
+            atomic_fetch_add(&stat_echoes, 1);
         }
+    }
+}
+
+// ===== XỬ LÝ PUMP FEEDBACK (Từ ESP32/Hardware) =====
+static void parse_feedback(struct json_object *parsed, int pump_id, IngestEvent *ev) {
+    struct json_object *pump_id_obj, *status_obj, *busy_obj, *alarm_obj;
+    int has_pump = pump_id > 0;
+    
+    if (!has_pump && json_object_object_get_ex(parsed, "pump_id", &pump_id_obj)) {
+        pump_id = json_object_get_int(pump_id_obj);
+        has_pump = 1;
+    }
+    
+    // Parse status (0=Unknown, 1=Running, 2=Stopped, 3=Error)
+    if (has_pump && json_object_object_get_ex(parsed, "status", &status_obj)) {
+        int status = json_object_get_int(status_obj);
         
-        MQTTClient_freeMessage(&message);
-        MQTTClient_free(topicName);
-        return 1;
+        // Validate status (0-3)
+        if (status >= 0 && status <= 3) {
+            ev->pump_id = pump_id;
+            ev->value = status;
+        } else {
+            printf("[MQTT-SUB] Invalid status value: %d (must be 0-3)\n", status);
+        }
     }
     
-    // ===== XỬ LÝ PUMP CONTROL =====
-    if (strcmp(topicName, "pump/control") == 0) {
-        struct json_object *parsed = json_tokener_parse(payload);
-        if (parsed) {
-            struct json_object *pump_id_obj, *state_obj;
-            
-            if (json_object_object_get_ex(parsed, "pump_id", &pump_id_obj) &&
-                json_object_object_get_ex(parsed, "state", &state_obj)) {
-                
-                int pump_id = json_object_get_int(pump_id_obj);
-                int state = json_object_get_int(state_obj);
-                
-                update_pump_status(pump_id, state);
-            }
-            
-            json_object_put(parsed);
+    // Parse busy (0=Idle, 1=Starting_P1, 2=Starting_P2)
+    if (json_object_object_get_ex(parsed, "busy", &busy_obj)) {
+        int busy = json_object_get_int(busy_obj);
+        
+        if (busy >= 0 && busy <= 2) {
+            ev->busy = busy;
+        } else {
+            printf("[MQTT-SUB] Invalid busy value: %d (must be 0-2)\n", busy);
         }
+    }
+    
+    // Parse alarm (0=No, 1=Yes)
+    if (json_object_object_get_ex(parsed, "alarm", &alarm_obj)) {
+        int alarm = json_object_get_int(alarm_obj);
         
-        MQTTClient_freeMessage(&message);
-        MQTTClient_free(topicName);
-        return 1;
+        if (alarm == 0 || alarm == 1) {
+            ev->alarm = alarm;
+        } else {
+            printf("[MQTT-SUB] Invalid alarm value: %d (must be 0 or 1)\n", alarm);
+        }
     }
     
-    // ===== XỬ LÝ PUMP FEEDBACK (Từ ESP32/Hardware) =====
-    if (strcmp(topicName, "pump/feedback") == 0) {
-        struct json_object *parsed = json_tokener_parse(payload);
-        if (parsed) {
-            struct json_object *pump_id_obj, *status_obj, *busy_obj, *alarm_obj;
-            
-            // Parse pump_id và status (0=Unknown, 1=Running, 2=Stopped, 3=Error)
-            if (json_object_object_get_ex(parsed, "pump_id", &pump_id_obj) &&
-                json_object_object_get_ex(parsed, "status", &status_obj)) {
-                
-                int pump_id = json_object_get_int(pump_id_obj);
-                int status = json_object_get_int(status_obj);
-                
-                // Validate status (0-3)
-                if (status >= 0 && status <= 3) {
-                    update_pump_feedback(pump_id, status);
-                } else {
-                    printf("[MQTT-SUB] Invalid pump status: %d (must be 0-3)\n", status);
-                }
-            }
-            
-            int busy_updated = 0, alarm_updated = 0;
-            int new_busy = -1, new_alarm = -1;
-            
-            // Parse busy (0=Idle, 1=Starting_P1, 2=Starting_P2)
-            if (json_object_object_get_ex(parsed, "busy", &busy_obj)) {
-                int busy = json_object_get_int(busy_obj);
-                
-                if (busy >= 0 && busy <= 2) {
-                    new_busy = busy;
-                    busy_updated = 1;
-                } else {
-                    printf("[MQTT-SUB] Invalid busy value: %d (must be 0-2)\n", busy);
-                }
-            }
-            
-            // Parse alarm (0=No, 1=Yes)
-            if (json_object_object_get_ex(parsed, "alarm", &alarm_obj)) {
-                int alarm = json_object_get_int(alarm_obj);
-                
-                if (alarm == 0 || alarm == 1) {
-                    new_alarm = alarm;
-                    alarm_updated = 1;
-                } else {
-                    printf("[MQTT-SUB] Invalid alarm value: %d (must be 0 or 1)\n", alarm);
-                }
-            }
-            
-            // Update system status if busy or alarm changed
-            if (busy_updated || alarm_updated) {
-                pthread_mutex_lock(&lock);
-                if (!busy_updated) new_busy = current_pump_status.busy;
-                if (!alarm_updated) new_alarm = current_pump_status.alarm;
-                pthread_mutex_unlock(&lock);
-                
-                update_system_status(new_busy, new_alarm);
-            }
-            
-            json_object_put(parsed);
+    if (ev->pump_id > 0 || ev->busy >= 0 || ev->alarm >= 0) {
+        ev->type = INGEST_FEEDBACK;
+    }
+}
+
+// Every filter we subscribe to. On the per-device ones the topic names the
+// gateway ("site:gw" as device_id) and pump, and wins over the payload; a
+// heartbeat there updates that gateway's own registry slot.
+typedef struct {
+    const char *filter;
+    MqttParseFn parse;
+    int site;               // capture index, -1 = not in the topic
+    int gateway;
+    int pump;
+} MqttRoute;
+
+static const MqttRoute mqtt_routes[] = {
+    {"gateway/heartbeat",               parse_heartbeat, -1, -1, -1},
+    {"pump/control",                    parse_control,   -1, -1, -1},
+    {"pump/feedback",                   parse_feedback,  -1, -1, -1},
+    {"site/+/gw/+/heartbeat",           parse_heartbeat,  0,  1, -1},
+    {"site/+/gw/+/pump/+/control",      parse_control,    0,  1,  2},
+    {"site/+/gw/+/pump/+/feedback",     parse_feedback,   0,  1,  2},
+};
+
+#define MQTT_ROUTE_COUNT    (int)(sizeof(mqtt_routes) / sizeof(mqtt_routes[0]))
+
+static TopicRouter *topic_router = NULL;
+static char *sub_topics[MQTT_ROUTE_COUNT];
+static int sub_qos[MQTT_ROUTE_COUNT];
+
+typedef struct {
+    const MqttRoute *route;
+    IngestEvent *ev;
+    int pump_id;
+    int rejected;           // matched, but the topic's device or pump is bad
+} MqttDispatch;
+
+// First match wins; the captures point into the topic and are only valid here
+static int route_topic(void *arg, const void *route, const TopicCaptures *caps) {
+    MqttDispatch *d = arg;
+    const MqttRoute *r = route;
+    
+    if (r->gateway >= 0) {
+        const TopicSegment *gw = &caps->seg[r->gateway];
+        int n = r->site >= 0 ? snprintf(d->ev->device_id, sizeof(d->ev->device_id), "%.*s:%.*s",
+                                        caps->seg[r->site].len, caps->seg[r->site].s, gw->len, gw->s)
+                             : snprintf(d->ev->device_id, sizeof(d->ev->device_id), "%.*s", gw->len, gw->s);
+        if (n >= (int)sizeof(d->ev->device_id)) {
+            printf("[MQTT-SUB] Device in topic too long, dropped\n");
+            d->rejected = 1;
+            return 1;
+        }
+    }
+    if (r->pump >= 0) {
+        long long pump_id = topic_segment_int(&caps->seg[r->pump]);
+        if (pump_id < 1 || pump_id > 1000000) {
+            printf("[MQTT-SUB] Bad pump in topic, dropped\n");
+            d->rejected = 1;
+            return 1;
+        }
+        d->pump_id = (int)pump_id;
+    }
+    d->route = r;
+    return 1;
+}
+
+// Built on the first start and kept: it's read-only from then on
+static int routes_build() {
+    if (topic_router) return 0;
+    topic_router = topics_new();
+    if (!topic_router) return -1;
+    
+    for (int i = 0; i < MQTT_ROUTE_COUNT; i++) {
+        if (topics_add(topic_router, mqtt_routes[i].filter, &mqtt_routes[i]) != 0) {
+            printf("[MQTT] Bad topic filter: %s\n", mqtt_routes[i].filter);
+            topics_free(topic_router);
+            topic_router = NULL;
+            return -1;
         }
+        sub_topics[i] = (char *)mqtt_routes[i].filter;
+        sub_qos[i] = 1;
+    }
+    return 0;
+}
+
+// Route, parse into an IngestEvent and hand it to the worker. Nothing here
+// takes `lock` or touches SQLite, so a slow disk can't stall MQTT receive.
+static int mqtt_message_arrived(void *context, char *topicName, int topicLen, MQTTAsync_message *message) {
+    char payload[1024];
+    atomic_fetch_add(&stat_received, 1);
+    snprintf(payload, sizeof(payload), "%.*s", (int)message->payloadlen, (char*)message->payload);
+    
+    IngestEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.busy = -1;
+    ev.alarm = -1;
+    
+    MqttDispatch d = {NULL, &ev, 0, 0};
+    topics_match(topic_router, topicName, topicLen, route_topic, &d);
+    
+    struct json_object *parsed = NULL;
+    struct json_object *device_id_obj;
+    
+    if (!d.route) {
+        if (!d.rejected) printf("[MQTT-SUB] Unhandled topic: %s\n", topicName);
+    } else if ((parsed = json_tokener_parse(payload)) != NULL) {
+        d.route->parse(parsed, d.pump_id, &ev);
         
-        MQTTClient_freeMessage(&message);
-        MQTTClient_free(topicName);
-        return 1;
+        if (ev.type && d.route->gateway < 0 && json_object_object_get_ex(parsed, "device_id", &device_id_obj)) {
+            snprintf(ev.device_id, sizeof(ev.device_id), "%s", json_object_get_string(device_id_obj));
+        }
+        if (ev.type && ingest_push(&ev) != 0) {
+            printf("[MQTT-SUB] Ingest queue full, dropped %s message\n", topicName);
+        }
     }
     
-    // ===== TOPIC KHÔNG XÁC ĐỊNH =====
-    printf("[MQTT-SUB] Unhandled topic: %s\n", topicName);
+    if (parsed) json_object_put(parsed);
     
-    MQTTClient_freeMessage(&message);
-    MQTTClient_free(topicName);
+    MQTTAsync_freeMessage(&message);
+    MQTTAsync_free(topicName);
     return 1;
 }
 
-void* mqtt_publisher_thread(void *arg) {
-    MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
-    MQTTClient_message msg = MQTTClient_message_initializer;
-    int rc;
+// ===== PUBLISH =====
+// A slot in the window, waiting up to MQTT_WINDOW_WAIT_MS for one
+static int window_acquire() {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += MQTT_WINDOW_WAIT_MS / 1000;
+    deadline.tv_nsec += (MQTT_WINDOW_WAIT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    
+    int rc = 0;
+    pthread_mutex_lock(&window_lock);
+    while (window_used >= mqtt_cfg.inflight_max && rc == 0) {
+        rc = pthread_cond_timedwait(&window_open, &window_lock, &deadline);
+    }
+    if (rc == 0) window_used++;
+    pthread_mutex_unlock(&window_lock);
+    return rc == 0 ? 0 : -1;
+}
+
+static void window_release() {
+    pthread_mutex_lock(&window_lock);
+    if (window_used > 0) window_used--;
+    pthread_cond_signal(&window_open);
+    pthread_mutex_unlock(&window_lock);
+}
+
+// Completions run on the client's thread: keep them short. paho has already
+// dropped the message from its in-flight list, so the next publish goes
+// straight out.
+static void publish_acked(void *context, MQTTAsync_successData *response) {
+    atomic_fetch_add(&stat_acked, 1);
+    window_release();
+}
+
+static void publish_failed(void *context, MQTTAsync_failureData *response) {
+    atomic_fetch_add(&stat_failed, 1);
+    window_release();
+    printf("[MQTT] Publish %d failed, rc=%d\n", response ? response->token : 0, response ? response->code : 0);
+}
+
+// A pump command on its way to the broker
+typedef struct {
+    long long seq;              // outbox record, 0 if published directly (no outbox)
+    long long command_id;
+    long long created_ms;
+    int len;
+    char payload[];
+} ControlMsg;
+
+static ControlMsg* control_msg_new(long long seq, long long command_id, long long created_ms, const char *payload, int len) {
+    ControlMsg *m = malloc(sizeof(*m) + len + 1);
+    if (!m) return NULL;
+    m->seq = seq;
+    m->command_id = command_id;
+    m->created_ms = created_ms;
+    m->len = len;
+    memcpy(m->payload, payload, len);
+    m->payload[len] = '\0';
+    return m;
+}
+
+static void control_acked(void *context, MQTTAsync_successData *response) {
+    ControlMsg *m = context;
+    atomic_fetch_add(&stat_acked, 1);
+    window_release();
     
-    sleep(1);
+    if (m->seq) {
+        pthread_mutex_lock(&conn_lock);
+        outbox_ack(&outbox, m->seq);
+        pthread_mutex_unlock(&conn_lock);
+    }
+    commands_delivered(m->command_id);
+    free(m);
+}
+
+// Mostly the connection going away before the PUBACK. An outbox record is
+// still on disk and goes again after the reconnect.
+static void control_failed(void *context, MQTTAsync_failureData *response) {
+    ControlMsg *m = context;
+    atomic_fetch_add(&stat_failed, 1);
+    window_release();
     
-    MQTTClient_create(&mqtt_pub_client, BROKER, "pump_mqtt_pub", MQTTCLIENT_PERSISTENCE_NONE, NULL);
+    if (m->seq) {
+        pthread_mutex_lock(&conn_lock);
+        // Still connected, so it wasn't the connection: start over from the oldest
+        if (outbox_ready && conn_state == MQTT_UP) outbox_rewind(&outbox);
+        pthread_cond_signal(&conn_cond);
+        pthread_mutex_unlock(&conn_lock);
+    } else {
+        commands_publish_failed(m->command_id, "Publish failed");
+    }
+    free(m);
+}
+
+static int publish(const char *topic, const void *payload, int len, int qos, int retained, int *token,
+                   MQTTAsync_onSuccess *on_success, MQTTAsync_onFailure *on_failure, void *context) {
+    MQTTAsync_message msg = MQTTAsync_message_initializer;
+    MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+    msg.payload = (void *)payload;
+    msg.payloadlen = len;
+    msg.qos = qos;
+    msg.retained = retained;
+    opts.onSuccess = on_success;
+    opts.onFailure = on_failure;
+    opts.context = context;
     
-    conn_opts.keepAliveInterval = 20;
-    conn_opts.cleansession = 1;
-    conn_opts.username = USERNAME;
-    conn_opts.password = PASSWORD;
+    if (window_acquire() != 0) return -1;
+    
+    int rc = MQTTASYNC_FAILURE;
+    pthread_rwlock_rdlock(&client_lock);
+    if (client) rc = MQTTAsync_sendMessage(client, topic, &msg, &opts);
+    pthread_rwlock_unlock(&client_lock);
+    
+    if (rc != MQTTASYNC_SUCCESS) {
+        window_release();
+        return -1;
+    }
+    atomic_fetch_add(&stat_published, 1);
+    if (token) *token = opts.token;
+    return 0;
+}
+
+int mqtt_publish(const char *topic, const void *payload, int len, int qos, int retained, int *token) {
+    return publish(topic, payload, len, qos, retained, token, publish_acked, publish_failed, NULL);
+}
+
+// With an outbox every command goes through it and the connection thread
+// publishes them in outbox order, so one sent just as the connection drops
+// can't overtake the ones queued while it was down.
+int mqtt_publish_control(long long id, const char *payload) {
+    int len = (int)strlen(payload);
+    long long now = now_ms();
     
-    printf("[MQTT-PUB] Connecting...\n");
-    if ((rc = MQTTClient_connect(mqtt_pub_client, &conn_opts)) != MQTTCLIENT_SUCCESS) {
-        printf("[MQTT-PUB] Failed, rc=%d\n", rc);
-        return NULL;
+    pthread_mutex_lock(&conn_lock);
+    if (outbox_ready) {
+        int rc = outbox_push(&outbox, id, now, payload, len);
+        int offline = conn_state != MQTT_UP;
+        pthread_cond_signal(&conn_cond);
+        pthread_mutex_unlock(&conn_lock);
+        return rc != 0 ? -1 : offline;
     }
-    printf("[MQTT-PUB] Connected!\n");
+    pthread_mutex_unlock(&conn_lock);
     
-    while (running) {
-        pthread_mutex_lock(&lock);
-        char payload[256];
-        // snprintf(payload, sizeof(payload), 
-        //          "{\"pump1\":%d,\"pump2\":%d,\"pump3\":%d,\"timestamp\":%ld}",
-        //          current_pump_status.pump1, 
-        //          current_pump_status.pump2,
-        //          current_pump_status.pump3,
-        //          current_pump_status.timestamp);
-        snprintf(payload, sizeof(payload), 
-        "{\"pump1\":%d,\"pump1_status\":%d,\"pump2\":%d,\"pump2_status\":%d,\"busy\":%d,\"alarm\":%d,\"timestamp\":%ld}",
-        current_pump_status.pump1, current_pump_status.pump1_status,
-        current_pump_status.pump2, current_pump_status.pump2_status,
-        current_pump_status.busy, current_pump_status.alarm,
-        current_pump_status.timestamp);
-        pthread_mutex_unlock(&lock);
+    ControlMsg *m = control_msg_new(0, id, now, payload, len);
+    if (!m) return -1;
+    if (publish("pump/control", m->payload, len, 1, 0, NULL, control_acked, control_failed, m) == 0) return 0;
+    free(m);
+    return -1;
+}
+
+// ===== CONNECTION =====
+static void subscribe_failed(void *context, MQTTAsync_failureData *response) {
+    printf("[MQTT] Subscribe failed, rc=%d\n", response ? response->code : 0);
+}
+
+// Under conn_lock: the next attempt after a doubling delay, drawn from the
+// upper half of it
+static void schedule_reconnect() {
+    long long delay = mqtt_cfg.reconnect_min_ms;
+    for (int i = 0; i < conn_attempt && delay < mqtt_cfg.reconnect_max_ms; i++) delay *= 2;
+    if (delay > mqtt_cfg.reconnect_max_ms) delay = mqtt_cfg.reconnect_max_ms;
+    delay = delay / 2 + rand_r(&jitter_seed) % (delay / 2 + 1);
+    
+    conn_attempt++;
+    conn_state = MQTT_DOWN;
+    reconnect_at_ms = now_ms() + delay;
+    pthread_cond_signal(&conn_cond);
+    printf("[MQTT] Reconnecting in %lld ms (attempt %d)\n", delay, conn_attempt);
+}
+
+// First connect and every reconnect: with a clean session the
+// subscriptions have to be made again each time
+static void on_connected(void *context, char *cause) {
+    atomic_fetch_add(&connect_generation, 1);
+    atomic_store(&connected, 1);
+    pthread_mutex_lock(&conn_lock);
+    if (ever_connected) atomic_fetch_add(&stat_reconnects, 1);
+    ever_connected = 1;
+    conn_state = MQTT_UP;
+    conn_attempt = 0;
+    // Whatever was in flight when the last connection dropped goes again
+    if (outbox_ready) outbox_rewind(&outbox);
+    pthread_cond_signal(&conn_cond);
+    pthread_mutex_unlock(&conn_lock);
+    printf("[MQTT] Connected to %s\n", mqtt_cfg.broker);
+    if (!mqtt_cfg.subscribe) return;
+    
+    MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+    opts.onFailure = subscribe_failed;
+    pthread_rwlock_rdlock(&client_lock);
+    if (client) MQTTAsync_subscribeMany(client, MQTT_ROUTE_COUNT, sub_topics, sub_qos, &opts);
+    pthread_rwlock_unlock(&client_lock);
+    printf("[MQTT] Subscribed to %d topic filters\n", MQTT_ROUTE_COUNT);
+}
+
+static void connect_failed(void *context, MQTTAsync_failureData *response) {
+    atomic_fetch_add(&stat_connect_failures, 1);
+    printf("[MQTT] Connect failed, rc=%d\n", response ? response->code : 0);
+    pthread_mutex_lock(&conn_lock);
+    schedule_reconnect();
+    pthread_mutex_unlock(&conn_lock);
+}
+
+static void connection_lost(void *context, char *cause) {
+    atomic_store(&connected, 0);
+    printf("[MQTT] Connection lost: %s\n", cause ? cause : "unknown");
+    pthread_mutex_lock(&conn_lock);
+    conn_attempt = 0;
+    client_stale = 1;
+    schedule_reconnect();
+    pthread_mutex_unlock(&conn_lock);
+}
+
+static int client_create() {
+    MQTTAsync c;
+    int rc = MQTTAsync_create(&c, mqtt_cfg.broker, mqtt_cfg.client_id, MQTTCLIENT_PERSISTENCE_NONE, NULL);
+    if (rc != MQTTASYNC_SUCCESS) {
+        printf("[MQTT] Create failed, rc=%d\n", rc);
+        return -1;
+    }
+    MQTTAsync_setCallbacks(c, NULL, connection_lost, mqtt_message_arrived, NULL);
+    MQTTAsync_setConnected(c, NULL, on_connected);
+    
+    pthread_rwlock_wrlock(&client_lock);
+    client = c;
+    pthread_rwlock_unlock(&client_lock);
+    return 0;
+}
+
+// Fails whatever the client still holds (outbox records go again from disk)
+static void client_destroy() {
+    pthread_rwlock_wrlock(&client_lock);
+    MQTTAsync c = client;
+    client = NULL;
+    pthread_rwlock_unlock(&client_lock);
+    if (!c) return;
+    
+    MQTTAsync_destroy(&c);
+    // No completion can come from it any more
+    pthread_mutex_lock(&window_lock);
+    window_used = 0;
+    pthread_cond_broadcast(&window_open);
+    pthread_mutex_unlock(&window_lock);
+}
+
+static int connect_start() {
+    MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer;
+    conn_opts.keepAliveInterval = mqtt_cfg.keepalive_s;
+    conn_opts.cleansession = 1;
+    conn_opts.username = mqtt_cfg.username;
+    conn_opts.password = mqtt_cfg.password;
+    conn_opts.maxInflight = mqtt_cfg.inflight_max;
+    conn_opts.onFailure = connect_failed;
+    
+    int rc = MQTTASYNC_FAILURE;
+    pthread_rwlock_rdlock(&client_lock);
+    if (client) rc = MQTTAsync_connect(client, &conn_opts);
+    pthread_rwlock_unlock(&client_lock);
+    return rc == MQTTASYNC_SUCCESS ? 0 : -1;
+}
+
+// Connects, reconnects on the backoff schedule and drains the outbox in
+// order while connected. Draining here rather than in the client's
+// callbacks is what lets it wait for room in the window.
+static void* connection_thread(void *arg) {
+    pthread_mutex_lock(&conn_lock);
+    while (conn_running) {
+        long long now = now_ms();
         
-        msg.payload = payload;
-        msg.payloadlen = strlen(payload);
-        msg.qos = 1;
-        msg.retained = 1;
+        if (conn_state == MQTT_DOWN && now >= reconnect_at_ms) {
+            conn_state = MQTT_CONNECTING;
+            int fresh = client_stale;
+            client_stale = 0;
+            pthread_mutex_unlock(&conn_lock);
+            
+            // After a lost connection paho still holds publishes it accepted
+            // but never wrote; a new client drops them instead of sending
+            // them late, behind newer ones
+            if (fresh) {
+                client_destroy();
+                client_create();
+            }
+            printf("[MQTT] Connecting to %s (%d in flight)...\n", mqtt_cfg.broker, mqtt_cfg.inflight_max);
+            int rc = connect_start();
+            pthread_mutex_lock(&conn_lock);
+            if (rc != 0 && conn_state == MQTT_CONNECTING) {
+                atomic_fetch_add(&stat_connect_failures, 1);
+                schedule_reconnect();
+            }
+            continue;
+        }
         
-        MQTTClient_publishMessage(mqtt_pub_client, "pump/status", &msg, NULL);
-        printf("[MQTT-PUB] Published: %s\n", payload);
+        const OutboxEntry *e = conn_state == MQTT_UP && outbox_ready ? outbox_next(&outbox) : NULL;
+        if (e && now - e->created_ms > mqtt_cfg.outbox_max_age_s * 1000LL) {
+            long long id = e->command_id;
+            outbox_sent(&outbox, e->seq);
+            outbox_ack(&outbox, e->seq);
+            outbox.expired++;
+            pthread_mutex_unlock(&conn_lock);
+            commands_publish_failed(id, "Expired in the offline queue");
+            pthread_mutex_lock(&conn_lock);
+            continue;
+        }
+        if (e) {
+            long long seq = e->seq;
+            ControlMsg *m = control_msg_new(seq, e->command_id, e->created_ms, e->payload, e->len);
+            pthread_mutex_unlock(&conn_lock);
+            int rc = m ? publish("pump/control", m->payload, m->len, 1, 0, NULL, control_acked, control_failed, m) : -1;
+            pthread_mutex_lock(&conn_lock);
+            if (rc == 0) {
+                // Unless a reconnect rewound the outbox meanwhile
+                outbox_sent(&outbox, seq);
+                continue;
+            }
+            // Not connected after all, or the window stayed full: again shortly
+            free(m);
+        }
         
-        sleep(5);
+        // Appends are durable within MQTT_OUTBOX_SYNC_MS, synced off the lock
+        // on a duplicate, which stays valid if a compaction swaps the file
+        if (outbox_ready && outbox.dirty) {
+            int fd = dup(outbox.fd);
+            outbox.dirty = 0;
+            pthread_mutex_unlock(&conn_lock);
+            if (fd < 0 || fdatasync(fd) != 0) printf("[OUTBOX] fdatasync failed\n");
+            if (fd >= 0) close(fd);
+            pthread_mutex_lock(&conn_lock);
+        }
+        
+        long long wake = now_ms() + MQTT_OUTBOX_SYNC_MS;
+        if (conn_state == MQTT_DOWN && reconnect_at_ms < wake) wake = reconnect_at_ms;
+        struct timespec ts = {wake / 1000, (wake % 1000) * 1000000};
+        pthread_cond_timedwait(&conn_cond, &conn_lock, &ts);
     }
-    
-    MQTTClient_disconnect(mqtt_pub_client, 10000);
-    MQTTClient_destroy(&mqtt_pub_client);
+    pthread_mutex_unlock(&conn_lock);
     return NULL;
 }
 
-void* mqtt_subscriber_thread(void *arg) {
-    MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
-    int rc;
+void mqtt_default_config(MqttConfig *cfg) {
+    cfg->broker = BROKER;
+    cfg->client_id = MQTT_CLIENT_ID;
+    cfg->username = USERNAME;
+    cfg->password = PASSWORD;
+    cfg->inflight_max = MQTT_INFLIGHT_MAX;
+    cfg->keepalive_s = MQTT_KEEPALIVE_S;
+    cfg->subscribe = 1;
+    cfg->reconnect_min_ms = MQTT_RECONNECT_MIN_MS;
+    cfg->reconnect_max_ms = MQTT_RECONNECT_MAX_MS;
+    cfg->outbox_path = MQTT_OUTBOX_PATH;
+    cfg->outbox_max = MQTT_OUTBOX_MAX;
+    cfg->outbox_max_bytes = MQTT_OUTBOX_MAX_BYTES;
+    cfg->outbox_max_age_s = MQTT_OUTBOX_MAX_AGE_S;
+}
+
+int mqtt_start(const MqttConfig *cfg) {
+    mqtt_cfg = *cfg;
+    if (mqtt_cfg.inflight_max < 1) mqtt_cfg.inflight_max = 1;
+    if (mqtt_cfg.reconnect_min_ms < 1) mqtt_cfg.reconnect_min_ms = MQTT_RECONNECT_MIN_MS;
+    if (mqtt_cfg.reconnect_max_ms < mqtt_cfg.reconnect_min_ms) mqtt_cfg.reconnect_max_ms = mqtt_cfg.reconnect_min_ms;
+    window_used = 0;
     
-    MQTTClient_create(&mqtt_sub_client, BROKER, "pump_mqtt_sub", MQTTCLIENT_PERSISTENCE_NONE, NULL);
-    MQTTClient_setCallbacks(mqtt_sub_client, NULL, NULL, mqtt_message_arrived, NULL);
+    conn_state = MQTT_DOWN;
+    conn_attempt = 0;
+    reconnect_at_ms = 0;
+    ever_connected = 0;
+    client_stale = 0;
+    jitter_seed = (unsigned)now_ms() ^ (unsigned)getpid();
     
-    conn_opts.keepAliveInterval = 20;
-    conn_opts.cleansession = 1;
-    conn_opts.username = USERNAME;
-    conn_opts.password = PASSWORD;
+    if (mqtt_cfg.outbox_path) {
+        if (outbox_open(&outbox, mqtt_cfg.outbox_path, mqtt_cfg.outbox_max, mqtt_cfg.outbox_max_bytes) == 0) {
+            outbox_ready = 1;
+        } else {
+            printf("[MQTT] No offline queue: commands fail while the broker is unreachable\n");
+        }
+    }
+    
+    if (routes_build() != 0 || client_create() != 0) {
+        mqtt_stop();
+        return -1;
+    }
+    
+    conn_running = 1;
+    if (pthread_create(&conn_tid, NULL, connection_thread, NULL) != 0) {
+        conn_running = 0;
+        mqtt_stop();
+        return -1;
+    }
+    return 0;
+}
+
+void mqtt_stop() {
+    if (conn_running) {
+        pthread_mutex_lock(&conn_lock);
+        conn_running = 0;
+        pthread_cond_signal(&conn_cond);
+        pthread_mutex_unlock(&conn_lock);
+        pthread_join(conn_tid, NULL);
+    }
+    
+    pthread_rwlock_wrlock(&client_lock);
+    MQTTAsync c = client;
+    client = NULL;
+    pthread_rwlock_unlock(&client_lock);
     
-    printf("[MQTT-SUB] Connecting...\n");
-    if ((rc = MQTTClient_connect(mqtt_sub_client, &conn_opts)) != MQTTCLIENT_SUCCESS) {
-        printf("[MQTT-SUB] Failed, rc=%d\n", rc);
-        return NULL;
+    if (c) {
+        // Publishes already handed over get up to the timeout for their PUBACK;
+        // commands still unacknowledged after that stay in the outbox
+        if (MQTTAsync_isConnected(c)) {
+            MQTTAsync_disconnectOptions opts = MQTTAsync_disconnectOptions_initializer;
+            opts.timeout = MQTT_STOP_TIMEOUT_MS;
+            MQTTAsync_disconnect(c, &opts);
+            for (int waited = 0; MQTTAsync_isConnected(c) && waited < MQTT_STOP_TIMEOUT_MS + 1000; waited += 10) {
+                usleep(10000);
+            }
+        }
+        MQTTAsync_destroy(&c);
+    }
+    atomic_store(&connected, 0);
+    
+    pthread_mutex_lock(&conn_lock);
+    if (outbox_ready) {
+        outbox_close(&outbox);
+        outbox_ready = 0;
+    }
+    conn_state = MQTT_DOWN;
+    pthread_mutex_unlock(&conn_lock);
+}
+
+void mqtt_get_stats(MqttStats *out) {
+    out->connected = atomic_load(&connected);
+    out->inflight_max = mqtt_cfg.inflight_max;
+    out->published = atomic_load(&stat_published);
+    out->acked = atomic_load(&stat_acked);
+    out->failed = atomic_load(&stat_failed);
+    out->received = atomic_load(&stat_received);
+    out->inflight = (int)(out->published - out->acked - out->failed);
+    out->reconnects = atomic_load(&stat_reconnects);
+    out->connect_failures = atomic_load(&stat_connect_failures);
+    out->pump_updates = atomic_load(&stat_pump_updates);
+    out->full_status = atomic_load(&stat_full_status);
+    out->echoes = atomic_load(&stat_echoes);
+    
+    pthread_mutex_lock(&conn_lock);
+    out->outbox_depth = outbox_ready ? outbox_depth(&outbox) : 0;
+    out->outbox_unsent = outbox_ready ? outbox_unsent(&outbox) : 0;
+    out->outbox_max = outbox_ready ? outbox.capacity : 0;
+    out->outbox_bytes = outbox_ready ? (long long)outbox.live_bytes : 0;
+    out->outbox_queued = outbox.queued;
+    out->outbox_dropped = outbox.dropped;
+    out->outbox_expired = outbox.expired;
+    pthread_mutex_unlock(&conn_lock);
+}
+
+// ===== STATUS PUBLISHER =====
+// Woken by the events journal instead of polling. Each changed pump goes to
+// its own retained topic at most every MQTT_STATUS_MIN_INTERVAL_MS, so a
+// burst of changes is one publish per pump with its newest state. The full
+// listing on pump/status follows at most every MQTT_STATUS_FULL_INTERVAL_MS
+// and is only repeated without a change every MQTT_STATUS_KEEPALIVE_S.
+typedef struct {
+    char topic[128];
+    char payload[EVENTS_FRAME_MAX];
+    int len;
+} PumpUpdate;
+
+typedef struct {
+    PumpUpdate *items;
+    int count;
+} PumpBatch;
+
+static pthread_mutex_t status_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t status_cond = PTHREAD_COND_INITIALIZER;
+static int status_dirty = 0;
+
+// Journal listener, on whichever thread changed the state
+static void status_changed(unsigned long long seq) {
+    pthread_mutex_lock(&status_lock);
+    if (!status_dirty) {
+        status_dirty = 1;
+        pthread_cond_signal(&status_cond);
+    }
+    pthread_mutex_unlock(&status_lock);
+}
+
+static int pump_topic(char *buf, size_t max, const char *device_id, int pump_id) {
+    return snprintf(buf, max, "%s%s/%d", MQTT_PUMP_TOPIC, device_id, pump_id);
+}
+
+// Runs under the journal lock: copy out, publish afterwards
+static int collect_pump(void *arg, unsigned long long seq, const char *event, const char *data, int data_len,
+                        const char *frame, int frame_len) {
+    PumpBatch *batch = arg;
+    if (batch->count == MQTT_STATUS_BATCH) return 1;
+    if (strcmp(event, "pump") != 0) return 0;
+    
+    char device_id[64];
+    int pump_id;
+    if (sscanf(data, "{\"device_id\":\"%63[^\"]\",\"pump_id\":%d", device_id, &pump_id) != 2) return 0;
+    
+    PumpUpdate *u = &batch->items[batch->count++];
+    pump_topic(u->topic, sizeof(u->topic), device_id, pump_id);
+    u->len = data_len < (int)sizeof(u->payload) ? data_len : (int)sizeof(u->payload) - 1;
+    memcpy(u->payload, data, u->len);
+    return 0;
+}
+
+static int publish_batch(const PumpBatch *batch) {
+    for (int i = 0; i < batch->count; i++) {
+        const PumpUpdate *u = &batch->items[i];
+        if (mqtt_publish(u->topic, u->payload, u->len, 1, 1, NULL) != 0) return -1;
+        atomic_fetch_add(&stat_pump_updates, 1);
+    }
+    return 0;
+}
+
+static int publish_all_pumps(PumpBatch *batch, unsigned long long *seq);
+
+// Pumps changed after *seq, newest state each; *seq moves only past what
+// was published. Falls back to every pump when the journal has moved on.
+static int publish_changed_pumps(PumpBatch *batch, unsigned long long *seq) {
+    unsigned long long head = events_head();
+    while (*seq < head) {
+        unsigned long long next;
+        batch->count = 0;
+        if (events_scan(*seq, head, NULL, collect_pump, batch, &next) < 0) return publish_all_pumps(batch, seq);
+        if (publish_batch(batch) != 0) return -1;
+        *seq = next;
     }
-    printf("[MQTT-SUB] Connected!\n");
-    MQTTClient_subscribe(mqtt_sub_client, "gateway/heartbeat", 1);
-    MQTTClient_subscribe(mqtt_sub_client, "pump/control", 1);
-    MQTTClient_subscribe(mqtt_sub_client, "pump/feedback", 1);
-    printf("[MQTT-SUB] Subscribed to: pump/control and pump/feedback\n");
+    return 0;
+}
+
+// Every pump: after a (re)connect, when the broker may have lost them or
+// changes were missed, and when the journal no longer covers *seq
+static int publish_all_pumps(PumpBatch *batch, unsigned long long *seq) {
+    unsigned long long head = events_head();
+    batch->count = 0;
+    
+    for (int gw = 0; gw < registry_gateway_count(); gw++) {
+        for (int slot = registry_gateway_first_pump(gw); slot >= 0; slot = registry_gateway_next_pump(slot)) {
+            PumpStatus p;
+            if (registry_read(slot, &p) != 0) continue;
+            
+            PumpUpdate *u = &batch->items[batch->count++];
+            pump_topic(u->topic, sizeof(u->topic), p.device_id, p.pump_id);
+            u->len = snprintf(u->payload, sizeof(u->payload),
+                              "{\"device_id\":\"%s\",\"pump_id\":%d,\"command\":%d,\"status\":%d,\"busy\":%d,\"alarm\":%d,\"timestamp\":%ld}",
+                              p.device_id, p.pump_id, p.command, p.status, p.busy, p.alarm, p.timestamp);
+            
+            if (batch->count == MQTT_STATUS_BATCH) {
+                if (publish_batch(batch) != 0) return -1;
+                batch->count = 0;
+            }
+        }
+    }
+    if (publish_batch(batch) != 0) return -1;
+    *seq = head;
+    return 0;
+}
+
+static void publish_full_status() {
+    size_t len = 0;
+    char *payload = registry_render_json(NULL, &len);
+    if (!payload) return;
+    
+    if (mqtt_publish("pump/status", payload, (int)len, 1, 1, NULL) == 0) {
+        atomic_fetch_add(&stat_full_status, 1);
+        printf("[MQTT-PUB] Published %zu bytes of pump state\n", len);
+    }
+    free(payload);
+}
+
+void* mqtt_publisher_thread(void *arg) {
+    PumpBatch batch = {calloc(MQTT_STATUS_BATCH, sizeof(PumpUpdate)), 0};
+    if (!batch.items) return NULL;
+    events_add_listener(status_changed);
+    
+    unsigned long long seq = events_head();
+    unsigned long long full_version = 0;
+    unsigned generation = 0;            // connect generation the pump topics were last filled for
+    long long pumps_at = 0, full_at = 0;
     
     while (running) {
-        sleep(1);
+        long long now = now_ms();
+        unsigned gen = atomic_load(&connect_generation);
+        
+        pthread_mutex_lock(&status_lock);
+        int dirty = status_dirty;
+        if (dirty && now - pumps_at >= MQTT_STATUS_MIN_INTERVAL_MS) status_dirty = 0;
+        pthread_mutex_unlock(&status_lock);
+        
+        if (atomic_load(&connected)) {
+            if (gen != generation) {
+                if (publish_all_pumps(&batch, &seq) == 0) generation = gen;
+                pumps_at = now;
+            } else if (dirty && now - pumps_at >= MQTT_STATUS_MIN_INTERVAL_MS) {
+                // Not published (the connection went): the next round retries from seq
+                if (publish_changed_pumps(&batch, &seq) != 0) status_changed(0);
+                pumps_at = now;
+            }
+            
+            unsigned long long version = registry_version();
+            if ((version != full_version && now - full_at >= MQTT_STATUS_FULL_INTERVAL_MS) ||
+                now - full_at >= MQTT_STATUS_KEEPALIVE_S * 1000LL) {
+                publish_full_status();
+                full_version = version;
+                full_at = now;
+            }
+        }
+        
+        // Until the next publish could be due, a change, or at most 1 s so
+        // shutdown and reconnects are noticed
+        long long wake = now + 1000;
+        if (dirty && pumps_at + MQTT_STATUS_MIN_INTERVAL_MS < wake) wake = pumps_at + MQTT_STATUS_MIN_INTERVAL_MS;
+        if (registry_version() != full_version && full_at + MQTT_STATUS_FULL_INTERVAL_MS < wake) {
+            wake = full_at + MQTT_STATUS_FULL_INTERVAL_MS;
+        }
+        struct timespec ts = {wake / 1000, (wake % 1000) * 1000000};
+        pthread_mutex_lock(&status_lock);
+        if (!status_dirty || now - pumps_at < MQTT_STATUS_MIN_INTERVAL_MS) {
+            pthread_cond_timedwait(&status_cond, &status_lock, &ts);
+        }
+        pthread_mutex_unlock(&status_lock);
     }
     
-    MQTTClient_disconnect(mqtt_sub_client, 10000);
-    MQTTClient_destroy(&mqtt_sub_client);
+    events_remove_listener(status_changed);
+    free(batch.items);
     return NULL;
-}
\ No newline at end of file
+}
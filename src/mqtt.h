@@ -1,17 +1,95 @@
 #ifndef MQTT_H
 #define MQTT_H
 
-#include <MQTTClient.h>
+#include <stddef.h>
+#include <MQTTAsync.h>
 
-#define MQTT_PUB_CLIENT_ID "mqtt_publisher"
-#define MQTT_SUB_CLIENT_ID "mqtt_subscriber"
-#define MQTT_PUB_TOPIC "sensor/data"
-#define MQTT_SUB_TOPIC "control/command"
+// One shared MQTTAsync connection for everything: the pump/status publisher,
+// the command sender and the subscriptions. The client's own thread writes
+// to the socket and runs the completions; a publish only waits when
+// inflight_max messages are already waiting for their PUBACK.
+#define MQTT_CLIENT_ID          "pump_mqtt"
+#define MQTT_KEEPALIVE_S        20
+#define MQTT_INFLIGHT_MAX       64      // QoS 1 publishes awaiting PUBACK
+#define MQTT_STOP_TIMEOUT_MS    10000   // lets in-flight publishes finish on shutdown
+#define MQTT_WINDOW_WAIT_MS     5000    // longest a publish waits for a free slot
 
-extern MQTTClient mqtt_pub_client;
-extern MQTTClient mqtt_sub_client;
+// pump/status: change-driven, see mqtt_publisher_thread()
+#define MQTT_PUMP_TOPIC             "pump/status/"  // + device_id/pump_id, one retained topic per pump
+#define MQTT_STATUS_MIN_INTERVAL_MS 200     // changes within this coalesce into one publish per pump
+#define MQTT_STATUS_FULL_INTERVAL_MS 1000   // full listing on pump/status at most this often
+#define MQTT_STATUS_KEEPALIVE_S     60      // full listing again when nothing changed
+#define MQTT_STATUS_BATCH           256     // pump updates copied out of the journal at a time
+
+// Reconnect: exponential backoff from MIN to MAX, each delay drawn from its
+// upper half so a restarted broker doesn't get every client at the same instant
+#define MQTT_RECONNECT_MIN_MS   500
+#define MQTT_RECONNECT_MAX_MS   60000
+
+// Pump commands published while the broker is unreachable wait here, on disk,
+// and go out in order once it is back (outbox.c)
+#define MQTT_OUTBOX_PATH        "/var/lib/pump_server/mqtt_outbox.dat"
+#define MQTT_OUTBOX_MAX         16384
+#define MQTT_OUTBOX_MAX_BYTES   (4 * 1024 * 1024)
+#define MQTT_OUTBOX_MAX_AGE_S   3600    // older commands fail instead of running late
+#define MQTT_OUTBOX_SYNC_MS     200     // fdatasync at most this long after an append
+
+typedef struct {
+    const char *broker;
+    const char *client_id;
+    const char *username;       // NULL = none
+    const char *password;
+    int inflight_max;
+    int keepalive_s;
+    int subscribe;              // 0: publish only (benchmarks)
+    int reconnect_min_ms;
+    int reconnect_max_ms;
+    const char *outbox_path;    // NULL: commands fail while disconnected
+    int outbox_max;
+    size_t outbox_max_bytes;
+    int outbox_max_age_s;
+} MqttConfig;
+
+typedef struct {
+    int connected;
+    int inflight_max;
+    int inflight;               // sent, not yet acknowledged or failed
+    unsigned long long published;
+    unsigned long long acked;
+    unsigned long long failed;
+    unsigned long long received;
+    unsigned long long reconnects;          // successful connects after the first
+    unsigned long long connect_failures;
+    unsigned long long pump_updates;        // per-pump retained publishes
+    unsigned long long full_status;         // full listings on pump/status
+    unsigned long long echoes;              // our own pump/control commands dropped on arrival
+    int outbox_depth;                       // queued, not yet acknowledged
+    int outbox_unsent;
+    int outbox_max;
+    long long outbox_bytes;                 // unacknowledged, what outbox_max_bytes caps
+    unsigned long long outbox_queued;
+    unsigned long long outbox_dropped;      // queue full: the command failed
+    unsigned long long outbox_expired;
+} MqttStats;
+
+void mqtt_default_config(MqttConfig *cfg);
+// 0 = client created; a connection thread connects in the background and
+// reconnects whenever the connection is lost or an attempt fails
+int mqtt_start(const MqttConfig *cfg);
+void mqtt_stop();
+
+// Any thread but the client's own (its callbacks). The payload is copied.
+// 0 once sent, with the MQTT message id in *token (may be NULL); -1 if the
+// client is stopped, refused it or the window stayed full.
+int mqtt_publish(const char *topic, const void *payload, int len, int qos, int retained, int *token);
+
+// QoS 1 publish of command id to pump/control; the PUBACK goes to
+// commands_delivered(id). 0 = sent, 1 = held in the outbox (disconnected, or
+// older commands still queued ahead of it), -1 = failed. A CommandPublishFn.
+int mqtt_publish_control(long long id, const char *payload);
+
+void mqtt_get_stats(MqttStats *out);
 
 void* mqtt_publisher_thread(void *arg);
-void* mqtt_subscriber_thread(void *arg);
 
-#endif
\ No newline at end of file
+#endif
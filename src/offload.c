@@ -0,0 +1,319 @@
+#include "offload.h"
+#include "db.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK_EMPTY     0
+#define CHUNK_FILLING   1
+#define CHUNK_FULL      2
+
+typedef struct OffloadWorker OffloadWorker;
+
+// Two chunks per stream: the worker fills one while MHD sends the other.
+// Chunks are filled and sent in the same order, so when chunk[out] is not
+// full, the next job will fill exactly that one.
+typedef struct OffloadStream {
+    MHD_ContentReaderCallback reader;
+    MHD_ContentReaderFreeCallback free_cb;
+    void *cls;
+    struct MHD_Connection *connection;
+    OffloadWorker *worker;
+    struct OffloadStream *next;     // job queue
+    uint64_t pos;                   // worker only
+    // Under worker->lock
+    int queued;             // on the job queue or running
+    int suspended;
+    int closing;            // MHD is done with the response
+    int end;                // 1 = reader finished, -1 = reader failed
+    int out;                // chunk MHD sends from
+    size_t off;
+    int fill;               // chunk the next job fills
+    int state[2];
+    size_t len[2];
+    char chunk[2][OFFLOAD_CHUNK];
+} OffloadStream;
+
+struct OffloadWorker {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t idle;            // a suspended stream was resumed
+    OffloadStream *head;
+    OffloadStream *tail;
+    int stop;
+    int stopping;
+    int streams;
+    int suspended;
+    int queued;
+    unsigned long long jobs;
+    unsigned long long bytes;
+};
+
+static OffloadWorker *workers = NULL;
+static int worker_count = 0;
+static atomic_uint next_worker;
+
+// Under w->lock
+static void stream_enqueue(OffloadStream *s) {
+    OffloadWorker *w = s->worker;
+    s->queued = 1;
+    s->next = NULL;
+    if (w->tail) {
+        w->tail->next = s;
+    } else {
+        w->head = s;
+    }
+    w->tail = s;
+    w->queued++;
+    pthread_cond_signal(&w->ready);
+}
+
+// Under w->lock: queues a fill if a chunk is free and the reader has more
+static void stream_schedule(OffloadStream *s) {
+    OffloadWorker *w = s->worker;
+    if (s->queued || s->end || s->closing || w->stopping || s->state[s->fill] != CHUNK_EMPTY) return;
+    
+    s->state[s->fill] = CHUNK_FILLING;
+    stream_enqueue(s);
+}
+
+// Under w->lock
+static void stream_resume(OffloadStream *s) {
+    OffloadWorker *w = s->worker;
+    if (!s->suspended) return;
+    
+    s->suspended = 0;
+    w->suspended--;
+    if (!s->closing) MHD_resume_connection(s->connection);
+    pthread_cond_broadcast(&w->idle);
+}
+
+// Called with w->lock held; drops it around the free callback
+static void stream_free(OffloadStream *s) {
+    OffloadWorker *w = s->worker;
+    w->streams--;
+    pthread_mutex_unlock(&w->lock);
+    
+    if (s->free_cb) s->free_cb(s->cls);
+    free(s);
+    
+    pthread_mutex_lock(&w->lock);
+}
+
+static void* offload_worker(void *arg) {
+    OffloadWorker *w = arg;
+    
+    // History cursors opened here run on this thread's own connection
+    if (db_reader_open() != 0) {
+        printf("[OFFLOAD] No reader connection, history shares the default one\n");
+    }
+    
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->head && !w->stop) {
+            pthread_cond_wait(&w->ready, &w->lock);
+        }
+        OffloadStream *s = w->head;
+        if (!s) break;
+        
+        w->head = s->next;
+        if (!w->head) w->tail = NULL;
+        w->queued--;
+        
+        if (s->closing) {
+            stream_free(s);
+            continue;
+        }
+        
+        int idx = s->fill;
+        int end = w->stopping ? -1 : 0;
+        size_t len = 0;
+        pthread_mutex_unlock(&w->lock);
+        
+        // MHD only reads the other chunk, so the reader runs unlocked
+        while (!end && len < OFFLOAD_CHUNK) {
+            ssize_t n = s->reader(s->cls, s->pos, s->chunk[idx] + len, OFFLOAD_CHUNK - len);
+            if (n == MHD_CONTENT_READER_END_OF_STREAM) {
+                end = 1;
+            } else if (n < 0) {
+                end = -1;
+            } else if (n == 0) {
+                break;
+            } else {
+                len += n;
+                s->pos += n;
+            }
+        }
+        
+        pthread_mutex_lock(&w->lock);
+        w->jobs++;
+        w->bytes += len;
+        s->queued = 0;
+        if (s->closing) {
+            stream_free(s);
+            continue;
+        }
+        
+        s->len[idx] = len;
+        s->state[idx] = len > 0 ? CHUNK_FULL : CHUNK_EMPTY;
+        if (len > 0) s->fill ^= 1;
+        s->end = end;
+        stream_schedule(s);     // read ahead into the other chunk
+        stream_resume(s);
+    }
+    pthread_mutex_unlock(&w->lock);
+    
+    db_reader_close();
+    return NULL;
+}
+
+static ssize_t offload_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    OffloadStream *s = cls;
+    OffloadWorker *w = s->worker;
+    ssize_t ret;
+    
+    pthread_mutex_lock(&w->lock);
+    if (s->state[s->out] == CHUNK_FULL) {
+        size_t n = s->len[s->out] - s->off;
+        if (n > max) n = max;
+        memcpy(buf, s->chunk[s->out] + s->off, n);
+        s->off += n;
+        if (s->off == s->len[s->out]) {
+            s->state[s->out] = CHUNK_EMPTY;
+            s->out ^= 1;
+            s->off = 0;
+        }
+        ret = (ssize_t)n;
+    } else if (s->end || w->stopping) {
+        ret = s->end > 0 ? MHD_CONTENT_READER_END_OF_STREAM : MHD_CONTENT_READER_END_WITH_ERROR;
+    } else {
+        // Nothing ready yet: park the connection until the worker resumes it
+        s->suspended = 1;
+        w->suspended++;
+        MHD_suspend_connection(s->connection);
+        ret = 0;
+    }
+    stream_schedule(s);
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+static void offload_free(void *cls) {
+    OffloadStream *s = cls;
+    OffloadWorker *w = s->worker;
+    
+    // The worker owns the reader state, so it runs the free callback too
+    pthread_mutex_lock(&w->lock);
+    s->closing = 1;
+    stream_resume(s);
+    if (!s->queued) stream_enqueue(s);
+    pthread_mutex_unlock(&w->lock);
+}
+
+int offload_init(int threads) {
+    if (threads <= 0) return 0;
+    
+    workers = calloc(threads, sizeof(*workers));
+    if (!workers) return -1;
+    
+    for (int i = 0; i < threads; i++) {
+        OffloadWorker *w = &workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->ready, NULL);
+        pthread_cond_init(&w->idle, NULL);
+        if (pthread_create(&w->tid, NULL, offload_worker, w) != 0) {
+            pthread_cond_destroy(&w->idle);
+            pthread_cond_destroy(&w->ready);
+            pthread_mutex_destroy(&w->lock);
+            break;
+        }
+        worker_count++;
+    }
+    if (worker_count == 0) {
+        free(workers);
+        workers = NULL;
+        return -1;
+    }
+    
+    printf("[OFFLOAD] %d slow-request threads\n", worker_count);
+    return 0;
+}
+
+void offload_quiesce() {
+    for (int i = 0; i < worker_count; i++) {
+        OffloadWorker *w = &workers[i];
+        
+        // Suspended streams always have a job pending, which resumes them
+        pthread_mutex_lock(&w->lock);
+        w->stopping = 1;
+        while (w->suspended > 0) {
+            pthread_cond_wait(&w->idle, &w->lock);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+void offload_shutdown() {
+    for (int i = 0; i < worker_count; i++) {
+        OffloadWorker *w = &workers[i];
+        pthread_mutex_lock(&w->lock);
+        w->stop = 1;
+        pthread_cond_signal(&w->ready);
+        pthread_mutex_unlock(&w->lock);
+        
+        pthread_join(w->tid, NULL);
+        pthread_cond_destroy(&w->idle);
+        pthread_cond_destroy(&w->ready);
+        pthread_mutex_destroy(&w->lock);
+    }
+    
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+}
+
+struct MHD_Response* offload_response(struct MHD_Connection *connection, MHD_ContentReaderCallback reader,
+                                      void *cls, MHD_ContentReaderFreeCallback free_cb) {
+    OffloadStream *s = worker_count > 0 ? calloc(1, sizeof(*s)) : NULL;
+    if (!s) {
+        struct MHD_Response *response = worker_count > 0 ? NULL :
+            MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 16 * 1024, reader, cls, free_cb);
+        if (!response && free_cb) free_cb(cls);
+        return response;
+    }
+    
+    s->reader = reader;
+    s->free_cb = free_cb;
+    s->cls = cls;
+    s->connection = connection;
+    s->worker = &workers[atomic_fetch_add(&next_worker, 1) % worker_count];
+    
+    OffloadWorker *w = s->worker;
+    pthread_mutex_lock(&w->lock);
+    w->streams++;
+    stream_schedule(s);     // start the query before MHD asks for the first bytes
+    pthread_mutex_unlock(&w->lock);
+    
+    struct MHD_Response *response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 16 * 1024,
+                                                                      offload_read, s, offload_free);
+    if (!response) offload_free(s);
+    return response;
+}
+
+void offload_get_stats(OffloadStats *out) {
+    memset(out, 0, sizeof(*out));
+    out->threads = worker_count;
+    
+    for (int i = 0; i < worker_count; i++) {
+        OffloadWorker *w = &workers[i];
+        pthread_mutex_lock(&w->lock);
+        out->streams += w->streams;
+        out->queued += w->queued;
+        out->jobs += w->jobs;
+        out->bytes += w->bytes;
+        pthread_mutex_unlock(&w->lock);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <microhttpd.h>
+
+// Slow-request pool. Content readers that hit the database (history, rollups)
+// run on these threads instead of MHD's event loops; the connection is
+// suspended until a chunk is ready, so a slow query or a slow client never
+// holds up the other connections on the same MHD thread.
+//
+// Each stream is pinned to one worker, which calls the reader and the free
+// callback for it, so per-thread state such as db_reader_open() is safe.
+#define OFFLOAD_CHUNK           (32 * 1024)     // bytes produced per job; two per stream
+
+typedef struct {
+    int threads;
+    int streams;                // open right now
+    int queued;                 // jobs waiting for a worker
+    unsigned long long jobs;
+    unsigned long long bytes;
+} OffloadStats;
+
+// threads <= 0 runs readers inline on the MHD thread, as before
+int offload_init(int threads);
+void offload_quiesce();     // before MHD_stop_daemon: ends parked streams so MHD can close them
+void offload_shutdown();    // after MHD_stop_daemon: runs the pending free callbacks, joins workers
+
+// Same contract as MHD_create_response_from_callback, except that free_cb also
+// runs if this fails. With a pool, reader and free_cb run on the worker.
+struct MHD_Response* offload_response(struct MHD_Connection *connection, MHD_ContentReaderCallback reader,
+                                      void *cls, MHD_ContentReaderFreeCallback free_cb);
+
+void offload_get_stats(OffloadStats *out);
+
+#endif
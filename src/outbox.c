@@ -0,0 +1,250 @@
+#include "outbox.h"
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OUTBOX_MAGIC    0x3142584fu     // "OXB1"
+#define OUTBOX_MAX_LEN  (64 * 1024)     // sanity bound on a record while reloading
+
+typedef struct {
+    uint32_t magic;
+    uint32_t len;
+    int64_t command_id;
+    int64_t created_ms;
+    uint8_t acked;
+    uint8_t pad[7];
+} OutboxRecord;
+
+static OutboxEntry* entry_at(const Outbox *ob, long long seq) {
+    return &ob->entries[seq % ob->capacity];
+}
+
+static size_t record_bytes(int len) {
+    return sizeof(OutboxRecord) + len;
+}
+
+static int entry_add(Outbox *ob, long long command_id, long long created_ms, const char *payload, int len, off_t offset) {
+    char *copy = malloc(len + 1);
+    if (!copy) return -1;
+    memcpy(copy, payload, len);
+    copy[len] = '\0';
+    
+    OutboxEntry *e = entry_at(ob, ob->tail);
+    e->seq = ob->tail++;
+    e->command_id = command_id;
+    e->created_ms = created_ms;
+    e->payload = copy;
+    e->len = len;
+    e->acked = 0;
+    e->offset = offset;
+    ob->live_bytes += record_bytes(len);
+    return 0;
+}
+
+// Reads the file back; stops at the first torn or foreign record and cuts
+// the file there, so a crash mid-append loses at most that record
+static int outbox_reload(Outbox *ob) {
+    off_t off = 0;
+    char *payload = malloc(OUTBOX_MAX_LEN);
+    if (!payload) return -1;
+    
+    for (;;) {
+        OutboxRecord rec;
+        if (pread(ob->fd, &rec, sizeof(rec), off) != (ssize_t)sizeof(rec)) break;
+        if (rec.magic != OUTBOX_MAGIC || rec.len > OUTBOX_MAX_LEN) break;
+        if (pread(ob->fd, payload, rec.len, off + sizeof(rec)) != (ssize_t)rec.len) break;
+        
+        if (!rec.acked) {
+            if (outbox_depth(ob) < ob->capacity &&
+                entry_add(ob, rec.command_id, rec.created_ms, payload, rec.len, off) == 0) {
+                ob->queued++;
+            } else {
+                ob->dropped++;
+            }
+        }
+        off += record_bytes(rec.len);
+    }
+    free(payload);
+    
+    ob->size = off;
+    if (outbox_depth(ob) == 0) ob->size = 0;
+    if (ftruncate(ob->fd, ob->size) != 0) return -1;
+    if (ob->tail > 1) printf("[OUTBOX] Reloaded %d unacknowledged command(s)\n", outbox_depth(ob));
+    return 0;
+}
+
+int outbox_open(Outbox *ob, const char *path, int capacity, size_t max_bytes) {
+    memset(ob, 0, sizeof(*ob));
+    ob->fd = -1;
+    if (capacity < 1) return -1;
+    
+    ob->entries = calloc(capacity, sizeof(OutboxEntry));
+    if (!ob->entries) return -1;
+    ob->capacity = capacity;
+    ob->max_bytes = max_bytes;
+    // seq 0 is free for "not in the outbox"
+    ob->head = ob->send = ob->tail = 1;
+    
+    ob->path = strdup(path);
+    ob->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+    if (!ob->path || ob->fd < 0 || outbox_reload(ob) != 0) {
+        printf("[OUTBOX] Can't open %s\n", path);
+        outbox_close(ob);
+        return -1;
+    }
+    return 0;
+}
+
+void outbox_close(Outbox *ob) {
+    if (ob->fd >= 0) {
+        outbox_sync(ob);
+        close(ob->fd);
+    }
+    for (long long s = ob->head; ob->entries && s < ob->tail; s++) free(entry_at(ob, s)->payload);
+    free(ob->entries);
+    free(ob->path);
+    memset(ob, 0, sizeof(*ob));
+    ob->fd = -1;
+}
+
+int outbox_push(Outbox *ob, long long command_id, long long created_ms, const char *payload, int len) {
+    size_t bytes = record_bytes(len);
+    if (ob->fd < 0 || outbox_depth(ob) >= ob->capacity || ob->live_bytes + bytes > ob->max_bytes) {
+        ob->dropped++;
+        return -1;
+    }
+    
+    OutboxRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = OUTBOX_MAGIC;
+    rec.len = len;
+    rec.command_id = command_id;
+    rec.created_ms = created_ms;
+    
+    // A short write leaves a torn record at the end, which reload cuts off
+    if (pwrite(ob->fd, &rec, sizeof(rec), ob->size) != (ssize_t)sizeof(rec) ||
+        pwrite(ob->fd, payload, len, ob->size + sizeof(rec)) != (ssize_t)len ||
+        entry_add(ob, command_id, created_ms, payload, len, ob->size) != 0) {
+        if (ftruncate(ob->fd, ob->size) != 0) printf("[OUTBOX] Can't cut a failed append\n");
+        ob->dropped++;
+        return -1;
+    }
+    ob->size += bytes;
+    ob->dirty = 1;
+    ob->queued++;
+    return 0;
+}
+
+const OutboxEntry* outbox_next(const Outbox *ob) {
+    return ob->send < ob->tail ? entry_at(ob, ob->send) : NULL;
+}
+
+void outbox_sent(Outbox *ob, long long seq) {
+    if (ob->send == seq) ob->send++;
+}
+
+void outbox_rewind(Outbox *ob) {
+    ob->send = ob->head;
+}
+
+// Writes the unacknowledged records to a new file and renames it over the
+// old one, so a crash leaves one or the other whole, never a mix
+static int outbox_compact(Outbox *ob) {
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", ob->path) >= (int)sizeof(tmp)) return -1;
+    
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (fd < 0) return -1;
+    
+    off_t off = 0;
+    for (long long s = ob->head; s < ob->tail; s++) {
+        OutboxEntry *e = entry_at(ob, s);
+        if (e->acked) continue;
+        
+        OutboxRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.magic = OUTBOX_MAGIC;
+        rec.len = e->len;
+        rec.command_id = e->command_id;
+        rec.created_ms = e->created_ms;
+        if (pwrite(fd, &rec, sizeof(rec), off) != (ssize_t)sizeof(rec) ||
+            pwrite(fd, e->payload, e->len, off + sizeof(rec)) != (ssize_t)e->len) {
+            close(fd);
+            unlink(tmp);
+            return -1;
+        }
+        off += record_bytes(e->len);
+    }
+    
+    if (fdatasync(fd) != 0 || rename(tmp, ob->path) != 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    
+    // Same order and sizes as written
+    off = 0;
+    for (long long s = ob->head; s < ob->tail; s++) {
+        OutboxEntry *e = entry_at(ob, s);
+        if (e->acked) continue;
+        e->offset = off;
+        off += record_bytes(e->len);
+    }
+    close(ob->fd);
+    ob->fd = fd;
+    ob->size = off;
+    ob->dirty = 0;
+    ob->compact_retry = 0;
+    ob->compactions++;
+    return 0;
+}
+
+void outbox_ack(Outbox *ob, long long seq) {
+    if (seq < ob->head || seq >= ob->tail) return;
+    OutboxEntry *e = entry_at(ob, seq);
+    if (e->acked) return;
+    
+    e->acked = 1;
+    ob->acked++;
+    ob->live_bytes -= record_bytes(e->len);
+    uint8_t one = 1;
+    if (pwrite(ob->fd, &one, 1, e->offset + offsetof(OutboxRecord, acked)) == 1) ob->dirty = 1;
+    
+    // Acks mostly arrive in order; the head only moves over a contiguous run
+    while (ob->head < ob->tail && entry_at(ob, ob->head)->acked) {
+        OutboxEntry *h = entry_at(ob, ob->head);
+        free(h->payload);
+        h->payload = NULL;
+        ob->head++;
+    }
+    if (ob->send < ob->head) ob->send = ob->head;
+    
+    // Everything delivered: start the file over. Otherwise drop the
+    // acknowledged records once they outweigh the rest.
+    size_t dead = (size_t)ob->size - ob->live_bytes;
+    if (ob->head == ob->tail) {
+        if (ob->size > 0 && ftruncate(ob->fd, 0) == 0) ob->size = 0;
+    } else if (dead >= OUTBOX_COMPACT_BYTES && dead >= ob->live_bytes && ob->size >= ob->compact_retry &&
+               outbox_compact(ob) != 0) {
+        printf("[OUTBOX] Compaction failed, keeping %lld bytes\n", (long long)ob->size);
+        ob->compact_retry = ob->size + OUTBOX_COMPACT_BYTES;
+    }
+}
+
+int outbox_depth(const Outbox *ob) {
+    return (int)(ob->tail - ob->head);
+}
+
+int outbox_unsent(const Outbox *ob) {
+    return (int)(ob->tail - ob->send);
+}
+
+void outbox_sync(Outbox *ob) {
+    if (ob->fd < 0 || !ob->dirty) return;
+    if (fdatasync(ob->fd) != 0) printf("[OUTBOX] fdatasync failed\n");
+    ob->dirty = 0;
+}
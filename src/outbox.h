@@ -0,0 +1,68 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Disk-backed FIFO for pump commands that can't be published right now.
+// Records are appended to one file and stay there until the broker has
+// acknowledged them, so a crash or restart replays whatever was still
+// unacknowledged, in order. An acknowledged record is flagged in place; the
+// file is truncated once everything in it is acknowledged, and rewritten
+// with only the unacknowledged records once the acknowledged ones take
+// OUTBOX_COMPACT_BYTES and at least as much as the rest. max_bytes only
+// counts unacknowledged records.
+// Not thread-safe: the owner (mqtt.c) serializes every call.
+#define OUTBOX_COMPACT_BYTES    (1024 * 1024)
+
+typedef struct {
+    long long seq;
+    long long command_id;
+    long long created_ms;
+    char *payload;
+    int len;
+    int acked;
+    off_t offset;               // of the record in the file
+} OutboxEntry;
+
+typedef struct {
+    int fd;
+    char *path;
+    OutboxEntry *entries;       // ring, slot = seq % capacity
+    int capacity;
+    size_t max_bytes;
+    long long head;             // oldest not yet acknowledged
+    long long send;             // next to publish
+    long long tail;             // next seq to assign
+    off_t size;                 // file bytes
+    size_t live_bytes;          // of records not yet acknowledged
+    off_t compact_retry;        // after a failed compaction, not before the file reaches this
+    int dirty;                  // written since the last outbox_sync()
+    unsigned long long queued;
+    unsigned long long acked;
+    unsigned long long dropped; // refused: full, or a write error
+    unsigned long long expired;
+    unsigned long long compactions;
+} Outbox;
+
+// Opens (or creates) path and reloads the records not yet acknowledged.
+// -1 if the file can't be opened or memory runs out.
+int outbox_open(Outbox *ob, const char *path, int capacity, size_t max_bytes);
+void outbox_close(Outbox *ob);
+
+// 0 once written (in the page cache; outbox_sync() makes it durable),
+// -1 if the queue is at capacity / max_bytes or the write failed
+int outbox_push(Outbox *ob, long long command_id, long long created_ms, const char *payload, int len);
+
+// The next record to publish, or NULL. outbox_sent(seq) moves past it,
+// unless outbox_rewind() ran in between.
+const OutboxEntry* outbox_next(const Outbox *ob);
+void outbox_sent(Outbox *ob, long long seq);
+void outbox_rewind(Outbox *ob);                 // publish again from the oldest unacknowledged
+void outbox_ack(Outbox *ob, long long seq);     // delivered, or given up on
+
+int outbox_depth(const Outbox *ob);             // not acknowledged
+int outbox_unsent(const Outbox *ob);
+void outbox_sync(Outbox *ob);
+
+#endif
@@ -0,0 +1,460 @@
+#include "registry.h"
+#include "seqlock.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Structure-of-arrays pump table. Each column is indexed by slot, so scans
+// over one field (e.g. status of every pump) touch contiguous memory.
+// Slots are append-only; the open-addressing index maps (gateway, pump_id)
+// to slot+1 and is published with release stores so readers need no lock.
+typedef struct {
+    int max_pumps;
+    int max_gateways;
+    
+    // Pump columns
+    int32_t *gateway;           // gateway slot
+    int32_t *pump_id;
+    uint8_t *command;
+    uint8_t *status;
+    time_t *updated_at;
+    atomic_int *next_in_gateway;
+    SeqLock *seq;
+    atomic_int pump_count;
+    
+    // Gateway columns
+    char (*device_id)[64];
+    uint8_t *busy;
+    uint8_t *alarm;
+    time_t *system_updated_at;
+    int32_t *hb_status;         // last reported by the heartbeat
+    char (*firmware)[32];
+    time_t *last_seen;
+    uint8_t *online;
+    atomic_int *first_pump;
+    int32_t *last_pump;
+    SeqLock *gw_seq;
+    atomic_int gateway_count;
+    
+    // Indexes: 0 = empty, otherwise slot + 1
+    atomic_uint *pump_index;
+    uint32_t pump_index_mask;
+    atomic_uint *gateway_index;
+    uint32_t gateway_index_mask;
+} PumpRegistry;
+
+static PumpRegistry reg;
+
+// Bumped after every write; never reset, so a cached render can't outlive a re-init
+static atomic_ullong reg_version;
+static atomic_ullong gw_version;
+
+static void bump_version() {
+    atomic_fetch_add_explicit(&reg_version, 1, memory_order_release);
+}
+
+static void bump_gateway_version() {
+    atomic_fetch_add_explicit(&gw_version, 1, memory_order_release);
+}
+
+static uint32_t next_pow2(uint32_t v) {
+    uint32_t p = 1;
+    while (p < v) p <<= 1;
+    return p;
+}
+
+static uint32_t hash_string(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t hash_pump(int32_t gw, int32_t pump_id) {
+    uint64_t k = ((uint64_t)(uint32_t)gw << 32) | (uint32_t)pump_id;
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return (uint32_t)k;
+}
+
+int registry_init(int max_pumps, int max_gateways) {
+    memset(&reg, 0, sizeof(reg));
+    reg.max_pumps = max_pumps;
+    reg.max_gateways = max_gateways;
+    
+    reg.gateway = calloc(max_pumps, sizeof(*reg.gateway));
+    reg.pump_id = calloc(max_pumps, sizeof(*reg.pump_id));
+    reg.command = calloc(max_pumps, sizeof(*reg.command));
+    reg.status = calloc(max_pumps, sizeof(*reg.status));
+    reg.updated_at = calloc(max_pumps, sizeof(*reg.updated_at));
+    reg.next_in_gateway = calloc(max_pumps, sizeof(*reg.next_in_gateway));
+    reg.seq = calloc(max_pumps, sizeof(*reg.seq));
+    
+    reg.device_id = calloc(max_gateways, sizeof(*reg.device_id));
+    reg.busy = calloc(max_gateways, sizeof(*reg.busy));
+    reg.alarm = calloc(max_gateways, sizeof(*reg.alarm));
+    reg.system_updated_at = calloc(max_gateways, sizeof(*reg.system_updated_at));
+    reg.hb_status = calloc(max_gateways, sizeof(*reg.hb_status));
+    reg.firmware = calloc(max_gateways, sizeof(*reg.firmware));
+    reg.last_seen = calloc(max_gateways, sizeof(*reg.last_seen));
+    reg.online = calloc(max_gateways, sizeof(*reg.online));
+    reg.first_pump = calloc(max_gateways, sizeof(*reg.first_pump));
+    reg.last_pump = calloc(max_gateways, sizeof(*reg.last_pump));
+    reg.gw_seq = calloc(max_gateways, sizeof(*reg.gw_seq));
+    
+    uint32_t pump_index_size = next_pow2((uint32_t)max_pumps * 2);
+    uint32_t gateway_index_size = next_pow2((uint32_t)max_gateways * 2);
+    reg.pump_index = calloc(pump_index_size, sizeof(*reg.pump_index));
+    reg.pump_index_mask = pump_index_size - 1;
+    reg.gateway_index = calloc(gateway_index_size, sizeof(*reg.gateway_index));
+    reg.gateway_index_mask = gateway_index_size - 1;
+    
+    if (!reg.gateway || !reg.pump_id || !reg.command || !reg.status || !reg.updated_at ||
+        !reg.next_in_gateway || !reg.seq || !reg.device_id || !reg.busy || !reg.alarm ||
+        !reg.system_updated_at || !reg.hb_status || !reg.firmware || !reg.last_seen || !reg.online ||
+        !reg.first_pump || !reg.last_pump || !reg.gw_seq ||
+        !reg.pump_index || !reg.gateway_index) {
+        fprintf(stderr, "[REGISTRY] Out of memory for %d pumps\n", max_pumps);
+        registry_free();
+        return -1;
+    }
+    
+    printf("[REGISTRY] Capacity: %d pumps, %d gateways\n", max_pumps, max_gateways);
+    return 0;
+}
+
+void registry_free() {
+    free(reg.gateway);
+    free(reg.pump_id);
+    free(reg.command);
+    free(reg.status);
+    free(reg.updated_at);
+    free(reg.next_in_gateway);
+    free(reg.seq);
+    free(reg.device_id);
+    free(reg.busy);
+    free(reg.alarm);
+    free(reg.system_updated_at);
+    free(reg.hb_status);
+    free(reg.firmware);
+    free(reg.last_seen);
+    free(reg.online);
+    free(reg.first_pump);
+    free(reg.last_pump);
+    free(reg.gw_seq);
+    free(reg.pump_index);
+    free(reg.gateway_index);
+    memset(&reg, 0, sizeof(reg));
+}
+
+int registry_valid_device_id(const char *device_id) {
+    if (!device_id || !*device_id) return 0;
+    
+    size_t len = 0;
+    for (const char *p = device_id; *p; p++, len++) {
+        char c = *p;
+        int ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                 c == '_' || c == '-' || c == '.' || c == ':';
+        if (!ok || len >= sizeof(reg.device_id[0]) - 1) return 0;
+    }
+    return 1;
+}
+
+int registry_find_gateway(const char *device_id) {
+    if (!device_id) device_id = DEFAULT_GATEWAY_ID;
+    if (!reg.gateway_index) return -1;
+    
+    uint32_t i = hash_string(device_id) & reg.gateway_index_mask;
+    for (;;) {
+        uint32_t e = atomic_load_explicit(&reg.gateway_index[i], memory_order_acquire);
+        if (e == 0) return -1;
+        if (strcmp(reg.device_id[e - 1], device_id) == 0) return (int)e - 1;
+        i = (i + 1) & reg.gateway_index_mask;
+    }
+}
+
+static int find_pump_in(int gw, int pump_id) {
+    uint32_t i = hash_pump(gw, pump_id) & reg.pump_index_mask;
+    for (;;) {
+        uint32_t e = atomic_load_explicit(&reg.pump_index[i], memory_order_acquire);
+        if (e == 0) return -1;
+        if (reg.gateway[e - 1] == gw && reg.pump_id[e - 1] == pump_id) return (int)e - 1;
+        i = (i + 1) & reg.pump_index_mask;
+    }
+}
+
+int registry_find_pump(const char *device_id, int pump_id) {
+    int gw = registry_find_gateway(device_id);
+    if (gw < 0) return -1;
+    return find_pump_in(gw, pump_id);
+}
+
+int registry_add_gateway(const char *device_id) {
+    if (!device_id) device_id = DEFAULT_GATEWAY_ID;
+    
+    int gw = registry_find_gateway(device_id);
+    if (gw >= 0) return gw;
+    
+    if (!registry_valid_device_id(device_id)) {
+        printf("[REGISTRY] Rejected device_id: %s\n", device_id);
+        return -1;
+    }
+    
+    gw = atomic_load_explicit(&reg.gateway_count, memory_order_relaxed);
+    if (gw >= reg.max_gateways) {
+        printf("[REGISTRY] Gateway table full (%d)\n", reg.max_gateways);
+        return -1;
+    }
+    
+    strncpy(reg.device_id[gw], device_id, sizeof(reg.device_id[gw]) - 1);
+    atomic_init(&reg.first_pump[gw], -1);
+    reg.last_pump[gw] = -1;
+    
+    uint32_t i = hash_string(device_id) & reg.gateway_index_mask;
+    while (atomic_load_explicit(&reg.gateway_index[i], memory_order_relaxed) != 0) {
+        i = (i + 1) & reg.gateway_index_mask;
+    }
+    atomic_store_explicit(&reg.gateway_count, gw + 1, memory_order_release);
+    atomic_store_explicit(&reg.gateway_index[i], (uint32_t)gw + 1, memory_order_release);
+    bump_gateway_version();
+    
+    printf("[REGISTRY] New gateway %s (slot %d)\n", device_id, gw);
+    return gw;
+}
+
+int registry_add_pump(const char *device_id, int pump_id) {
+    if (pump_id < 1) return -1;
+    
+    int gw = registry_add_gateway(device_id);
+    if (gw < 0) return -1;
+    
+    int slot = find_pump_in(gw, pump_id);
+    if (slot >= 0) return slot;
+    
+    slot = atomic_load_explicit(&reg.pump_count, memory_order_relaxed);
+    if (slot >= reg.max_pumps) {
+        printf("[REGISTRY] Pump table full (%d)\n", reg.max_pumps);
+        return -1;
+    }
+    
+    reg.gateway[slot] = gw;
+    reg.pump_id[slot] = pump_id;
+    reg.command[slot] = 0;
+    reg.status[slot] = STATUS_UNKNOWN;
+    reg.updated_at[slot] = 0;
+    atomic_init(&reg.next_in_gateway[slot], -1);
+    
+    // Publish the row before it becomes reachable from the index or the count
+    atomic_store_explicit(&reg.pump_count, slot + 1, memory_order_release);
+    
+    if (reg.last_pump[gw] < 0) {
+        atomic_store_explicit(&reg.first_pump[gw], slot, memory_order_release);
+    } else {
+        atomic_store_explicit(&reg.next_in_gateway[reg.last_pump[gw]], slot, memory_order_release);
+    }
+    reg.last_pump[gw] = slot;
+    
+    uint32_t i = hash_pump(gw, pump_id) & reg.pump_index_mask;
+    while (atomic_load_explicit(&reg.pump_index[i], memory_order_relaxed) != 0) {
+        i = (i + 1) & reg.pump_index_mask;
+    }
+    atomic_store_explicit(&reg.pump_index[i], (uint32_t)slot + 1, memory_order_release);
+    bump_version();
+    
+    return slot;
+}
+
+unsigned long long registry_version() {
+    return atomic_load_explicit(&reg_version, memory_order_acquire);
+}
+
+unsigned long long registry_gateway_version() {
+    return atomic_load_explicit(&gw_version, memory_order_acquire);
+}
+
+int registry_pump_count() {
+    return atomic_load_explicit(&reg.pump_count, memory_order_acquire);
+}
+
+int registry_gateway_count() {
+    return atomic_load_explicit(&reg.gateway_count, memory_order_acquire);
+}
+
+int registry_gateway_first_pump(int gw) {
+    if (gw < 0 || gw >= registry_gateway_count()) return -1;
+    return atomic_load_explicit(&reg.first_pump[gw], memory_order_acquire);
+}
+
+int registry_gateway_next_pump(int slot) {
+    if (slot < 0 || slot >= registry_pump_count()) return -1;
+    return atomic_load_explicit(&reg.next_in_gateway[slot], memory_order_acquire);
+}
+
+int registry_read(int slot, PumpStatus *out) {
+    if (slot < 0 || slot >= registry_pump_count()) return -1;
+    
+    int gw = reg.gateway[slot];
+    unsigned int seq;
+    
+    do {
+        seq = seqlock_read_begin(&reg.seq[slot]);
+        out->pump_id = reg.pump_id[slot];
+        out->command = reg.command[slot];
+        out->status = reg.status[slot];
+        out->timestamp = reg.updated_at[slot];
+    } while (seqlock_read_retry(&reg.seq[slot], seq));
+    
+    time_t system_updated_at;
+    do {
+        seq = seqlock_read_begin(&reg.gw_seq[gw]);
+        out->busy = reg.busy[gw];
+        out->alarm = reg.alarm[gw];
+        system_updated_at = reg.system_updated_at[gw];
+    } while (seqlock_read_retry(&reg.gw_seq[gw], seq));
+    
+    // device_id is written once before the gateway is published
+    memcpy(out->device_id, reg.device_id[gw], sizeof(out->device_id));
+    if (system_updated_at > out->timestamp) out->timestamp = system_updated_at;
+    return 0;
+}
+
+int registry_read_gateway(int gw, GatewayHardwareStatus *out) {
+    if (gw < 0 || gw >= registry_gateway_count()) return -1;
+    
+    unsigned int seq;
+    do {
+        seq = seqlock_read_begin(&reg.gw_seq[gw]);
+        out->is_online = reg.online[gw];
+        out->gateway_reported_status = reg.hb_status[gw];
+        out->last_seen_at = reg.last_seen[gw];
+        memcpy(out->firmware_version, reg.firmware[gw], sizeof(out->firmware_version));
+    } while (seqlock_read_retry(&reg.gw_seq[gw], seq));
+    
+    out->firmware_version[sizeof(out->firmware_version) - 1] = '\0';
+    memcpy(out->device_id, reg.device_id[gw], sizeof(out->device_id));
+    return 0;
+}
+
+int registry_set_command(int slot, int command, time_t timestamp) {
+    int changed = (reg.command[slot] != command);
+    
+    seqlock_write_begin(&reg.seq[slot]);
+    reg.command[slot] = (uint8_t)command;
+    reg.updated_at[slot] = timestamp;
+    seqlock_write_end(&reg.seq[slot]);
+    bump_version();
+    
+    return changed;
+}
+
+int registry_set_status(int slot, int status, time_t timestamp) {
+    int changed = (reg.status[slot] != status);
+    
+    seqlock_write_begin(&reg.seq[slot]);
+    reg.status[slot] = (uint8_t)status;
+    reg.updated_at[slot] = timestamp;
+    seqlock_write_end(&reg.seq[slot]);
+    bump_version();
+    
+    return changed;
+}
+
+int registry_set_system(int gw, int busy, int alarm, time_t timestamp) {
+    if (busy < 0) busy = reg.busy[gw];
+    if (alarm < 0) alarm = reg.alarm[gw];
+    
+    int changed = (reg.busy[gw] != busy) || (reg.alarm[gw] != alarm);
+    
+    seqlock_write_begin(&reg.gw_seq[gw]);
+    reg.busy[gw] = (uint8_t)busy;
+    reg.alarm[gw] = (uint8_t)alarm;
+    reg.system_updated_at[gw] = timestamp;
+    seqlock_write_end(&reg.gw_seq[gw]);
+    bump_version();
+    
+    return changed;
+}
+
+int registry_set_heartbeat(int gw, int status, const char *firmware, time_t timestamp) {
+    int changed = !reg.online[gw] || reg.hb_status[gw] != status ||
+                  (firmware && strncmp(reg.firmware[gw], firmware, sizeof(reg.firmware[gw]) - 1) != 0);
+    
+    seqlock_write_begin(&reg.gw_seq[gw]);
+    reg.online[gw] = 1;
+    reg.hb_status[gw] = status;
+    reg.last_seen[gw] = timestamp;
+    if (firmware) snprintf(reg.firmware[gw], sizeof(reg.firmware[gw]), "%s", firmware);
+    seqlock_write_end(&reg.gw_seq[gw]);
+    bump_gateway_version();
+    
+    return changed;
+}
+
+int registry_set_offline(int gw, time_t seen_before) {
+    if (!reg.online[gw] || reg.last_seen[gw] >= seen_before) return 0;
+    
+    seqlock_write_begin(&reg.gw_seq[gw]);
+    reg.online[gw] = 0;
+    seqlock_write_end(&reg.gw_seq[gw]);
+    bump_gateway_version();
+    
+    return 1;
+}
+
+char* registry_render_json(const char *device_id, size_t *len_out) {
+    size_t cap = 4096;
+    size_t len = 0;
+    char *buf = malloc(cap);
+    if (!buf) return NULL;
+    
+    int slot, count = 0;
+    int total = registry_pump_count();
+    int gw = -1;
+    
+    if (device_id) {
+        gw = registry_find_gateway(device_id);
+        slot = registry_gateway_first_pump(gw);
+    } else {
+        slot = total > 0 ? 0 : -1;
+    }
+    
+    len = snprintf(buf, cap, "{\"pumps\":[");
+    
+    while (slot >= 0) {
+        PumpStatus p;
+        if (registry_read(slot, &p) == 0) {
+            // Room for one row plus the closing "],"count":N}"
+            if (cap - len < 256) {
+                cap *= 2;
+                char *grown = realloc(buf, cap);
+                if (!grown) {
+                    free(buf);
+                    return NULL;
+                }
+                buf = grown;
+            }
+            len += snprintf(buf + len, cap - len,
+                "%s{\"device_id\":\"%s\",\"pump_id\":%d,\"command\":%d,\"status\":%d,\"busy\":%d,\"alarm\":%d,\"timestamp\":%ld}",
+                count > 0 ? "," : "",
+                p.device_id, p.pump_id, p.command, p.status, p.busy, p.alarm, (long)p.timestamp);
+            count++;
+        }
+        
+        if (device_id) {
+            slot = registry_gateway_next_pump(slot);
+        } else {
+            slot = (slot + 1 < total) ? slot + 1 : -1;
+        }
+    }
+    
+    len += snprintf(buf + len, cap - len, "],\"count\":%d}", count);
+    if (len_out) *len_out = len;
+    return buf;
+}
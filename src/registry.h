@@ -0,0 +1,62 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include "shared.h"
+#include <stddef.h>
+#include <time.h>
+
+// Capacity of the pump table (fixed at startup, no rehash under readers)
+#define REGISTRY_MAX_PUMPS      131072
+#define REGISTRY_MAX_GATEWAYS   8192
+
+// Gateway used when a message carries no device_id (single-site installs)
+#define DEFAULT_GATEWAY_ID      "default"
+
+int registry_init(int max_pumps, int max_gateways);
+void registry_free();
+
+// Device ids are limited to [A-Za-z0-9_.:-] so they are safe in JSON and MQTT topics
+int registry_valid_device_id(const char *device_id);
+
+// Lookups are lock-free and O(1); they return the slot or -1 if unknown
+int registry_find_gateway(const char *device_id);
+int registry_find_pump(const char *device_id, int pump_id);
+
+// Find or create. Caller holds `lock` (the registry has a single writer at a time)
+int registry_add_gateway(const char *device_id);
+int registry_add_pump(const char *device_id, int pump_id);
+
+// Changes after every add or write, so a render tagged with the version read
+// before it is current for as long as the version stays the same
+unsigned long long registry_version();
+// Same for the gateway columns: adds, heartbeats and gateways going offline
+unsigned long long registry_gateway_version();
+
+int registry_pump_count();
+int registry_gateway_count();
+
+// Walk the pumps of one gateway: first slot, then next until -1
+int registry_gateway_first_pump(int gw);
+int registry_gateway_next_pump(int slot);
+
+// Consistent copy of one pump (lock-free, seqlock per slot)
+int registry_read(int slot, PumpStatus *out);
+
+// Consistent copy of one gateway's heartbeat state (lock-free, seqlock per gateway)
+int registry_read_gateway(int gw, GatewayHardwareStatus *out);
+
+// Writers: caller holds `lock`. Return 1 if the value changed, 0 otherwise.
+int registry_set_command(int slot, int command, time_t timestamp);
+int registry_set_status(int slot, int status, time_t timestamp);
+int registry_set_system(int gw, int busy, int alarm, time_t timestamp);
+// Marks the gateway online; changed on its first heartbeat, a new status or
+// firmware (NULL keeps it), or coming back from offline
+int registry_set_heartbeat(int gw, int status, const char *firmware, time_t timestamp);
+// Offline if it was online and last seen before seen_before; 1 if it lapsed now
+int registry_set_offline(int gw, time_t seen_before);
+
+// {"count":N,"pumps":[...]} for all pumps, or only those of device_id when not NULL.
+// Returns a malloc'd string; caller frees.
+char* registry_render_json(const char *device_id, size_t *len_out);
+
+#endif
@@ -0,0 +1,294 @@
+#include "respcache.h"
+#include "shared.h"
+#include "registry.h"
+#include "events.h"
+#include "compress.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Immutable once published. One reference for the cache slot and one per
+// thread response over it; MHD calls body_free only when the last connection
+// sending that response is done with it.
+typedef struct CachedBody {
+    atomic_int refs;
+    unsigned long long version;
+    struct CachedBody *gzip;    // NULL if small or incompressible; this body holds a reference
+    size_t len;
+    char data[];
+} CachedBody;
+
+typedef struct {
+    pthread_mutex_t lock;       // renders and swaps; a hit never takes it
+    CachedBody *body;
+} CacheSlot;
+
+typedef struct {
+    struct MHD_Response *response[RESPCACHE_KEYS];
+    struct MHD_Response *gzip[RESPCACHE_KEYS];
+    struct MHD_Response *not_modified[RESPCACHE_KEYS];
+    unsigned long long version[RESPCACHE_KEYS];
+    char etag[RESPCACHE_KEYS][RESPCACHE_ETAG_MAX];
+} ThreadCache;
+
+static CacheSlot slots[RESPCACHE_KEYS] = {
+    { PTHREAD_MUTEX_INITIALIZER, NULL },
+    { PTHREAD_MUTEX_INITIALIZER, NULL },
+};
+
+static pthread_key_t thread_key;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static time_t etag_epoch;
+
+static atomic_ullong renders;
+static atomic_ullong responses;
+static atomic_int bodies;
+
+static void body_release(CachedBody *b) {
+    if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) == 1) {
+        if (b->gzip) body_release(b->gzip);
+        free(b);
+        atomic_fetch_sub_explicit(&bodies, 1, memory_order_relaxed);
+    }
+}
+
+// MHD hands back the buffer the response was made from
+static void body_free(void *data) {
+    body_release((CachedBody *)((char *)data - offsetof(CachedBody, data)));
+}
+
+// Thread exit (MHD_stop_daemon joins its threads): connections are gone by
+// then, so destroying the responses drops their bodies
+static void thread_cache_free(void *arg) {
+    ThreadCache *tc = arg;
+    for (int k = 0; k < RESPCACHE_KEYS; k++) {
+        if (tc->response[k]) MHD_destroy_response(tc->response[k]);
+        if (tc->gzip[k]) MHD_destroy_response(tc->gzip[k]);
+        if (tc->not_modified[k]) MHD_destroy_response(tc->not_modified[k]);
+    }
+    free(tc);
+}
+
+static void cache_init() {
+    pthread_key_create(&thread_key, thread_cache_free);
+    etag_epoch = time(NULL);
+}
+
+static ThreadCache* thread_cache() {
+    pthread_once(&init_once, cache_init);
+    
+    ThreadCache *tc = pthread_getspecific(thread_key);
+    if (!tc) {
+        tc = calloc(1, sizeof(*tc));
+        if (tc && pthread_setspecific(thread_key, tc) != 0) {
+            free(tc);
+            tc = NULL;
+        }
+    }
+    return tc;
+}
+
+// Both only move forward, so "older than" is a plain comparison
+static unsigned long long slot_version(int key) {
+    if (key == RESPCACHE_PUMPS) return registry_version();
+    return registry_gateway_version();
+}
+
+static CachedBody* body_alloc(unsigned long long version, size_t cap) {
+    CachedBody *b = malloc(sizeof(*b) + cap);
+    if (!b) return NULL;
+    
+    atomic_init(&b->refs, 1);
+    b->version = version;
+    b->gzip = NULL;
+    b->len = 0;
+    atomic_fetch_add_explicit(&bodies, 1, memory_order_relaxed);
+    return b;
+}
+
+// Compressed once per render, not once per request
+static CachedBody* render_gzip(const CachedBody *b) {
+    size_t cap = compress_bound(b->len);
+    CachedBody *gz = body_alloc(b->version, cap);
+    if (!gz) return NULL;
+    
+    gz->len = compress_into(COMPRESS_GZIP, COMPRESS_LEVEL, b->data, b->len, gz->data, cap);
+    if (gz->len == 0 || gz->len >= b->len) {
+        body_release(gz);
+        return NULL;
+    }
+    
+    CachedBody *shrunk = realloc(gz, sizeof(*gz) + gz->len);
+    return shrunk ? shrunk : gz;
+}
+
+// Read after `version`, so the body is at least that new
+static CachedBody* render(int key, unsigned long long version) {
+    size_t len;
+    char *json = key == RESPCACHE_PUMPS ? registry_render_json(NULL, &len) : events_render_gateways(NULL, &len);
+    if (!json) return NULL;
+    
+    CachedBody *b = body_alloc(version, len + 1);
+    if (b) {
+        b->len = len;
+        memcpy(b->data, json, len);
+        b->data[len] = '\0';
+        b->gzip = len >= COMPRESS_MIN_BYTES ? render_gzip(b) : NULL;
+        atomic_fetch_add_explicit(&renders, 1, memory_order_relaxed);
+    }
+    
+    free(json);
+    return b;
+}
+
+// A reference on a body at least as new as version, rendering it if the
+// slot's is older. Threads that miss together render once.
+static CachedBody* slot_acquire(int key, unsigned long long version) {
+    CacheSlot *s = &slots[key];
+    
+    pthread_mutex_lock(&s->lock);
+    if (!s->body || s->body->version < version) {
+        CachedBody *fresh = render(key, version);
+        if (!fresh) {
+            pthread_mutex_unlock(&s->lock);
+            return NULL;
+        }
+        if (s->body) body_release(s->body);
+        s->body = fresh;
+    }
+    
+    CachedBody *b = s->body;
+    atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&s->lock);
+    return b;
+}
+
+static const char key_kind[RESPCACHE_KEYS] = { 'p', 'g' };
+
+static struct MHD_Response* body_response(CachedBody *b, const char *etag, int gzip) {
+    atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+    struct MHD_Response *response = MHD_create_response_from_buffer_with_free_callback(b->len, b->data, body_free);
+    if (!response) {
+        body_release(b);
+        return NULL;
+    }
+    
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    MHD_add_response_header(response, "Vary", "Accept-Encoding");
+    if (gzip) MHD_add_response_header(response, "Content-Encoding", "gzip");
+    respcache_set_etag(response, etag);
+    return response;
+}
+
+struct MHD_Response* respcache_response(int key, const char *if_none_match, int gzip, int *status) {
+    if (key < 0 || key >= RESPCACHE_KEYS) return NULL;
+    
+    ThreadCache *tc = thread_cache();
+    if (!tc) return NULL;
+    
+    unsigned long long version = slot_version(key);
+    if (!tc->response[key] || tc->version[key] < version) {
+        CachedBody *b = slot_acquire(key, version);
+        if (!b) return NULL;
+        
+        char etag[RESPCACHE_ETAG_MAX];
+        respcache_etag(key_kind[key], b->version, etag, sizeof(etag));
+        version = b->version;
+        
+        // The responses take their own references
+        int has_gzip = b->gzip != NULL;
+        struct MHD_Response *response = body_response(b, etag, 0);
+        struct MHD_Response *compressed = has_gzip ? body_response(b->gzip, etag, 1) : NULL;
+        struct MHD_Response *not_modified = respcache_not_modified(etag);
+        body_release(b);
+        
+        if (!response || !not_modified || (has_gzip && !compressed)) {
+            if (response) MHD_destroy_response(response);
+            if (compressed) MHD_destroy_response(compressed);
+            if (not_modified) MHD_destroy_response(not_modified);
+            return NULL;
+        }
+        
+        // Connections still sending the old ones keep them (and the body) alive
+        if (tc->response[key]) MHD_destroy_response(tc->response[key]);
+        if (tc->gzip[key]) MHD_destroy_response(tc->gzip[key]);
+        if (tc->not_modified[key]) MHD_destroy_response(tc->not_modified[key]);
+        tc->response[key] = response;
+        tc->gzip[key] = compressed;
+        tc->not_modified[key] = not_modified;
+        tc->version[key] = version;
+        memcpy(tc->etag[key], etag, sizeof(etag));
+        atomic_fetch_add_explicit(&responses, 1, memory_order_relaxed);
+    }
+    
+    if (respcache_etag_match(if_none_match, tc->etag[key])) {
+        *status = MHD_HTTP_NOT_MODIFIED;
+        return tc->not_modified[key];
+    }
+    *status = MHD_HTTP_OK;
+    return gzip && tc->gzip[key] ? tc->gzip[key] : tc->response[key];
+}
+
+void respcache_etag(char kind, unsigned long long version, char *buf, size_t max) {
+    pthread_once(&init_once, cache_init);
+    snprintf(buf, max, "W/\"%c%lx.%llx\"", kind, (long)etag_epoch, version);
+}
+
+// If-None-Match is "*" or a list of tags; weak comparison, so W/ is ignored
+int respcache_etag_match(const char *if_none_match, const char *etag) {
+    if (!if_none_match) return 0;
+    
+    const char *want = etag + (strncmp(etag, "W/", 2) == 0 ? 2 : 0);
+    size_t want_len = strlen(want);
+    const char *p = if_none_match;
+    
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '*') return 1;
+        if (strncmp(p, "W/", 2) == 0) p += 2;
+        
+        const char *end = p;
+        while (*end && *end != ',') end++;
+        const char *last = end;
+        while (last > p && (last[-1] == ' ' || last[-1] == '\t')) last--;
+        
+        if ((size_t)(last - p) == want_len && memcmp(p, want, want_len) == 0) return 1;
+        p = end;
+    }
+    return 0;
+}
+
+void respcache_set_etag(struct MHD_Response *response, const char *etag) {
+    MHD_add_response_header(response, "ETag", etag);
+    MHD_add_response_header(response, "Access-Control-Expose-Headers", "ETag");
+}
+
+struct MHD_Response* respcache_not_modified(const char *etag) {
+    struct MHD_Response *response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+    if (!response) return NULL;
+    
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    MHD_add_response_header(response, "Vary", "Accept-Encoding");
+    respcache_set_etag(response, etag);
+    return response;
+}
+
+void respcache_shutdown() {
+    for (int k = 0; k < RESPCACHE_KEYS; k++) {
+        pthread_mutex_lock(&slots[k].lock);
+        if (slots[k].body) body_release(slots[k].body);
+        slots[k].body = NULL;
+        pthread_mutex_unlock(&slots[k].lock);
+    }
+}
+
+void respcache_get_stats(RespCacheStats *out) {
+    out->renders = atomic_load_explicit(&renders, memory_order_relaxed);
+    out->responses = atomic_load_explicit(&responses, memory_order_relaxed);
+    out->bodies = atomic_load_explicit(&bodies, memory_order_relaxed);
+}
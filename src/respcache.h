@@ -0,0 +1,47 @@
+#ifndef RESPCACHE_H
+#define RESPCACHE_H
+
+#include <stddef.h>
+#include <microhttpd.h>
+
+// Pre-rendered bodies for the hot GETs. Each state change makes the next
+// request render the JSON once into an immutable, refcounted body tagged with
+// the state version it was rendered at. Every MHD thread keeps its own
+// response over the current body, so a GET that finds nothing changed is one
+// version check: no lock, no render, no allocation. Bodies over
+// COMPRESS_MIN_BYTES also get a gzip copy, compressed once per render.
+#define RESPCACHE_PUMPS         0       // GET /api/pump/status (all gateways)
+#define RESPCACHE_GATEWAY       1       // GET /api/gateway/status (all gateways)
+#define RESPCACHE_KEYS          2
+
+// Weak ETags: W/"<kind><process start>.<version>", so a tag from before a
+// restart never matches
+#define RESPCACHE_ETAG_MAX      48
+
+typedef struct {
+    unsigned long long renders;     // bodies rendered
+    unsigned long long responses;   // per-thread responses built over a body
+    int bodies;                     // alive, including ones still being sent
+} RespCacheStats;
+
+// Response for the current state of key, with the JSON headers and its ETag
+// set; the 304 one (*status 304) when if_none_match (may be NULL) names that
+// ETag. With gzip set, the body compressed at render time if it was worth it.
+// It is owned by the calling thread: queue it, don't destroy it. It stays
+// valid until this thread's next call for the same key. NULL when out of
+// memory.
+struct MHD_Response* respcache_response(int key, const char *if_none_match, int gzip, int *status);
+
+// For endpoints that render per request: the tag for a version of their data,
+// and whether an If-None-Match header (may be NULL) matches it
+void respcache_etag(char kind, unsigned long long version, char *buf, size_t max);
+int respcache_etag_match(const char *if_none_match, const char *etag);
+void respcache_set_etag(struct MHD_Response *response, const char *etag);   // ETag and its CORS exposure
+struct MHD_Response* respcache_not_modified(const char *etag);             // empty 304 body; caller destroys
+
+// After MHD_stop_daemon: drops the current bodies
+void respcache_shutdown();
+
+void respcache_get_stats(RespCacheStats *out);
+
+#endif
@@ -0,0 +1,389 @@
+#include "rollup.h"
+#include "shared.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *level_names[ROLLUP_LEVELS] = {"minute", "hour", "day"};
+static const int level_seconds[ROLLUP_LEVELS] = {60, 3600, 86400};
+static const char *level_tables[ROLLUP_LEVELS] = {"pump_rollup_minute", "pump_rollup_hour", "pump_rollup_day"};
+
+// Last state seen per pump and the time it has been credited up to.
+// Only the writer thread touches this table.
+typedef struct {
+    char device_id[64];
+    int pump_id;
+    int status;
+    int busy;
+    int alarm;
+    time_t since;
+} RollupState;
+
+static RollupState *states = NULL;
+static int state_cap = 0;
+static int state_count = 0;
+
+static sqlite3 *wconn = NULL;
+static sqlite3 *rconn = NULL;
+static sqlite3_stmt *upsert_stmt[ROLLUP_LEVELS];
+static sqlite3_stmt *state_stmt = NULL;
+static sqlite3_stmt *query_stmt[ROLLUP_LEVELS];
+static pthread_mutex_t query_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int state_hash(const char *device_id, int pump_id) {
+    unsigned int h = 2166136261u;
+    for (const char *p = device_id; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return (h ^ (unsigned int)pump_id) * 16777619u;
+}
+
+static RollupState* state_slot(RollupState *table, int cap, const char *device_id, int pump_id) {
+    unsigned int i = state_hash(device_id, pump_id) & (cap - 1);
+    while (table[i].pump_id != 0) {
+        if (table[i].pump_id == pump_id && strcmp(table[i].device_id, device_id) == 0) break;
+        i = (i + 1) & (cap - 1);
+    }
+    return &table[i];
+}
+
+// Find or create; the table doubles at half full
+static RollupState* state_get(const char *device_id, int pump_id, int *created) {
+    if (state_count * 2 >= state_cap) {
+        int cap = state_cap ? state_cap * 2 : 1024;
+        RollupState *grown = calloc(cap, sizeof(*grown));
+        if (!grown) return NULL;
+        
+        for (int i = 0; i < state_cap; i++) {
+            if (states[i].pump_id != 0) {
+                *state_slot(grown, cap, states[i].device_id, states[i].pump_id) = states[i];
+            }
+        }
+        free(states);
+        states = grown;
+        state_cap = cap;
+    }
+    
+    RollupState *st = state_slot(states, state_cap, device_id, pump_id);
+    *created = (st->pump_id == 0);
+    if (*created) {
+        snprintf(st->device_id, sizeof(st->device_id), "%s", device_id);
+        st->pump_id = pump_id;
+        state_count++;
+    }
+    return st;
+}
+
+static int accrues(const RollupState *st) {
+    return st->status == STATUS_RUNNING || st->alarm == 1 || st->busy > 0;
+}
+
+static int upsert(int level, const RollupState *st, time_t bucket, int runtime, int starts, int errors,
+                  int alarm_s, int busy1_s, int busy2_s) {
+    sqlite3_stmt *stmt = upsert_stmt[level];
+    
+    sqlite3_bind_text(stmt, 1, st->device_id, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, st->pump_id);
+    sqlite3_bind_int64(stmt, 3, bucket);
+    sqlite3_bind_int(stmt, 4, runtime);
+    sqlite3_bind_int(stmt, 5, starts);
+    sqlite3_bind_int(stmt, 6, errors);
+    sqlite3_bind_int(stmt, 7, alarm_s);
+    sqlite3_bind_int(stmt, 8, busy1_s);
+    sqlite3_bind_int(stmt, 9, busy2_s);
+    
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return (rc == SQLITE_DONE) ? 0 : -1;
+}
+
+// Credit [from, to) in the pump's current state to every bucket it overlaps
+static int accrue(const RollupState *st, time_t from, time_t to) {
+    if (to <= from || !accrues(st)) return 0;
+    
+    int run = st->status == STATUS_RUNNING;
+    int alarm = st->alarm == 1;
+    int busy1 = st->busy == BUSY_STARTING_P1;
+    int busy2 = st->busy == BUSY_STARTING_P2;
+    
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        time_t t = from;
+        while (t < to) {
+            time_t bucket = t - t % level_seconds[level];
+            time_t end = bucket + level_seconds[level];
+            if (end > to) end = to;
+            int secs = (int)(end - t);
+            
+            if (upsert(level, st, bucket, run ? secs : 0, 0, 0,
+                       alarm ? secs : 0, busy1 ? secs : 0, busy2 ? secs : 0) != 0) return -1;
+            t = end;
+        }
+    }
+    return 0;
+}
+
+static int count_events(const RollupState *st, time_t at, int starts, int errors) {
+    if (!starts && !errors) return 0;
+    
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        time_t bucket = at - at % level_seconds[level];
+        if (upsert(level, st, bucket, 0, starts, errors, 0, 0, 0) != 0) return -1;
+    }
+    return 0;
+}
+
+static int save_state(const RollupState *st) {
+    sqlite3_bind_text(state_stmt, 1, st->device_id, -1, SQLITE_STATIC);
+    sqlite3_bind_int(state_stmt, 2, st->pump_id);
+    sqlite3_bind_int(state_stmt, 3, st->status);
+    sqlite3_bind_int(state_stmt, 4, st->busy);
+    sqlite3_bind_int(state_stmt, 5, st->alarm);
+    sqlite3_bind_int64(state_stmt, 6, st->since);
+    
+    int rc = sqlite3_step(state_stmt);
+    sqlite3_reset(state_stmt);
+    return (rc == SQLITE_DONE) ? 0 : -1;
+}
+
+int rollup_snapshot(const char *device_id, int pump_id, int status, int busy, int alarm, time_t timestamp) {
+    if (!wconn || pump_id < 1) return -1;
+    
+    int created;
+    RollupState *st = state_get(device_id, pump_id, &created);
+    if (!st) return -1;
+    
+    int prev_status = created ? STATUS_UNKNOWN : st->status;
+    
+    // A snapshot older than since credits nothing
+    if (!created && accrue(st, st->since, timestamp) != 0) return -1;
+    
+    st->status = status;
+    st->busy = busy;
+    st->alarm = alarm;
+    // rollup_tick may already have credited past an older snapshot's time
+    if (created || timestamp > st->since) st->since = timestamp;
+    
+    if (count_events(st, timestamp,
+                     status == STATUS_RUNNING && prev_status != STATUS_RUNNING,
+                     status == STATUS_ERROR && prev_status != STATUS_ERROR) != 0) return -1;
+    
+    return save_state(st);
+}
+
+int rollup_tick(time_t now) {
+    if (!wconn) return -1;
+    
+    for (int i = 0; i < state_cap; i++) {
+        RollupState *st = &states[i];
+        if (st->pump_id == 0 || !accrues(st) || st->since >= now) continue;
+        
+        if (accrue(st, st->since, now) != 0) return -1;
+        st->since = now;
+        if (save_state(st) != 0) return -1;
+    }
+    return 0;
+}
+
+// Rebuild from the raw snapshots once, when the rollup tables are new
+static int rollup_backfill() {
+    sqlite3_stmt *stmt;
+    int rows = 0;
+    
+    const char *sql = "SELECT device_id, pump_id, status, busy, alarm, timestamp FROM pump_snapshots ORDER BY id";
+    if (sqlite3_prepare_v2(wconn, sql, -1, &stmt, NULL) != SQLITE_OK) return -1;
+    
+    sqlite3_exec(wconn, "BEGIN", NULL, NULL, NULL);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *device_id = (const char *)sqlite3_column_text(stmt, 0);
+        rollup_snapshot(device_id ? device_id : "", sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2),
+                        sqlite3_column_int(stmt, 3), sqlite3_column_int(stmt, 4), sqlite3_column_int64(stmt, 5));
+        rows++;
+    }
+    sqlite3_finalize(stmt);
+    
+    if (sqlite3_exec(wconn, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "[ROLLUP] Backfill failed: %s\n", sqlite3_errmsg(wconn));
+        sqlite3_exec(wconn, "ROLLBACK", NULL, NULL, NULL);
+        return -1;
+    }
+    
+    printf("[ROLLUP] Backfilled from %d snapshots\n", rows);
+    return 0;
+}
+
+static int load_states() {
+    sqlite3_stmt *stmt;
+    
+    const char *sql = "SELECT device_id, pump_id, status, busy, alarm, since FROM pump_rollup_state";
+    if (sqlite3_prepare_v2(wconn, sql, -1, &stmt, NULL) != SQLITE_OK) return -1;
+    
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *device_id = (const char *)sqlite3_column_text(stmt, 0);
+        int created;
+        RollupState *st = state_get(device_id ? device_id : "", sqlite3_column_int(stmt, 1), &created);
+        if (!st) break;
+        
+        st->status = sqlite3_column_int(stmt, 2);
+        st->busy = sqlite3_column_int(stmt, 3);
+        st->alarm = sqlite3_column_int(stmt, 4);
+        st->since = sqlite3_column_int64(stmt, 5);
+    }
+    
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+int rollup_init(sqlite3 *writer, sqlite3 *reader) {
+    char sql[768];
+    char *err_msg = NULL;
+    
+    wconn = writer;
+    rconn = reader;
+    
+    if (sqlite3_exec(wconn,
+            "CREATE TABLE IF NOT EXISTS pump_rollup_state (device_id TEXT, pump_id INTEGER, status INTEGER, busy INTEGER, alarm INTEGER, since INTEGER, "
+            "PRIMARY KEY (device_id, pump_id)) WITHOUT ROWID;",
+            NULL, NULL, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "[ROLLUP] Error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return -1;
+    }
+    
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        snprintf(sql, sizeof(sql),
+                 "CREATE TABLE IF NOT EXISTS %s (device_id TEXT, pump_id INTEGER, bucket INTEGER, runtime_s INTEGER, starts INTEGER, errors INTEGER, "
+                 "alarm_s INTEGER, busy1_s INTEGER, busy2_s INTEGER, PRIMARY KEY (device_id, pump_id, bucket)) WITHOUT ROWID;"
+                 "CREATE INDEX IF NOT EXISTS idx_%s_bucket ON %s(bucket);",
+                 level_tables[level], level_tables[level], level_tables[level]);
+        if (sqlite3_exec(wconn, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+            fprintf(stderr, "[ROLLUP] Error: %s\n", err_msg);
+            sqlite3_free(err_msg);
+            return -1;
+        }
+        
+        snprintf(sql, sizeof(sql),
+                 "INSERT INTO %s (device_id, pump_id, bucket, runtime_s, starts, errors, alarm_s, busy1_s, busy2_s) VALUES (?,?,?,?,?,?,?,?,?) "
+                 "ON CONFLICT (device_id, pump_id, bucket) DO UPDATE SET runtime_s = runtime_s + excluded.runtime_s, "
+                 "starts = starts + excluded.starts, errors = errors + excluded.errors, alarm_s = alarm_s + excluded.alarm_s, "
+                 "busy1_s = busy1_s + excluded.busy1_s, busy2_s = busy2_s + excluded.busy2_s",
+                 level_tables[level]);
+        if (sqlite3_prepare_v3(wconn, sql, -1, SQLITE_PREPARE_PERSISTENT, &upsert_stmt[level], NULL) != SQLITE_OK) {
+            fprintf(stderr, "[ROLLUP] Prepare failed: %s\n", sqlite3_errmsg(wconn));
+            return -1;
+        }
+    }
+    
+    const char *state_sql =
+        "INSERT INTO pump_rollup_state (device_id, pump_id, status, busy, alarm, since) VALUES (?,?,?,?,?,?) "
+        "ON CONFLICT (device_id, pump_id) DO UPDATE SET status = excluded.status, busy = excluded.busy, "
+        "alarm = excluded.alarm, since = excluded.since";
+    if (sqlite3_prepare_v3(wconn, state_sql, -1, SQLITE_PREPARE_PERSISTENT, &state_stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "[ROLLUP] Prepare failed: %s\n", sqlite3_errmsg(wconn));
+        return -1;
+    }
+    
+    if (load_states() != 0) return -1;
+    if (state_count == 0 && rollup_backfill() != 0) return -1;
+    
+    // Prepared after the tables exist; the reader connection may have cached an older schema
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        snprintf(sql, sizeof(sql),
+                 "SELECT device_id, pump_id, bucket, runtime_s, starts, errors, alarm_s, busy1_s, busy2_s FROM %s "
+                 "WHERE bucket >= ?1 AND bucket < ?2 AND (?3 IS NULL OR device_id = ?3) AND (?4 IS NULL OR pump_id = ?4) "
+                 "ORDER BY bucket, device_id, pump_id",
+                 level_tables[level]);
+        if (sqlite3_prepare_v3(rconn, sql, -1, SQLITE_PREPARE_PERSISTENT, &query_stmt[level], NULL) != SQLITE_OK) {
+            fprintf(stderr, "[ROLLUP] Prepare failed: %s\n", sqlite3_errmsg(rconn));
+            return -1;
+        }
+    }
+    
+    printf("[ROLLUP] Tracking %d pumps\n", state_count);
+    return 0;
+}
+
+void rollup_close() {
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        sqlite3_finalize(upsert_stmt[level]);
+        sqlite3_finalize(query_stmt[level]);
+        upsert_stmt[level] = NULL;
+        query_stmt[level] = NULL;
+    }
+    sqlite3_finalize(state_stmt);
+    state_stmt = NULL;
+    
+    free(states);
+    states = NULL;
+    state_cap = 0;
+    state_count = 0;
+    wconn = NULL;
+    rconn = NULL;
+}
+
+int rollup_level_from_name(const char *name) {
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        if (strcmp(name, level_names[level]) == 0) return level;
+    }
+    return -1;
+}
+
+const char* rollup_level_name(int level) {
+    return (level >= 0 && level < ROLLUP_LEVELS) ? level_names[level] : "unknown";
+}
+
+int rollup_level_seconds(int level) {
+    return (level >= 0 && level < ROLLUP_LEVELS) ? level_seconds[level] : 0;
+}
+
+char* rollup_render_json(int level, time_t from, time_t to, const char *device_id, int pump_id, size_t *len_out) {
+    if (!rconn || level < 0 || level >= ROLLUP_LEVELS) return NULL;
+    
+    size_t cap = 4096;
+    size_t len = 0;
+    int count = 0;
+    char *buf = malloc(cap);
+    if (!buf) return NULL;
+    
+    len = snprintf(buf, cap, "{\"bucket\":\"%s\",\"bucket_seconds\":%d,\"data\":[", level_names[level], level_seconds[level]);
+    
+    pthread_mutex_lock(&query_lock);
+    sqlite3_stmt *stmt = query_stmt[level];
+    sqlite3_bind_int64(stmt, 1, from);
+    sqlite3_bind_int64(stmt, 2, to);
+    if (device_id) sqlite3_bind_text(stmt, 3, device_id, -1, SQLITE_TRANSIENT);
+    if (pump_id > 0) sqlite3_bind_int(stmt, 4, pump_id);
+    
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        // Room for one row plus the closing "],"count":N}"
+        if (cap - len < 320) {
+            cap *= 2;
+            char *grown = realloc(buf, cap);
+            if (!grown) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = grown;
+        }
+        
+        const char *dev = (const char *)sqlite3_column_text(stmt, 0);
+        len += snprintf(buf + len, cap - len,
+            "%s{\"device_id\":\"%s\",\"pump_id\":%d,\"bucket\":%lld,\"runtime_s\":%d,\"starts\":%d,\"errors\":%d,"
+            "\"alarm_s\":%d,\"busy1_s\":%d,\"busy2_s\":%d}",
+            count > 0 ? "," : "",
+            dev ? dev : "", sqlite3_column_int(stmt, 1), (long long)sqlite3_column_int64(stmt, 2),
+            sqlite3_column_int(stmt, 3), sqlite3_column_int(stmt, 4), sqlite3_column_int(stmt, 5),
+            sqlite3_column_int(stmt, 6), sqlite3_column_int(stmt, 7), sqlite3_column_int(stmt, 8));
+        count++;
+    }
+    
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    pthread_mutex_unlock(&query_lock);
+    
+    if (!buf) return NULL;
+    len += snprintf(buf + len, cap - len, "],\"count\":%d}", count);
+    if (len_out) *len_out = len;
+    return buf;
+}
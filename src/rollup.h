@@ -0,0 +1,36 @@
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <sqlite3.h>
+#include <stddef.h>
+#include <time.h>
+
+// Per-pump duration and event counters at minute, hour and day resolution
+// (UTC buckets), maintained by the DB writer as snapshots are committed.
+#define ROLLUP_MINUTE   0
+#define ROLLUP_HOUR     1
+#define ROLLUP_DAY      2
+#define ROLLUP_LEVELS   3
+
+// Open intervals (a pump still running, an alarm still active) are credited
+// at least this often, so the current bucket is never more than a tick behind
+#define ROLLUP_TICK_S   60
+
+// Writer side: upserts go through `writer` inside the DB writer's open
+// transaction. Queries use `reader`.
+int rollup_init(sqlite3 *writer, sqlite3 *reader);
+void rollup_close();
+int rollup_snapshot(const char *device_id, int pump_id, int status, int busy, int alarm, time_t timestamp);
+int rollup_tick(time_t now);
+
+// Reader side: returns -1 for an unknown name
+int rollup_level_from_name(const char *name);
+const char* rollup_level_name(int level);
+int rollup_level_seconds(int level);
+
+// {"bucket":"hour","data":[...],"count":N} for buckets starting in [from, to).
+// device_id / pump_id narrow the result when not NULL / > 0.
+// Returns a malloc'd string; caller frees.
+char* rollup_render_json(int level, time_t from, time_t to, const char *device_id, int pump_id, size_t *len_out);
+
+#endif
@@ -0,0 +1,272 @@
+#include "router.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PARAM_STR       1
+#define PARAM_INT       2
+
+typedef struct RouteNode RouteNode;
+
+struct RouteNode {
+    char *segment;              // literal children only
+    size_t segment_len;
+    RouteNode **children;       // literal children, open addressing
+    int child_count;
+    int child_cap;              // power of two, at most half full
+    RouteNode *param;           // "{name}" / "{name:int}"
+    RouteNode *rest;            // "{name*}"
+    char *param_name;           // on param and rest nodes
+    int param_type;
+    const void *routes[ROUTER_METHODS];
+    int methods;
+};
+
+struct Router {
+    RouteNode root;
+};
+
+static unsigned segment_hash(const char *s, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+static RouteNode* child_find(const RouteNode *n, const char *s, size_t len) {
+    if (n->child_count == 0) return NULL;
+    
+    unsigned mask = n->child_cap - 1;
+    for (unsigned i = segment_hash(s, len) & mask; n->children[i]; i = (i + 1) & mask) {
+        RouteNode *c = n->children[i];
+        if (c->segment_len == len && memcmp(c->segment, s, len) == 0) return c;
+    }
+    return NULL;
+}
+
+static int child_insert(RouteNode *n, RouteNode *child) {
+    if ((n->child_count + 1) * 2 > n->child_cap) {
+        int cap = n->child_cap ? n->child_cap * 2 : 4;
+        RouteNode **table = calloc(cap, sizeof(*table));
+        if (!table) return -1;
+        
+        for (int i = 0; i < n->child_cap; i++) {
+            RouteNode *c = n->children[i];
+            if (!c) continue;
+            unsigned j = segment_hash(c->segment, c->segment_len) & (cap - 1);
+            while (table[j]) j = (j + 1) & (cap - 1);
+            table[j] = c;
+        }
+        free(n->children);
+        n->children = table;
+        n->child_cap = cap;
+    }
+    
+    unsigned mask = n->child_cap - 1;
+    unsigned i = segment_hash(child->segment, child->segment_len) & mask;
+    while (n->children[i]) i = (i + 1) & mask;
+    n->children[i] = child;
+    n->child_count++;
+    return 0;
+}
+
+static void node_free(RouteNode *n) {
+    for (int i = 0; i < n->child_cap; i++) {
+        if (n->children[i]) {
+            node_free(n->children[i]);
+            free(n->children[i]);
+        }
+    }
+    free(n->children);
+    if (n->param) {
+        node_free(n->param);
+        free(n->param);
+    }
+    if (n->rest) {
+        node_free(n->rest);
+        free(n->rest);
+    }
+    free(n->segment);
+    free(n->param_name);
+}
+
+Router* router_new() {
+    return calloc(1, sizeof(Router));
+}
+
+void router_free(Router *r) {
+    if (!r) return;
+    node_free(&r->root);
+    free(r);
+}
+
+// The param or rest child of n for "{...}", made on first use
+static RouteNode* param_child(RouteNode *n, const char *s, size_t len) {
+    if (len < 3 || s[len - 1] != '}') return NULL;
+    const char *name = s + 1;
+    size_t name_len = len - 2;
+    int rest = 0, type = PARAM_STR;
+    
+    if (name[name_len - 1] == '*') {
+        rest = 1;
+        name_len--;
+    } else if (name_len > 4 && memcmp(name + name_len - 4, ":int", 4) == 0) {
+        type = PARAM_INT;
+        name_len -= 4;
+    }
+    if (name_len == 0) return NULL;
+    
+    RouteNode **slot = rest ? &n->rest : &n->param;
+    if (*slot) {
+        // One parameter per position: the same name and type or nothing
+        RouteNode *p = *slot;
+        if (strlen(p->param_name) != name_len || memcmp(p->param_name, name, name_len) != 0 ||
+            p->param_type != type) return NULL;
+        return p;
+    }
+    
+    RouteNode *p = calloc(1, sizeof(*p));
+    if (!p) return NULL;
+    p->param_name = strndup(name, name_len);
+    p->param_type = type;
+    if (!p->param_name) {
+        free(p);
+        return NULL;
+    }
+    *slot = p;
+    return p;
+}
+
+int router_add(Router *r, int methods, const char *pattern, const void *route) {
+    if (!r || !route || pattern[0] != '/' || !(methods & (ROUTER_GET | ROUTER_POST))) return -1;
+    
+    RouteNode *n = &r->root;
+    const char *s = pattern + 1;
+    while (*s) {
+        size_t len = strcspn(s, "/");
+        if (len == 0) return -1;
+        
+        RouteNode *next;
+        if (s[0] == '{') {
+            // "{name*}" has to be the last segment
+            next = param_child(n, s, len);
+            if (!next || (next == n->rest && s[len] != '\0')) return -1;
+        } else {
+            next = child_find(n, s, len);
+            if (!next) {
+                next = calloc(1, sizeof(*next));
+                if (!next) return -1;
+                next->segment = strndup(s, len);
+                next->segment_len = len;
+                if (!next->segment || child_insert(n, next) != 0) {
+                    free(next->segment);
+                    free(next);
+                    return -1;
+                }
+            }
+        }
+        
+        n = next;
+        s += len;
+        if (*s == '/') s++;
+    }
+    
+    if (n->methods & methods) return -1;
+    for (int m = 0; m < ROUTER_METHODS; m++) {
+        if (methods & (1 << m)) n->routes[m] = route;
+    }
+    n->methods |= methods;
+    return 0;
+}
+
+static int param_push(RouteParams *params, const RouteNode *n, const char *s, size_t len) {
+    if (params->count == ROUTER_MAX_PARAMS || params->used + len + 1 > sizeof(params->buf)) return -1;
+    
+    long long num = 0;
+    if (n->param_type == PARAM_INT) {
+        // Digits only, and few enough not to overflow
+        if (len == 0 || len > 18) return -1;
+        for (size_t i = 0; i < len; i++) {
+            if (s[i] < '0' || s[i] > '9') return -1;
+            num = num * 10 + (s[i] - '0');
+        }
+    }
+    
+    char *value = params->buf + params->used;
+    memcpy(value, s, len);
+    value[len] = '\0';
+    params->used += len + 1;
+    
+    int i = params->count++;
+    params->name[i] = n->param_name;
+    params->value[i] = value;
+    params->num[i] = num;
+    return 0;
+}
+
+static void param_pop(RouteParams *params, int count, size_t used) {
+    params->count = count;
+    params->used = used;
+}
+
+// seg is the start of the next segment, NULL once the path is used up
+static const RouteNode* match(const RouteNode *n, const char *seg, RouteParams *params) {
+    int count = params->count;
+    size_t used = params->used;
+    
+    if (!seg) {
+        if (n->methods) return n;
+        if (n->rest && n->rest->methods && param_push(params, n->rest, "", 0) == 0) return n->rest;
+        return NULL;
+    }
+    
+    size_t len = strcspn(seg, "/");
+    const char *next = seg[len] == '/' ? seg + len + 1 : NULL;
+    
+    const RouteNode *child = child_find(n, seg, len);
+    const RouteNode *found = child ? match(child, next, params) : NULL;
+    if (found) return found;
+    
+    if (n->param && len > 0 && param_push(params, n->param, seg, len) == 0) {
+        found = match(n->param, next, params);
+        if (found) return found;
+        param_pop(params, count, used);
+    }
+    
+    if (n->rest && n->rest->methods && param_push(params, n->rest, seg, strlen(seg)) == 0) return n->rest;
+    return NULL;
+}
+
+const void* router_match(const Router *r, int method, const char *path, RouteParams *params, int *allowed) {
+    params->count = 0;
+    params->used = 0;
+    *allowed = 0;
+    if (!r || path[0] != '/') return NULL;
+    
+    const RouteNode *n = match(&r->root, path[1] ? path + 1 : NULL, params);
+    if (!n) return NULL;
+    
+    *allowed = n->methods;
+    for (int m = 0; m < ROUTER_METHODS; m++) {
+        if (method == (1 << m)) return n->routes[m];
+    }
+    return NULL;
+}
+
+int router_method(const char *method) {
+    if (strcmp(method, "GET") == 0) return ROUTER_GET;
+    if (strcmp(method, "POST") == 0) return ROUTER_POST;
+    return 0;
+}
+
+const char* route_param(const RouteParams *params, const char *name) {
+    for (int i = 0; i < params->count; i++) {
+        if (strcmp(params->name[i], name) == 0) return params->value[i];
+    }
+    return NULL;
+}
+
+long long route_param_int(const RouteParams *params, const char *name, long long dflt) {
+    for (int i = 0; i < params->count; i++) {
+        if (strcmp(params->name[i], name) == 0) return params->num[i];
+    }
+    return dflt;
+}
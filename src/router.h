@@ -0,0 +1,52 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+
+// Path router: a trie over URL segments, built once at startup and only
+// read after that, so lookups need no lock. Each node finds its literal
+// children through a small hash table; a match costs O(path length) however
+// many routes there are. Patterns:
+//   "/api/pump/status"                 literal segments
+//   "/api/commands/{id:int}"           one segment, digits only
+//   "/api/gateways/{device_id}/status" one non-empty segment
+//   "/{path*}"                         the rest of the path (last only, may be empty)
+// A literal beats a parameter, which beats a rest match; the router backs up
+// to the next choice when the deeper segments don't match.
+#define ROUTER_MAX_PARAMS       4
+#define ROUTER_PARAM_BYTES      256     // all values of one match, NUL-terminated
+
+#define ROUTER_GET              0x1
+#define ROUTER_POST             0x2
+#define ROUTER_METHODS          2
+
+typedef struct {
+    int count;
+    const char *name[ROUTER_MAX_PARAMS];
+    const char *value[ROUTER_MAX_PARAMS];   // into buf
+    long long num[ROUTER_MAX_PARAMS];       // {name:int} values
+    size_t used;
+    char buf[ROUTER_PARAM_BYTES];
+} RouteParams;
+
+typedef struct Router Router;
+
+Router* router_new();
+void router_free(Router *r);
+
+// methods is a mask of ROUTER_GET / ROUTER_POST; route is handed back by
+// router_match(). -1 on a malformed pattern, a parameter that clashes with
+// one already at that position, or a method the path already has.
+int router_add(Router *r, int methods, const char *pattern, const void *route);
+
+// The route for method and path, or NULL. *allowed gets the methods the
+// path does have (0 = no such path, else the answer is 405).
+const void* router_match(const Router *r, int method, const char *path, RouteParams *params, int *allowed);
+
+int router_method(const char *method);      // ROUTER_GET, ROUTER_POST or 0
+
+// NULL / dflt when the route has no such parameter
+const char* route_param(const RouteParams *params, const char *name);
+long long route_param_int(const RouteParams *params, const char *name, long long dflt);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <stdatomic.h>
+#include <sched.h>
+
+// Sequence lock: one writer at a time (callers serialize writers themselves),
+// any number of readers that never block the writer. The counter is odd while
+// a write is in progress; a reader retries if it changed during its copy.
+typedef struct {
+    atomic_uint seq;
+} SeqLock;
+
+#define SEQLOCK_INITIALIZER { 0 }
+
+static inline void seqlock_write_begin(SeqLock *sl) {
+    unsigned int s = atomic_load_explicit(&sl->seq, memory_order_relaxed);
+    atomic_store_explicit(&sl->seq, s + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void seqlock_write_end(SeqLock *sl) {
+    unsigned int s = atomic_load_explicit(&sl->seq, memory_order_relaxed);
+    atomic_store_explicit(&sl->seq, s + 1, memory_order_release);
+}
+
+static inline unsigned int seqlock_read_begin(SeqLock *sl) {
+    unsigned int s;
+    while ((s = atomic_load_explicit(&sl->seq, memory_order_acquire)) & 1) {
+        sched_yield();
+    }
+    return s;
+}
+
+static inline int seqlock_read_retry(SeqLock *sl, unsigned int start) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&sl->seq, memory_order_relaxed) != start;
+}
+
+#endif
@@ -1,17 +1,21 @@
 #include "shared.h"
+#include "registry.h"
 #include "db.h"
+#include "events.h"
 #include <string.h>
 #include <stdio.h>
 
 volatile int running = 1;
 pthread_mutex_t lock;
-PumpStatus current_pump_status = {0, 0, 0, 0, 0, 0, 0};  // 7 giá trị
 PumpHistory pump_history = {0};
-GatewayHardwareStatus gateway_hw_status = {0, 0, 0, "", ""};
 
-// Previous states for change detection
-static PumpStatus previous_pump_status = {0, 0, 0, 0, 0, 0, 0};
-static GatewayHardwareStatus previous_gateway_status = {0, 0, 0, "", ""};
+int pump_status_snapshot(const char *device_id, int pump_id, PumpStatus *out) {
+    return registry_read(registry_find_pump(device_id, pump_id), out);
+}
+
+int gateway_status_snapshot(const char *device_id, GatewayHardwareStatus *out) {
+    return registry_read_gateway(registry_find_gateway(device_id), out);
+}
 
 void add_pump_history(PumpStatus status) {
     pthread_mutex_lock(&lock);
@@ -26,183 +30,172 @@ void add_pump_history(PumpStatus status) {
     pthread_mutex_unlock(&lock);
 }
 
-void update_pump_status(int pump_id, int state) {
-    pthread_mutex_lock(&lock);
+void update_pump_status(const char *device_id, int pump_id, int state) {
+    if (!device_id) device_id = DEFAULT_GATEWAY_ID;
     
-    int previous_state = (pump_id == 1) ? previous_pump_status.pump1 : previous_pump_status.pump2;
+    pthread_mutex_lock(&lock);
     
-    switch(pump_id) {
-        case 1: current_pump_status.pump1 = state; break;
-        case 2: current_pump_status.pump2 = state; break;
+    int slot = registry_add_pump(device_id, pump_id);
+    if (slot < 0) {
+        pthread_mutex_unlock(&lock);
+        printf("[SHARED] %s/Pump%d unknown, command dropped\n", device_id, pump_id);
+        return;
     }
     
-    current_pump_status.timestamp = time(NULL);
-    
     // Check if command actually changed
-    int command_changed = (previous_state != state);
+    int command_changed = registry_set_command(slot, state, time(NULL));
+    
+    PumpStatus snap;
+    registry_read(slot, &snap);
     
     pthread_mutex_unlock(&lock);
     
     if (command_changed) {
-        add_pump_history(current_pump_status);
-        
-        printf("[SHARED] Pump%d COMMAND = %s (CHANGED)\n", pump_id, state ? "ON" : "OFF");
+        add_pump_history(snap);
         
-        db_insert_command(pump_id, state, current_pump_status.timestamp, "api");
-        db_insert_snapshot(
-            current_pump_status.pump1, current_pump_status.pump1_status,
-            current_pump_status.pump2, current_pump_status.pump2_status,
-            current_pump_status.busy, current_pump_status.alarm,
-            current_pump_status.timestamp
-        );
+        printf("[SHARED] %s/Pump%d COMMAND = %s (CHANGED)\n", device_id, pump_id, state ? "ON" : "OFF");
         
-        // Update previous state
-        pthread_mutex_lock(&lock);
-        switch(pump_id) {
-            case 1: previous_pump_status.pump1 = state; break;
-            case 2: previous_pump_status.pump2 = state; break;
-        }
-        pthread_mutex_unlock(&lock);
+        db_insert_command(device_id, pump_id, state, snap.timestamp, "api");
+        db_insert_snapshot(&snap);
+        events_pump(&snap);
     } else {
-        printf("[SHARED] Pump%d COMMAND = %s (no change, skip DB)\n", pump_id, state ? "ON" : "OFF");
+        printf("[SHARED] %s/Pump%d COMMAND = %s (no change, skip DB)\n", device_id, pump_id, state ? "ON" : "OFF");
     }
 }
 
-void update_pump_feedback(int pump_id, int status) {
-    pthread_mutex_lock(&lock);
+void update_pump_feedback(const char *device_id, int pump_id, int status) {
+    if (!device_id) device_id = DEFAULT_GATEWAY_ID;
     
     // Validate status (0-3)
     if (status < 0 || status > 3) {
         status = STATUS_UNKNOWN;
     }
     
-    int previous_status = (pump_id == 1) ? previous_pump_status.pump1_status : previous_pump_status.pump2_status;
+    pthread_mutex_lock(&lock);
     
-    switch(pump_id) {
-        case 1: current_pump_status.pump1_status = status; break;
-        case 2: current_pump_status.pump2_status = status; break;
+    int slot = registry_add_pump(device_id, pump_id);
+    if (slot < 0) {
+        pthread_mutex_unlock(&lock);
+        printf("[FEEDBACK] %s/Pump%d unknown, feedback dropped\n", device_id, pump_id);
+        return;
     }
     
-    current_pump_status.timestamp = time(NULL);
-    
     // Check if status actually changed
-    int status_changed = (previous_status != status);
+    int status_changed = registry_set_status(slot, status, time(NULL));
+    
+    PumpStatus snap;
+    registry_read(slot, &snap);
     
     pthread_mutex_unlock(&lock);
     
     const char *status_str[] = {"Unknown", "Running", "Stopped", "Error"};
     
     if (status_changed) {
-        printf("[FEEDBACK] Pump%d HW Status = %s (CHANGED)\n", pump_id, status_str[status]);
-        
-        db_insert_feedback(pump_id, status, current_pump_status.timestamp);
-        db_insert_snapshot(
-            current_pump_status.pump1, current_pump_status.pump1_status,
-            current_pump_status.pump2, current_pump_status.pump2_status,
-            current_pump_status.busy, current_pump_status.alarm,
-            current_pump_status.timestamp
-        );
+        printf("[FEEDBACK] %s/Pump%d HW Status = %s (CHANGED)\n", device_id, pump_id, status_str[status]);
         
-        // Update previous state
-        pthread_mutex_lock(&lock);
-        switch(pump_id) {
-            case 1: previous_pump_status.pump1_status = status; break;
-            case 2: previous_pump_status.pump2_status = status; break;
-        }
-        pthread_mutex_unlock(&lock);
+        db_insert_feedback(device_id, pump_id, status, snap.timestamp);
+        db_insert_snapshot(&snap);
+        events_pump(&snap);
     } else {
-        printf("[FEEDBACK] Pump%d HW Status = %s (no change, skip DB)\n", pump_id, status_str[status]);
+        printf("[FEEDBACK] %s/Pump%d HW Status = %s (no change, skip DB)\n", device_id, pump_id, status_str[status]);
     }
 }
+
 void update_gateway_heartbeat(const char *device_id, const char *firmware, int status) {
-    pthread_mutex_lock(&lock);
-    
-    // Check what changed
-    int is_first_heartbeat = (gateway_hw_status.last_seen_at == 0);
-    int status_changed = (gateway_hw_status.gateway_reported_status != status);
-    int online_state_changed = (gateway_hw_status.is_online != 1);
-    int firmware_changed = (firmware && strcmp(gateway_hw_status.firmware_version, firmware) != 0);
+    if (!device_id) device_id = DEFAULT_GATEWAY_ID;
     
-    // Update current state
-    gateway_hw_status.is_online = 1;
-    gateway_hw_status.gateway_reported_status = status;
-    gateway_hw_status.last_seen_at = time(NULL);
+    pthread_mutex_lock(&lock);
     
-    if (device_id) {
-        strncpy(gateway_hw_status.device_id, device_id, sizeof(gateway_hw_status.device_id) - 1);
+    int gw = registry_add_gateway(device_id);
+    if (gw < 0) {
+        pthread_mutex_unlock(&lock);
+        printf("[GATEWAY] %s unknown, heartbeat dropped\n", device_id);
+        return;
     }
     
-    if (firmware) {
-        strncpy(gateway_hw_status.firmware_version, firmware, sizeof(gateway_hw_status.firmware_version) - 1);
-    }
+    // First heartbeat, new status or firmware, or back from offline
+    int changed = registry_set_heartbeat(gw, status, firmware, time(NULL));
+    
+    GatewayHardwareStatus snap;
+    registry_read_gateway(gw, &snap);
     
     pthread_mutex_unlock(&lock);
     
-    // Only save to DB if something important changed
-    if (is_first_heartbeat || status_changed || online_state_changed || firmware_changed) {
-        printf("[GATEWAY] Heartbeat: %s (FW: %s, Status: %d) - CHANGED, saving to DB\n", 
-               device_id ? device_id : "unknown", 
-               firmware ? firmware : "unknown",
-               status);
+    events_gateway(&snap, changed);
+    
+    // Only save to DB if something important changed for this gateway
+    if (changed) {
+        printf("[GATEWAY] Heartbeat: %s (FW: %s, Status: %d) - CHANGED, saving to DB\n",
+               device_id, snap.firmware_version[0] ? snap.firmware_version : "unknown", status);
         
-        db_insert_gateway_status(1, device_id, firmware, gateway_hw_status.last_seen_at);
+        db_insert_gateway_status(1, device_id, snap.firmware_version, snap.last_seen_at);
+    } else {
+        printf("[GATEWAY] Heartbeat: %s (FW: %s, Status: %d) - no change, skip DB\n",
+               device_id, snap.firmware_version[0] ? snap.firmware_version : "unknown", status);
+    }
+}
+
+void update_gateway_liveness(time_t now) {
+    int count = registry_gateway_count();
+    
+    for (int gw = 0; gw < count; gw++) {
+        // Lock-free look first: nearly every gateway is fresh or already offline
+        GatewayHardwareStatus snap;
+        if (registry_read_gateway(gw, &snap) != 0 || !snap.is_online ||
+            now - snap.last_seen_at < GATEWAY_TIMEOUT_S) {
+            continue;
+        }
         
-        // Update previous state
         pthread_mutex_lock(&lock);
-        previous_gateway_status.is_online = 1;
-        previous_gateway_status.gateway_reported_status = status;
-        if (device_id) {
-            strncpy(previous_gateway_status.device_id, device_id, sizeof(previous_gateway_status.device_id) - 1);
-        }
-        if (firmware) {
-            strncpy(previous_gateway_status.firmware_version, firmware, sizeof(previous_gateway_status.firmware_version) - 1);
-        }
+        int lapsed = registry_set_offline(gw, now - GATEWAY_TIMEOUT_S + 1);
+        registry_read_gateway(gw, &snap);
         pthread_mutex_unlock(&lock);
-    } else {
-        printf("[GATEWAY] Heartbeat: %s (FW: %s, Status: %d) - no change, skip DB\n", 
-               device_id ? device_id : "unknown", 
-               firmware ? firmware : "unknown",
-               status);
+        
+        if (lapsed) {
+            printf("[GATEWAY] %s offline (last seen %lds ago)\n", snap.device_id, (long)(now - snap.last_seen_at));
+            events_gateway(&snap, 1);
+            db_insert_gateway_status(0, snap.device_id, snap.firmware_version, now);
+        }
     }
 }
 
-void update_system_status(int busy, int alarm) {
+void update_system_status(const char *device_id, int busy, int alarm) {
+    if (!device_id) device_id = DEFAULT_GATEWAY_ID;
+    
     pthread_mutex_lock(&lock);
     
-    int busy_changed = (previous_pump_status.busy != busy);
-    int alarm_changed = (previous_pump_status.alarm != alarm);
+    int gw = registry_add_gateway(device_id);
+    if (gw < 0) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
     
-    current_pump_status.busy = busy;
-    current_pump_status.alarm = alarm;
-    current_pump_status.timestamp = time(NULL);
+    int changed = registry_set_system(gw, busy, alarm, time(NULL));
+    int first = registry_gateway_first_pump(gw);
     
     pthread_mutex_unlock(&lock);
     
-    if (busy_changed || alarm_changed) {
+    if (changed) {
         const char *busy_str[] = {"Idle", "Starting_P1", "Starting_P2"};
         
-        if (busy_changed) {
-            printf("[SYSTEM] Busy status: %s (CHANGED)\n", 
-                   (busy >= 0 && busy <= 2) ? busy_str[busy] : "Invalid");
+        if (busy >= 0) {
+            printf("[SYSTEM] %s Busy status: %s\n", device_id,
+                   (busy <= 2) ? busy_str[busy] : "Invalid");
         }
         
-        if (alarm_changed) {
-            printf("[SYSTEM] Alarm status: %s (CHANGED)\n", alarm ? "ACTIVE" : "Clear");
+        if (alarm >= 0) {
+            printf("[SYSTEM] %s Alarm status: %s\n", device_id, alarm ? "ACTIVE" : "Clear");
         }
         
-        db_insert_snapshot(
-            current_pump_status.pump1, current_pump_status.pump1_status,
-            current_pump_status.pump2, current_pump_status.pump2_status,
-            current_pump_status.busy, current_pump_status.alarm,
-            current_pump_status.timestamp
-        );
-        
-        // Update previous state
-        pthread_mutex_lock(&lock);
-        previous_pump_status.busy = busy;
-        previous_pump_status.alarm = alarm;
-        pthread_mutex_unlock(&lock);
+        // Busy/alarm belong to the gateway: snapshot every pump behind it
+        for (int slot = first; slot >= 0; slot = registry_gateway_next_pump(slot)) {
+            PumpStatus snap;
+            if (registry_read(slot, &snap) == 0) {
+                db_insert_snapshot(&snap);
+                events_pump(&snap);
+            }
+        }
     } else {
-        printf("[SYSTEM] Busy/Alarm status unchanged, skip DB\n");
+        printf("[SYSTEM] %s Busy/Alarm status unchanged, skip DB\n", device_id);
     }
-}
\ No newline at end of file
+}
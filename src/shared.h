@@ -15,21 +15,27 @@
 #define STATUS_STOPPED  2
 #define STATUS_ERROR    3
 
+// A gateway is offline once its heartbeat is this old
+#define GATEWAY_TIMEOUT_S   30
+
 // Busy Status
 #define BUSY_IDLE           0
 #define BUSY_STARTING_P1    1
 #define BUSY_STARTING_P2    2
 
+// One pump of the fleet, identified by (device_id, pump_id).
+// The live table is in registry.c; this is the copy readers get.
 typedef struct {
-    // Software commands
-    int pump1;              // 0=OFF, 1=ON
-    int pump2;              // 0=OFF, 1=ON
+    char device_id[64];     // Gateway that owns the pump
+    int pump_id;
+    
+    // Software command
+    int command;            // 0=OFF, 1=ON
     
     // Hardware feedback (4 states)
-    int pump1_status;       // 0=Unknown, 1=Running, 2=Stopped, 3=Error
-    int pump2_status;       // 0=Unknown, 1=Running, 2=Stopped, 3=Error
+    int status;             // 0=Unknown, 1=Running, 2=Stopped, 3=Error
     
-    // System status
+    // Gateway system status
     int busy;               // 0=Idle, 1=Starting_P1, 2=Starting_P2
     int alarm;              // 0=No_Alarm, 1=Alarm_Active
     
@@ -42,8 +48,9 @@ typedef struct {
     int index;
 } PumpHistory;
 
+// Heartbeat state of one gateway. The live table is in registry.c.
 typedef struct {
-    int is_online;
+    int is_online;          // 0 once the heartbeat is GATEWAY_TIMEOUT_S old
     int gateway_reported_status;
     time_t last_seen_at;
     char device_id[64];
@@ -53,14 +60,21 @@ typedef struct {
 // Global
 extern volatile int running;
 extern pthread_mutex_t lock;
-extern PumpStatus current_pump_status;
 extern PumpHistory pump_history;
-extern GatewayHardwareStatus gateway_hw_status;
 
+// Lock-free consistent copies for readers (HTTP, publisher, dashboards).
+// Writers still serialize on `lock`, but readers never take it.
+int pump_status_snapshot(const char *device_id, int pump_id, PumpStatus *out);
+int gateway_status_snapshot(const char *device_id, GatewayHardwareStatus *out);
+
+// device_id NULL means DEFAULT_GATEWAY_ID (registry.h)
 void add_pump_history(PumpStatus status);
-void update_pump_status(int pump_id, int state);
-void update_pump_feedback(int pump_id, int status);
+void update_pump_status(const char *device_id, int pump_id, int state);
+void update_pump_feedback(const char *device_id, int pump_id, int status);
 void update_gateway_heartbeat(const char *device_id, const char *firmware, int status);
-void update_system_status(int busy, int alarm);
+// Once a second: gateways whose heartbeat is GATEWAY_TIMEOUT_S old go offline
+void update_gateway_liveness(time_t now);
+// busy/alarm < 0 keeps the current value
+void update_system_status(const char *device_id, int busy, int alarm);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,272 @@
+#include "static_files.h"
+#include "compress.h"
+#include "respcache.h"
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+typedef struct {
+    char name[64];
+    const char *type;
+    char *data;
+    size_t len;
+    char *gz;                               // NULL if not worth it
+    size_t gz_len;
+    char hash[17];                          // FNV-1a 64 of data, hex
+    char etag[RESPCACHE_ETAG_MAX];
+    struct MHD_Response *response[2][2];    // [immutable][gzip]
+    struct MHD_Response *not_modified[2];   // [immutable]
+} StaticFile;
+
+static StaticFile files[STATIC_MAX_FILES];
+static int file_count = 0;
+static char immutable_cache_control[64];
+
+static const struct {
+    const char *ext;
+    const char *type;
+    int text;
+} mime_types[] = {
+    { ".html", "text/html; charset=utf-8", 1 },
+    { ".js", "text/javascript; charset=utf-8", 1 },
+    { ".css", "text/css; charset=utf-8", 1 },
+    { ".json", "application/json", 1 },
+    { ".svg", "image/svg+xml", 1 },
+    { ".txt", "text/plain; charset=utf-8", 1 },
+    { ".png", "image/png", 0 },
+    { ".ico", "image/x-icon", 0 },
+};
+
+static int mime_lookup(const char *name, const char **type) {
+    const char *dot = strrchr(name, '.');
+    for (size_t i = 0; dot && i < sizeof(mime_types) / sizeof(mime_types[0]); i++) {
+        if (strcmp(dot, mime_types[i].ext) == 0) {
+            *type = mime_types[i].type;
+            return mime_types[i].text;
+        }
+    }
+    *type = "application/octet-stream";
+    return 0;
+}
+
+static void hash_content(StaticFile *f) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < f->len; i++) {
+        h ^= (unsigned char)f->data[i];
+        h *= 1099511628211ULL;
+    }
+    snprintf(f->hash, sizeof(f->hash), "%016llx", (unsigned long long)h);
+    snprintf(f->etag, sizeof(f->etag), "W/\"%s\"", f->hash);
+}
+
+static int read_file(const char *path, StaticFile *f) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return -1;
+    
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || st.st_size > STATIC_MAX_FILE_BYTES) {
+        fclose(fp);
+        return -1;
+    }
+    
+    f->len = st.st_size;
+    f->data = malloc(f->len + 1);
+    if (!f->data || fread(f->data, 1, f->len, fp) != f->len) {
+        free(f->data);
+        f->data = NULL;
+        fclose(fp);
+        return -1;
+    }
+    f->data[f->len] = '\0';
+    fclose(fp);
+    return 0;
+}
+
+// Index of the file whose quoted name starts at data[i] (a '"'), or -1
+static int reference_at(const StaticFile *html, size_t i) {
+    for (int k = 0; k < file_count; k++) {
+        const StaticFile *f = &files[k];
+        size_t n = strlen(f->name);
+        if (f != html && i + 1 + n < html->len && html->data[i + 1 + n] == '"' &&
+            memcmp(html->data + i + 1, f->name, n) == 0) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+// "name" -> "name?v=<hash>" for every other file, so a changed file gets a new URL
+static void rewrite_references(StaticFile *html) {
+    size_t extra = 0;
+    for (size_t i = 0; i < html->len; i++) {
+        if (html->data[i] == '"' && reference_at(html, i) >= 0) extra += 3 + sizeof(files[0].hash) - 1;
+    }
+    if (extra == 0) return;
+    
+    char *out = malloc(html->len + extra + 1);
+    if (!out) return;
+    size_t len = 0;
+    
+    for (size_t i = 0; i < html->len; i++) {
+        out[len++] = html->data[i];
+        int k = html->data[i] == '"' ? reference_at(html, i) : -1;
+        if (k < 0) continue;
+        
+        size_t n = strlen(files[k].name);
+        len += sprintf(out + len, "%s?v=%s", files[k].name, files[k].hash);
+        i += n;
+    }
+    
+    out[len] = '\0';
+    free(html->data);
+    html->data = out;
+    html->len = len;
+}
+
+static struct MHD_Response* file_response(StaticFile *f, int immutable, int gzip) {
+    struct MHD_Response *response = gzip ?
+        MHD_create_response_from_buffer(f->gz_len, f->gz, MHD_RESPMEM_PERSISTENT) :
+        MHD_create_response_from_buffer(f->len, f->data, MHD_RESPMEM_PERSISTENT);
+    if (!response) return NULL;
+    
+    MHD_add_response_header(response, "Content-Type", f->type);
+    MHD_add_response_header(response, "Cache-Control", immutable ? immutable_cache_control : "no-cache");
+    MHD_add_response_header(response, "ETag", f->etag);
+    if (f->gz) MHD_add_response_header(response, "Vary", "Accept-Encoding");
+    if (gzip) MHD_add_response_header(response, "Content-Encoding", "gzip");
+    return response;
+}
+
+static int build_responses(StaticFile *f) {
+    for (int immutable = 0; immutable < 2; immutable++) {
+        f->response[immutable][0] = file_response(f, immutable, 0);
+        f->response[immutable][1] = f->gz ? file_response(f, immutable, 1) : NULL;
+        
+        f->not_modified[immutable] = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+        if (f->not_modified[immutable]) {
+            MHD_add_response_header(f->not_modified[immutable], "Cache-Control",
+                                    immutable ? immutable_cache_control : "no-cache");
+            MHD_add_response_header(f->not_modified[immutable], "ETag", f->etag);
+        }
+        
+        if (!f->response[immutable][0] || (f->gz && !f->response[immutable][1]) || !f->not_modified[immutable]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int static_init(const char *root) {
+    static_free();
+    snprintf(immutable_cache_control, sizeof(immutable_cache_control), "public, max-age=%d, immutable",
+             STATIC_IMMUTABLE_MAX_AGE);
+    
+    DIR *dir = opendir(root);
+    if (!dir) {
+        printf("[STATIC] %s not found, dashboard not served\n", root);
+        return -1;
+    }
+    
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL && file_count < STATIC_MAX_FILES) {
+        StaticFile *f = &files[file_count];
+        if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(f->name)) continue;
+        
+        char path[512];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", root, de->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        
+        memset(f, 0, sizeof(*f));
+        snprintf(f->name, sizeof(f->name), "%s", de->d_name);
+        if (read_file(path, f) != 0) {
+            printf("[STATIC] Skipped %s (unreadable or over %d bytes)\n", path, STATIC_MAX_FILE_BYTES);
+            continue;
+        }
+        file_count++;
+    }
+    closedir(dir);
+    
+    // Hash the assets first, then point the HTML at their hashed URLs
+    for (int i = 0; i < file_count; i++) {
+        hash_content(&files[i]);
+    }
+    for (int i = 0; i < file_count; i++) {
+        const char *dot = strrchr(files[i].name, '.');
+        if (dot && strcmp(dot, ".html") == 0) {
+            rewrite_references(&files[i]);
+            hash_content(&files[i]);
+        }
+    }
+    
+    size_t total = 0, total_gz = 0;
+    for (int i = 0; i < file_count; i++) {
+        StaticFile *f = &files[i];
+        int text = mime_lookup(f->name, &f->type);
+        
+        if (text && f->len >= COMPRESS_MIN_BYTES) {
+            size_t cap = compress_bound(f->len);
+            f->gz = malloc(cap);
+            f->gz_len = f->gz ? compress_into(COMPRESS_GZIP, COMPRESS_STATIC_LEVEL, f->data, f->len, f->gz, cap) : 0;
+            if (f->gz_len == 0 || f->gz_len >= f->len) {
+                free(f->gz);
+                f->gz = NULL;
+                f->gz_len = 0;
+            }
+        }
+        
+        if (build_responses(f) != 0) {
+            printf("[STATIC] Out of memory\n");
+            static_free();
+            return -1;
+        }
+        total += f->len;
+        total_gz += f->gz ? f->gz_len : f->len;
+    }
+    
+    printf("[STATIC] %d files from %s (%zu bytes, %zu gzipped)\n", file_count, root, total, total_gz);
+    return 0;
+}
+
+void static_free() {
+    for (int i = 0; i < file_count; i++) {
+        StaticFile *f = &files[i];
+        for (int immutable = 0; immutable < 2; immutable++) {
+            if (f->response[immutable][0]) MHD_destroy_response(f->response[immutable][0]);
+            if (f->response[immutable][1]) MHD_destroy_response(f->response[immutable][1]);
+            if (f->not_modified[immutable]) MHD_destroy_response(f->not_modified[immutable]);
+        }
+        free(f->data);
+        free(f->gz);
+    }
+    memset(files, 0, sizeof(files));
+    file_count = 0;
+}
+
+struct MHD_Response* static_response(const char *url, const char *version, int gzip,
+                                     const char *if_none_match, int *status) {
+    if (url[0] != '/') return NULL;
+    const char *name = url[1] ? url + 1 : "index.html";
+    
+    for (int i = 0; i < file_count; i++) {
+        StaticFile *f = &files[i];
+        if (strcmp(f->name, name) != 0) continue;
+        
+        int immutable = version && strcmp(version, f->hash) == 0;
+        if (respcache_etag_match(if_none_match, f->etag)) {
+            *status = MHD_HTTP_NOT_MODIFIED;
+            return f->not_modified[immutable];
+        }
+        
+        *status = MHD_HTTP_OK;
+        return f->response[immutable][gzip && f->gz ? 1 : 0];
+    }
+    return NULL;
+}
+
+int static_file_count() {
+    return file_count;
+}
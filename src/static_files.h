@@ -0,0 +1,26 @@
+#ifndef STATIC_FILES_H
+#define STATIC_FILES_H
+
+#include <microhttpd.h>
+
+// The dashboard (web/) served from memory. Files are read once at start,
+// text files get a gzip copy at COMPRESS_STATIC_LEVEL, and each carries an
+// ETag from a hash of its content. References to the other files in HTML
+// are rewritten to "name?v=<hash>": a request with the current ?v= may be
+// cached for a year, anything else revalidates (If-None-Match -> 304).
+#define STATIC_MAX_FILES            64
+#define STATIC_MAX_FILE_BYTES       (4 * 1024 * 1024)
+#define STATIC_IMMUTABLE_MAX_AGE    31536000
+
+// Loads the regular files directly under root; -1 if it can't be read
+int static_init(const char *root);
+void static_free();         // after MHD_stop_daemon
+
+// GET url ("/" is index.html); NULL if there is no such file. version is
+// the ?v= argument (may be NULL). Responses are shared: queue, don't destroy.
+struct MHD_Response* static_response(const char *url, const char *version, int gzip,
+                                     const char *if_none_match, int *status);
+
+int static_file_count();
+
+#endif
@@ -0,0 +1,220 @@
+#include "topics.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct TopicNode TopicNode;
+
+struct TopicNode {
+    char *level;                // literal children only
+    size_t level_len;
+    TopicNode **children;       // literal children, open addressing
+    int child_count;
+    int child_cap;              // power of two, at most half full
+    TopicNode *plus;            // "+"
+    const void *route;          // a filter ends here
+    const void *rest;           // "<this>/#"
+};
+
+struct TopicRouter {
+    TopicNode root;
+};
+
+static unsigned level_hash(const char *s, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+static TopicNode* child_find(const TopicNode *n, const char *s, size_t len) {
+    if (n->child_count == 0) return NULL;
+    
+    unsigned mask = n->child_cap - 1;
+    for (unsigned i = level_hash(s, len) & mask; n->children[i]; i = (i + 1) & mask) {
+        TopicNode *c = n->children[i];
+        if (c->level_len == len && memcmp(c->level, s, len) == 0) return c;
+    }
+    return NULL;
+}
+
+static int child_insert(TopicNode *n, TopicNode *child) {
+    if ((n->child_count + 1) * 2 > n->child_cap) {
+        int cap = n->child_cap ? n->child_cap * 2 : 4;
+        TopicNode **table = calloc(cap, sizeof(*table));
+        if (!table) return -1;
+        
+        for (int i = 0; i < n->child_cap; i++) {
+            TopicNode *c = n->children[i];
+            if (!c) continue;
+            unsigned j = level_hash(c->level, c->level_len) & (cap - 1);
+            while (table[j]) j = (j + 1) & (cap - 1);
+            table[j] = c;
+        }
+        free(n->children);
+        n->children = table;
+        n->child_cap = cap;
+    }
+    
+    unsigned mask = n->child_cap - 1;
+    unsigned i = level_hash(child->level, child->level_len) & mask;
+    while (n->children[i]) i = (i + 1) & mask;
+    n->children[i] = child;
+    n->child_count++;
+    return 0;
+}
+
+static void node_free(TopicNode *n) {
+    for (int i = 0; i < n->child_cap; i++) {
+        if (n->children[i]) {
+            node_free(n->children[i]);
+            free(n->children[i]);
+        }
+    }
+    free(n->children);
+    if (n->plus) {
+        node_free(n->plus);
+        free(n->plus);
+    }
+    free(n->level);
+}
+
+TopicRouter* topics_new() {
+    return calloc(1, sizeof(TopicRouter));
+}
+
+void topics_free(TopicRouter *r) {
+    if (!r) return;
+    node_free(&r->root);
+    free(r);
+}
+
+int topics_add(TopicRouter *r, const char *filter, const void *route) {
+    if (!r || !route || !filter[0]) return -1;
+    
+    TopicNode *n = &r->root;
+    const char *s = filter;
+    int wildcards = 0;
+    for (;;) {
+        size_t len = strcspn(s, "/");
+        int last = s[len] == '\0';
+        
+        if (len == 1 && s[0] == '#') {
+            if (!last || ++wildcards > TOPICS_MAX_CAPTURES || n->rest) return -1;
+            n->rest = route;
+            return 0;
+        }
+        // '+' and '#' only ever stand alone as a level
+        if (memchr(s, '+', len) && len != 1) return -1;
+        if (memchr(s, '#', len)) return -1;
+        
+        TopicNode *next;
+        if (len == 1 && s[0] == '+') {
+            if (++wildcards > TOPICS_MAX_CAPTURES) return -1;
+            if (!n->plus) n->plus = calloc(1, sizeof(TopicNode));
+            next = n->plus;
+            if (!next) return -1;
+        } else {
+            next = child_find(n, s, len);
+            if (!next) {
+                next = calloc(1, sizeof(*next));
+                if (!next) return -1;
+                next->level = strndup(s, len);
+                next->level_len = len;
+                if (!next->level || child_insert(n, next) != 0) {
+                    free(next->level);
+                    free(next);
+                    return -1;
+                }
+            }
+        }
+        
+        n = next;
+        if (last) break;
+        s += len + 1;
+    }
+    
+    if (n->route) return -1;
+    n->route = route;
+    return 0;
+}
+
+typedef struct {
+    const char *end;
+    TopicCaptures caps;
+    TopicVisitor fn;
+    void *arg;
+    int matched;
+} MatchState;
+
+static int visit(MatchState *m, const void *route, const char *s, int len) {
+    TopicCaptures *caps = &m->caps;
+    caps->seg[caps->count].s = s;
+    caps->seg[caps->count].len = len;
+    caps->count++;
+    m->matched++;
+    int stop = m->fn ? m->fn(m->arg, route, caps) : 0;
+    caps->count--;
+    return stop;
+}
+
+// s is the start of the next level; done once the topic is used up (an
+// empty last level after a trailing '/' is still a level)
+static int match(const TopicNode *n, const char *s, int done, int first, MatchState *m) {
+    if (done) {
+        if (n->route) {
+            m->matched++;
+            if (m->fn && m->fn(m->arg, n->route, &m->caps)) return 1;
+        }
+        // "a/#" matches "a" too, with nothing captured
+        if (n->rest && visit(m, n->rest, s, 0)) return 1;
+        return 0;
+    }
+    
+    const char *slash = memchr(s, '/', m->end - s);
+    size_t len = slash ? (size_t)(slash - s) : (size_t)(m->end - s);
+    const char *next = slash ? slash + 1 : m->end;
+    
+    const TopicNode *child = child_find(n, s, len);
+    if (child && match(child, next, !slash, 0, m)) return 1;
+    
+    if (first && len > 0 && s[0] == '$') return 0;
+    
+    if (n->plus) {
+        TopicCaptures *caps = &m->caps;
+        caps->seg[caps->count].s = s;
+        caps->seg[caps->count].len = (int)len;
+        caps->count++;
+        int stop = match(n->plus, next, !slash, 0, m);
+        caps->count--;
+        if (stop) return 1;
+    }
+    
+    if (n->rest && visit(m, n->rest, s, (int)(m->end - s))) return 1;
+    return 0;
+}
+
+int topics_match(const TopicRouter *r, const char *topic, int len, TopicVisitor fn, void *arg) {
+    if (!r || !topic) return 0;
+    
+    MatchState m;
+    m.end = topic + (len > 0 ? (size_t)len : strlen(topic));
+    m.caps.count = 0;
+    m.fn = fn;
+    m.arg = arg;
+    m.matched = 0;
+    if (m.end == topic) return 0;
+    
+    match(&r->root, topic, 0, 1, &m);
+    return m.matched;
+}
+
+long long topic_segment_int(const TopicSegment *seg) {
+    // Digits only, and few enough not to overflow
+    if (seg->len == 0 || seg->len > 18) return -1;
+    
+    long long num = 0;
+    for (int i = 0; i < seg->len; i++) {
+        if (seg->s[i] < '0' || seg->s[i] > '9') return -1;
+        num = num * 10 + (seg->s[i] - '0');
+    }
+    return num;
+}
@@ -0,0 +1,49 @@
+#ifndef TOPICS_H
+#define TOPICS_H
+
+#include <stddef.h>
+
+// MQTT topic router: subscription filters compiled into a trie over topic
+// levels, built once before the first subscribe and only read after that,
+// so lookups need no lock. Literal children are found through a small hash
+// table per node; a match costs O(topic levels), not O(filters). Filters
+// follow MQTT:
+//   "pump/feedback"                    literal levels
+//   "site/+/gw/+/pump/+/feedback"      '+' matches exactly one level
+//   "site/+/#"                         '#' the rest (last only, may be none)
+// Wildcards never match a first level starting with '$' ($SYS and friends).
+// Each '+' and '#' captures the topic text it matched, in filter order, as
+// a pointer into the topic: nothing is copied.
+#define TOPICS_MAX_CAPTURES     8
+
+typedef struct {
+    const char *s;              // into the topic, not NUL-terminated
+    int len;
+} TopicSegment;
+
+typedef struct {
+    int count;
+    TopicSegment seg[TOPICS_MAX_CAPTURES];
+} TopicCaptures;
+
+// Once per matching filter; at each level a literal beats '+', which beats
+// '#'. Nonzero stops the walk.
+typedef int (*TopicVisitor)(void *arg, const void *route, const TopicCaptures *caps);
+
+typedef struct TopicRouter TopicRouter;
+
+TopicRouter* topics_new();
+void topics_free(TopicRouter *r);
+
+// -1 on a malformed filter (a wildcard that isn't a whole level, '#' that
+// isn't last, more than TOPICS_MAX_CAPTURES wildcards), or one already added
+int topics_add(TopicRouter *r, const char *filter, const void *route);
+
+// Walks the filters matching topic (len bytes, or up to the NUL if len is
+// 0); returns how many were visited
+int topics_match(const TopicRouter *r, const char *topic, int len, TopicVisitor fn, void *arg);
+
+// A capture as a non-negative decimal number, -1 if it isn't one
+long long topic_segment_int(const TopicSegment *seg);
+
+#endif
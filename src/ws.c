@@ -0,0 +1,893 @@
+#include "ws.h"
+#include "events.h"
+#include "registry.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <json-c/json.h>
+
+#define WS_OP_CONT      0x0
+#define WS_OP_TEXT      0x1
+#define WS_OP_BINARY    0x2
+#define WS_OP_CLOSE     0x8
+#define WS_OP_PING      0x9
+#define WS_OP_PONG      0xA
+
+#define WS_HEADER_MAX   10
+
+// Serialized frames, shared by every client it is queued to. Only the hub
+// thread touches refs, so a plain int is enough.
+typedef struct {
+    int refs;
+    size_t len;
+    size_t cap;
+    unsigned char data[];
+} WsBuf;
+
+typedef struct {
+    WsBuf *buf;
+    size_t off;
+} WsOut;
+
+typedef struct WsConn {
+    int fd;
+    void (*close_fn)(void *handle);
+    void *handle;
+    int slot;                       // index in conns
+    time_t last_rx;
+    int ping_sent;
+    int subscribed;
+    char device_id[64];             // "" = all gateways
+    int closing;                    // close frame queued, drop once flushed
+    int epollout;
+    
+    unsigned char in[WS_MAX_MESSAGE + WS_HEADER_MAX + 4];
+    size_t in_len;
+    char msg[WS_MAX_MESSAGE + 1];   // reassembled message
+    size_t msg_len;
+    int msg_op;                     // 0 when no message is in progress
+    
+    WsOut queue[WS_QUEUE_MAX];
+    int q_head;
+    int q_count;
+    size_t queued;
+    
+    struct WsConn *next;            // pending list, then dead list
+} WsConn;
+
+static int epoll_fd = -1;
+static int wake_fd = -1;
+static pthread_t hub_tid;
+static volatile int hub_running = 0;
+static int wake_pending = 0;        // atomic; saves an eventfd write per publish while the hub is busy
+static WsCommandFn command_fn = NULL;
+
+// Handed over by ws_attach, picked up by the hub
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static WsConn *pending = NULL;
+static int attached = 0;            // under pending_lock: pending + live
+
+// Hub thread only
+static WsConn *conns[WS_MAX_CLIENTS];
+static int conn_count = 0;
+static unsigned long long hub_seq = 0;
+static WsConn *dead = NULL;         // closed this round; freed once no epoll event can point at them
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static WsStats stats;
+
+// ===== SHA-1 / BASE64 (handshake only) =====
+static uint32_t rol(uint32_t v, int n) {
+    return (v << n) | (v >> (32 - n));
+}
+
+static void sha1_block(uint32_t h[5], const unsigned char *p) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        uint32_t t = rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol(b, 30);
+        b = a;
+        a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+static void sha1(const unsigned char *data, size_t len, unsigned char out[20]) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    unsigned char block[64];
+    size_t i = 0;
+    
+    for (; i + 64 <= len; i += 64) {
+        sha1_block(h, data + i);
+    }
+    
+    size_t rest = len - i;
+    memset(block, 0, sizeof(block));
+    memcpy(block, data + i, rest);
+    block[rest] = 0x80;
+    if (rest >= 56) {
+        sha1_block(h, block);
+        memset(block, 0, sizeof(block));
+    }
+    uint64_t bits = (uint64_t)len * 8;
+    for (int j = 0; j < 8; j++) {
+        block[63 - j] = (unsigned char)(bits >> (8 * j));
+    }
+    sha1_block(h, block);
+    
+    for (int j = 0; j < 20; j++) {
+        out[j] = (unsigned char)(h[j / 4] >> (24 - 8 * (j % 4)));
+    }
+}
+
+void ws_accept_key(const char *key, char *out) {
+    static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char joined[128];
+    unsigned char digest[20];
+    
+    int n = snprintf(joined, sizeof(joined), "%s%s", key, guid);
+    if (n >= (int)sizeof(joined)) n = sizeof(joined) - 1;
+    sha1((const unsigned char *)joined, n, digest);
+    
+    // 20 bytes -> 28 characters, one '=' of padding
+    int o = 0;
+    for (int i = 0; i < 18; i += 3) {
+        uint32_t v = (uint32_t)digest[i] << 16 | (uint32_t)digest[i + 1] << 8 | digest[i + 2];
+        out[o++] = b64[(v >> 18) & 63];
+        out[o++] = b64[(v >> 12) & 63];
+        out[o++] = b64[(v >> 6) & 63];
+        out[o++] = b64[v & 63];
+    }
+    uint32_t v = (uint32_t)digest[18] << 16 | (uint32_t)digest[19] << 8;
+    out[o++] = b64[(v >> 18) & 63];
+    out[o++] = b64[(v >> 12) & 63];
+    out[o++] = b64[(v >> 6) & 63];
+    out[o++] = '=';
+    out[o] = 0;
+}
+
+// ===== BUFFERS =====
+static WsBuf* buf_new(size_t cap) {
+    WsBuf *b = malloc(sizeof(WsBuf) + cap);
+    if (!b) return NULL;
+    b->refs = 0;
+    b->len = 0;
+    b->cap = cap;
+    return b;
+}
+
+static void buf_release(WsBuf *b) {
+    if (b && --b->refs <= 0) free(b);
+}
+
+static int buf_reserve(WsBuf **bp, size_t more) {
+    WsBuf *b = *bp;
+    if (b->len + more <= b->cap) return 0;
+    
+    size_t cap = b->cap * 2;
+    if (cap < b->len + more) cap = b->len + more;
+    WsBuf *nb = realloc(b, sizeof(WsBuf) + cap);
+    if (!nb) return -1;
+    nb->cap = cap;
+    *bp = nb;
+    return 0;
+}
+
+static size_t frame_header(unsigned char *h, int opcode, size_t len) {
+    h[0] = 0x80 | opcode;
+    if (len < 126) {
+        h[1] = (unsigned char)len;
+        return 2;
+    }
+    if (len < 65536) {
+        h[1] = 126;
+        h[2] = (unsigned char)(len >> 8);
+        h[3] = (unsigned char)len;
+        return 4;
+    }
+    h[1] = 127;
+    for (int i = 0; i < 8; i++) {
+        h[2 + i] = (unsigned char)((uint64_t)len >> (56 - 8 * i));
+    }
+    return 10;
+}
+
+// One unmasked frame; the payload is prefix + body + suffix
+static int buf_frame(WsBuf **bp, int opcode, const char *prefix, const char *body, size_t body_len, const char *suffix) {
+    size_t plen = strlen(prefix), slen = strlen(suffix);
+    size_t len = plen + body_len + slen;
+    
+    if (buf_reserve(bp, WS_HEADER_MAX + len) != 0) return -1;
+    WsBuf *b = *bp;
+    b->len += frame_header(b->data + b->len, opcode, len);
+    memcpy(b->data + b->len, prefix, plen);
+    memcpy(b->data + b->len + plen, body, body_len);
+    memcpy(b->data + b->len + plen + body_len, suffix, slen);
+    b->len += len;
+    return 0;
+}
+
+static WsBuf* buf_message(int opcode, const char *payload, size_t len) {
+    WsBuf *b = buf_new(WS_HEADER_MAX + len);
+    if (b && buf_frame(&b, opcode, "", payload, len, "") != 0) {
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+// ===== CONNECTIONS =====
+static void wake_hub() {
+    if (__atomic_exchange_n(&wake_pending, 1, __ATOMIC_ACQ_REL)) return;
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        // Counter saturated means the hub is already due to wake
+    }
+}
+
+static void events_wake(unsigned long long seq) {
+    wake_hub();
+}
+
+static void conn_close(WsConn *c) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    
+    for (int i = 0; i < c->q_count; i++) {
+        buf_release(c->queue[(c->q_head + i) % WS_QUEUE_MAX].buf);
+    }
+    
+    if (c->close_fn) {
+        c->close_fn(c->handle);
+    } else {
+        close(c->fd);
+    }
+    
+    conns[c->slot] = conns[--conn_count];
+    conns[c->slot]->slot = c->slot;
+    conns[conn_count] = NULL;
+    
+    pthread_mutex_lock(&pending_lock);
+    attached--;
+    pthread_mutex_unlock(&pending_lock);
+    
+    c->fd = -1;
+    c->q_count = 0;
+    c->next = dead;
+    dead = c;
+}
+
+static void free_dead() {
+    while (dead) {
+        WsConn *c = dead;
+        dead = c->next;
+        free(c);
+    }
+}
+
+static void set_epollout(WsConn *c, int on) {
+    if (c->epollout == on) return;
+    
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (on ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->epollout = on;
+}
+
+// Returns -1 if the connection got closed
+static int conn_flush(WsConn *c) {
+    size_t sent = 0;
+    
+    while (c->q_count > 0) {
+        WsOut *o = &c->queue[c->q_head];
+        ssize_t n = send(c->fd, o->buf->data + o->off, o->buf->len - o->off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            conn_close(c);
+            return -1;
+        }
+        
+        o->off += n;
+        c->queued -= n;
+        sent += n;
+        if (o->off == o->buf->len) {
+            buf_release(o->buf);
+            c->q_head = (c->q_head + 1) % WS_QUEUE_MAX;
+            c->q_count--;
+        }
+    }
+    
+    if (sent) {
+        pthread_mutex_lock(&stats_lock);
+        stats.bytes_out += sent;
+        pthread_mutex_unlock(&stats_lock);
+    }
+    
+    if (c->q_count == 0 && c->closing) {
+        conn_close(c);
+        return -1;
+    }
+    set_epollout(c, c->q_count > 0);
+    return 0;
+}
+
+static void conn_push(WsConn *c, WsBuf *b) {
+    WsOut *o = &c->queue[(c->q_head + c->q_count) % WS_QUEUE_MAX];
+    o->buf = b;
+    o->off = 0;
+    b->refs++;
+    c->q_count++;
+    c->queued += b->len;
+}
+
+// Replaces everything not yet started with a fresh snapshot
+static void conn_snapshot(WsConn *c, unsigned long long seq) {
+    // A frame that is half written has to finish or the stream is corrupt
+    int keep = (c->q_count > 0 && c->queue[c->q_head].off > 0) ? 1 : 0;
+    for (int i = keep; i < c->q_count; i++) {
+        WsOut *o = &c->queue[(c->q_head + i) % WS_QUEUE_MAX];
+        c->queued -= o->buf->len - o->off;
+        buf_release(o->buf);
+    }
+    c->q_count = keep;
+    
+    size_t pumps_len;
+    char *pumps = registry_render_json(c->device_id[0] ? c->device_id : NULL, &pumps_len);
+    size_t gateways_len;
+    char *gateways = events_render_gateways(c->device_id[0] ? c->device_id : NULL, &gateways_len);
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "{\"op\":\"pumps\",\"seq\":%llu,\"data\":", seq);
+    
+    WsBuf *b = pumps && gateways ? buf_new(pumps_len + gateways_len + 128) : NULL;
+    if (b && (buf_frame(&b, WS_OP_TEXT, prefix, pumps, pumps_len, "}") != 0 ||
+              buf_frame(&b, WS_OP_TEXT, "{\"op\":\"gateways\",\"data\":", gateways, gateways_len, "}") != 0)) {
+        free(b);
+        b = NULL;
+    }
+    free(pumps);
+    free(gateways);
+    
+    if (!b) {
+        // Out of memory: drop the client rather than leave it with stale state
+        c->closing = 1;
+        return;
+    }
+    conn_push(c, b);
+}
+
+// Batch buffers respect the per-client limits; a client over them is resynced
+static void conn_queue(WsConn *c, WsBuf *b, unsigned long long seq) {
+    if (c->q_count == WS_QUEUE_MAX || c->queued + b->len > WS_CLIENT_BUFFER) {
+        conn_snapshot(c, seq);
+        pthread_mutex_lock(&stats_lock);
+        stats.resyncs++;
+        pthread_mutex_unlock(&stats_lock);
+        return;
+    }
+    conn_push(c, b);
+}
+
+// Control replies go out even to a client that is over its limit
+static void conn_reply(WsConn *c, int opcode, const char *payload, size_t len) {
+    if (c->q_count == WS_QUEUE_MAX) {
+        c->closing = 1;
+        return;
+    }
+    WsBuf *b = buf_message(opcode, payload, len);
+    if (b) conn_push(c, b);
+}
+
+static void conn_ack(WsConn *c, long long id, long long command_id, const char *error) {
+    char reply[160];
+    int n;
+    if (error) {
+        n = snprintf(reply, sizeof(reply), "{\"op\":\"ack\",\"id\":%lld,\"ok\":false,\"error\":\"%s\"}", id, error);
+    } else {
+        n = snprintf(reply, sizeof(reply), "{\"op\":\"ack\",\"id\":%lld,\"ok\":true,\"command_id\":%lld}", id, command_id);
+    }
+    conn_reply(c, WS_OP_TEXT, reply, n);
+}
+
+static void conn_close_frame(WsConn *c, int code) {
+    unsigned char payload[2] = {(unsigned char)(code >> 8), (unsigned char)code};
+    conn_reply(c, WS_OP_CLOSE, (const char *)payload, 2);
+    c->closing = 1;
+}
+
+static void handle_message(WsConn *c, char *msg) {
+    pthread_mutex_lock(&stats_lock);
+    stats.messages_in++;
+    pthread_mutex_unlock(&stats_lock);
+    
+    struct json_object *parsed = json_tokener_parse(msg);
+    if (!parsed) {
+        conn_close_frame(c, 1007);
+        return;
+    }
+    
+    struct json_object *op_obj, *obj;
+    const char *op = json_object_object_get_ex(parsed, "op", &op_obj) ? json_object_get_string(op_obj) : "";
+    
+    if (strcmp(op, "sub") == 0) {
+        const char *device_id = json_object_object_get_ex(parsed, "device_id", &obj) ? json_object_get_string(obj) : "";
+        if (device_id[0] && !registry_valid_device_id(device_id)) {
+            conn_close_frame(c, 1008);
+        } else {
+            snprintf(c->device_id, sizeof(c->device_id), "%s", device_id);
+            c->subscribed = 1;
+            // The hub's position, not the journal head: the next batch starts
+            // there, so anything published since is replayed, never skipped
+            conn_snapshot(c, hub_seq);
+        }
+    } else if (strcmp(op, "unsub") == 0) {
+        c->subscribed = 0;
+    } else if (strcmp(op, "cmd") == 0) {
+        long long id = json_object_object_get_ex(parsed, "id", &obj) ? json_object_get_int64(obj) : 0;
+        const char *device_id = json_object_object_get_ex(parsed, "device_id", &obj) ? json_object_get_string(obj) : DEFAULT_GATEWAY_ID;
+        int pump_id = json_object_object_get_ex(parsed, "pump_id", &obj) ? json_object_get_int(obj) : 0;
+        int state = json_object_object_get_ex(parsed, "state", &obj) ? json_object_get_int(obj) : -1;
+        
+        const char *error = NULL;
+        long long command_id = -1;
+        if (pump_id < 1 || (state != 0 && state != 1) || !registry_valid_device_id(device_id)) {
+            error = "Invalid device_id, pump_id or state";
+        } else if (!command_fn || (command_id = command_fn(device_id, pump_id, state)) < 0) {
+            error = "Too many pending commands";
+        }
+        
+        pthread_mutex_lock(&stats_lock);
+        stats.commands++;
+        if (error) stats.commands_failed++;
+        pthread_mutex_unlock(&stats_lock);
+        
+        conn_ack(c, id, command_id, error);
+    } else {
+        static const char reply[] = "{\"op\":\"error\",\"error\":\"Unknown op\"}";
+        conn_reply(c, WS_OP_TEXT, reply, sizeof(reply) - 1);
+    }
+    
+    json_object_put(parsed);
+}
+
+// Parses every complete frame in c->in. Returns -1 on a protocol error.
+static int conn_parse(WsConn *c) {
+    size_t pos = 0;
+    
+    while (!c->closing && c->in_len - pos >= 2) {
+        unsigned char *p = c->in + pos;
+        int fin = p[0] & 0x80;
+        int opcode = p[0] & 0x0F;
+        uint64_t len = p[1] & 0x7F;
+        size_t hdr = 2;
+        
+        // Client frames must be masked (RFC 6455 5.1)
+        if (!(p[1] & 0x80) || (p[0] & 0x70)) {
+            conn_close_frame(c, 1002);
+            break;
+        }
+        if (len == 126) {
+            if (c->in_len - pos < 4) break;
+            len = (uint64_t)p[2] << 8 | p[3];
+            hdr = 4;
+        } else if (len == 127) {
+            if (c->in_len - pos < 10) break;
+            len = 0;
+            for (int i = 0; i < 8; i++) {
+                len = len << 8 | p[2 + i];
+            }
+            hdr = 10;
+        }
+        if (len > WS_MAX_MESSAGE) {
+            conn_close_frame(c, 1009);
+            break;
+        }
+        if (c->in_len - pos < hdr + 4 + len) break;
+        
+        unsigned char *mask = p + hdr;
+        unsigned char *payload = mask + 4;
+        for (uint64_t i = 0; i < len; i++) {
+            payload[i] ^= mask[i & 3];
+        }
+        pos += hdr + 4 + len;
+        
+        if (opcode >= WS_OP_CLOSE) {
+            if (!fin || len > 125) {
+                conn_close_frame(c, 1002);
+                break;
+            }
+            if (opcode == WS_OP_CLOSE) {
+                conn_close_frame(c, 1000);
+            } else if (opcode == WS_OP_PING) {
+                conn_reply(c, WS_OP_PONG, (const char *)payload, len);
+            }
+            continue;
+        }
+        
+        if (opcode == WS_OP_CONT ? c->msg_op == 0 : c->msg_op != 0) {
+            conn_close_frame(c, 1002);
+            break;
+        }
+        if (opcode != WS_OP_CONT) {
+            c->msg_op = opcode;
+            c->msg_len = 0;
+        }
+        if (c->msg_len + len > WS_MAX_MESSAGE) {
+            conn_close_frame(c, 1009);
+            break;
+        }
+        memcpy(c->msg + c->msg_len, payload, len);
+        c->msg_len += len;
+        
+        if (fin) {
+            c->msg[c->msg_len] = 0;
+            if (c->msg_op == WS_OP_TEXT) handle_message(c, c->msg);
+            c->msg_op = 0;
+            c->msg_len = 0;
+        }
+    }
+    
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    return 0;
+}
+
+static void conn_read(WsConn *c) {
+    for (;;) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            conn_close(c);
+            return;
+        }
+        if (n == 0) {
+            conn_close(c);
+            return;
+        }
+        
+        c->in_len += n;
+        c->last_rx = time(NULL);
+        c->ping_sent = 0;
+        conn_parse(c);
+        if (c->closing) {
+            // Stop reading; whatever is queued (the close frame last) goes out first
+            c->in_len = 0;
+            break;
+        }
+    }
+    conn_flush(c);
+}
+
+// ===== FAN-OUT =====
+typedef struct {
+    const char *device_id;          // "" = all gateways
+    WsBuf *buf;                     // NULL if the journal no longer reaches hub_seq
+    int lost;
+} WsBatch;
+
+static int batch_frame(void *arg, unsigned long long seq, const char *event, const char *data, int data_len,
+                       const char *frame, int frame_len) {
+    WsBuf **bp = arg;
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "{\"op\":\"%s\",\"seq\":%llu,\"data\":", event, seq);
+    return buf_frame(bp, WS_OP_TEXT, prefix, data, data_len, "}");
+}
+
+static void batch_build(WsBatch *batch, unsigned long long until) {
+    unsigned long long next;
+    batch->buf = buf_new(4096);
+    batch->lost = 0;
+    if (!batch->buf) return;
+    
+    // Out of memory part way counts as lost too: a partial batch would skip changes
+    batch->buf->refs = 1;
+    if (events_scan(hub_seq, until, batch->device_id[0] ? batch->device_id : NULL, batch_frame, &batch->buf, &next) < 0 ||
+        next != until) {
+        batch->lost = 1;
+    }
+    
+    pthread_mutex_lock(&stats_lock);
+    stats.batches++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Everything published since hub_seq, serialized once per distinct filter
+// and queued by reference to every subscriber
+static void fan_out() {
+    unsigned long long until = events_head();
+    if (until == hub_seq) return;
+    
+    WsBatch batches[WS_MAX_FILTERS];
+    int nb = 0;
+    unsigned long long deliveries = 0;
+    
+    for (int i = 0; i < conn_count; i++) {
+        WsConn *c = conns[i];
+        if (!c->subscribed || c->closing) continue;
+        
+        WsBatch *batch = NULL;
+        WsBatch own;
+        for (int j = 0; j < nb; j++) {
+            if (strcmp(batches[j].device_id, c->device_id) == 0) {
+                batch = &batches[j];
+                break;
+            }
+        }
+        if (!batch) {
+            batch = nb < WS_MAX_FILTERS ? &batches[nb++] : &own;
+            batch->device_id = c->device_id;
+            batch_build(batch, until);
+        }
+        
+        if (!batch->buf || batch->lost) {
+            // The hub fell a whole journal behind; everyone starts over
+            conn_snapshot(c, until);
+            pthread_mutex_lock(&stats_lock);
+            stats.resyncs++;
+            pthread_mutex_unlock(&stats_lock);
+        } else if (batch->buf->len > 0) {
+            conn_queue(c, batch->buf, until);
+            deliveries++;
+        }
+        
+        if (batch == &own) buf_release(own.buf);
+    }
+    
+    for (int j = 0; j < nb; j++) {
+        buf_release(batches[j].buf);
+    }
+    hub_seq = until;
+    
+    pthread_mutex_lock(&stats_lock);
+    stats.deliveries += deliveries;
+    pthread_mutex_unlock(&stats_lock);
+    
+    // Flush after queuing so one slow socket doesn't hold up the others.
+    // conn_flush may close and swap a connection into slot i.
+    for (int i = conn_count - 1; i >= 0; i--) {
+        if (conns[i]->q_count > 0) conn_flush(conns[i]);
+    }
+}
+
+static void take_pending() {
+    pthread_mutex_lock(&pending_lock);
+    WsConn *list = pending;
+    pending = NULL;
+    pthread_mutex_unlock(&pending_lock);
+    
+    while (list) {
+        WsConn *c = list;
+        list = c->next;
+        
+        c->slot = conn_count;
+        conns[conn_count++] = c;
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = c;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) != 0) {
+            conn_close(c);
+            continue;
+        }
+        
+        // The first frames may have arrived together with the upgrade request
+        if (c->in_len > 0) {
+            conn_parse(c);
+            conn_flush(c);
+        }
+    }
+}
+
+static void check_idle(time_t now) {
+    for (int i = conn_count - 1; i >= 0; i--) {
+        WsConn *c = conns[i];
+        if (now - c->last_rx >= 2 * WS_PING_S) {
+            conn_close(c);
+        } else if (now - c->last_rx >= WS_PING_S && !c->ping_sent) {
+            c->ping_sent = 1;
+            conn_reply(c, WS_OP_PING, "", 0);
+            conn_flush(c);
+        }
+    }
+}
+
+static void* hub_thread(void *arg) {
+    struct epoll_event evs[64];
+    time_t next_check = time(NULL) + 1;
+    
+    while (hub_running) {
+        int n = epoll_wait(epoll_fd, evs, 64, 1000);
+        
+        for (int i = 0; i < n; i++) {
+            if (evs[i].data.ptr == NULL) {
+                uint64_t count;
+                if (read(wake_fd, &count, sizeof(count)) < 0) {
+                    // Spurious; the flag below is what matters
+                }
+                __atomic_store_n(&wake_pending, 0, __ATOMIC_RELEASE);
+                take_pending();
+                fan_out();
+                continue;
+            }
+            
+            WsConn *c = evs[i].data.ptr;
+            if (c->fd < 0) continue;    // closed earlier in this round
+            
+            if (evs[i].events & (EPOLLERR | EPOLLHUP)) {
+                conn_close(c);
+            } else if (evs[i].events & EPOLLIN) {
+                conn_read(c);
+            } else if (evs[i].events & EPOLLOUT) {
+                conn_flush(c);
+            }
+        }
+        
+        time_t now = time(NULL);
+        if (now >= next_check) {
+            check_idle(now);
+            next_check = now + 1;
+        }
+        free_dead();
+        
+        pthread_mutex_lock(&stats_lock);
+        stats.clients = conn_count;
+        stats.subscribed = 0;
+        for (int i = 0; i < conn_count; i++) {
+            stats.subscribed += conns[i]->subscribed;
+        }
+        pthread_mutex_unlock(&stats_lock);
+    }
+    
+    // Going away (1001), best effort: the sockets are non-blocking
+    take_pending();
+    while (conn_count > 0) {
+        WsConn *c = conns[conn_count - 1];
+        static const unsigned char bye[4] = {0x80 | WS_OP_CLOSE, 2, 0x03, 0xE9};
+        if (send(c->fd, bye, sizeof(bye), MSG_NOSIGNAL) < 0) {
+            // Already gone
+        }
+        conn_close(c);
+    }
+    free_dead();
+    return NULL;
+}
+
+// ===== API =====
+int ws_init() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || wake_fd < 0) {
+        printf("[WS] epoll/eventfd failed\n");
+        return -1;
+    }
+    
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+    
+    hub_seq = events_head();
+    hub_running = 1;
+    if (pthread_create(&hub_tid, NULL, hub_thread, NULL) != 0) {
+        hub_running = 0;
+        return -1;
+    }
+    events_add_listener(events_wake);
+    
+    printf("[WS] Hub ready (max %d clients)\n", WS_MAX_CLIENTS);
+    return 0;
+}
+
+void ws_shutdown() {
+    if (!hub_running) return;
+    
+    events_remove_listener(events_wake);
+    
+    pthread_mutex_lock(&pending_lock);
+    hub_running = 0;
+    pthread_mutex_unlock(&pending_lock);
+    
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        // The 1 s epoll timeout gets there anyway
+    }
+    pthread_join(hub_tid, NULL);
+    
+    close(wake_fd);
+    close(epoll_fd);
+    wake_fd = epoll_fd = -1;
+}
+
+void ws_set_command_handler(WsCommandFn fn) {
+    command_fn = fn;
+}
+
+int ws_full() {
+    pthread_mutex_lock(&pending_lock);
+    int full = attached >= WS_MAX_CLIENTS;
+    pthread_mutex_unlock(&pending_lock);
+    return full;
+}
+
+int ws_attach(int fd, const char *extra, size_t extra_len, void (*close_fn)(void *handle), void *handle) {
+    WsConn *c = calloc(1, sizeof(*c));
+    if (!c || extra_len > sizeof(c->in)) {
+        free(c);
+        return -1;
+    }
+    
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        free(c);
+        return -1;
+    }
+    
+    c->fd = fd;
+    c->close_fn = close_fn;
+    c->handle = handle;
+    c->last_rx = time(NULL);
+    if (extra_len) memcpy(c->in, extra, extra_len);
+    c->in_len = extra_len;
+    
+    pthread_mutex_lock(&pending_lock);
+    if (!hub_running || attached >= WS_MAX_CLIENTS) {
+        pthread_mutex_unlock(&pending_lock);
+        free(c);
+        return -1;
+    }
+    c->next = pending;
+    pending = c;
+    attached++;
+    pthread_mutex_unlock(&pending_lock);
+    
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        // Counter saturated: the hub is due to wake anyway
+    }
+    return 0;
+}
+
+void ws_get_stats(WsStats *out) {
+    pthread_mutex_lock(&stats_lock);
+    *out = stats;
+    pthread_mutex_unlock(&stats_lock);
+}
@@ -0,0 +1,58 @@
+#ifndef WS_H
+#define WS_H
+
+#include <stddef.h>
+
+// WebSocket channel on /api/ws. libmicrohttpd does the HTTP upgrade, then the
+// socket is handed to one hub thread (epoll) that owns all WebSocket I/O.
+//
+// Client -> server (text frames, JSON):
+//   {"op":"sub","device_id":"site-7"}   state for one gateway, or all without device_id
+//   {"op":"unsub"}
+//   {"op":"cmd","id":7,"device_id":"site-7","pump_id":1,"state":1}
+// Server -> client:
+//   {"op":"pumps","seq":N,"data":{"pumps":[...],"count":N}}   on sub and on resync
+//   {"op":"gateway","seq":N,"data":{...}}
+//   {"op":"pump","seq":N,"data":{...}}                         one per change
+//   {"op":"ack","id":7,"ok":true,"command_id":N} / {"op":"ack","id":7,"ok":false,"error":"..."}
+#define WS_MAX_CLIENTS      1024
+#define WS_MAX_MESSAGE      4096            // largest client message
+#define WS_CLIENT_BUFFER    (256 * 1024)    // queued bytes before a client is resynced
+#define WS_QUEUE_MAX        64              // queued buffers per client
+#define WS_MAX_FILTERS      64              // distinct device_id filters serialized per batch
+#define WS_PING_S           30              // ping after this much silence, drop after twice that
+
+typedef struct {
+    int clients;
+    int subscribed;
+    unsigned long long messages_in;
+    unsigned long long batches;             // serialized journal reads, each shared by every subscriber with the same filter
+    unsigned long long deliveries;          // batch buffers queued to clients
+    unsigned long long bytes_out;
+    unsigned long long resyncs;
+    unsigned long long commands;
+    unsigned long long commands_failed;
+} WsStats;
+
+// Queues a pump command. Returns its command ID, or -1 if it was refused.
+typedef long long (*WsCommandFn)(const char *device_id, int pump_id, int state);
+
+int ws_init();
+void ws_shutdown();     // closes every client and stops the hub thread
+void ws_set_command_handler(WsCommandFn fn);
+
+// Sec-WebSocket-Accept for a Sec-WebSocket-Key (out: at least 29 bytes)
+void ws_accept_key(const char *key, char *out);
+
+// 1 if another client would go over WS_MAX_CLIENTS
+int ws_full();
+
+// Hands an upgraded socket to the hub. extra is what the HTTP layer already
+// read past the headers. close_fn(handle) releases the socket when the hub is
+// done with it (close(fd) if NULL). Returns -1 if the hub won't take it; the
+// caller still owns the socket then.
+int ws_attach(int fd, const char *extra, size_t extra_len, void (*close_fn)(void *handle), void *handle);
+
+void ws_get_stats(WsStats *out);
+
+#endif
@@ -1,7 +1,11 @@
 // ============================================
 // CONSTANTS
 // ============================================
-const API = 'http://localhost:8080';
+// Same origin when the server serves the dashboard; opened from disk, the default port
+const API = window.location.protocol === 'file:' ? 'http://localhost:8080' : window.location.origin;
+const DEFAULT_GATEWAY = 'default';
+// Dashboard can be scoped to one site: index.html?device_id=site-7
+const GATEWAY = new URLSearchParams(window.location.search).get('device_id');
 const STATUS_TEXT = ['Unknown', 'Running', 'Stopped', 'Error'];
 const STATUS_ICONS = ['help', 'play_circle', 'stop_circle', 'error'];
 const BUSY_TEXT = ['Idle', 'Starting P1', 'Starting P2'];
@@ -10,20 +14,50 @@ const BUSY_ICONS = ['check_circle', 'sync', 'sync'];
 // ============================================
 // HISTORY STATE
 // ============================================
+// The window is fetched in keyset pages, then kept current with since_id
+const HISTORY_WINDOW = 5000;
+const HISTORY_PAGE = 1000;
 let historyCache = null;
+let historySyncing = false;
 let filteredData = [];
 let currentPage = 1;
 let rowsPerPage = 20;
 let sortColumn = 'timestamp';
 let sortDirection = 'desc';
 let activeFilters = {
-    pump1Status: 'all',
-    pump2Status: 'all',
+    pumpId: 'all',
+    status: 'all',
     searchTerm: '',
     dateFrom: null,
     dateTo: null
 };
 
+// ============================================
+// CONDITIONAL GETS
+// ============================================
+// Last ETag and body per URL, so a poll that finds nothing changed is a
+// bodiless 304. Oldest entries go first once the map is full.
+const CONDITIONAL_CACHE_MAX = 32;
+const conditionalCache = new Map();
+
+async function fetchJson(url) {
+    const cached = conditionalCache.get(url);
+    const res = await fetch(url, cached ? { headers: { 'If-None-Match': cached.etag } } : undefined);
+    if (res.status === 304 && cached) return cached.data;
+    if (!res.ok) throw new Error(`HTTP ${res.status}`);
+    
+    const data = await res.json();
+    const etag = res.headers.get('ETag');
+    conditionalCache.delete(url);
+    if (etag && !data.error) {
+        conditionalCache.set(url, { etag, data });
+        if (conditionalCache.size > CONDITIONAL_CACHE_MAX) {
+            conditionalCache.delete(conditionalCache.keys().next().value);
+        }
+    }
+    return data;
+}
+
 // ============================================
 // SIDEBAR & NAVIGATION
 // ============================================
@@ -88,32 +122,71 @@ window.addEventListener('resize', () => {
 // ============================================
 // DASHBOARD FUNCTIONS
 // ============================================
+// Pumps keyed by "device/pump" in listing order; /api/ws (or /api/events) keeps it current
+const pumps = new Map();
+let ws = null;
+let wsOpened = false;
+let events = null;
+let pollTimer = null;
+let renderPending = false;
+let nextCommandId = 1;
+const pendingCommands = new Map();
+
+function pumpKey(p) {
+    return `${p.device_id}/${p.pump_id}`;
+}
+
+function setPumps(list) {
+    pumps.clear();
+    list.forEach(p => pumps.set(pumpKey(p), p));
+    renderStatus();
+}
+
+// A burst of events repaints once per frame
+function scheduleRender() {
+    if (renderPending) return;
+    renderPending = true;
+    requestAnimationFrame(() => {
+        renderPending = false;
+        renderStatus();
+    });
+}
+
+function renderStatus() {
+    const list = [...pumps.values()];
+    
+    // Busy/alarm are per gateway; show the first listed gateway's
+    const system = list[0] || {busy: 0, alarm: 0};
+    
+    document.getElementById('busyStatus').innerHTML = `
+        <span class="material-symbols-rounded">${BUSY_ICONS[system.busy]}</span>
+        ${BUSY_TEXT[system.busy] || '--'}
+    `;
+    document.getElementById('alarmStatus').innerHTML = system.alarm ? 
+        '<span class="material-symbols-rounded" style="color: #dc3545;">warning</span> ACTIVE' : 
+        '<span class="material-symbols-rounded" style="color: #28a745;">check_circle</span> OK';
+    
+    const grid = document.getElementById('pumpGrid');
+    grid.innerHTML = list.map(p => createPumpCard(p.device_id, p.pump_id, p.command, p.status)).join('');
+    
+    document.getElementById('lastUpdate').textContent = new Date().toLocaleTimeString();
+}
+
 async function loadStatus() {
     try {
-        const res = await fetch(`${API}/api/pump/status`);
-        const data = await res.json();
-        
-        document.getElementById('busyStatus').innerHTML = `
-            <span class="material-symbols-rounded">${BUSY_ICONS[data.busy]}</span>
-            ${BUSY_TEXT[data.busy] || '--'}
-        `;
-        document.getElementById('alarmStatus').innerHTML = data.alarm ? 
-            '<span class="material-symbols-rounded" style="color: #dc3545;">warning</span> ACTIVE' : 
-            '<span class="material-symbols-rounded" style="color: #28a745;">check_circle</span> OK';
-        
-        const grid = document.getElementById('pumpGrid');
-        grid.innerHTML = `
-            ${createPumpCard(1, data.pump1, data.pump1_status)}
-            ${createPumpCard(2, data.pump2, data.pump2_status)}
-        `;
-        
-        document.getElementById('lastUpdate').textContent = new Date().toLocaleTimeString();
+        const url = GATEWAY ? `${API}/api/pump/status?device_id=${encodeURIComponent(GATEWAY)}` : `${API}/api/pump/status`;
+        const data = await fetchJson(url);
+        setPumps(data.pumps);
     } catch (err) {
         console.error('Error:', err);
     }
 }
 
-function createPumpCard(id, cmd, status) {
+function pumpLabel(deviceId, id) {
+    return deviceId && deviceId !== DEFAULT_GATEWAY ? `${deviceId} / Pump ${id}` : `Pump ${id}`;
+}
+
+function createPumpCard(deviceId, id, cmd, status) {
     const statusClass = ['unknown', 'running', 'stopped', 'error'][status] || 'unknown';
     const statusIcon = STATUS_ICONS[status] || 'help';
     
@@ -122,7 +195,7 @@ function createPumpCard(id, cmd, status) {
             <div class="pump-card-header">
                 <div class="pump-title">
                     <span class="material-symbols-rounded icon-lg">water_drop</span>
-                    Pump ${id}
+                    ${pumpLabel(deviceId, id)}
                 </div>
                 <span class="status-badge ${statusClass}">
                     <span class="material-symbols-rounded" style="font-size: 16px;">${statusIcon}</span>
@@ -152,11 +225,11 @@ function createPumpCard(id, cmd, status) {
                 </div>
             </div>
             <div class="controls">
-                <button class="btn btn-on" onclick="control(${id}, 1)">
+                <button class="btn btn-on" onclick="control('${deviceId}', ${id}, 1)">
                     <span class="material-symbols-rounded">power_settings_new</span>
                     TURN ON
                 </button>
-                <button class="btn btn-off" onclick="control(${id}, 0)">
+                <button class="btn btn-off" onclick="control('${deviceId}', ${id}, 0)">
                     <span class="material-symbols-rounded">power_off</span>
                     TURN OFF
                 </button>
@@ -165,14 +238,40 @@ function createPumpCard(id, cmd, status) {
     `;
 }
 
-async function control(pumpId, state) {
+// Over the WebSocket: acked once published, the new state follows as a "pump" message
+function sendCommand(deviceId, pumpId, state) {
+    return new Promise((resolve, reject) => {
+        const id = nextCommandId++;
+        pendingCommands.set(id, {resolve, reject});
+        ws.send(JSON.stringify({op: 'cmd', id: id, device_id: deviceId, pump_id: pumpId, state: state}));
+    });
+}
+
+async function control(deviceId, pumpId, state) {
+    if (ws && ws.readyState === WebSocket.OPEN) {
+        try {
+            await sendCommand(deviceId, pumpId, state);
+        } catch (err) {
+            alert('Error: ' + err.message);
+        }
+        return;
+    }
+    
     try {
-        await fetch(`${API}/api/pump/control`, {
+        const res = await fetch(`${API}/api/pump/control`, {
             method: 'POST',
             headers: {'Content-Type': 'application/json'},
-            body: JSON.stringify({pump_id: pumpId, state: state})
+            body: JSON.stringify({device_id: deviceId, pump_id: pumpId, state: state})
         });
-        setTimeout(loadStatus, 200);
+        const data = await res.json();
+        if (res.status !== 202) throw new Error(data.error || res.statusText);
+        
+        // With the event stream up the change arrives by itself; when polling,
+        // wait (server-side) until the registry has the command, then refresh
+        if (pollTimer) {
+            await fetch(`${API}/api/commands/${data.command_id}?wait=2000&until=applied`);
+            loadStatus();
+        }
     } catch (err) {
         alert('Error: ' + err.message);
     }
@@ -180,66 +279,158 @@ async function control(pumpId, state) {
 
 async function loadGateway() {
     try {
-        const res = await fetch(`${API}/api/gateway/status`);
-        const data = await res.json();
-        
-        const dot = document.getElementById('gatewayDot');
-        dot.className = 'status-dot ' + (data.status ? 'online' : 'offline');
-        
-        document.getElementById('deviceId').textContent = data.device_id || 'N/A';
-        document.getElementById('firmware').textContent = data.firmware || 'N/A';
-        document.getElementById('lastSeen').textContent = data.last_seen ? 
-            new Date(data.last_seen * 1000).toLocaleString() : 'Never';
+        const url = GATEWAY ? `${API}/api/gateway/status?device_id=${encodeURIComponent(GATEWAY)}` : `${API}/api/gateway/status`;
+        setGateways((await fetchJson(url)).gateways);
     } catch (err) {
         console.error('Gateway error:', err);
     }
 }
 
+// Every stream is already narrowed to GATEWAY when set; the card shows the
+// first gateway listed
+const gateways = new Map();
+
+function setGateways(list) {
+    gateways.clear();
+    list.forEach(g => gateways.set(g.device_id, g));
+    renderGateway();
+}
+
+function applyGateway(g) {
+    gateways.set(g.device_id, g);
+    renderGateway();
+}
+
+function renderGateway() {
+    const data = gateways.values().next().value || {};
+    const dot = document.getElementById('gatewayDot');
+        dot.className = 'status-dot ' + (data.is_online ? 'online' : 'offline');
+        
+        document.getElementById('deviceId').textContent = data.device_id || 'N/A';
+        document.getElementById('firmware').textContent = data.firmware || 'N/A';
+    document.getElementById('lastSeen').textContent = data.last_seen ? 
+        new Date(data.last_seen * 1000).toLocaleString() : 'Never';
+}
+
 // ============================================
 // HISTORY FUNCTIONS - MAIN LOAD
 // ============================================
+// Date range part of the history query; the cache is only reused while it matches
+function historyQuery() {
+    let query = '';
+    
+    if (activeFilters.dateFrom) {
+        const fromTimestamp = Math.floor(activeFilters.dateFrom.getTime() / 1000);
+        query += `&from=${fromTimestamp}`;
+    }
+    
+    if (activeFilters.dateTo) {
+        const toTimestamp = Math.floor(activeFilters.dateTo.getTime() / 1000);
+        query += `&to=${toTimestamp}`;
+    }
+    
+    return query;
+}
+
+async function fetchHistory(params) {
+    return fetchJson(`${API}/api/pump/history?${params}`);
+}
+
 async function loadHistory() {
+    const query = historyQuery();
+    
+    // Same date range as the cached window: only fetch rows we don't have
+    if (historyCache && historyCache.query === query) {
+        await syncHistory();
+        populatePumpFilter();
+        applyLocalFilters();
+        return;
+    }
+    
     showHistoryLoading();
+    historySyncing = true;
     
     try {
-        // Build API URL with date range
-        let apiUrl = `${API}/api/pump/history?limit=5000`;
+        const rows = [];
+        let maxId = 0;
+        let cursor = null;
         
-        if (activeFilters.dateFrom) {
-            const fromTimestamp = Math.floor(activeFilters.dateFrom.getTime() / 1000);
-            apiUrl += `&from=${fromTimestamp}`;
-            console.log('[LOAD] From:', activeFilters.dateFrom, '→ timestamp:', fromTimestamp);
-        }
+        do {
+            let params = `limit=${HISTORY_PAGE}${query}`;
+            if (cursor) params += `&cursor=${encodeURIComponent(cursor)}`;
+            
+            const page = await fetchHistory(params);
+            rows.push(...page.data);
+            maxId = Math.max(maxId, page.max_id);
+            cursor = page.next_cursor;
+        } while (cursor && rows.length < HISTORY_WINDOW);
         
-        if (activeFilters.dateTo) {
-            const toTimestamp = Math.floor(activeFilters.dateTo.getTime() / 1000);
-            apiUrl += `&to=${toTimestamp}`;
-            console.log('[LOAD] To:', activeFilters.dateTo, '→ timestamp:', toTimestamp);
-        }
+        console.log('[LOAD] Received:', rows.length, 'records', query);
         
-        console.log('[LOAD] Fetching:', apiUrl);
+        historyCache = { query, data: rows, count: rows.length, maxId };
+        filteredData = [...rows];
+        currentPage = 1;
         
-        const res = await fetch(apiUrl);
-        const data = await res.json();
+        populatePumpFilter();
+        applyLocalFilters();
+        
+    } catch (err) {
+        showHistoryError(err);
+    } finally {
+        historySyncing = false;
+    }
+}
+
+// Pull only rows newer than the newest one held; cost is O(new rows)
+async function syncHistory() {
+    if (!historyCache || historySyncing) return;
+    historySyncing = true;
+    
+    try {
+        const cache = historyCache;
+        const fresh = [];
+        let page;
         
-        console.log('[LOAD] Received:', data.count, 'records');
+        do {
+            page = await fetchHistory(`limit=${HISTORY_PAGE}&since_id=${cache.maxId}${cache.query}`);
+            fresh.push(...page.data);
+            cache.maxId = Math.max(cache.maxId, page.max_id);
+        } while (page.count === HISTORY_PAGE);
         
-        if (data.count > 0) {
-            const firstRecord = new Date(data.data[0].timestamp * 1000);
-            const lastRecord = new Date(data.data[data.count - 1].timestamp * 1000);
-            console.log('[LOAD] Data range:', lastRecord, '→', firstRecord);
-        }
+        // A full reload replaced the cache while we were fetching
+        if (cache !== historyCache || fresh.length === 0) return;
         
-        historyCache = data;
-        filteredData = [...data.data];
-        currentPage = 1;
+        // since_id rows arrive oldest first; the window is newest first
+        cache.data = fresh.reverse().concat(cache.data).slice(0, HISTORY_WINDOW);
+        cache.count = cache.data.length;
+        console.log('[SYNC] +', fresh.length, 'records');
         
+        populatePumpFilter();
         applyLocalFilters();
         
     } catch (err) {
-        showHistoryError(err);
+        console.error('History sync error:', err);
+    } finally {
+        historySyncing = false;
     }
 }
+
+// Pump filter lists every (gateway, pump) present in the loaded window
+function populatePumpFilter() {
+    const select = document.getElementById('filterPump');
+    if (!select || !historyCache) return;
+    
+    const keys = [...new Set(historyCache.data.map(item => `${item.device_id}/${item.pump_id}`))].sort();
+    if (activeFilters.pumpId !== 'all' && !keys.includes(activeFilters.pumpId)) {
+        activeFilters.pumpId = 'all';
+    }
+    
+    select.innerHTML = '<option value="all">All Pumps</option>' + keys.map(key => {
+        const [deviceId, pumpId] = key.split('/');
+        return `<option value="${key}" ${key === activeFilters.pumpId ? 'selected' : ''}>${pumpLabel(deviceId, pumpId)}</option>`;
+    }).join('');
+}
+
 function showHistoryLoading() {
     const tbody = document.getElementById('historyBody');
     tbody.innerHTML = `
@@ -276,26 +467,25 @@ function showHistoryError(err) {
 }
 
 function refreshHistory() {
-    historyCache = null;
     filteredData = [];
     currentPage = 1;
     activeFilters = {
-        pump1Status: 'all',
-        pump2Status: 'all',
+        pumpId: 'all',
+        status: 'all',
         searchTerm: '',
         dateFrom: null,
         dateTo: null
     };
     
     // Reset filters UI
-    const filterP1 = document.getElementById('filterP1');
-    const filterP2 = document.getElementById('filterP2');
+    const filterPump = document.getElementById('filterPump');
+    const filterStatus = document.getElementById('filterStatus');
     const searchInput = document.getElementById('searchInput');
     const datetimeFrom = document.getElementById('datetimeFrom');
     const datetimeTo = document.getElementById('datetimeTo');
     
-    if (filterP1) filterP1.value = 'all';
-    if (filterP2) filterP2.value = 'all';
+    if (filterPump) filterPump.value = 'all';
+    if (filterStatus) filterStatus.value = 'all';
     if (searchInput) searchInput.value = '';
     if (datetimeFrom) datetimeFrom.value = '';
     if (datetimeTo) datetimeTo.value = '';
@@ -322,21 +512,20 @@ function applyLocalFilters() {
         const term = activeFilters.searchTerm.toLowerCase();
         data = data.filter(item => {
             const timestamp = new Date(item.timestamp * 1000).toLocaleString().toLowerCase();
-            const p1Status = STATUS_TEXT[item.pump1_status || 0].toLowerCase();
-            const p2Status = STATUS_TEXT[item.pump2_status || 0].toLowerCase();
-            return timestamp.includes(term) || p1Status.includes(term) || p2Status.includes(term);
+            const status = STATUS_TEXT[item.status || 0].toLowerCase();
+            const pump = pumpLabel(item.device_id, item.pump_id).toLowerCase();
+            return timestamp.includes(term) || status.includes(term) || pump.includes(term);
         });
     }
     
-    // Status filters
-    if (activeFilters.pump1Status !== 'all') {
-        const statusNum = parseInt(activeFilters.pump1Status);
-        data = data.filter(item => (item.pump1_status || 0) === statusNum);
+    // Pump / status filters
+    if (activeFilters.pumpId !== 'all') {
+        data = data.filter(item => `${item.device_id}/${item.pump_id}` === activeFilters.pumpId);
     }
     
-    if (activeFilters.pump2Status !== 'all') {
-        const statusNum = parseInt(activeFilters.pump2Status);
-        data = data.filter(item => (item.pump2_status || 0) === statusNum);
+    if (activeFilters.status !== 'all') {
+        const statusNum = parseInt(activeFilters.status);
+        data = data.filter(item => (item.status || 0) === statusNum);
     }
     
     // Sorting
@@ -373,9 +562,14 @@ const handleSearchInput = debounce((value) => {
     applyLocalFilters();  // LOCAL, không reload BE
 }, 300);
 
-function filterByStatus(pump, status) {
-    if (pump === 'pump1') activeFilters.pump1Status = status;
-    else if (pump === 'pump2') activeFilters.pump2Status = status;
+function filterByPump(key) {
+    activeFilters.pumpId = key;
+    currentPage = 1;
+    applyLocalFilters();  // LOCAL, không reload BE
+}
+
+function filterByStatus(status) {
+    activeFilters.status = status;
     currentPage = 1;
     applyLocalFilters();  // LOCAL, không reload BE
 }
@@ -522,8 +716,7 @@ function renderHistoryTable() {
     
     // Render rows
     tbody.innerHTML = pageData.map(item => {
-        const p1Status = item.pump1_status !== undefined ? item.pump1_status : 0;
-        const p2Status = item.pump2_status !== undefined ? item.pump2_status : 0;
+        const status = item.status !== undefined ? item.status : 0;
         
         return `
             <tr>
@@ -534,27 +727,27 @@ function renderHistoryTable() {
                     </div>
                 </td>
                 <td>
-                    <span class="badge ${item.pump1 ? 'badge-success' : 'badge-secondary'}">
-                        <span class="material-symbols-rounded">${item.pump1 ? 'toggle_on' : 'toggle_off'}</span>
-                        ${item.pump1 ? 'ON' : 'OFF'}
-                    </span>
+                    <div class="status-cell">
+                        <span class="material-symbols-rounded">router</span>
+                        ${item.device_id}
+                    </div>
                 </td>
                 <td>
-                    <span class="badge ${getBadgeClass(p1Status)}">
-                        <span class="material-symbols-rounded">${STATUS_ICONS[p1Status]}</span>
-                        ${STATUS_TEXT[p1Status]}
-                    </span>
+                    <div class="status-cell">
+                        <span class="material-symbols-rounded">water_drop</span>
+                        Pump ${item.pump_id}
+                    </div>
                 </td>
                 <td>
-                    <span class="badge ${item.pump2 ? 'badge-success' : 'badge-secondary'}">
-                        <span class="material-symbols-rounded">${item.pump2 ? 'toggle_on' : 'toggle_off'}</span>
-                        ${item.pump2 ? 'ON' : 'OFF'}
+                    <span class="badge ${item.command ? 'badge-success' : 'badge-secondary'}">
+                        <span class="material-symbols-rounded">${item.command ? 'toggle_on' : 'toggle_off'}</span>
+                        ${item.command ? 'ON' : 'OFF'}
                     </span>
                 </td>
                 <td>
-                    <span class="badge ${getBadgeClass(p2Status)}">
-                        <span class="material-symbols-rounded">${STATUS_ICONS[p2Status]}</span>
-                        ${STATUS_TEXT[p2Status]}
+                    <span class="badge ${getBadgeClass(status)}">
+                        <span class="material-symbols-rounded">${STATUS_ICONS[status]}</span>
+                        ${STATUS_TEXT[status]}
                     </span>
                 </td>
                 <td>
@@ -700,21 +893,20 @@ function exportToCSV() {
     }
     
     // CSV Header
-    const headers = ['Timestamp', 'P1 Command', 'P1 Status', 'P2 Command', 'P2 Status', 'Inverter', 'Alarm'];
+    const headers = ['Timestamp', 'Gateway', 'Pump', 'Command', 'Status', 'Inverter', 'Alarm'];
     
     // CSV Rows
     const rows = filteredData.map(item => {
-        const p1Status = item.pump1_status !== undefined ? item.pump1_status : 0;
-        const p2Status = item.pump2_status !== undefined ? item.pump2_status : 0;
+        const status = item.status !== undefined ? item.status : 0;
         const busy = item.busy !== undefined ? item.busy : 0;
         const alarm = item.alarm !== undefined ? item.alarm : 0;
         
         return [
             new Date(item.timestamp * 1000).toLocaleString(),
-            item.pump1 ? 'ON' : 'OFF',
-            STATUS_TEXT[p1Status],
-            item.pump2 ? 'ON' : 'OFF',
-            STATUS_TEXT[p2Status],
+            item.device_id,
+            item.pump_id,
+            item.command ? 'ON' : 'OFF',
+            STATUS_TEXT[status],
             BUSY_TEXT[busy],
             alarm ? 'ACTIVE' : 'OK'
         ];
@@ -743,13 +935,115 @@ function toISOLocal(date) {
     return new Date(date.getTime() - offset).toISOString();
 }
 // ============================================
-// AUTO-REFRESH & INITIALIZATION
+// LIVE UPDATES & INITIALIZATION
 // ============================================
-setInterval(() => {
+function historyVisible() {
+    return !document.getElementById('page-history').classList.contains('hidden');
+}
+
+// Snapshot rows reach the DB a batch later than the event
+const syncHistorySoon = debounce(() => {
+    if (historyVisible()) syncHistory();
+}, 500);
+
+function poll() {
     loadStatus();
     loadGateway();
-}, 2000);
+    
+    if (historyVisible()) {
+        syncHistory();
+    }
+}
+
+// Only while the event stream is down (or the browser has no EventSource)
+function startPolling() {
+    if (!pollTimer) pollTimer = setInterval(poll, 2000);
+}
+
+function stopPolling() {
+    clearInterval(pollTimer);
+    pollTimer = null;
+}
+
+function applyPump(p) {
+    pumps.set(pumpKey(p), p);
+    scheduleRender();
+    syncHistorySoon();
+}
+
+// Server-sent events: state only, commands go over HTTP POST
+function connectEvents() {
+    if (!window.EventSource) {
+        poll();
+        startPolling();
+        return;
+    }
+    
+    const url = GATEWAY ? `${API}/api/events?device_id=${encodeURIComponent(GATEWAY)}` : `${API}/api/events`;
+    events = new EventSource(url);
+    
+    // Sent on connect and whenever the server had to resync us
+    events.addEventListener('pumps', e => {
+        stopPolling();
+        setPumps(JSON.parse(e.data).pumps);
+    });
+    
+    events.addEventListener('pump', e => applyPump(JSON.parse(e.data)));
+    
+    events.addEventListener('gateways', e => setGateways(JSON.parse(e.data).gateways));
+    events.addEventListener('gateway', e => applyGateway(JSON.parse(e.data)));
+    
+    // EventSource reconnects by itself and resumes from the last id; poll meanwhile
+    events.addEventListener('open', stopPolling);
+    events.onerror = () => startPolling();
+}
+
+// One connection for state and commands. If it never opens (proxy without
+// upgrade support, old browser) fall back to /api/events for good.
+function connectLive() {
+    if (!window.WebSocket) {
+        connectEvents();
+        return;
+    }
+    
+    ws = new WebSocket(API.replace(/^http/, 'ws') + '/api/ws');
+    
+    ws.onopen = () => {
+        wsOpened = true;
+        stopPolling();
+        ws.send(JSON.stringify(GATEWAY ? {op: 'sub', device_id: GATEWAY} : {op: 'sub'}));
+    };
+    
+    ws.onmessage = e => {
+        const m = JSON.parse(e.data);
+        if (m.op === 'pumps') {
+            setPumps(m.data.pumps);
+        } else if (m.op === 'pump') {
+            applyPump(m.data);
+        } else if (m.op === 'gateways') {
+            setGateways(m.data.gateways);
+        } else if (m.op === 'gateway') {
+            applyGateway(m.data);
+        } else if (m.op === 'ack') {
+            const pending = pendingCommands.get(m.id);
+            if (!pending) return;
+            pendingCommands.delete(m.id);
+            m.ok ? pending.resolve(m) : pending.reject(new Error(m.error));
+        }
+    };
+    
+    ws.onclose = () => {
+        pendingCommands.forEach(p => p.reject(new Error('Connection lost')));
+        pendingCommands.clear();
+        ws = null;
+        
+        if (!wsOpened) {
+            connectEvents();
+            return;
+        }
+        startPolling();
+        setTimeout(connectLive, 2000);
+    };
+}
 
-// Initial load
-loadStatus();
-loadGateway();
\ No newline at end of file
+connectLive();